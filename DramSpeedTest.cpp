@@ -281,6 +281,10 @@ TEST(DramSpeedTest, HWAdjacentPrefetcher)
 	}
 }
 
+// The branchless version uses AVX2 gathers, this test must only run on hosts supporting AVX2
+//
+#pragma GCC push_options
+#pragma GCC target("avx2")
 TEST(DramSpeedTest, SumWithEarlyExitTest)
 {
 	atype* a = AllocateMemory(true /*usingHugePage*/);
@@ -477,6 +481,7 @@ TEST(DramSpeedTest, SumWithEarlyExitTest)
 	printf("\n");
 	
 }
+#pragma GCC pop_options
 
 TEST(DramSpeedTest, HugePage)
 {
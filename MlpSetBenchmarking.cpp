@@ -1,6 +1,7 @@
 #include "common.h"
 #include "MlpSetUInt64.h"
 #include "MlpSetUInt64Range.h"
+#include "MlpSetUInt64Sharded.h"
 
 #include "gtest/gtest.h"
 
@@ -65,6 +66,77 @@ TEST(MlpSetBenchmarking, MlpSetBenchmarkC)
     bm_run_workloadC(&bm_tree);
 }
 
+typedef MlpSetUInt64::ShardedMlpSet<16> BmShardedMlpSet;
+
+int ShardedMlpSetBmInsert(void* tree, unsigned long long key, void* entry)
+{
+    entry;
+
+    BmShardedMlpSet* s = reinterpret_cast<BmShardedMlpSet*>(tree);
+    return s->Insert(key) ? 0 : 1;
+}
+
+void* ShardedMlpSetBmLoad(void* tree, unsigned long long index)
+{
+    BmShardedMlpSet* s = reinterpret_cast<BmShardedMlpSet*>(tree);
+    s->Exist(index);
+    return NULL;
+}
+
+void* ShardedMlpSetBmErase(void* tree, unsigned long long index)
+{
+    BmShardedMlpSet* s = reinterpret_cast<BmShardedMlpSet*>(tree);
+    s->Remove(index);
+    return NULL;
+}
+
+void ShardedMlpSetInitBmTree(BmShardedMlpSet& s, BenchmarkTree& bm_tree)
+{
+    s.Init(4194304);
+    memset(&bm_tree, 0, sizeof(bm_tree));
+    bm_tree.tree = &s;
+
+    bm_tree.Insert = &ShardedMlpSetBmInsert;
+    bm_tree.Load = &ShardedMlpSetBmLoad;
+    bm_tree.Erase = &ShardedMlpSetBmErase;
+}
+
+// Each writer owns a different top-level slice of the key space, so with
+// ShardedMlpSet<16> every writer runs on its own shard without contention.
+//
+TEST(MlpSetBenchmarking, ShardedMlpSetBenchmarkCMultiWriter)
+{
+    for (int writers : { 1, 2, 4, 8, 16 })
+    {
+        BmShardedMlpSet s;
+        BenchmarkTree bm_tree;
+        ShardedMlpSetInitBmTree(s, bm_tree);
+        bm_run_workloadC_multi_writer(&bm_tree, writers);
+    }
+}
+
+TEST(MlpSetBenchmarking, ShardedMlpSetWriterScaling)
+{
+    const int keysPerWriter = 200000;
+    // MlpSet allows a single writer; it is the baseline for the sharded set.
+    //
+    printf("MlpSet (single writer): ");
+    {
+        MlpSetUInt64::MlpSet s;
+        BenchmarkTree bm_tree;
+        MlpSetInitBmTree(s, bm_tree);
+        bm_run_writer_scaling(&bm_tree, 1, keysPerWriter);
+    }
+    for (int writers : { 1, 2, 4, 8, 16 })
+    {
+        printf("ShardedMlpSet<16>: ");
+        BmShardedMlpSet s;
+        BenchmarkTree bm_tree;
+        ShardedMlpSetInitBmTree(s, bm_tree);
+        bm_run_writer_scaling(&bm_tree, writers, keysPerWriter);
+    }
+}
+
 int MlpRangeBmInsertRange(void* tree, unsigned long first,
 		                unsigned long last, void *entry)
 {
@@ -5,33 +5,22 @@
 #include <iomanip>
 #include <thread>
 #include <bitset>
+#include <algorithm>
+#include <array>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
 
 
 namespace MlpSetUInt64
 {
 
 
-// Vectorized XXHash utility
-// The hash function is a slightly modified XXH32, to fix a known deficiency 
-// The 3 hash functions are XXHashFn1, XXHashFn2, XXHashFn3
-// XXHashArray computes 18 hashes from the prefixes of a key 
-// using vectorization (detail in function comment)
+// Scalar XXHash utility, see MlpSetUInt64Hash.h
+// The vectorized versions computing the hashes of all prefixes of a key at once are in the per-ISA translation units
 //
 namespace XXH
 {
 
-static const uint32_t XXH_SEED1 = 1192827283U;
-static const uint32_t XXH_SEED2 = 534897851U;
-
-static const uint32_t PRIME32_1 = 2654435761U;
-static const uint32_t PRIME32_2 = 2246822519U;
-static const uint32_t PRIME32_3 = 3266489917U;
-static const uint32_t PRIME32_4 = 668265263U;
-static const uint32_t PRIME32_5 = 374761393U;
-
-
-#define XXH_rotl32(x,r) ((x << r) | (x >> (32 - r)))
-
 uint32_t XXH32_avalanche(uint32_t h32)
 {
     h32 ^= h32 >> 15;
@@ -75,132 +64,6 @@ uint32_t XXHashFn3(uint64_t key, uint32_t len)
 	return XXH32_CoreLogic(key, len, 0 /*seed*/, PRIME32_3);
 }
 
-static const __m128i PRIME32_1_ARRAY = _mm_set_epi32(PRIME32_1, PRIME32_1, PRIME32_1, PRIME32_1);
-static const __m128i PRIME32_2_ARRAY = _mm_set_epi32(PRIME32_2, PRIME32_2, PRIME32_2, PRIME32_2);
-static const __m128i PRIME32_3_ARRAY = _mm_set_epi32(PRIME32_3, PRIME32_3, PRIME32_3, PRIME32_3);
-static const __m128i PRIME32_4_ARRAY = _mm_set_epi32(PRIME32_4, PRIME32_4, PRIME32_4, PRIME32_4);
-
-static const __m128i XXH_OUT1_INIT = _mm_set_epi32(PRIME32_5 + XXH_SEED1 + 8U,
-                                                   PRIME32_5 + XXH_SEED1 + 7U,
-                                                   PRIME32_5 + XXH_SEED1 + 6U,
-                                                   PRIME32_5 + XXH_SEED1 + 5U);
-static const __m128i XXH_OUT2_INIT = _mm_set_epi32(PRIME32_5 + XXH_SEED2 + 8U,
-                                                   PRIME32_5 + XXH_SEED2 + 7U,
-                                                   PRIME32_5 + XXH_SEED2 + 6U,
-                                                   PRIME32_5 + XXH_SEED2 + 5U);
-static const __m128i XXH_OUT3_INIT = _mm_set_epi32(PRIME32_5 + 8U,
-                                                   PRIME32_5 + 7U,
-                                                   PRIME32_5 + 6U,
-                                                   PRIME32_5 + 5U);
-static const __m128i XXH_OUT4_INIT = _mm_set_epi32(PRIME32_5 + XXH_SEED1 + 4U,
-                                                   PRIME32_5 + XXH_SEED1 + 3U,
-                                                   PRIME32_5 + XXH_SEED2 + 4U,
-                                                   PRIME32_5 + XXH_SEED2 + 3U);
-static const __m128i XXH_LOW_MASK = _mm_set_epi32(0xffffffffU, 
-                                                  0xffffff00U, 
-                                                  0xffff0000U, 
-                                                  0xff000000U);
-
-void XXHExecuteRotlAndMult(__m128i& data)
-{
-	__m128i tmp = _mm_srli_epi32(data, 15);
-	data = _mm_slli_epi32(data, 17);
-	data = _mm_or_si128(data, tmp);
-	data = _mm_mullo_epi32(data, PRIME32_4_ARRAY);
-}
-
-void XXHExecuteAvalanche(__m128i& data)
-{
-	__m128i tmp = _mm_srli_epi32(data, 15);
-	data = _mm_xor_si128(data, tmp);
-	data = _mm_mullo_epi32(data, PRIME32_2_ARRAY);
-	
-	tmp = _mm_srli_epi32(data, 13);
-	data = _mm_xor_si128(data, tmp);
-	data = _mm_mullo_epi32(data, PRIME32_3_ARRAY);
-	
-	tmp = _mm_srli_epi32(data, 16);
-	data = _mm_xor_si128(data, tmp);
-}
-
-
-void XXHashArray(uint64_t key, __m128i& out1, __m128i& out2, __m128i& out3, __m128i& out4, uint64_t& out5)
-{
-	uint32_t low = key;
-	uint32_t high = key >> 32;
-	
-	uint32_t x1 = high * PRIME32_1;
-	uint32_t x2 = high * PRIME32_3;
-	
-	out1 = _mm_set1_epi32(x1);
-	out1 = _mm_xor_si128(out1, XXH_OUT1_INIT);
-	XXHExecuteRotlAndMult(out1);
-	
-	out2 = _mm_set1_epi32(x2);
-	out2 = _mm_xor_si128(out2, XXH_OUT2_INIT);
-	XXHExecuteRotlAndMult(out2);
-	
-	out3 = _mm_set1_epi32(x2);
-	out3 = _mm_xor_si128(out3, XXH_OUT3_INIT);
-	XXHExecuteRotlAndMult(out3);
-	
-	uint32_t high3byte = high & 0xffffff00U;
-	uint32_t high3byteP1 = high3byte * PRIME32_1;
-	uint32_t high3byteP3 = high3byte * PRIME32_3;
-	
-	out4 = _mm_set_epi32(x1, high3byteP1, x2, high3byteP3);
-	out4 = _mm_xor_si128(out4, XXH_OUT4_INIT);
-	XXHExecuteRotlAndMult(out4);
-	
-	__m128i v1 = _mm_set1_epi32(low);
-	v1 = _mm_and_si128(v1, XXH_LOW_MASK);
-	__m128i v2 = _mm_mullo_epi32(v1, PRIME32_1_ARRAY);
-	__m128i v3 = _mm_mullo_epi32(v1, PRIME32_3_ARRAY);
-	
-	out1 = _mm_xor_si128(out1, v2);
-	XXHExecuteRotlAndMult(out1);
-	
-	out2 = _mm_xor_si128(out2, v3);
-	XXHExecuteRotlAndMult(out2);
-	
-	out3 = _mm_xor_si128(out3, v3);
-	XXHExecuteRotlAndMult(out3);
-	
-	XXHExecuteAvalanche(out1);
-	XXHExecuteAvalanche(out2);
-	XXHExecuteAvalanche(out3);
-	XXHExecuteAvalanche(out4);
-	
-	uint32_t h34 = (PRIME32_5 + 4U) ^ x2;
-	h34 = XXH_rotl32(h34, 17) * PRIME32_4;
-	h34 = XXH32_avalanche(h34);
-	
-	uint32_t h33 = (PRIME32_5 + 3U) ^ high3byteP3;
-	h33 = XXH_rotl32(h33, 17) * PRIME32_4;
-	h33 = XXH32_avalanche(h33);
-	
-	assert(_mm_extract_epi32(out1, 3) == XXHashFn1(key, 8));
-	assert(_mm_extract_epi32(out1, 2) == XXHashFn1(key, 7));
-	assert(_mm_extract_epi32(out1, 1) == XXHashFn1(key, 6));
-	assert(_mm_extract_epi32(out1, 0) == XXHashFn1(key, 5));
-	assert(_mm_extract_epi32(out2, 3) == XXHashFn2(key, 8));
-	assert(_mm_extract_epi32(out2, 2) == XXHashFn2(key, 7));
-	assert(_mm_extract_epi32(out2, 1) == XXHashFn2(key, 6));
-	assert(_mm_extract_epi32(out2, 0) == XXHashFn2(key, 5));
-	assert(_mm_extract_epi32(out3, 3) == XXHashFn3(key, 8));
-	assert(_mm_extract_epi32(out3, 2) == XXHashFn3(key, 7));
-	assert(_mm_extract_epi32(out3, 1) == XXHashFn3(key, 6));
-	assert(_mm_extract_epi32(out3, 0) == XXHashFn3(key, 5));
-	assert(_mm_extract_epi32(out4, 3) == XXHashFn1(key, 4));
-	assert(_mm_extract_epi32(out4, 2) == XXHashFn1(key, 3));
-	assert(_mm_extract_epi32(out4, 1) == XXHashFn2(key, 4));
-	assert(_mm_extract_epi32(out4, 0) == XXHashFn2(key, 3));
-	assert(h34 == XXHashFn3(key, 4));
-	assert(h33 == XXHashFn3(key, 3));
-	
-	out5 = (uint64_t(h34) << 32) | h33;
-}
-
 }	// namespace XXH
 
 LockGuard::LockGuard(std::shared_mutex *m, bool is_shared) : m(m), _is_shared(is_shared)
@@ -237,18 +100,23 @@ void CuckooHashTableNode::Init(int ilen, int dlen, uint64_t dkey, uint32_t hash1
 	SetChildNum(childrenCount);
 }
 	
-int CuckooHashTableNode::FindNeighboringEmptySlot()
+int CuckooHashTableNode::FindNeighboringEmptySlot(int maxOffset)
 {
 	#ifdef EXTERNAL_BITMAP_ONLY
 	return 0;
 	#endif
 
+	if (maxOffset == NO_NEIGHBORING_BITMAP)
+	{
+		return 0;
+	}
+
 	int lowbits = reinterpret_cast<uintptr_t>(this) & 63;
 	if (lowbits < 32)
 	{	
 		// favors same cache line slot most
 		//
-		if (!this[1].IsOccupied())
+		if (maxOffset >= 1 && !this[1].IsOccupied())
 		{
 			return 1;
 		}
@@ -263,7 +131,7 @@ int CuckooHashTableNode::FindNeighboringEmptySlot()
 	//
 	rep(i, 1, 3)
 	{
-		if (!this[i].IsOccupied())
+		if (i <= maxOffset && !this[i].IsOccupied())
 		{
 			return i;
 		}
@@ -331,17 +199,72 @@ void CuckooHashTableNode::BitMapSet(int child, bool on/*=true*/)
 	}
 }
 	
-uint64_t* CuckooHashTableNode::AllocateExternalBitMap()
+ExternalBitMapPool::ExternalBitMapPool()
+	: m_freeList(nullptr)
+	, m_released(nullptr)
+	, m_chunkCursor(nullptr)
+	, m_chunkEnd(nullptr)
+	, m_numAllocations(0)
+{ }
+
+ExternalBitMapPool::~ExternalBitMapPool()
 {
-	uint64_t* ptr = new uint64_t[4];
-	memset(ptr, 0, 32);
-	return ptr;
+	for (void* chunk : m_chunks)
+	{
+		free(chunk);
+	}
+}
+
+uint64_t* ExternalBitMapPool::Allocate()
+{
+	m_numAllocations++;
+	if (unlikely(m_freeList == nullptr))
+	{
+		m_freeList = m_released.exchange(nullptr);
+	}
+	void* ptr;
+	if (m_freeList != nullptr)
+	{
+		ptr = m_freeList;
+		m_freeList = m_freeList->next;
+	}
+	else
+	{
+		if (unlikely(m_chunkCursor == m_chunkEnd))
+		{
+			void* chunk;
+			int ret = posix_memalign(&chunk, 64, CHUNK_SIZE);
+			ReleaseAssert(!ret);
+			m_chunks.push_back(chunk);
+			m_chunkCursor = reinterpret_cast<char*>(chunk);
+			m_chunkEnd = m_chunkCursor + CHUNK_SIZE;
+		}
+		ptr = m_chunkCursor;
+		m_chunkCursor += BITMAP_SIZE;
+	}
+	memset(ptr, 0, BITMAP_SIZE);
+	return reinterpret_cast<uint64_t*>(ptr);
+}
+
+void ExternalBitMapPool::Release(uint64_t* ptr)
+{
+	FreeBitMap* bitmap = reinterpret_cast<FreeBitMap*>(ptr);
+	FreeBitMap* head = m_released.load();
+	do
+	{
+		bitmap->next = head;
+	} while (!m_released.compare_exchange_weak(head, bitmap));
+}
+
+void ExternalBitMapPool::ReleaseDeferred(void* pool, void* ptr)
+{
+	reinterpret_cast<ExternalBitMapPool*>(pool)->Release(reinterpret_cast<uint64_t*>(ptr));
 }
 	
-void CuckooHashTableNode::ExtendToBitMap(uint32_t generation)
+void CuckooHashTableNode::ExtendToBitMap(uint32_t generation, ExternalBitMapPool& pool, int maxBitmapOffset)
 {
 	uint64_t children = childMap.load();
-	int offset = FindNeighboringEmptySlot() + 4;
+	int offset = FindNeighboringEmptySlot(maxBitmapOffset) + 4;
 	uint32_t hashVal = hash;
 	hashVal &= 0xff03ffffU;
 	hashVal |= (offset << 21);
@@ -349,7 +272,7 @@ void CuckooHashTableNode::ExtendToBitMap(uint32_t generation)
 	if (offset == 4)
 	{
 		this[offset-4].generation.store(generation);
-		uint64_t* ptr = AllocateExternalBitMap();
+		uint64_t* ptr = pool.Allocate();
 		childMap.store(reinterpret_cast<uintptr_t>(ptr));
 	}
 	else
@@ -409,6 +332,47 @@ static int Bitmap256LowerBound(std::atomic<uint64_t>* ptr, uint32_t child)
 	return -1;
 }
 
+static int Bitmap256Predecessor(uint64_t* ptr, uint32_t child)
+{
+	int idx = child / 64;
+	uint64_t x = ptr[idx] & (~uint64_t(0) >> (63 - child % 64));
+	if (x) 
+	{ 
+		return 63 - __builtin_clzll(x) + idx * 64; 
+	}
+	idx--;
+	while (idx >= 0)
+	{
+		if (ptr[idx] != 0)
+		{
+			return 63 - __builtin_clzll(ptr[idx]) + idx * 64;
+		}
+		idx--;
+	}
+	return -1;
+}
+
+static int Bitmap256Predecessor(std::atomic<uint64_t>* ptr, uint32_t child)
+{
+	int idx = child / 64;
+	uint64_t x = ptr[idx].load() & (~uint64_t(0) >> (63 - child % 64));
+	if (x) 
+	{ 
+		return 63 - __builtin_clzll(x) + idx * 64; 
+	}
+	idx--;
+	while (idx >= 0)
+	{
+		uint64_t val = ptr[idx].load();
+		if (val != 0)
+		{
+			return 63 - __builtin_clzll(val) + idx * 64;
+		}
+		idx--;
+	}
+	return -1;
+}
+
 int CuckooHashTableNode::LowerBoundChild(uint32_t child)
 {
 	if (IsUsingInternalChildMap())
@@ -500,6 +464,44 @@ int CuckooHashTableNode::LowerBoundChild(uint32_t child)
 	}	
 }
 	
+int CuckooHashTableNode::PredecessorChild(uint32_t child)
+{
+	if (IsUsingInternalChildMap())
+	{
+		// the child list is sorted
+		//
+		int k = GetChildNum();
+		uint64_t c = childMap.load();
+		int result = -1;
+		rep(i, 0, k - 1)
+		{
+			int x = c & 255;
+			c >>= 8;
+			if (x > int(child)) { break; }
+			result = x;
+		}
+		return result;
+	}
+	else if (unlikely(IsExternalPointerBitMap()))
+	{
+		uint64_t* ptr = reinterpret_cast<uint64_t*>(childMap.load());
+		return Bitmap256Predecessor(ptr, child);
+	}
+	else
+	{
+		// Reassemble the internal bitmap (see LowerBoundChild for the layout)
+		//
+		int offset = (hash >> 21) & 7;
+		uint64_t* ptr = reinterpret_cast<uint64_t*>(&(this[offset-4]));
+		uint64_t bitmap[4];
+		bitmap[0] = childMap.load();
+		bitmap[1] = (ptr[0] & 0xffffffff3fffffffULL) | (uint64_t((hash >> 18) & 3) << 30);
+		bitmap[2] = ptr[1];
+		bitmap[3] = ptr[2];
+		return Bitmap256Predecessor(bitmap, child);
+	}
+}
+
 bool CuckooHashTableNode::ExistChild(int child)
 {
 	if (IsUsingInternalChildMap())
@@ -548,7 +550,7 @@ bool CuckooHashTableNode::ExistChild(int child)
 	}
 }
 
-void CuckooHashTableNode::AddChild(int child, uint32_t generation)
+void CuckooHashTableNode::AddChild(int child, uint32_t generation, ExternalBitMapPool& pool, int maxBitmapOffset)
 {
 	uint8_t k = GetChildNum();
 	if (IsUsingInternalChildMap())
@@ -579,7 +581,7 @@ void CuckooHashTableNode::AddChild(int child, uint32_t generation)
 #endif
 			return;
 		}
-		ExtendToBitMap(generation);
+		ExtendToBitMap(generation, pool, maxBitmapOffset);
 	}
 	BitMapSet(child);
 	SetChildNum(k+1);
@@ -641,6 +643,16 @@ void CuckooHashTableNode::RevertToInternalBitmap(std::function<void(void*)> addD
 	
 	childMap.store(tmpChildMap);
 
+	{
+		// release the neighboring slot holding the rest of the bitmap,
+		// otherwise it stays occupied with no owner (and Cuckoo displacement can't move it)
+		//
+		int offset = ((hash >> 21) & 7) - 4;
+		hash &= ~(7 << 21);
+		memset(&(this[offset]), 0, sizeof(CuckooHashTableNode));
+		return;
+	}
+
 _leave:
 	hash &= ~(7 << 21); // mark the node as using internal child map
 }
@@ -757,9 +769,9 @@ vector<int> CuckooHashTableNode::GetAllChildren()
 	return ret;
 }
 	
-uint64_t* CuckooHashTableNode::CopyToExternalBitMap()
+uint64_t* CuckooHashTableNode::CopyToExternalBitMap(ExternalBitMapPool& pool)
 {
-	uint64_t* ptr = AllocateExternalBitMap();
+	uint64_t* ptr = pool.Allocate();
 	CuckooHashTableNode* node_ptr = reinterpret_cast<CuckooHashTableNode*>(&ptr[1]);
 	
 	int offset = (hash >> 21) & 7;
@@ -772,21 +784,17 @@ uint64_t* CuckooHashTableNode::CopyToExternalBitMap()
 	return ptr;
 }
 	
-void CuckooHashTableNode::MoveNode(CuckooHashTableNode* target, uint32_t generation)
+void CuckooHashTableNode::CopyNodeTo(CuckooHashTableNode* target, uint32_t generation, ExternalBitMapPool& pool, int maxBitmapOffset)
 {
     target->SetGeneration(generation);
-	this->SetGeneration(generation);
     target->CopyWithoutGeneration(*this);
 	if (IsUsingInternalChildMap() || (IsExternalPointerBitMap() || IsLeaf())) //ASK RON TODO
 	//if (IsUsingInternalChildMap() || (IsExternalPointerBitMap()))
 	{
-		// Only clear the occupied flag to mark this node as free
-		// Don't zero other fields that readers might still be accessing
-		hash = 0;
 		return;
 	}
 	int offset = (hash >> 21) & 7;
-	int targetOffset = target->FindNeighboringEmptySlot() + 4;
+	int targetOffset = target->FindNeighboringEmptySlot(maxBitmapOffset) + 4;
 	uint32_t targetHashVal = target->hash;
 	targetHashVal &= 0xff1fffffU;
 	targetHashVal |= (targetOffset << 21);
@@ -801,12 +809,9 @@ void CuckooHashTableNode::MoveNode(CuckooHashTableNode* target, uint32_t generat
 	}
 	else
 	{
-		uint64_t* ptr = CopyToExternalBitMap();
+		uint64_t* ptr = CopyToExternalBitMap(pool);
 		target->childMap.store(reinterpret_cast<uint64_t>(ptr));
 	}
-
-	hash = 0;
-	this[offset-4].hash.store(0);
 #ifndef NDEBUG
 	if (!target->IsUsingInternalChildMap() && !target->IsExternalPointerBitMap())
 	{
@@ -815,14 +820,30 @@ void CuckooHashTableNode::MoveNode(CuckooHashTableNode* target, uint32_t generat
 #endif
 }
 	
-void CuckooHashTableNode::RelocateBitMap()
+void CuckooHashTableNode::MoveNode(CuckooHashTableNode* target, uint32_t generation, ExternalBitMapPool& pool, int maxBitmapOffset)
+{
+	this->SetGeneration(generation);
+	bool hasNeighboringBitMap = IsUsingNeighboringBitMap();
+	int offset = (hash >> 21) & 7;
+	CopyNodeTo(target, generation, pool, maxBitmapOffset);
+	// Only clear the occupied flag to mark this node as free
+	// Don't zero other fields that readers might still be accessing
+	//
+	hash = 0;
+	if (hasNeighboringBitMap)
+	{
+		this[offset-4].hash.store(0);
+	}
+}
+	
+void CuckooHashTableNode::RelocateBitMap(ExternalBitMapPool& pool, int maxBitmapOffset)
 {
 	uint64_t children = childMap.load();
-	int offset = FindNeighboringEmptySlot() + 4;
+	int offset = FindNeighboringEmptySlot(maxBitmapOffset) + 4;
 	int oldOffset = (hash >> 21) & 7;
 	if (offset == 4)
 	{
-		uint64_t* ptr = CopyToExternalBitMap();
+		uint64_t* ptr = CopyToExternalBitMap(pool);
 		childMap.store(reinterpret_cast<uint64_t>(ptr));
 	}
 	else
@@ -835,13 +856,6 @@ void CuckooHashTableNode::RelocateBitMap()
 	hash |= offset << 21;
 }	
 
-static const __m128i HASH18_MASK = _mm_set_epi32(0x3ffffU, 0x3ffffU, 0x3ffffU, 0x3ffffU);
-static const __m128i HASH_EXPECT_MASK1 = _mm_set_epi32(0x80000000U | (7U << 27), 
-                                                       0x80000000U | (6U << 27), 
-                                                       0x80000000U | (5U << 27), 
-                                                       0x80000000U | (4U << 27));
-static const __m128i HASH_EXPECT_MASK2 = _mm_set_epi32(0xf803ffffU, 0xf803ffffU, 0xf803ffffU, 0xf803ffffU);
-
 static inline uint64_t RoundUpToNearestMultipleOf(uint64_t x, uint64_t y)
 {
 	if (x % y == 0) return x;
@@ -855,330 +869,810 @@ static inline uint64_t RoundUpToNearestPowerOf2(uint64_t x)
 	return z;
 }
 
+// The two Cuckoo positions of a key
+// In large capacity mode, bits 18-24 (resp. 25-31) of XXHashFn3 become bits 32-38 of position 1 (resp. 2)
+// The low 18 bits of XXHashFn3 are the node tag, so the positions stay independent of it
+//
+static inline HtPosition HashPosition1(uint64_t key, uint32_t len, HtPosition mask)
+{
+#ifdef MLP_LARGE_CAPACITY
+	uint64_t high = (XXH::XXHashFn3(key, len) >> 18) & 0x7f;
+	return (XXH::XXHashFn1(key, len) | (high << 32)) & mask;
+#else
+	return XXH::XXHashFn1(key, len) & mask;
+#endif
+}
+
+static inline HtPosition HashPosition2(uint64_t key, uint32_t len, HtPosition mask)
+{
+#ifdef MLP_LARGE_CAPACITY
+	uint64_t high = XXH::XXHashFn3(key, len) >> 25;
+	return (XXH::XXHashFn2(key, len) | (high << 32)) & mask;
+#else
+	return XXH::XXHashFn2(key, len) & mask;
+#endif
+}
+
+// The mask the hash kernels apply to get a bucket choice, which is the block of the bucket in the high bits
+// and the bucket within the block in the low BUCKET_CHOICE_BITS bits (see CuckooHashTable::BUCKET_SIZE)
+//
+static constexpr int BUCKET_CHOICE_BITS = 5;
+
+static inline HtPosition BucketHashMask(HtPosition htMask)
+{
+	return HtPosition((uint64_t(htMask) + 1) << (BUCKET_CHOICE_BITS - 3)) - 1;
+}
+
+// The first slot of the bucket for a masked hash value
+// 32 values of the low bits are spread over the 3 buckets of the block 11/11/10
+//
+static inline HtPosition BucketStart(HtPosition choice)
+{
+	HtPosition block = choice >> BUCKET_CHOICE_BITS;
+	HtPosition bucket = ((choice & ((1 << BUCKET_CHOICE_BITS) - 1)) * 3) >> BUCKET_CHOICE_BITS;
+	return block * 8 + bucket * 3;
+}
+
+static inline HtPosition BucketPosition1(uint64_t key, uint32_t len, HtPosition htMask)
+{
+	return BucketStart(HashPosition1(key, len, BucketHashMask(htMask)));
+}
+
+static inline HtPosition BucketPosition2(uint64_t key, uint32_t len, HtPosition htMask)
+{
+	return BucketStart(HashPosition2(key, len, BucketHashMask(htMask)));
+}
+
 static inline void MultiplyBy3(const __m128i& input, __m128i& output)
 {
 	output = _mm_add_epi32(input, input);
 	output = _mm_add_epi32(input, output);
 }
 
-#ifdef ENABLE_STATS
-CuckooHashTable::Stats::Stats()
-	: m_slowpathCount(0)
-	, m_movedNodesCount(0)
-	, m_relocatedBitmapsCount(0)
+// The portable hash kernel, see MlpSetUInt64Hash.h
+//
+void QueryHashesScalar(uint64_t key, HtPosition mask, HtPosition* allPositions1, HtPosition* allPositions2, uint32_t* expectedHash)
 {
-	memset(m_lcpResultHistogram, 0, sizeof m_lcpResultHistogram); 
+	rep(i, 2, 7)
+	{
+		allPositions1[i] = HashPosition1(key, i + 1, mask);
+		allPositions2[i] = HashPosition2(key, i + 1, mask);
+		expectedHash[i] = 0x80000000U | (uint32_t(i) << 27) | (XXH::XXHashFn3(key, i + 1) & 0x3ffffU);
+	}
 }
 
-void CuckooHashTable::Stats::ClearStats()
+bool IsHashKernelSupported(HashKernel kernel)
 {
-	m_slowpathCount = 0;
-	m_movedNodesCount = 0;
-	m_relocatedBitmapsCount = 0;
-	memset(m_lcpResultHistogram, 0, sizeof m_lcpResultHistogram); 
+	__builtin_cpu_init();
+	switch (kernel)
+	{
+	case HashKernel::SCALAR:
+		return true;
+	case HashKernel::SSE42:
+		return __builtin_cpu_supports("sse4.2");
+	case HashKernel::AVX2:
+		return __builtin_cpu_supports("avx2");
+	case HashKernel::AVX512:
+		return __builtin_cpu_supports("avx512f");
+	}
+	return false;
 }
 
-void CuckooHashTable::Stats::ReportStats()
+const char* HashKernelName(HashKernel kernel)
 {
-	printf("Cuckoo HashTable stats:\n");
-	printf("\tQueryLCP slow-path count = %u\n", m_slowpathCount);
-	printf("\tInsertion moved nodes count = %u\n", m_movedNodesCount);
-	printf("\tInsertion relocated bitmaps count = %u\n", m_relocatedBitmapsCount);
-	printf("\tQueryLCP result histogram (result node IndexLen, not actual LCP):\n");
-	rep(i, 2, 8)
+	switch (kernel)
 	{
-		printf("\t\tLCP = %d: %u\n", i, m_lcpResultHistogram[i]);
+	case HashKernel::SCALAR:
+		return "scalar";
+	case HashKernel::SSE42:
+		return "SSE4.2";
+	case HashKernel::AVX2:
+		return "AVX2";
+	case HashKernel::AVX512:
+		return "AVX-512";
 	}
+	return "unknown";
 }
-#endif
 
-CuckooHashTable::CuckooHashTable() 
-	: ht(nullptr)
-	, htMask(0)
-#ifdef ENABLE_STATS
-	, stats()
-#endif
-#ifndef NDEBUG
-	, m_hasCalledInit(false)
-#endif
-{ }
-	
-void CuckooHashTable::Init(CuckooHashTableNode* _ht, uint64_t _mask)
+static QueryHashesFn GetQueryHashesFn(HashKernel kernel)
 {
-	assert(!m_hasCalledInit);
-#ifndef NDEBUG
-	m_hasCalledInit = true;
-#endif
-	ht = _ht;
-	htMask = _mask;
-	assert(reinterpret_cast<uintptr_t>(_ht) % 128 == 0);
-	assert(RoundUpToNearestPowerOf2(_mask + 1) == _mask + 1);
+	switch (kernel)
+	{
+	case HashKernel::SCALAR:
+		return QueryHashesScalar;
+	case HashKernel::SSE42:
+		return QueryHashesSse42;
+	case HashKernel::AVX2:
+		return QueryHashesAvx2;
+	case HashKernel::AVX512:
+		return QueryHashesAvx512;
+	}
+	return QueryHashesScalar;
 }
 
-uint32_t CuckooHashTable::ReservePositionForInsert(int ilen, uint64_t dkey, uint32_t hash18bit, bool& exist, bool& failed, uint32_t generation)
+// The one-time dispatcher, picks the widest kernel the running CPU supports
+//
+static HashKernel DetectHashKernel()
 {
-	assert(m_hasCalledInit);
-	
-	exist = false;
-	failed = false;
-	
-	uint32_t expectedHash = hash18bit | ((ilen-1) << 27) | 0x80000000U;
-	int shiftLen = 64 - 8 * ilen;
-	uint64_t shiftedKey = dkey >> shiftLen;
-	
-	uint32_t h1, h2;
-	h1 = XXH::XXHashFn1(dkey, ilen) & htMask;
-	h2 = XXH::XXHashFn2(dkey, ilen) & htMask;
-	if (ht[h1].IsEqual(expectedHash, shiftLen, shiftedKey))
-	{
-		exist = true;
-		return h1;
-	}
-	if (ht[h2].IsEqual(expectedHash, shiftLen, shiftedKey))
+	for (HashKernel kernel : { HashKernel::AVX512, HashKernel::AVX2, HashKernel::SSE42 })
 	{
-		exist = true;
-		return h2;
+		if (IsHashKernelSupported(kernel))
+		{
+			return kernel;
+		}
 	}
-	if (!ht[h1].IsOccupied())
+	return HashKernel::SCALAR;
+}
+
+static HashKernel s_hashKernel = DetectHashKernel();
+static QueryHashesFn s_queryHashes = GetQueryHashesFn(s_hashKernel);
+
+HashKernel GetHashKernel()
+{
+	return s_hashKernel;
+}
+
+bool SetHashKernel(HashKernel kernel)
+{
+	if (!IsHashKernelSupported(kernel))
 	{
-		return h1;
+		return false;
 	}
-	if (!ht[h2].IsOccupied())
+	s_hashKernel = kernel;
+	s_queryHashes = GetQueryHashesFn(kernel);
+	return true;
+}
+
+void MlpStats::Report() const
+{
+	printf("MlpSet stats:\n");
+	printf("\tQueryLCP slow-path count = %llu\n", (unsigned long long)slowPathCount);
+	printf("\tQueryLCP result histogram (result node IndexLen, not actual LCP):\n");
+	rep(i, 2, 8)
 	{
-		return h2;
+		printf("\t\tLCP = %d: %llu\n", i, (unsigned long long)lcpResultHistogram[i]);
 	}
-	uint32_t victimPosition = rand()%2 ? h1 : h2;
+	printf("\tInsertion moved nodes count = %llu\n", (unsigned long long)movedNodesCount);
+	printf("\tInsertion relocated bitmaps count = %llu\n", (unsigned long long)relocatedBitmapsCount);
+	printf("\tCuckoo displacement chain length histogram (%llu failed, %llu nodes stashed):\n", 
+	       (unsigned long long)displacementFailures, (unsigned long long)stashInsertions);
+	rep(i, 1, DISPLACEMENT_DEPTH_BUCKETS - 1)
 	{
-		HashTableCuckooDisplacement(victimPosition, 1, failed, generation);
+		if (displacementDepthHistogram[i])
+		{
+			printf("\t\tlen %s %d: %llu\n", (i == DISPLACEMENT_DEPTH_BUCKETS - 1) ? ">=" : "=", i, 
+			       (unsigned long long)displacementDepthHistogram[i]);
+		}
 	}
-	if (failed)
+	printf("\tLower_bound queries parent-path walk length histogram:\n");
+	rep(i, 0, 8)
 	{
-		return -1;
+		printf("\t\tlen = %d: %llu\n", i, (unsigned long long)lowerBoundParentPathStepsHistogram[i]);
 	}
-	assert(!ht[victimPosition].IsOccupied());
-	return victimPosition;
+	printf("\tPending deallocations postponed = %llu\n", (unsigned long long)pendingDeallocationsPostponed);
 }
 
-uint32_t CuckooHashTable::Insert(int ilen, int dlen, uint64_t dkey, int firstChild, bool& exist, bool& failed, uint32_t generation)
+StatsRecorder::StatsRecorder()
+	: m_active(nullptr)
+	, m_shards(nullptr)
+{ }
+
+StatsRecorder::~StatsRecorder()
 {
-	assert(m_hasCalledInit);
-	
-	uint32_t hash18bit = XXH::XXHashFn3(dkey, ilen);
-	hash18bit = hash18bit & ((1<<18) - 1);
-	
-	uint32_t pos = ReservePositionForInsert(ilen, dkey, hash18bit, exist, failed, generation);
-	if (!exist && !failed)
+	delete[] m_shards;
+}
+
+void StatsRecorder::Enable()
+{
+	if (m_shards == nullptr)
 	{
-		ht[pos].Init(ilen, dlen, dkey, hash18bit, firstChild, generation);
-		
+		m_shards = new Shard[ReaderSlotRegistry::MAX_READER_SLOTS + 1];
+		memset(m_shards, 0, sizeof(Shard) * (ReaderSlotRegistry::MAX_READER_SLOTS + 1));
 	}
-	
-	return pos;
+	m_active.store(m_shards);
 }
 
-// UNPROTECTED, seems to only be used internally and in insert. Could be protected easily with gen + lock.
-uint32_t CuckooHashTable::Lookup(int ilen, uint64_t ikey, bool& found)
+void StatsRecorder::Disable()
 {
-	assert(m_hasCalledInit);
-	
-	found = false;
-	uint32_t hash18bit = XXH::XXHashFn3(ikey, ilen);
-	hash18bit = hash18bit & ((1<<18) - 1);
-	uint32_t expectedHash = hash18bit | ((ilen-1) << 27) | 0x80000000U;
-	int shiftLen = 64 - 8 * ilen;
-	uint64_t shiftedKey = ikey >> shiftLen;
-	
-	uint32_t h1, h2;
-	h1 = XXH::XXHashFn1(ikey, ilen) & htMask;
-	h2 = XXH::XXHashFn2(ikey, ilen) & htMask;
-	MEM_PREFETCH(ht[h1]);
-	MEM_PREFETCH(ht[h2]);
-	if (ht[h1].IsEqual(expectedHash, shiftLen, shiftedKey))
+	m_active.store(nullptr);
+}
+
+MlpStats StatsRecorder::GetTotals() const
+{
+	static_assert(sizeof(MlpStats) % sizeof(uint64_t) == 0, "MlpStats must only hold uint64_t counters");
+	MlpStats totals;
+	memset(&totals, 0, sizeof totals);
+	if (m_shards == nullptr)
 	{
-		found = true;
-		return h1;
+		return totals;
 	}
-	if (ht[h2].IsEqual(expectedHash, shiftLen, shiftedKey))
+	uint64_t* dst = reinterpret_cast<uint64_t*>(&totals);
+	uint32_t numSlots = ReaderSlotRegistry::NumSlotsInUse();
+	for (uint32_t i = 0; i <= numSlots; i++)
 	{
-		found = true;
-		return h2;
+		// the last one is the shard of OVERFLOW_SLOT
+		//
+		uint32_t slot = (i == numSlots) ? ReaderSlotRegistry::OVERFLOW_SLOT : i;
+		uint64_t* src = reinterpret_cast<uint64_t*>(&m_shards[slot].counters);
+		for (size_t k = 0; k < sizeof(MlpStats) / sizeof(uint64_t); k++)
+		{
+			dst[k] += __atomic_load_n(&src[k], __ATOMIC_RELAXED);
+		}
 	}
-	return -1;
+	return totals;
 }
 
-bool CuckooHashTable::Remove(int ilen, uint64_t key, uint32_t generation)
+void StatsRecorder::Clear()
 {
-	assert(m_hasCalledInit);
-
-	uint32_t hash18bit = XXH::XXHashFn3(key, ilen);
-	hash18bit = hash18bit & ((1<<18) - 1);
-	uint32_t expectedHash = hash18bit | ((ilen-1) << 27) | 0x80000000U;
-	int shiftLen = 64 - 8 * ilen;
-	uint64_t shiftedMinKey = key >> shiftLen;
-
-	uint32_t h1, h2;
-	h1 = XXH::XXHashFn1(key, ilen) & htMask;
-	h2 = XXH::XXHashFn2(key, ilen) & htMask;
-
-	MEM_PREFETCH(ht[h1]);
-	MEM_PREFETCH(ht[h2]);
-
-	if (ht[h1].IsEqual(expectedHash, shiftLen, shiftedMinKey))
+	if (m_shards == nullptr)
 	{
-		ht[h1].SetGeneration(generation);
-		ht[h1].Clear();
-		return true;
+		return;
 	}
-	if (ht[h2].IsEqual(expectedHash, shiftLen, shiftedMinKey))
+	for (uint32_t i = 0; i <= ReaderSlotRegistry::OVERFLOW_SLOT; i++)
 	{
-		ht[h2].SetGeneration(generation);
-		ht[h2].Clear();
-		return true;
+		uint64_t* counters = reinterpret_cast<uint64_t*>(&m_shards[i].counters);
+		for (size_t k = 0; k < sizeof(MlpStats) / sizeof(uint64_t); k++)
+		{
+			__atomic_store_n(&counters[k], 0, __ATOMIC_RELAXED);
+		}
 	}
-	return false;
 }
 
-CuckooHashTable::LookupMustExistPromise CuckooHashTable::GetLookupMustExistPromise(int ilen, uint64_t ikey)
-{
-	assert(m_hasCalledInit);
-	
+CuckooHashTable::CuckooHashTable() 
+	: ht(nullptr)
+	, htMask(0)
+	, numNodes(0)
+	, resizeSeq(0)
+	, hasStash(false)
+	, stashIlenMask(0)
+	, migrationTarget(nullptr)
+	, migrationCursor(0)
+	, migrationFailed(false)
+	, movedDuringMigration()
+	, isMigrationTarget(false)
+	, createdBitmaps()
+	, stats()
+#ifndef NDEBUG
+	, m_hasCalledInit(false)
+#endif
+{ }
+	
+void CuckooHashTable::Init(CuckooHashTableNode* _ht, uint64_t _mask, ExternalBitMapPool* _bitmapPool, bool _hasStash)
+{
+	assert(!m_hasCalledInit);
+#ifndef NDEBUG
+	m_hasCalledInit = true;
+#endif
+	ht = _ht;
+	htMask = _mask;
+	numNodes = 0;
+	bitmapPool = _bitmapPool;
+	hasStash = _hasStash;
+	// the array may be a mapped snapshot image
+	//
+	uint32_t mask = 0;
+	for (uint64_t i = htMask + 1; i < NumSlots(); i++)
+	{
+		if (ht[i].IsOccupiedAndNode())
+		{
+			mask |= 1U << ht[i].GetIndexKeyLen();
+		}
+	}
+	stashIlenMask = mask;
+	assert(reinterpret_cast<uintptr_t>(_ht) % 128 == 0);
+	assert(RoundUpToNearestPowerOf2(_mask + 1) == _mask + 1);
+}
+
+bool CuckooHashTable::MigrateTo(CuckooHashTable& newTable, uint32_t generation)
+{
+	StartMigration(newTable);
+	MigrateStep(NumSlots(), generation);
+	if (unlikely(MigrationFailed()))
+	{
+		AbortMigration();
+		return false;
+	}
+	assert(MigrationDone());
+	FinishMigration();
+	return true;
+}
+
+void CuckooHashTable::StartMigration(CuckooHashTable& newTable)
+{
+	assert(m_hasCalledInit);
+	assert(!IsMigrating());
+	assert(newTable.numNodes == 0);
+	migrationTarget = &newTable;
+	migrationCursor = 0;
+	migrationFailed = false;
+	movedDuringMigration.clear();
+	newTable.isMigrationTarget = true;
+	newTable.createdBitmaps.clear();
+}
+
+void CuckooHashTable::MigrateStep(uint64_t numSlots, uint32_t generation)
+{
+	assert(IsMigrating());
+	// Copying only writes to migrationTarget, so no node of this table moves during the step
+	//
+	for (const std::pair<int, uint64_t>& moved : movedDuringMigration)
+	{
+		SyncMigratedNode(moved.first, moved.second, generation);
+	}
+	movedDuringMigration.clear();
+	
+	uint64_t end = migrationCursor + std::min(numSlots, NumSlots() - migrationCursor);
+	for (; migrationCursor < end && !migrationFailed; migrationCursor++)
+	{
+		if (ht[migrationCursor].IsOccupiedAndNode())
+		{
+			CopyToMigrationTarget(migrationCursor, generation);
+		}
+	}
+}
+
+void CuckooHashTable::SyncMigratedNode(int ilen, uint64_t key, uint32_t generation)
+{
+	assert(IsMigrating());
+	migrationTarget->RemoveMigratedNode(ilen, key, generation);
+	bool found;
+	HtPosition pos = Lookup(ilen, key, found);
+	// the nodes past the cursor are copied when it gets there
+	//
+	if (found && pos < migrationCursor && !migrationFailed)
+	{
+		CopyToMigrationTarget(pos, generation);
+	}
+}
+
+void CuckooHashTable::FinishMigration()
+{
+	assert(IsMigrating() && MigrationDone() && !migrationFailed);
+	assert(migrationTarget->numNodes == numNodes);
+	migrationTarget->isMigrationTarget = false;
+	migrationTarget->createdBitmaps.clear();
+	migrationTarget = nullptr;
+}
+
+void CuckooHashTable::AbortMigration()
+{
+	assert(IsMigrating());
+	// External bitmaps are shared between the two tables, except those created by the migration itself
+	// (when no neighboring slot was free for an internal bitmap), free those
+	// newTable was never published, so no reader can be using them
+	//
+	for (uint64_t* bitmap : migrationTarget->createdBitmaps)
+	{
+		migrationTarget->bitmapPool->Release(bitmap);
+	}
+	migrationTarget->isMigrationTarget = false;
+	migrationTarget->createdBitmaps.clear();
+	migrationTarget = nullptr;
+	movedDuringMigration.clear();
+}
+
+void CuckooHashTable::CopyToMigrationTarget(HtPosition pos, uint32_t generation)
+{
+	CuckooHashTable& newTable = *migrationTarget;
+	CuckooHashTableNode& node = ht[pos];
+	bool exist, failed;
+	HtPosition newPos = newTable.ReservePositionForInsert(node.GetIndexKeyLen(), 
+	                                                      node.GetIndexKey(), 
+	                                                      node.GetHash18bit(), 
+	                                                      exist /*out*/, 
+	                                                      failed /*out*/, 
+	                                                      generation);
+	if (unlikely(failed))
+	{
+		migrationFailed = true;
+		return;
+	}
+	assert(!exist);
+	node.CopyNodeTo(&newTable.ht[newPos], generation, *newTable.bitmapPool, newTable.MaxBitmapOffset(newPos));
+	newTable.NoteCreatedBitmap(newPos, node.IsUsingNeighboringBitMap());
+}
+
+void CuckooHashTable::RemoveMigratedNode(int ilen, uint64_t key, uint32_t generation)
+{
+	bool found;
+	HtPosition pos = Lookup(ilen, key, found);
+	if (!found)
+	{
+		return;
+	}
+	CuckooHashTableNode& node = ht[pos];
+	if (node.IsUsingNeighboringBitMap())
+	{
+		int offset = ((node.hash >> 21) & 7) - 4;
+		memset(&node + offset, 0, sizeof(CuckooHashTableNode));
+	}
+	else if (!node.IsLeaf() && !node.IsUsingInternalChildMap() && node.IsExternalPointerBitMap())
+	{
+		// the ones shared with the old table are still in use there
+		//
+		uint64_t* bitmap = reinterpret_cast<uint64_t*>(node.childMap.load());
+		if (createdBitmaps.erase(bitmap) > 0)
+		{
+			bitmapPool->Release(bitmap);
+		}
+	}
+	bool removed = Remove(ilen, key, generation);
+	assert(removed);
+	(void)removed;
+}
+
+void CuckooHashTable::SwapTable(CuckooHashTableNode* _ht, uint64_t _mask, uint32_t _stashIlenMask)
+{
+	assert(m_hasCalledInit);
+	assert(_mask >= htMask);
+	assert(reinterpret_cast<uintptr_t>(_ht) % 128 == 0);
+	resizeSeq.fetch_add(1);
+	// Readers load htMask before ht, so publishing ht first guarantees 
+	// they never combine the new (larger) mask with the old array
+	//
+	ht.store(_ht, std::memory_order_release);
+	htMask.store(_mask, std::memory_order_release);
+	stashIlenMask = _stashIlenMask;
+	resizeSeq.fetch_add(1);
+}
+
+HtPosition CuckooHashTable::ReservePositionForInsert(int ilen, uint64_t dkey, uint32_t hash18bit, bool& exist, bool& failed, uint32_t generation)
+{
+	assert(m_hasCalledInit);
+	
+	exist = false;
+	failed = false;
+	
+	uint32_t expectedHash = hash18bit | ((ilen-1) << 27) | 0x80000000U;
+	int shiftLen = 64 - 8 * ilen;
+	uint64_t shiftedKey = dkey >> shiftLen;
+	
+	HtPosition h1, h2;
+	h1 = BucketPosition1(dkey, ilen, htMask);
+	h2 = BucketPosition2(dkey, ilen, htMask);
+	HtPosition candidates[2 * BUCKET_SIZE];
+	rep(i, 0, BUCKET_SIZE - 1)
+	{
+		candidates[i] = h1 + i;
+		candidates[BUCKET_SIZE + i] = h2 + i;
+	}
+	for (HtPosition pos : candidates)
+	{
+		if (ht[pos].IsEqual(expectedHash, shiftLen, shiftedKey))
+		{
+			exist = true;
+			return pos;
+		}
+	}
+	if (unlikely(stashIlenMask & (1U << ilen)))
+	{
+		HtPosition pos = FindInStash(expectedHash, shiftLen, shiftedKey);
+		if (pos != HtPosition(-1))
+		{
+			exist = true;
+			return pos;
+		}
+	}
+	for (HtPosition pos : candidates)
+	{
+		if (!ht[pos].IsOccupied())
+		{
+			numNodes++;
+			return pos;
+		}
+	}
+	HtPosition freedPosition = HashTableCuckooDisplacement(candidates, generation);
+	if (freedPosition != HtPosition(-1))
+	{
+		numNodes++;
+		return freedPosition;
+	}
+	if (hasStash)
+	{
+		for (HtPosition pos = htMask + 1; pos < NumSlots(); pos++)
+		{
+			if (!ht[pos].IsOccupied())
+			{
+				// readers may search the stash before the node is written, but not miss it afterwards
+				//
+				stashIlenMask |= 1U << ilen;
+				stats.Count(&MlpStats::stashInsertions);
+				numNodes++;
+				return pos;
+			}
+		}
+	}
+	failed = true;
+	return -1;
+}
+
+HtPosition CuckooHashTable::Insert(int ilen, int dlen, uint64_t dkey, int firstChild, bool& exist, bool& failed, uint32_t generation)
+{
+	assert(m_hasCalledInit);
+	
+	uint32_t hash18bit = XXH::XXHashFn3(dkey, ilen);
+	hash18bit = hash18bit & ((1<<18) - 1);
+	
+	HtPosition pos = ReservePositionForInsert(ilen, dkey, hash18bit, exist, failed, generation);
+	if (!exist && !failed)
+	{
+		ht[pos].Init(ilen, dlen, dkey, hash18bit, firstChild, generation);
+		
+	}
+	
+	return pos;
+}
+
+HtPosition CuckooHashTable::BucketPosition(int which, int ilen, uint64_t key)
+{
+	assert(m_hasCalledInit);
+	return (which == 0) ? BucketPosition1(key, ilen, htMask) : BucketPosition2(key, ilen, htMask);
+}
+
+HtPosition CuckooHashTable::InsertIntoBucket(int which, int ilen, int dlen, uint64_t dkey, int firstChild, uint32_t generation)
+{
+	assert(m_hasCalledInit);
+	
+	HtPosition bucket = BucketPosition(which, ilen, dkey);
+	rep(i, 0, BUCKET_SIZE - 1)
+	{
+		if (!ht[bucket + i].IsOccupied())
+		{
+			uint32_t hash18bit = XXH::XXHashFn3(dkey, ilen);
+			hash18bit = hash18bit & ((1<<18) - 1);
+			ht[bucket + i].Init(ilen, dlen, dkey, hash18bit, firstChild, generation);
+			return bucket + i;
+		}
+	}
+	return -1;
+}
+
+// UNPROTECTED, seems to only be used internally and in insert. Could be protected easily with gen + lock.
+HtPosition CuckooHashTable::Lookup(int ilen, uint64_t ikey, bool& found)
+{
+	assert(m_hasCalledInit);
+	
+	found = false;
 	uint32_t hash18bit = XXH::XXHashFn3(ikey, ilen);
 	hash18bit = hash18bit & ((1<<18) - 1);
 	uint32_t expectedHash = hash18bit | ((ilen-1) << 27) | 0x80000000U;
 	int shiftLen = 64 - 8 * ilen;
 	uint64_t shiftedKey = ikey >> shiftLen;
 	
-	uint32_t h1, h2;
-	h1 = XXH::XXHashFn1(ikey, ilen) & htMask;
-	h2 = XXH::XXHashFn2(ikey, ilen) & htMask;
-	
-	return LookupMustExistPromise(true /*valid*/,
-	                              shiftLen,
-	                              ht + h1,
-	                              ht + h2,
-	                              expectedHash,
-	                              shiftedKey);
+	HtPosition h1, h2;
+	h1 = BucketPosition1(ikey, ilen, htMask);
+	h2 = BucketPosition2(ikey, ilen, htMask);
+	PrefetchBucket(h1);
+	PrefetchBucket(h2);
+	rep(i, 0, BUCKET_SIZE - 1)
+	{
+		if (ht[h1 + i].IsEqual(expectedHash, shiftLen, shiftedKey))
+		{
+			found = true;
+			return h1 + i;
+		}
+	}
+	rep(i, 0, BUCKET_SIZE - 1)
+	{
+		if (ht[h2 + i].IsEqual(expectedHash, shiftLen, shiftedKey))
+		{
+			found = true;
+			return h2 + i;
+		}
+	}
+	if (unlikely(stashIlenMask & (1U << ilen)))
+	{
+		HtPosition pos = FindInStash(expectedHash, shiftLen, shiftedKey);
+		found = (pos != HtPosition(-1));
+		return pos;
+	}
+	return -1;
 }
 
-int ALWAYS_INLINE CuckooHashTable::QueryLCP(uint64_t key, 
-                                            uint32_t& idxLen, 
-                                            uint32_t* allPositions1, 
-                                            uint32_t* allPositions2, 
-                                            uint32_t* expectedHash,
-											std::function<ReaderGenerationGuard(void)> generation_getter,
-											std::atomic<uint32_t>& cur_generation)
+bool CuckooHashTable::Remove(int ilen, uint64_t key, uint32_t generation)
 {
-	while (true)
+	assert(m_hasCalledInit);
+
+	uint32_t hash18bit = XXH::XXHashFn3(key, ilen);
+	hash18bit = hash18bit & ((1<<18) - 1);
+	uint32_t expectedHash = hash18bit | ((ilen-1) << 27) | 0x80000000U;
+	int shiftLen = 64 - 8 * ilen;
+	uint64_t shiftedMinKey = key >> shiftLen;
+
+	HtPosition h1, h2;
+	h1 = BucketPosition1(key, ilen, htMask);
+	h2 = BucketPosition2(key, ilen, htMask);
+
+	PrefetchBucket(h1);
+	PrefetchBucket(h2);
+
+	HtPosition candidates[2 * BUCKET_SIZE];
+	rep(i, 0, BUCKET_SIZE - 1)
 	{
-		ReaderGenerationGuard generation_guard = generation_getter();
-		uint32_t generation = generation_guard.generation();
-		// LockGuard lock(&displacement_mutex, true);
-		int ret = QueryLCPInternal(key, idxLen, allPositions1, allPositions2, expectedHash, generation);
-		if (generation > cur_generation.load()) {
-			// this implies that the generation was reset, so we need to retry.
-			continue;
+		candidates[i] = h1 + i;
+		candidates[BUCKET_SIZE + i] = h2 + i;
+	}
+	for (HtPosition pos : candidates)
+	{
+		if (ht[pos].IsEqual(expectedHash, shiftLen, shiftedMinKey))
+		{
+			ht[pos].SetGeneration(generation);
+			ht[pos].Clear();
+			numNodes--;
+			return true;
 		}
-		if (ret >= 0)
+	}
+	if (unlikely(stashIlenMask & (1U << ilen)))
+	{
+		HtPosition pos = FindInStash(expectedHash, shiftLen, shiftedMinKey);
+		if (pos != HtPosition(-1))
 		{
-			return ret;
+			ht[pos].SetGeneration(generation);
+			ht[pos].Clear();
+			numNodes--;
+			bool lastOfLength = true;
+			for (HtPosition i = htMask + 1; i < NumSlots(); i++)
+			{
+				lastOfLength &= !(ht[i].IsOccupiedAndNode() && ht[i].GetIndexKeyLen() == ilen);
+			}
+			if (lastOfLength)
+			{
+				stashIlenMask &= ~(1U << ilen);
+			}
+			return true;
 		}
 	}
+	return false;
+}
+
+CuckooHashTable::LookupMustExistPromise CuckooHashTable::GetLookupMustExistPromise(int ilen, uint64_t ikey)
+{
+	assert(m_hasCalledInit);
+	
+	uint32_t hash18bit = XXH::XXHashFn3(ikey, ilen);
+	hash18bit = hash18bit & ((1<<18) - 1);
+	uint32_t expectedHash = hash18bit | ((ilen-1) << 27) | 0x80000000U;
+	int shiftLen = 64 - 8 * ilen;
+	uint64_t shiftedKey = ikey >> shiftLen;
+	
+	// htMask must be loaded before ht, see SwapTable
+	//
+	HtPosition mask = htMask.load(std::memory_order_acquire);
+	CuckooHashTableNode* table = ht.load(std::memory_order_relaxed);
+	
+	HtPosition h1, h2;
+	h1 = BucketPosition1(ikey, ilen, mask);
+	h2 = BucketPosition2(ikey, ilen, mask);
+	
+	return LookupMustExistPromise(true /*valid*/,
+	                              shiftLen,
+	                              table + h1,
+	                              table + h2,
+	                              (stashIlenMask.load(std::memory_order_relaxed) & (1U << ilen)) ? table + mask + 1 : nullptr,
+	                              expectedHash,
+	                              shiftedKey);
+}
+
+int CuckooHashTable::QueryLCPInternal(uint64_t key, 
+                                      uint32_t& idxLen, 
+                                      HtPosition* allPositions1, 
+                                      HtPosition* allPositions2, 
+                                      uint32_t* expectedHash,
+                                      uint32_t generation)
+{
+	QueryLCPPrepare(key, allPositions1, allPositions2, expectedHash);
+	return QueryLCPResolve(key, idxLen, allPositions1, allPositions2, expectedHash, generation);
 }
 
-int ALWAYS_INLINE CuckooHashTable::QueryLCPInternal(uint64_t key, 
-                                            	    uint32_t& idxLen, 
-                                            	    uint32_t* allPositions1, 
-                                            	    uint32_t* allPositions2, 
-                                            	    uint32_t* expectedHash,
-											  	    uint32_t generation)
+void CuckooHashTable::QueryLCPPrepare(uint64_t key, 
+                                      HtPosition* allPositions1, 
+                                      HtPosition* allPositions2, 
+                                      uint32_t* expectedHash)
 {
 	assert(m_hasCalledInit);
 	
+	// htMask must be loaded before ht, see SwapTable
+	//
+	HtPosition mask = htMask.load(std::memory_order_acquire);
+	
+	s_queryHashes(key, BucketHashMask(mask), allPositions1, allPositions2, expectedHash);
+	
+	rep(i, 2, 7)
+	{
+		allPositions1[i] = BucketStart(allPositions1[i]);
+		allPositions2[i] = BucketStart(allPositions2[i]);
+	}
+	
+	PrefetchBucket(allPositions1[2]);
+	PrefetchBucket(allPositions1[3]);
+	PrefetchBucket(allPositions1[4]);
+	PrefetchBucket(allPositions1[5]);
+	PrefetchBucket(allPositions1[6]);
+	PrefetchBucket(allPositions2[2]);
+	PrefetchBucket(allPositions2[3]);
+	PrefetchBucket(allPositions2[4]);
+	PrefetchBucket(allPositions2[5]);
+	PrefetchBucket(allPositions2[6]);
+}
 
-	__m128i h1, h2, h3, h4;
-	uint64_t h5;
-	XXH::XXHashArray(key, h1, h2, h3, h4, h5);
-	
-	__m128i hashModMask = _mm_set1_epi32(htMask);
-	h1 = _mm_and_si128(h1, hashModMask);
-	h2 = _mm_and_si128(h2, hashModMask);
-	h4 = _mm_and_si128(h4, hashModMask);
-	
-	_mm_storeu_si128(reinterpret_cast<__m128i*>(allPositions1 + 4), h1);
-	_mm_storeu_si128(reinterpret_cast<__m128i*>(allPositions2 + 4), h2);
-	_mm_storeu_si128(reinterpret_cast<__m128i*>(allPositions1), h4);
-	*reinterpret_cast<uint64_t*>(allPositions2 + 2) = *reinterpret_cast<uint64_t*>(allPositions1);
-	
-	MEM_PREFETCH(ht[allPositions1[2]]);
-	MEM_PREFETCH(ht[allPositions1[3]]);
-	MEM_PREFETCH(ht[allPositions1[4]]);
-	MEM_PREFETCH(ht[allPositions1[5]]);
-	MEM_PREFETCH(ht[allPositions1[6]]);
-	MEM_PREFETCH(ht[allPositions2[2]]);
-	MEM_PREFETCH(ht[allPositions2[3]]);
-	MEM_PREFETCH(ht[allPositions2[4]]);
-	MEM_PREFETCH(ht[allPositions2[5]]);
-	MEM_PREFETCH(ht[allPositions2[6]]);
-	
-	__m128i expect1 = _mm_and_si128(h3, HASH18_MASK);
-	expect1 = _mm_or_si128(expect1, HASH_EXPECT_MASK1);
-	_mm_storeu_si128(reinterpret_cast<__m128i*>(expectedHash + 4), expect1);
-	h5 &= 0x3ffff0003ffffULL;
-	h5 |= 0x8000000080000000ULL | (3ULL << 59) | (2ULL << 27);
-	*reinterpret_cast<uint64_t*>(expectedHash + 2) = h5;
+int CuckooHashTable::QueryLCPResolve(uint64_t key, 
+                                     uint32_t& idxLen, 
+                                     HtPosition* allPositions1, 
+                                     HtPosition* allPositions2, 
+                                     uint32_t* expectedHash,
+                                     uint32_t generation)
+{
+	assert(m_hasCalledInit);
 	
+	// the stash lengths are loaded once, the stash is only searched for the lengths of the nodes in it
+	//
+	uint32_t stashLens = stashIlenMask.load(std::memory_order_relaxed);
+	// htMask must be loaded before ht, see SwapTable
+	//
+	HtPosition mask = htMask.load(std::memory_order_acquire);
+	CuckooHashTableNode* table = ht.load(std::memory_order_relaxed);
 	int len = 7;
 
 	for (; len >= 2; len --)
-	{		
-		if ((ht[allPositions1[len]].hash & 0xf803ffffU) == expectedHash[len]) 
+	{
+		// The node may be in either slot of its two buckets, which are in the prefetched lines
+		//
+		HtPosition pos = -1;
+		if ((table[allPositions1[len]].hash & 0xf803ffffU) == expectedHash[len]) { pos = allPositions1[len]; }
+		else if ((table[allPositions2[len]].hash & 0xf803ffffU) == expectedHash[len]) { pos = allPositions2[len]; }
+		else if ((table[allPositions1[len] + 1].hash & 0xf803ffffU) == expectedHash[len]) { pos = allPositions1[len] + 1; }
+		else if ((table[allPositions2[len] + 1].hash & 0xf803ffffU) == expectedHash[len]) { pos = allPositions2[len] + 1; }
+		else if (unlikely(stashLens & (1U << (len + 1))))
 		{
-			if (ht[allPositions1[len]].LoadGeneration() > generation)
+			HtPosition stashStart = mask + 1;
+			uint32_t matches = MatchStashHashes(stashStart, expectedHash[len]);
+			if (matches != 0)
+			{
+				pos = stashStart + __builtin_ctz(matches);
+			}
+			else if (StashModifiedAfter(stashStart, generation))
 			{
 				return -1;
 			}
-			break;
 		}
-		if ((ht[allPositions2[len]].hash & 0xf803ffffU) == expectedHash[len])
+		if (pos != HtPosition(-1))
 		{
-			if (ht[allPositions2[len]].LoadGeneration() > generation)
+			if (table[pos].LoadGeneration() > generation)
 			{
 				return -1;
 			}
-			allPositions1[len] = allPositions2[len];
+			// the hash may be a false match, keep the other bucket in allPositions2 for the slow path
+			//
+			if (BucketOf(pos) == allPositions2[len])
+			{
+				allPositions2[len] = allPositions1[len];
+			}
+			allPositions1[len] = pos;
 			break;
 		}
 		// Check generation at start of each iteration to detect expiry during loop
-		if (ht[allPositions1[len]].GetOccupyFlag() == 2 && ht[allPositions1[len]].LoadGeneration() > generation)
+		if (BucketsModifiedAfter(allPositions1[len], allPositions2[len], generation))
 		{
 			return -1;
 		}
-		if (ht[allPositions2[len]].GetOccupyFlag() == 2 && ht[allPositions2[len]].LoadGeneration() > generation)
-		{
-			return -1;
-		}		
 		allPositions1[len] = 0;
 	}
 	if (len < 2)
 	{
-#ifdef ENABLE_STATS
-		stats.m_lcpResultHistogram[2]++;
-#endif
+		stats.Count(&MlpStats::lcpResultHistogram, 2);
 		return 2;
 	}
 
 	int shiftLen = 64 - 8 * (len + 1);
-	if (unlikely((ht[allPositions1[len]].minKey >> shiftLen) != (key >> shiftLen))) goto _slowpath;
+	if (unlikely((table[allPositions1[len]].minKey >> shiftLen) != (key >> shiftLen))) goto _slowpath;
 	// Check generation after accessing minKey to ensure data read is still valid
-	if (ht[allPositions1[len]].LoadGeneration() > generation) return -1;
+	if (table[allPositions1[len]].LoadGeneration() > generation) return -1;
 
 	idxLen = len + 1;
-#ifdef ENABLE_STATS
-	stats.m_lcpResultHistogram[idxLen]++;
-#endif
+	stats.Count(&MlpStats::lcpResultHistogram, idxLen);
 	{
-		uint64_t xorValue = key ^ ht[allPositions1[len]].minKey;
-		if (ht[allPositions1[len]].LoadGeneration() > generation)
+		uint64_t xorValue = key ^ table[allPositions1[len]].minKey;
+		if (table[allPositions1[len]].LoadGeneration() > generation)
 		{
 			return -1;
 		}
@@ -1192,48 +1686,33 @@ int ALWAYS_INLINE CuckooHashTable::QueryLCPInternal(uint64_t key,
 	//
 _slowpath:
 	{
-#ifdef ENABLE_STATS
-		stats.m_slowpathCount++;
-#endif
-        if (ht[allPositions1[len]].LoadGeneration() > generation) {
+		stats.Count(&MlpStats::slowPathCount);
+        if (table[allPositions1[len]].LoadGeneration() > generation) {
 			return -1;
 		}
 
-		if (ht[allPositions1[7]].IsEqualNoHash(key, 8)) { idxLen = 8; goto _slowpath_end; }
-		if (ht[allPositions2[7]].IsEqualNoHash(key, 8)) { allPositions1[7] = allPositions2[7]; idxLen = 8; goto _slowpath_end; }
-		// Check generation after accessing nodes to ensure data read is still valid
-		if (ht[allPositions1[7]].LoadGeneration() > generation || ht[allPositions2[7]].LoadGeneration() > generation) { return -1; }
-		if (ht[allPositions1[6]].IsEqualNoHash(key, 7)) { idxLen = 7; goto _slowpath_end; }
-		if (ht[allPositions2[6]].IsEqualNoHash(key, 7)) { allPositions1[6] = allPositions2[6]; idxLen = 7; goto _slowpath_end; }
-		// Check generation after accessing nodes to ensure data read is still valid
-		if (ht[allPositions1[6]].LoadGeneration() > generation || ht[allPositions2[6]].LoadGeneration() > generation) { return -1; }
-		if (ht[allPositions1[5]].IsEqualNoHash(key, 6)) { idxLen = 6; goto _slowpath_end; }
-		if (ht[allPositions2[5]].IsEqualNoHash(key, 6)) { allPositions1[5] = allPositions2[5]; idxLen = 6; goto _slowpath_end; }
-		// Check generation after accessing nodes to ensure data read is still valid
-		if (ht[allPositions1[5]].LoadGeneration() > generation || ht[allPositions2[5]].LoadGeneration() > generation) { return -1; }
-		if (ht[allPositions1[4]].IsEqualNoHash(key, 5)) { idxLen = 5; goto _slowpath_end; }
-		if (ht[allPositions2[4]].IsEqualNoHash(key, 5)) { allPositions1[4] = allPositions2[4]; idxLen = 5; goto _slowpath_end; }
-		// Check generation after accessing nodes to ensure data read is still valid
-		if (ht[allPositions1[4]].LoadGeneration() > generation || ht[allPositions2[4]].LoadGeneration() > generation) { return -1; }
-		if (ht[allPositions1[3]].IsEqualNoHash(key, 4)) { idxLen = 4; goto _slowpath_end; }
-		if (ht[allPositions2[3]].IsEqualNoHash(key, 4)) { allPositions1[3] = allPositions2[3]; idxLen = 4; goto _slowpath_end; }
-		// Check generation after accessing nodes to ensure data read is still valid
-		if (ht[allPositions1[3]].LoadGeneration() > generation || ht[allPositions2[3]].LoadGeneration() > generation) { return -1; }
-		if (ht[allPositions1[2]].IsEqualNoHash(key, 3)) { idxLen = 3; goto _slowpath_end; }
-		if (ht[allPositions2[2]].IsEqualNoHash(key, 3)) { allPositions1[2] = allPositions2[2]; idxLen = 3; goto _slowpath_end; }
-		// Check generation after accessing nodes to ensure data read is still valid
-		if (ht[allPositions1[2]].LoadGeneration() > generation || ht[allPositions2[2]].LoadGeneration() > generation) { return -1; }
-#ifdef ENABLE_STATS
-		stats.m_lcpResultHistogram[2]++;
-#endif
+		// allPositions1 is the slot whose hash matched and allPositions2 the first slot of the other bucket,
+		// so searching the buckets of both covers every slot the node may be in
+		//
+		for (int i = 7; i >= 2; i--)
+		{
+			HtPosition pos = FindInBuckets(key, i + 1, allPositions1[i], allPositions2[i]);
+			if (pos != HtPosition(-1))
+			{
+				allPositions1[i] = pos;
+				idxLen = i + 1;
+				goto _slowpath_end;
+			}
+			// Check generation after accessing nodes to ensure data read is still valid
+			if (BucketsModifiedAfter(BucketOf(allPositions1[i]), allPositions2[i], generation)) { return -1; }
+		}
+		stats.Count(&MlpStats::lcpResultHistogram, 2);
 		return 2;
 
 _slowpath_end:
-#ifdef ENABLE_STATS
-		stats.m_lcpResultHistogram[idxLen]++;
-#endif
-		uint64_t xorValue = key ^ ht[allPositions1[idxLen-1]].minKey;
-		if (ht[allPositions1[idxLen-1]].LoadGeneration() > generation)
+		stats.Count(&MlpStats::lcpResultHistogram, idxLen);
+		uint64_t xorValue = key ^ table[allPositions1[idxLen-1]].minKey;
+		if (table[allPositions1[idxLen-1]].LoadGeneration() > generation)
 		{
 			return -1;
 		}
@@ -1244,65 +1723,162 @@ _slowpath_end:
 	}
 }
 
-void CuckooHashTable::HashTableCuckooDisplacement(uint32_t victimPosition, int rounds, bool& failed, uint32_t generation)
+HtPosition CuckooHashTable::HashTableCuckooDisplacement(const HtPosition* candidates, uint32_t generation)
 {
-	if (rounds > 1000)
+	// Breadth-first search over the slots whose node could move to its other bucket, starting from the candidates
+	// queue[i].parent is the entry whose node would move into queue[i].pos once the node there has moved on
+	//
+	struct DisplacementStep
 	{
-		failed = true;
-		return;
-	}
-
-	assert(ht[victimPosition].IsOccupied());
-	if (likely(ht[victimPosition].IsNode()))
+		HtPosition pos;
+		int parent;
+		int depth;
+	};
+	// the queue is 64KB, too much for the stack of the writer, so each writer thread reuses its own
+	//
+	static thread_local std::vector<DisplacementStep> queue;
+	if (unlikely(queue.empty()))
 	{
-		int ilen = ht[victimPosition].GetIndexKeyLen();
-		uint64_t ikey = ht[victimPosition].GetIndexKey();
-		
-		uint32_t h1, h2;
-		h1 = XXH::XXHashFn1(ikey, ilen) & htMask;
-		h2 = XXH::XXHashFn2(ikey, ilen) & htMask;
-		
-		if (h1 == victimPosition)
-		{
-			swap(h1, h2);
-		}
-		assert(h2 == victimPosition);
-		if (ht[h1].IsOccupied())
+		queue.resize(MAX_DISPLACEMENT_QUEUE);
+	}
+	int tail = 0;
+	rep(i, 0, 2 * BUCKET_SIZE - 1)
+	{
+		assert(ht[candidates[i]].IsOccupied());
+		if (unlikely(!ht[candidates[i]].IsNode()))
 		{
-			HashTableCuckooDisplacement(h1, rounds+1, failed, generation);
-			if (failed) return;
+			// an internal bitmap can always be relocated
+			//
+			stats.Count(&MlpStats::displacementDepthHistogram, 1);
+			RelocateBitmapAt(candidates[i]);
+			return candidates[i];
 		}
-		assert(!ht[h1].IsOccupied());
-#ifdef ENABLE_STATS
-		stats.m_movedNodesCount++;
-#endif
-        ht[h1].SetGeneration(generation);
-		ht[victimPosition].MoveNode(&ht[h1], generation);
+		queue[tail++] = DisplacementStep { candidates[i], -1 /*parent*/, 1 /*depth*/ };
 	}
-	else
+	
+	for (int head = 0; head < tail; head++)
 	{
-		CuckooHashTableNode* owner = nullptr;
-		rep(i, -3, 3)
+		const DisplacementStep& step = queue[head];
+		if (step.depth >= MAX_DISPLACEMENT_PATH_LEN)
+		{
+			continue;
+		}
+		int ilen = ht[step.pos].GetIndexKeyLen();
+		uint64_t ikey = ht[step.pos].GetIndexKey();
+		HtPosition other = BucketPosition1(ikey, ilen, htMask);
+		if (other == BucketOf(step.pos))
+		{
+			other = BucketPosition2(ikey, ilen, htMask);
+		}
+		rep(i, 0, BUCKET_SIZE - 1)
 		{
-			CuckooHashTableNode* target = &ht[victimPosition + i];
-			//if (target->IsOccupiedAndNode() && !target->IsUsingInternalChildMap() && !target->IsExternalPointerBitMap())
-			if (target->IsOccupiedAndNode() && !target->IsUsingInternalChildMap() && !target->IsExternalPointerBitMap() && !target->IsLeaf()) //ASK RON TODO
+			HtPosition pos = other + i;
+			// a slot may show up only once on a path, or its node would be moved twice
+			//
+			bool onPath = false;
+			for (int k = head; k != -1; k = queue[k].parent)
+			{
+				onPath |= (queue[k].pos == pos);
+			}
+			if (onPath)
 			{
-				int offset = ((target->hash >> 21) & 7) - 4;
-				if (offset + i == 0)
+				continue;
+			}
+			if (!ht[pos].IsOccupied() || !ht[pos].IsNode())
+			{
+				// the end of the path, perform the moves back to front so that every node is in one of its slots at all times
+				//
+				stats.Count(&MlpStats::displacementDepthHistogram, 
+				            std::min(step.depth + int(ht[pos].IsOccupied()), MlpStats::DISPLACEMENT_DEPTH_BUCKETS - 1));
+				if (ht[pos].IsOccupied())
 				{
-					owner = target;
-					break;
+					RelocateBitmapAt(pos);
 				}
+				for (int k = head; k != -1; k = queue[k].parent)
+				{
+					assert(!ht[pos].IsOccupied());
+					stats.Count(&MlpStats::movedNodesCount);
+					bool hadNeighboringBitMap = ht[queue[k].pos].IsUsingNeighboringBitMap();
+					ht[pos].SetGeneration(generation);
+					ht[queue[k].pos].MoveNode(&ht[pos], generation, *bitmapPool, MaxBitmapOffset(pos));
+					NoteCreatedBitmap(pos, hadNeighboringBitMap);
+					if (unlikely(IsMigrating()))
+					{
+						movedDuringMigration.emplace_back(ht[pos].GetIndexKeyLen(), ht[pos].GetIndexKey());
+					}
+					pos = queue[k].pos;
+				}
+				assert(!ht[pos].IsOccupied());
+				return pos;
+			}
+			if (tail < MAX_DISPLACEMENT_QUEUE)
+			{
+				queue[tail++] = DisplacementStep { pos, head /*parent*/, step.depth + 1 /*depth*/ };
 			}
 		}
-		assert(owner != nullptr);
-#ifdef ENABLE_STATS
-		stats.m_relocatedBitmapsCount++;
-#endif
-		owner->RelocateBitMap();
 	}
-	assert(!ht[victimPosition].IsOccupied());
+	stats.Count(&MlpStats::displacementFailures);
+	return -1;
+}
+
+void CuckooHashTable::RelocateBitmapAt(HtPosition pos)
+{
+	CuckooHashTableNode* owner = nullptr;
+	int ownerOffset = 0;
+	rep(i, -3, 3)
+	{
+		// pointer arithmetic, as pos + i wraps around near slot 0 (the neighbours there are gap slots)
+		//
+		CuckooHashTableNode* target = &ht[pos] + i;
+		//if (target->IsOccupiedAndNode() && !target->IsUsingInternalChildMap() && !target->IsExternalPointerBitMap())
+		if (target->IsOccupiedAndNode() && !target->IsUsingInternalChildMap() && !target->IsExternalPointerBitMap() && !target->IsLeaf()) //ASK RON TODO
+		{
+			int offset = ((target->hash >> 21) & 7) - 4;
+			if (offset + i == 0)
+			{
+				owner = target;
+				ownerOffset = i;
+				break;
+			}
+		}
+	}
+	assert(owner != nullptr);
+	stats.Count(&MlpStats::relocatedBitmapsCount);
+	owner->RelocateBitMap(*bitmapPool, MaxBitmapOffset(pos + ownerOffset));
+	NoteCreatedBitmap(pos + ownerOffset, true /*hadNeighboringBitMap*/);
+	assert(!ht[pos].IsOccupied());
+}
+
+uint32_t CuckooHashTable::MatchStashHashes(HtPosition stashStart, uint32_t expectedHash)
+{
+	static_assert(STASH_SIZE % 4 == 0, "the stash is compared 4 slots at a time");
+	const __m128i hashMask = _mm_set1_epi32(0xf803ffffU);
+	const __m128i target = _mm_set1_epi32(expectedHash);
+	uint32_t matches = 0;
+	for (int i = 0; i < STASH_SIZE; i += 4)
+	{
+		CuckooHashTableNode* slots = ht + stashStart + i;
+		__m128i hashes = _mm_set_epi32(slots[3].hash, slots[2].hash, slots[1].hash, slots[0].hash);
+		__m128i eq = _mm_cmpeq_epi32(_mm_and_si128(hashes, hashMask), target);
+		matches |= uint32_t(_mm_movemask_ps(_mm_castsi128_ps(eq))) << i;
+	}
+	return matches;
+}
+
+HtPosition CuckooHashTable::FindInStash(uint32_t expectedHash, int shiftLen, uint64_t shiftedKey)
+{
+	HtPosition stashStart = htMask + 1;
+	uint32_t matches = MatchStashHashes(stashStart, expectedHash);
+	while (matches != 0)
+	{
+		HtPosition pos = stashStart + __builtin_ctz(matches);
+		if (ht[pos].IsEqual(expectedHash, shiftLen, shiftedKey))
+		{
+			return pos;
+		}
+		matches &= matches - 1;
+	}
+	return -1;
 }
 
 void MlpSet::ResetGenerationsIfNeeded(uint32_t &cur_gen)
@@ -1313,11 +1889,15 @@ void MlpSet::ResetGenerationsIfNeeded(uint32_t &cur_gen)
 	cur_gen = 1;
 	cur_generation = 0;
 	m_hashTable.ResetGenerations();
+	if (m_growingTable != nullptr)
+	{
+		m_growingTable->ResetGenerations();
+	}
 }
 
 void CuckooHashTable::ResetGenerations()
 {
-	for (uint32_t i = 0; i <= htMask; i++)
+	for (uint64_t i = 0; i < NumSlots(); i++)
 	{
 		if (ht[i].GetOccupyFlag() == 2 && ht[i].LoadGeneration() > 0)
 		{
@@ -1326,223 +1906,528 @@ void CuckooHashTable::ResetGenerations()
 	}
 }
 
-MlpSet::MlpSet() 
-	: m_memoryPtr(nullptr)
-	, m_allocatedSize(-1)
-	, m_hashTable()
-#ifndef NDEBUG
-	, m_hasCalledInit(false)
-#endif
-{ }
-	
-MlpSet::~MlpSet()
+// Size of the huge pages backing MemoryBacking::HUGETLB and TRANSPARENT_HUGE_PAGES memory
+// (the x86-64 default huge page size)
+//
+static const uint64_t BACKING_HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+// mbind(2) through the raw syscall, so that we don't need to link with libnuma
+// Returns whether the pages of [ptr, ptr + size) now follow the policy
+//
+static bool ApplyNumaPolicy(void* ptr, uint64_t size, const MemoryPolicy& policy)
 {
-	if (m_memoryPtr != nullptr && m_memoryPtr != MAP_FAILED)
+	if (policy.numaPolicy == NumaPolicy::DEFAULT || policy.numaNodeMask == 0)
 	{
-		free(m_memoryPtr);
-		m_memoryPtr = nullptr;
+		return policy.numaPolicy == NumaPolicy::DEFAULT;
 	}
+	int mode = (policy.numaPolicy == NumaPolicy::BIND) ? MPOL_BIND : MPOL_INTERLEAVE;
+	unsigned long nodeMask = policy.numaNodeMask;
+	// The kernel reads maxnode - 1 bits of the mask
+	// The memory is freshly mapped and untouched, MPOL_MF_MOVE only matters if the caller already touched it
+	//
+	long ret = syscall(SYS_mbind, ptr, size, mode, &nodeMask, sizeof(nodeMask) * 8 + 1, MPOL_MF_MOVE);
+	return ret == 0;
 }
-	
-#ifdef ENABLE_STATS
-MlpSet::Stats::Stats()
-{
-	memset(m_lowerBoundParentPathStepsHistogram, 0, sizeof m_lowerBoundParentPathStepsHistogram);
-	m_numbersOfPendingDeallocationPostponed = 0;
-}
-		
-void MlpSet::Stats::ClearStats()
+
+// The length of the mapping backing an allocation of size bytes
+//
+static uint64_t BackingMappingSize(uint64_t size, MemoryBacking backing)
 {
-	memset(m_lowerBoundParentPathStepsHistogram, 0, sizeof m_lowerBoundParentPathStepsHistogram);
+	if (backing == MemoryBacking::PLAIN_PAGES)
+	{
+		return RoundUpToNearestMultipleOf(size, 4096);
+	}
+	return RoundUpToNearestMultipleOf(size, BACKING_HUGE_PAGE_SIZE);
 }
-		
-void MlpSet::Stats::ReportStats()	
+
+void* AllocateBackingMemory(uint64_t size, const MemoryPolicy& policy, MemoryBacking& backing, bool* numaPolicyApplied)
 {
-	printf("MlpSet stats:\n");
-	bool containsUsefulInfo = false;
-	rep(i, 0, 7) 
+	void* ptr = nullptr;
+	backing = policy.backing;
+	if (backing == MemoryBacking::HUGETLB)
 	{
-		if (m_lowerBoundParentPathStepsHistogram[i]) 
+		// Without MAP_NORESERVE the mapping fails right away if the huge page pool is too small,
+		// instead of raising SIGBUS when the memory is touched
+		//
+		ptr = mmap(nullptr,
+		           BackingMappingSize(size, backing),
+		           PROT_READ | PROT_WRITE,
+		           MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB,
+		           -1 /*fd*/,
+		           0 /*offset*/);
+		if (ptr == MAP_FAILED)
 		{
-			containsUsefulInfo = true;
+			ptr = nullptr;
+			backing = MemoryBacking::TRANSPARENT_HUGE_PAGES;
 		}
 	}
-	if (containsUsefulInfo)
+	if (backing == MemoryBacking::TRANSPARENT_HUGE_PAGES)
 	{
-		printf("\tLower_bound queries parent-path walk length histogram:\n");
-		rep(i, 0, 7)
+		// map one extra huge page and trim the mapping to a 2MB aligned range
+		//
+		uint64_t sz = BackingMappingSize(size, backing);
+		void* raw = mmap(nullptr, sz + BACKING_HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1 /*fd*/, 0 /*offset*/);
+		ReleaseAssert(raw != MAP_FAILED);
+		uintptr_t rawStart = reinterpret_cast<uintptr_t>(raw);
+		uintptr_t start = RoundUpToNearestMultipleOf(rawStart, BACKING_HUGE_PAGE_SIZE);
+		if (start > rawStart)
+		{
+			ReleaseAssert(munmap(raw, start - rawStart) == 0);
+		}
+		ReleaseAssert(munmap(reinterpret_cast<void*>(start + sz), rawStart + BACKING_HUGE_PAGE_SIZE - start) == 0);
+		ptr = reinterpret_cast<void*>(start);
+		// fails if the kernel is built without THP, the memory is then plain pages
+		// (the mapping stays 2MB rounded, which is what FreeBackingMemory expects for this backing)
+		//
+		if (madvise(ptr, sz, MADV_HUGEPAGE) != 0)
 		{
-			printf("\tlen = %d: %u\n", i, m_lowerBoundParentPathStepsHistogram[i]);
+			backing = MemoryBacking::PLAIN_PAGES;
+			uint64_t plainSize = BackingMappingSize(size, backing);
+			if (plainSize < sz)
+			{
+				ReleaseAssert(munmap(reinterpret_cast<void*>(start + plainSize), sz - plainSize) == 0);
+			}
 		}
 	}
+	if (ptr == nullptr)
+	{
+		assert(backing == MemoryBacking::PLAIN_PAGES);
+		ptr = mmap(nullptr, BackingMappingSize(size, backing), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1 /*fd*/, 0 /*offset*/);
+		ReleaseAssert(ptr != MAP_FAILED);
+	}
+	// Anonymous mappings are zero filled, and no page has been touched yet,
+	// so the policy decides where every page is placed
+	//
+	bool applied = ApplyNumaPolicy(ptr, BackingMappingSize(size, backing), policy);
+	if (numaPolicyApplied != nullptr)
+	{
+		*numaPolicyApplied = applied;
+	}
+	return ptr;
 }
 
-void MlpSet::ClearStats()
+void FreeBackingMemory(void* ptr, uint64_t size, MemoryBacking backing)
 {
-	stats.ClearStats();
-	m_hashTable.stats.ClearStats();
+	int ret = munmap(ptr, BackingMappingSize(size, backing));
+	ReleaseAssert(ret == 0);
 }
-		
-void MlpSet::ReportStats()
+
+MlpSet::MlpSet() 
+	: m_memoryPtr(nullptr)
+	, m_allocatedSize(-1)
+	, m_memoryBacking(MemoryBacking::PLAIN_PAGES)
+	, m_numaPolicyApplied(true)
+	, m_memoryPolicy()
+	, m_hashTableMemoryPtr(nullptr)
+	, m_growingTable()
+	, m_growingTableMemoryPtr(nullptr)
+	, m_incrementalGrowth(true)
+	, m_mappedImage(nullptr)
+	, m_mappedImageSize(0)
+	, m_hashTable()
+	, m_sharedReaderGeneration(UINT32_MAX)
+	, m_deallocationQueue(nullptr)
+	, m_reclamationBacklog(0)
+	, m_reclamationMode(ReclamationMode::INLINE)
+	, m_reclamationLowWatermark(0)
+	, m_reclamationHighWatermark(PENDING_ALLOCATIONS_CLEAR_BUFFER)
+	, m_stopReclamationThread(false)
+#ifndef NDEBUG
+	, m_hasCalledInit(false)
+#endif
 {
-	stats.ReportStats();
-	m_hashTable.stats.ReportStats();
+	for (std::atomic<PerReaderInteger*>& generations : m_readerGenerationChunks)
+	{
+		generations.store(nullptr);
+	}
 }
-#endif
+	
+MlpSet::~MlpSet()
+{
+	StopReclamationThread();
+	// No readers are left, everything can be freed
+	//
+	AwaitingDeallocation* head = m_deallocationQueue.exchange(nullptr);
+	while (head != nullptr)
+	{
+		m_awaitingDeallocations.push_back(head);
+		head = head->next;
+	}
+	for (AwaitingDeallocation* entry : m_awaitingDeallocations)
+	{
+		entry->deleter(entry->context, entry->ptr);
+		delete entry;
+	}
+	m_awaitingDeallocations.clear();
+	for (std::atomic<PerReaderInteger*>& generations : m_readerGenerationChunks)
+	{
+		free(generations.load());
+	}
+	if (m_mappedImage != nullptr)
+	{
+		// both chunks live in the image
+		//
+		munmap(m_mappedImage, m_mappedImageSize);
+		m_mappedImage = nullptr;
+		m_hashTableMemoryPtr = nullptr;
+		m_memoryPtr = nullptr;
+	}
+	if (m_hashTableMemoryPtr != nullptr)
+	{
+		FreeHashTableMemory(nullptr, m_hashTableMemoryPtr);
+		m_hashTableMemoryPtr = nullptr;
+	}
+	if (m_growingTableMemoryPtr != nullptr)
+	{
+		FreeHashTableMemory(nullptr, m_growingTableMemoryPtr);
+		m_growingTableMemoryPtr = nullptr;
+	}
+	if (m_memoryPtr != nullptr)
+	{
+		FreeBackingMemory(m_memoryPtr, m_allocatedSize, m_memoryBacking);
+		m_memoryPtr = nullptr;
+	}
+}
+	
 
-void MlpSet::Init(uint32_t maxSetSize)
+void MlpSet::Init(uint32_t maxSetSize, const MemoryPolicy& memoryPolicy)
 {
 	assert(!m_hasCalledInit);
 #ifndef NDEBUG
 	m_hasCalledInit = true;
 #endif
-	// We are using _mm_i32gather_epi32 currently, which allows us to only index as far as 32GB memory
-	// This is currently limiting how many elements we can hold in the container
-	// If we use _mm256_i64gather_epi32 instead, we will support a max size of 2^30 
-	// (the current 32-bit hash functiion becomes the limiting factor in this case)
-	// In theory, we can support up to 2^37 elements (which should be sufficient for any in-memory workload), 
-	// by making use of the currently unused 14 higher bits of HashFn3 to get two 39-bit hash value for Cuckoo
-	// But for now let's just target 1<<28 input size
-	// TODO: investigate what is the perf effect of changing _mm_i32gather_epi32 to _mm256_i64gather_epi32
+	// Hash table positions are 32-bit by default, so the table can have at most 2^30 slots (see BucketHashMask),
+	// which limits the initial size to 2^29 elements (the table may still grow up to MAX_TABLE_SIZE).
+	// In large capacity mode (MLP_LARGE_CAPACITY), positions are 64-bit and make use of 
+	// the otherwise unused 14 higher bits of HashFn3 to get two 39-bit hash values for Cuckoo,
+	// supporting up to 2^36 elements (which should be sufficient for any in-memory workload)
 	//
-	ReleaseAssert(maxSetSize <= (1 << 28));
 	maxSetSize = max(maxSetSize, 4096U);
+	ReleaseAssert(RoundUpToNearestPowerOf2(maxSetSize) * 2 <= CuckooHashTable::MAX_TABLE_SIZE);
 	
-	// compute how much memory to allocate
-	// First, the top 3 levels of the tree
+	// compute how much memory to allocate for the top 3 levels of the tree
+	// The hash table lives in its own chunk, since it is replaced when the table grows
 	//
 	uint64_t sz = 32 + 8192 + 2 * 1024 * 1024;
-	// Then, we need 6 HashTableNode's gap for internal bitmap
-	//
-	sz += sizeof(CuckooHashTableNode) * 6;
-	// Pad sz to 128 bytes so the real hash table starts at 128-byte boundary
-	//
-	sz = RoundUpToNearestMultipleOf(sz, 128);
-	uint64_t hashTableOffset = sz;
-	// Real hash table size
-	//
-	uint64_t htSize = RoundUpToNearestPowerOf2(maxSetSize) * 4;
-	// We need 6 slots gap in the end for internal bitmap as well
-	//
-	sz += (htSize + 6) * sizeof(CuckooHashTableNode);
-	
-	int ret = posix_memalign(&m_memoryPtr, 4096, sz);
-	ReleaseAssert(!ret);
-	//m_memoryPtr = malloc(sz);
-	// m_memoryPtr = mmap(NULL, 
-	//                    sz, 
-	//                    PROT_READ | PROT_WRITE, 
-	//                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, 
-	//                    -1 /*fd*/, 
-	//                    0 /*offset*/);
-	ReleaseAssert(m_memoryPtr != MAP_FAILED);
+	
+	m_memoryPolicy = memoryPolicy;
+	m_memoryPtr = AllocateBackingMemory(sz, m_memoryPolicy, m_memoryBacking /*out*/, &m_numaPolicyApplied /*out*/);
 	m_allocatedSize = sz;
 		
 	uintptr_t ptr = reinterpret_cast<uintptr_t>(m_memoryPtr);
 	m_root = reinterpret_cast<std::atomic<uint64_t>*>(ptr);
 	m_treeDepth1 = reinterpret_cast<std::atomic<uint64_t>*>(ptr + 32);
 	m_treeDepth2 = reinterpret_cast<std::atomic<uint64_t>*>(ptr + 32 + 8192);
-	m_hashTable.Init(reinterpret_cast<CuckooHashTableNode*>(ptr + hashTableOffset), htSize - 1);
 	
-	memset(m_memoryPtr, 0, m_allocatedSize);
+	// Real hash table size
+	// A set of n random keys has little more than n nodes, which the buckets hold at 2 slots per key
+	// (denser key sets have up to about 1.5n nodes, and grow the table once)
+	//
+	uint64_t htSize = RoundUpToNearestPowerOf2(maxSetSize) * 2;
+	CuckooHashTableNode* ht;
+	m_hashTableMemoryPtr = AllocateHashTableMemory(htSize, ht);
+	m_hashTable.Init(ht, htSize - 1, &m_bitmapPool, true /*hasStash*/);
 
 	cur_generation.store(0);
+}
+
+// Stored at the start of a hash table allocation, in the padding before the gap slots,
+// so that the deleter knows how to free it
+//
+struct HashTableMemoryHeader
+{
+	uint64_t size;
+	MemoryBacking backing;
+};
+
+void MlpSet::FreeHashTableMemory(void* /*context*/, void* ptr)
+{
+	HashTableMemoryHeader* header = reinterpret_cast<HashTableMemoryHeader*>(ptr);
+	FreeBackingMemory(ptr, header->size, header->backing);
+}
+
+void MlpSet::GetHashTableMemoryLayout(uint64_t htSize, uint64_t& gap, uint64_t& size)
+{
+	// We need 6 HashTableNode's gap before the table and after its stash for internal bitmap
+	// Pad the gap to 128 bytes so the real hash table starts at 128-byte boundary
+	//
+	gap = RoundUpToNearestMultipleOf(sizeof(CuckooHashTableNode) * 6, 128);
+	assert(sizeof(HashTableMemoryHeader) + sizeof(CuckooHashTableNode) * 6 <= gap);
+	size = gap + (htSize + CuckooHashTable::STASH_SIZE + 6) * sizeof(CuckooHashTableNode);
+}
+
+void* MlpSet::AllocateHashTableMemory(uint64_t htSize, CuckooHashTableNode*& ht)
+{
+	uint64_t gap, sz;
+	GetHashTableMemoryLayout(htSize, gap /*out*/, sz /*out*/);
+	
+	MemoryBacking backing;
+	void* memoryPtr = AllocateBackingMemory(sz, m_memoryPolicy, backing /*out*/);
+	HashTableMemoryHeader* header = reinterpret_cast<HashTableMemoryHeader*>(memoryPtr);
+	header->size = sz;
+	header->backing = backing;
+	ht = reinterpret_cast<CuckooHashTableNode*>(reinterpret_cast<uintptr_t>(memoryPtr) + gap);
+	return memoryPtr;
+}
 
-	int num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
-	ReleaseAssert(num_cpus > 0);
+MlpSet::MemoryStats MlpSet::GetMemoryStats()
+{
+	assert(m_hasCalledInit);
+	MemoryStats ms;
+	memset(&ms, 0, sizeof ms);
+	uint64_t htSize = uint64_t(m_hashTable.htMask) + 1;
+	if (m_mappedImage != nullptr)
+	{
+		ms.mappedImageBytes = m_mappedImageSize;
+	}
+	else
+	{
+		uint64_t gap;
+		ms.topLevelBitmapBytes = m_allocatedSize;
+		std::vector<unsigned char> residency((m_allocatedSize + 4095) / 4096);
+		if (mincore(m_memoryPtr, m_allocatedSize, residency.data()) == 0)
+		{
+			for (unsigned char r : residency)
+			{
+				ms.topLevelBitmapResidentBytes += (r & 1) ? 4096 : 0;
+			}
+		}
+		GetHashTableMemoryLayout(htSize, gap /*out*/, ms.hashTableBytes /*out*/);
+		if (m_growingTable != nullptr)
+		{
+			uint64_t growingTableBytes;
+			GetHashTableMemoryLayout(uint64_t(m_growingTable->htMask) + 1, gap /*out*/, growingTableBytes /*out*/);
+			ms.hashTableBytes += growingTableBytes;
+		}
+		ms.externalBitmapPoolBytes = m_bitmapPool.NumChunks() * ExternalBitMapPool::CHUNK_SIZE;
+	}
+	for (std::atomic<PerReaderInteger*>& generations : m_readerGenerationChunks)
+	{
+		if (generations.load() != nullptr)
+		{
+			ms.readerGenerationBytes += sizeof(PerReaderInteger) * READER_GENERATION_CHUNK_SIZE;
+		}
+	}
+	ms.hashTableSlots = htSize;
 
-	m_readerGenerationsBuffer.resize(sizeof(PerCpuInteger) * num_cpus);
-	m_readerGenerations = reinterpret_cast<PerCpuInteger*>(m_readerGenerationsBuffer.data());
-	for (size_t i = 0; i < num_cpus; i++)
+	for (uint64_t i = 0; i < m_hashTable.NumSlots(); i++)
 	{
-		m_readerGenerations[i].value.store(UINT32_MAX);
+		CuckooHashTableNode& node = m_hashTable.ht[i];
+		if (!node.IsOccupiedAndNode())
+		{
+			continue;
+		}
+		if (i >= htSize)
+		{
+			ms.numStashedNodes++;
+		}
+		if (node.IsLeaf())
+		{
+			ms.numLeaves++;
+		}
+		else if (node.IsUsingInternalChildMap())
+		{
+			ms.numInternalMapNodes++;
+		}
+		else if (node.IsExternalPointerBitMap())
+		{
+			ms.numPointerBitmapNodes++;
+		}
+		else
+		{
+			ms.numInternalBitmapNodes++;
+		}
 	}
+	ms.numInnerNodes = ms.numInternalMapNodes + ms.numInternalBitmapNodes + ms.numPointerBitmapNodes;
+	ms.internalBitmapBytes = ms.numInternalBitmapNodes * sizeof(CuckooHashTableNode);
+	ms.pointerBitmapBytes = ms.numPointerBitmapNodes * ExternalBitMapPool::BITMAP_SIZE;
+	ms.loadFactor = double(ms.numLeaves + ms.numInnerNodes) / double(htSize);
+	ms.pendingDeallocations = m_reclamationBacklog.load();
+	return ms;
 }
 
-void MlpSet::ClearL1Cache(uint64_t value, std::optional<uint64_t> successor)
+void MlpSet::GrowHashTable(uint32_t generation, uint64_t minTableSize)
 {
-	if (successor.has_value() && ((*successor >> 48) == (value >> 48)))
+	if (m_growingTable != nullptr && FinishHashTableGrowth(generation) && 
+	    RoundUpToNearestPowerOf2(minTableSize) <= uint64_t(m_hashTable.htMask) + 1)
 	{
-		// successor occupies the same L1 bit
 		return;
 	}
-
-	bool found;
-	uint64_t smallest_in_range = WriterLowerBound((value >> 48) << 48, found);
-	if (found && smallest_in_range < value)
+	uint64_t htSize = uint64_t(m_hashTable.htMask) + 1;
+	if (RoundUpToNearestPowerOf2(minTableSize) > htSize * 2)
+	{
+		htSize = RoundUpToNearestPowerOf2(minTableSize) / 2;
+	}
+	while (true)
 	{
-		// there's an item in the data structure smaller than value but bigger
-		// than the minimal number that would have those high bits, meaning
-		// it occupies the same L1 bit
+		htSize *= 2;
+		ReleaseAssert(htSize <= CuckooHashTable::MAX_TABLE_SIZE);
+		
+		CuckooHashTableNode* ht;
+		void* memoryPtr = AllocateHashTableMemory(htSize, ht);
+		CuckooHashTable newTable;
+		newTable.Init(ht, htSize - 1, &m_bitmapPool, true /*hasStash*/);
+		
+		// The old table is not modified during the migration, 
+		// readers keep using it until the new one is published
+		//
+		if (unlikely(!m_hashTable.MigrateTo(newTable, generation)))
+		{
+			FreeHashTableMemory(nullptr, memoryPtr);
+			continue;
+		}
+		
+		m_hashTable.SwapTable(ht, htSize - 1, newTable.stashIlenMask);
+		m_hashTable.numNodes = newTable.numNodes;
+		
+		// Readers that started before the swap may still be using the old table
+		//
+		AddDeallocation(m_hashTableMemoryPtr, FreeHashTableMemory, nullptr);
+		m_hashTableMemoryPtr = memoryPtr;
 		return;
 	}
-
-	// nullify the bit from the L1 cache
-	uint64_t h16bits = value >> 48;
-	m_treeDepth1[value >> 54] &= ~(uint64_t(1) << (h16bits % 64));
 }
 
-void MlpSet::ClearL2Cache(uint64_t value, std::optional<uint64_t> successor)
+void MlpSet::StepHashTableGrowth(uint64_t key, uint32_t generation)
 {
-	if (successor.has_value() && ((*successor >> 40) == (value >> 40)))
+	if (likely(m_growingTable == nullptr))
 	{
-		// successor occupies the same L2 bit
-		return;
+		if (likely(!m_incrementalGrowth || !m_hashTable.ShouldStartGrowing()))
+		{
+			return;
+		}
+		uint64_t htSize = (uint64_t(m_hashTable.htMask) + 1) * 2;
+		if (htSize > CuckooHashTable::MAX_TABLE_SIZE)
+		{
+			return;
+		}
+		CuckooHashTableNode* ht;
+		m_growingTableMemoryPtr = AllocateHashTableMemory(htSize, ht);
+		m_growingTable.reset(new CuckooHashTable());
+		m_growingTable->Init(ht, htSize - 1, &m_bitmapPool, true /*hasStash*/);
+		m_hashTable.StartMigration(*m_growingTable);
+	}
+	else
+	{
+		SyncGrowingHashTable(key, generation);
+	}
+	
+	m_hashTable.MigrateStep(CuckooHashTable::MIGRATION_SLOTS_PER_STEP, generation);
+	if (unlikely(m_hashTable.MigrationDone() || m_hashTable.MigrationFailed()))
+	{
+		if (unlikely(!FinishHashTableGrowth(generation)))
+		{
+			GrowHashTable(generation);
+		}
 	}
+}
 
-	bool found;
-	uint64_t smallest_in_range = WriterLowerBound((value >> 40) << 40, found);
-	if (found && smallest_in_range < value)
+void MlpSet::SyncGrowingHashTable(uint64_t key, uint32_t generation)
+{
+	if (likely(m_growingTable == nullptr))
 	{
-		// there's an item in the data structure smaller than value but bigger
-		// than the minimal number that would have those high bits, meaning
-		// it occupies the same L2 bit
 		return;
 	}
+	rep(ilen, 3, 8)
+	{
+		m_hashTable.SyncMigratedNode(ilen, key, generation);
+	}
+}
 
-	// nullify the bit from the L2 cache
-	uint64_t h24bits = value >> 40;
-	m_treeDepth2[value >> 46] &= ~(uint64_t(1) << (h24bits % 64));
+bool MlpSet::FinishHashTableGrowth(uint32_t generation)
+{
+	assert(m_growingTable != nullptr);
+	m_hashTable.MigrateStep(m_hashTable.NumSlots(), generation);
+	if (unlikely(m_hashTable.MigrationFailed()))
+	{
+		m_hashTable.AbortMigration();
+		FreeHashTableMemory(nullptr, m_growingTableMemoryPtr);
+		m_growingTableMemoryPtr = nullptr;
+		m_growingTable.reset();
+		return false;
+	}
+	m_hashTable.FinishMigration();
+	m_hashTable.SwapTable(m_growingTable->ht, m_growingTable->htMask, m_growingTable->stashIlenMask);
+	m_hashTable.numNodes = m_growingTable->numNodes;
+	
+	// Readers that started before the swap may still be using the old table
+	//
+	AddDeallocation(m_hashTableMemoryPtr, FreeHashTableMemory, nullptr);
+	m_hashTableMemoryPtr = m_growingTableMemoryPtr;
+	m_growingTableMemoryPtr = nullptr;
+	m_growingTable.reset();
+	return true;
 }
 
-void MlpSet::ClearRootCache(uint64_t value, std::optional<uint64_t> successor)
+void MlpSet::ClearTopLevelBits(uint64_t h24bits)
 {
-	if (successor.has_value() && ((*successor >> 56) == (value >> 56)))
+	m_treeDepth2[h24bits / 64] &= ~(uint64_t(1) << (h24bits % 64));
+	
+	uint64_t h16bits = h24bits >> 8;
+	if ((m_treeDepth2[h16bits * 4].load() | m_treeDepth2[h16bits * 4 + 1].load() | 
+	     m_treeDepth2[h16bits * 4 + 2].load() | m_treeDepth2[h16bits * 4 + 3].load()) != 0)
 	{
-		// successor occupies the same root bit
 		return;
 	}
-
-	bool found;
-	uint64_t smallest_in_range = WriterLowerBound((value >> 56) << 56, found);
-	if (found && smallest_in_range < value)
+	m_treeDepth1[h16bits / 64] &= ~(uint64_t(1) << (h16bits % 64));
+	
+	uint64_t h8bits = h16bits >> 8;
+	if ((m_treeDepth1[h8bits * 4].load() | m_treeDepth1[h8bits * 4 + 1].load() | 
+	     m_treeDepth1[h8bits * 4 + 2].load() | m_treeDepth1[h8bits * 4 + 3].load()) != 0)
 	{
-		// there's an item in the data structure smaller than value but bigger
-		// than the minimal number that would have those high bits, meaning
-		// it occupies the same root bit
 		return;
 	}
-
-	// nullify the bit from the root cache
-	uint64_t h8bits = value >> 56;
-	m_root[value >> 62] &= ~(uint64_t(1) << (h8bits % 64));
+	m_root[h8bits / 64] &= ~(uint64_t(1) << (h8bits % 64));
 }
 
-std::optional<uint64_t> MlpSet::ClearLowLevelCaches(uint64_t value)
+void MlpSet::SetTopLevelBits(uint64_t h24bits)
 {
-	bool found_successor = false;
-	uint64_t successor = WriterLowerBound(value + 1, found_successor);
-	std::optional<uint64_t> opt_successor;
+	uint64_t h16bits = h24bits >> 8;
+	m_root[(h16bits >> 8) / 64].fetch_or(uint64_t(1) << ((h16bits >> 8) % 64));
+	m_treeDepth1[h16bits / 64].fetch_or(uint64_t(1) << (h16bits % 64));
+	m_treeDepth2[h24bits / 64].fetch_or(uint64_t(1) << (h24bits % 64));
+}
 
-	if (found_successor)
+std::optional<uint64_t> MlpSet::ClearLowLevelCaches(uint64_t value, uint32_t ilen, const HtPosition* allPositions1, const HtPosition* allPositions2)
+{
+	// Walk up the path like RemoveLeaf does: nodes with a single child go away together with the leaf,
+	// the first node with more children survives and so does the 24-bit prefix
+	//
+	for (ilen--; ilen > 2; ilen--)
 	{
-		opt_successor = successor;
+		HtPosition pos = m_hashTable.FindInBuckets(value, ilen, allPositions1[ilen - 1], allPositions2[ilen - 1]);
+		if (pos == HtPosition(-1))
+		{
+			// empty node
+			continue;
+		}
+		CuckooHashTableNode& node = m_hashTable.ht[pos];
+		if (node.GetChildNum() == 1)
+		{
+			continue;
+		}
+		
+		// The minKey of the surviving ancestors only changes if value is the minimum of this subtree,
+		// the new minimum is then the one of the next child
+		//
+		if (node.minKey != value)
+		{
+			return std::optional<uint64_t>();
+		}
+		int fullKeyLen = node.GetFullKeyLen();
+		int child = node.LowerBoundChild((value >> (56 - 8 * fullKeyLen)) % 256 + 1);
+		assert(child != -1);
+		uint64_t childKey = (value >> (64 - 8 * fullKeyLen) << (64 - 8 * fullKeyLen)) | (uint64_t(child) << (56 - 8 * fullKeyLen));
+		bool found;
+		HtPosition childPos = m_hashTable.Lookup(fullKeyLen + 1 /*ilen*/, childKey, found);
+		assert(found);
+		return m_hashTable.ht[childPos].minKey.load();
 	}
-
-	ClearRootCache(value, opt_successor);
-	ClearL1Cache(value, opt_successor);
-	ClearL2Cache(value, opt_successor);
-	return opt_successor;
+	
+	// value is the last key with its 24-bit prefix
+	//
+	ClearTopLevelBits(value >> 40);
+	return std::optional<uint64_t>();
 }
 
 uint32_t MlpSet::IncrementGeneration()
@@ -1552,28 +2437,205 @@ uint32_t MlpSet::IncrementGeneration()
 	return cur_gen;
 }
 
-void MlpSet::ResetReaderGeneration(int cpu)
+void MlpSet::AddDeallocation(void* ptr, Deleter deleter, void* context)
 {
-	m_readerGenerations[cpu].value.store(UINT32_MAX);
+	AwaitingDeallocation* entry = new AwaitingDeallocation(ptr, deleter, context, cur_generation.load());
+	AwaitingDeallocation* head = m_deallocationQueue.load();
+	do
+	{
+		entry->next = head;
+	} while (!m_deallocationQueue.compare_exchange_weak(head, entry));
+	
+	size_t backlog = m_reclamationBacklog.fetch_add(1) + 1;
+	if (m_reclamationMode == ReclamationMode::BACKGROUND && backlog == m_reclamationHighWatermark)
+	{
+		m_reclamationThreadCv.notify_one();
+	}
 }
 
-void MlpSet::AddDeallocation(void* ptr)
+void MlpSet::ConfigureReclamation(ReclamationMode mode, size_t lowWatermark, size_t highWatermark)
 {
-	m_awaitingDeallocations.push_back(AwaitingDeallocation(ptr, cur_generation.load()));
-}
+	assert(m_hasCalledInit);
+	ReleaseAssert(lowWatermark < highWatermark);
+	StopReclamationThread();
+	m_reclamationMode = mode;
+	m_reclamationLowWatermark = lowWatermark;
+	m_reclamationHighWatermark = highWatermark;
+	if (mode == ReclamationMode::BACKGROUND)
+	{
+		m_stopReclamationThread.store(false);
+		m_reclamationThread = std::thread([this]() { ReclamationThreadMain(); });
+	}
+}
+
+void MlpSet::StopReclamationThread()
+{
+	if (!m_reclamationThread.joinable())
+	{
+		return;
+	}
+	{
+		std::lock_guard<std::mutex> lock(m_reclamationThreadMutex);
+		m_stopReclamationThread.store(true);
+	}
+	m_reclamationThreadCv.notify_one();
+	m_reclamationThread.join();
+}
+
+void MlpSet::ReclamationThreadMain()
+{
+	std::unique_lock<std::mutex> lock(m_reclamationThreadMutex);
+	while (!m_stopReclamationThread.load())
+	{
+		// The writer notifies us when the backlog reaches the high watermark, but the notification
+		// may be missed, and once we started we keep going until the low watermark is reached,
+		// so also wake up periodically
+		//
+		m_reclamationThreadCv.wait_for(lock, RECLAMATION_RETRY_INTERVAL);
+		size_t backlog = m_reclamationBacklog.load();
+		if (backlog >= m_reclamationHighWatermark)
+		{
+			while (backlog > m_reclamationLowWatermark && !m_stopReclamationThread.load())
+			{
+				lock.unlock();
+				if (Reclaim() == 0)
+				{
+					// everything left is still in use by readers
+					//
+					std::this_thread::sleep_for(RECLAMATION_RETRY_INTERVAL);
+				}
+				lock.lock();
+				backlog = m_reclamationBacklog.load();
+			}
+		}
+	}
+}
+
+std::atomic<uint32_t> ReaderSlotRegistry::s_numSlotsInUse(0);
+
+namespace {
+
+std::mutex g_readerSlotsMutex;
+std::vector<uint32_t> g_freeReaderSlots;
+
+}	// anonymous namespace
+
+void ReaderSlotRegistry::AcquireSlot()
+{
+	{
+		std::lock_guard<std::mutex> lock(g_readerSlotsMutex);
+		if (!g_freeReaderSlots.empty())
+		{
+			t_slot = g_freeReaderSlots.back();
+			g_freeReaderSlots.pop_back();
+		}
+		else if (s_numSlotsInUse.load() < MAX_READER_SLOTS)
+		{
+			t_slot = s_numSlotsInUse.load();
+			s_numSlotsInUse.store(t_slot + 1);
+		}
+		else
+		{
+			// nothing to return at thread exit
+			//
+			t_slot = OVERFLOW_SLOT;
+			return;
+		}
+	}
+	
+	// constructed on first use, so only threads that own a slot register a destructor
+	//
+	static thread_local ThreadSlotOwner owner;
+	(void)owner;
+}
+
+void ReaderSlotRegistry::ReleaseSlot()
+{
+	// The thread is not inside a read, so its generation is UINT32_MAX in every set
+	// and the next owner of the slot starts from a clean state
+	//
+	std::lock_guard<std::mutex> lock(g_readerSlotsMutex);
+	g_freeReaderSlots.push_back(t_slot);
+	t_slot = INVALID_SLOT;
+}
+
+MlpSet::PerReaderInteger* MlpSet::AllocateReaderGenerationChunk(uint32_t chunk)
+{
+	void* ptr = aligned_alloc(CACHE_LINE_SIZE, sizeof(PerReaderInteger) * READER_GENERATION_CHUNK_SIZE);
+	ReleaseAssert(ptr != nullptr);
+	PerReaderInteger* generations = reinterpret_cast<PerReaderInteger*>(ptr);
+	for (uint32_t i = 0; i < READER_GENERATION_CHUNK_SIZE; i++)
+	{
+		new (&generations[i].value) std::atomic<uint32_t>(UINT32_MAX);
+	}
+	// another reader of the chunk may have been faster
+	//
+	PerReaderInteger* expected = nullptr;
+	if (!m_readerGenerationChunks[chunk].compare_exchange_strong(expected, generations))
+	{
+		free(ptr);
+		return expected;
+	}
+	return generations;
+}
+
+std::atomic<uint32_t>& MlpSet::ReaderGenerationOfSlot(uint32_t slot)
+{
+	uint32_t chunk = slot / READER_GENERATION_CHUNK_SIZE;
+	PerReaderInteger* generations = m_readerGenerationChunks[chunk].load();
+	if (unlikely(generations == nullptr))
+	{
+		generations = AllocateReaderGenerationChunk(chunk);
+	}
+	return generations[slot % READER_GENERATION_CHUNK_SIZE].value;
+}
 
 ReaderGenerationGuard MlpSet::ReaderGeneration()
 {
-	uint32_t gen = cur_generation.load();
+	uint32_t slot = ReaderSlotRegistry::CurrentThreadSlot();
+	if (unlikely(slot == ReaderSlotRegistry::OVERFLOW_SLOT))
+	{
+		return SharedReaderGeneration();
+	}
+	std::atomic<uint32_t>& readerGeneration = ReaderGenerationOfSlot(slot);
+	uint32_t gen;
+	do
+	{
+		gen = cur_generation.load();
+		readerGeneration.store(gen);
+		// If the writer published a new generation in between, it may have already
+		// scanned our slot and freed memory we are about to read, so start over
+		//
+	} while (unlikely(gen != cur_generation.load()));
+	
+	uint32_t resizeSeq = m_hashTable.resizeSeq.load();
 
-	int cpu = sched_getcpu();
-	m_readerGenerations[cpu].value.store(gen);
+	return ReaderGenerationGuard(gen, resizeSeq, &readerGeneration);
+}
+
+ReaderGenerationGuard MlpSet::SharedReaderGeneration()
+{
+	// Join the readers in the shared slot, lowering its generation to ours if it is newer
+	// The slot only goes back up once all of them have left, which may hold back reclamation
+	// while the overflow threads keep reading, but never frees anything one of them can reach
+	//
+	uint32_t gen = cur_generation.load();
+	uint64_t value = m_sharedReaderGeneration.load();
+	uint64_t newValue;
+	do
+	{
+		uint32_t published = ((value >> 32) == 0) ? gen : min(uint32_t(value), gen);
+		newValue = (((value >> 32) + 1) << 32) | published;
+	} while (!m_sharedReaderGeneration.compare_exchange_weak(value, newValue));
+	
+	// The slot holds at most the generation we loaded, and the generation only grows, so reading
+	// at the current generation is safe: a writer that scanned the slot before we joined had not published it yet
+	//
+	gen = cur_generation.load();
+	
+	uint32_t resizeSeq = m_hashTable.resizeSeq.load();
 
-	return ReaderGenerationGuard(gen,
-								 [this, cpu]()
-								 {
-									ResetReaderGeneration(cpu);
-								 });
+	return ReaderGenerationGuard(gen, resizeSeq, nullptr /*reader_slot*/, &m_sharedReaderGeneration);
 }
 
 void MlpSet::DeallocatePending()
@@ -1584,31 +2646,67 @@ void MlpSet::DeallocatePending()
 	// This will in turn reduce the contention the removing thread has with
 	// the reader threads, while still maintaining a relatively small amount
 	// of allocated unused buffers.
-	if (m_awaitingDeallocations.size() < PENDING_ALLOCATIONS_CLEAR_BUFFER)
+	if (m_reclamationMode != ReclamationMode::INLINE || m_reclamationBacklog.load() < m_reclamationHighWatermark)
 		return;
 
+	Reclaim();
+}
+
+size_t MlpSet::Reclaim()
+{
+	std::lock_guard<std::mutex> lock(m_reclamationMutex);
+	
+	// Take the whole queue at once, it is ordered newest first
+	//
+	AwaitingDeallocation* head = m_deallocationQueue.exchange(nullptr);
+	size_t numTaken = m_awaitingDeallocations.size();
+	while (head != nullptr)
+	{
+		m_awaitingDeallocations.push_back(head);
+		head = head->next;
+	}
+	std::reverse(m_awaitingDeallocations.begin() + numTaken, m_awaitingDeallocations.end());
+	if (m_awaitingDeallocations.empty())
+	{
+		return 0;
+	}
+
+	// A buffer may still be reachable in the generation it was unlinked in
+	// (it is pushed before the writer finishes unlinking it), so only buffers
+	// from generations the writer has already published can be freed
+	//
+	uint32_t min_generation = cur_generation.load();
+
 	// Go through the current readers' generations.
 	// Note that this entail contention with the readers for the cache lines
 	// of those addresses, so we must minimize the amount of time this code
 	// is being executed.
-	uint32_t readers_min_generation = UINT32_MAX;
-	for (size_t i = 0; i < m_readerGenerationsBuffer.size() / sizeof(PerCpuInteger); i++)
+	uint32_t numSlots = ReaderSlotRegistry::NumSlotsInUse();
+	for (uint32_t chunk = 0; chunk * READER_GENERATION_CHUNK_SIZE < numSlots; chunk++)
 	{
-		PerCpuInteger& generation = m_readerGenerations[i];
-		readers_min_generation = min(readers_min_generation, generation.value.load());
+		// no reader of the chunk has started a read yet
+		//
+		PerReaderInteger* generations = m_readerGenerationChunks[chunk].load();
+		if (generations == nullptr)
+		{
+			continue;
+		}
+		for (uint32_t i = 0; i < READER_GENERATION_CHUNK_SIZE; i++)
+		{
+			min_generation = min(min_generation, generations[i].value.load());
+		}
 	}
+	min_generation = min(min_generation, uint32_t(m_sharedReaderGeneration.load()));
 
 	size_t i = 0;
 	for (i = 0; i < m_awaitingDeallocations.size(); i++)
 	{
-		if (m_awaitingDeallocations[i].generation >= readers_min_generation)
+		AwaitingDeallocation* entry = m_awaitingDeallocations[i];
+		if (entry->generation >= min_generation)
 		{
-			#ifdef ENABLE_STATS
-			stats.m_numbersOfPendingDeallocationPostponed++;
-			#endif
+			m_hashTable.stats.Count(&MlpStats::pendingDeallocationsPostponed);
 
-			// The allocations are pushed back into the m_waitingDeallocation vector
-			// which means they appear in it in increasing generation order.
+			// The allocations are pushed in increasing generation order.
 			//
 			// Therefore, if we ran into an allocation which conflicts with
 			// some reader's current generation, all of the next awaiting allocations
@@ -1618,19 +2716,22 @@ void MlpSet::DeallocatePending()
 		}
 
 		// deallocate the buffer
-		delete[] m_awaitingDeallocations[i].ptr;
+		entry->deleter(entry->context, entry->ptr);
+		delete entry;
 	}
 
 	// delete all the pending allocations that were freed
 	m_awaitingDeallocations.erase(m_awaitingDeallocations.begin(), m_awaitingDeallocations.begin() + i);
+	m_reclamationBacklog.fetch_sub(i);
+	return i;
 }
 
 bool MlpSet::Remove(uint64_t value, uint32_t generation)
 {
+	assert(m_mappedImage == nullptr);
 	uint32_t ilen;
-	uint64_t _allPositions1[4], _allPositions2[4], _expectedHash[4];
-	uint32_t* allPositions1 = reinterpret_cast<uint32_t*>(_allPositions1);
-	uint32_t* allPositions2 = reinterpret_cast<uint32_t*>(_allPositions2);
+	HtPosition allPositions1[8], allPositions2[8];
+	uint64_t _expectedHash[4];
 	uint32_t* expectedHash = reinterpret_cast<uint32_t*>(_expectedHash);
 
 	int lcpLen = m_hashTable.QueryLCPInternal(value, 
@@ -1653,8 +2754,22 @@ bool MlpSet::Remove(uint64_t value, uint32_t generation)
 		cur_gen = IncrementGeneration();
 	}	
 
-	std::optional<uint64_t> opt_successor = ClearLowLevelCaches(value);
+	std::optional<uint64_t> opt_successor = ClearLowLevelCaches(value, ilen, allPositions1, allPositions2);
+	RemoveLeaf(value, ilen, allPositions1, allPositions2, opt_successor, cur_gen);
+	StepHashTableGrowth(value, cur_gen);
 
+	if (should_take_generation) {
+		cur_generation.store(cur_gen);
+	}
+
+	DeallocatePending();
+
+	return true;
+}
+
+void MlpSet::RemoveLeaf(uint64_t value, uint32_t ilen, const HtPosition* allPositions1, const HtPosition* allPositions2,
+                        std::optional<uint64_t> opt_successor, uint32_t cur_gen)
+{
 	// Remove the node from the hash table
 	bool res = m_hashTable.Remove(ilen, value, cur_gen);
 	assert(res);
@@ -1663,13 +2778,8 @@ bool MlpSet::Remove(uint64_t value, uint32_t generation)
 	for (ilen--; ilen > 2; ilen--)
 	{
 		// find the right position
-		uint32_t pos = allPositions1[ilen - 1];
-		if (!m_hashTable.ht[pos].IsEqualNoHash(value, ilen))
-		{
-			pos = allPositions2[ilen - 1];
-		}
-
-		if (!m_hashTable.ht[pos].IsEqualNoHash(value, ilen))
+		HtPosition pos = m_hashTable.FindInBuckets(value, ilen, allPositions1[ilen - 1], allPositions2[ilen - 1]);
+		if (pos == HtPosition(-1))
 		{
 			// empty node
 			continue;
@@ -1689,7 +2799,7 @@ bool MlpSet::Remove(uint64_t value, uint32_t generation)
 		if (remove_child && m_hashTable.ht[pos].ExistChild(child))
 		{
 			m_hashTable.ht[pos].SetGeneration(cur_gen);
-			bool zero_children = m_hashTable.ht[pos].RemoveChild(child, [this](void* ptr){AddDeallocation(ptr);});
+			bool zero_children = m_hashTable.ht[pos].RemoveChild(child, [this](void* ptr){AddDeallocation(ptr, ExternalBitMapPool::ReleaseDeferred, &m_bitmapPool);});
 			remove_child = false;
 			if (!zero_children)
 				continue;
@@ -1697,559 +2807,1544 @@ bool MlpSet::Remove(uint64_t value, uint32_t generation)
 			// the current node has no more children, delete and remember to
 			// delete the pointer to it from its parent as we move up the tree
 			m_hashTable.ht[pos].Clear();
+			m_hashTable.numNodes--;
 			remove_child = true;
 		}
 	}
-
-	if (should_take_generation) {
-		cur_generation.store(cur_gen);
-	}
-
-	DeallocatePending();
-
-	return true;
 }
 
-bool MlpSet::Insert(uint64_t value, uint32_t generation)
+void MlpSet::RemoveSortedKeys(const uint64_t* keys, size_t n, std::optional<uint64_t> successor, uint32_t generation)
 {
-	assert(m_hasCalledInit);
-	bool should_take_generation = generation == UINT32_MAX;
-	uint32_t cur_gen = generation;
-	if (should_take_generation) {
-		cur_gen = IncrementGeneration();
-	}	
-	int lcpLen;
-	// Handle LCP < 2 case first
-	// This is supposed to be a L1 hit (working set 8KB)
-	//
+	assert(m_mappedImage == nullptr);
+	rep(i, 0, int(n) - 1)
 	{
-		uint64_t h16bits = value >> 48;
-		if (unlikely((m_treeDepth1[h16bits / 64].load() & (uint64_t(1) << (h16bits % 64))) == 0))
+		assert(i == 0 || keys[i - 1] < keys[i]);
+		assert(!successor.has_value() || keys[i] < *successor);
+		uint32_t ilen;
+		HtPosition allPositions1[8], allPositions2[8];
+		uint64_t _expectedHash[4];
+		uint32_t* expectedHash = reinterpret_cast<uint32_t*>(_expectedHash);
+		int lcpLen = m_hashTable.QueryLCPInternal(keys[i], 
+		                                          ilen /*out*/, 
+		                                          allPositions1 /*out*/, 
+		                                          allPositions2 /*out*/, 
+		                                          expectedHash /*out*/,
+		                                          UINT32_MAX);
+		ReleaseAssert(lcpLen == 8);
+		// The keys are removed in increasing order, so the successor of a key is the next one
+		//
+		std::optional<uint64_t> keySuccessor = successor;
+		if (i + 1 < int(n))
 		{
-			lcpLen = 2;
-			uint64_t rootBit = uint64_t(1) << ((h16bits >> 8) % 64);
-			uint64_t depth1Bit = uint64_t(1) << (h16bits % 64);
-			m_root[(h16bits >> 8) / 64].fetch_or(rootBit);
-			m_treeDepth1[h16bits / 64].fetch_or(depth1Bit);
-			goto _end;
+			keySuccessor = keys[i + 1];
 		}
+		RemoveLeaf(keys[i], ilen, allPositions1, allPositions2, keySuccessor, generation);
+		SyncGrowingHashTable(keys[i], generation);
 	}
 	
-	// Issue the prefetch in case LCP turns out to be 2
+	// A 24-bit prefix is gone iff its depth 3 node is gone
 	//
-	MEM_PREFETCH(m_treeDepth2[(value >> 40) / 64]);
-	
-	// Since we know the LCP is >= 2, QueryLCP is applicable
-	// 
+	rep(i, 0, int(n) - 1)
 	{
-		uint32_t ilen;
-		uint64_t _allPositions1[4], _allPositions2[4], _expectedHash[4];
-		uint32_t* allPositions1 = reinterpret_cast<uint32_t*>(_allPositions1);
-		uint32_t* allPositions2 = reinterpret_cast<uint32_t*>(_allPositions2);
-		uint32_t* expectedHash = reinterpret_cast<uint32_t*>(_expectedHash);
+		uint64_t h24bits = keys[i] >> 40;
+		if (i > 0 && (keys[i - 1] >> 40) == h24bits)
+		{
+			continue;
+		}
+		bool found;
+		m_hashTable.Lookup(3 /*ilen*/, keys[i], found);
+		if (!found)
+		{
+			ClearTopLevelBits(h24bits);
+		}
+	}
+	
+	DeallocatePending();
+}
 
-		// Can be changed to UnsafeQueryLCP as we have a single writer.
-		lcpLen = m_hashTable.QueryLCPInternal(value, 
-									  		  ilen /*out*/, 
-									  		  allPositions1 /*out*/, 
-									  		  allPositions2 /*out*/, 
-									  		  expectedHash /*out*/,
-									  		  UINT32_MAX /*generation*/);
-		if (lcpLen == 8)
+struct MlpSet::BulkLoadPartition
+{
+	struct Node
+	{
+		uint64_t minKey;
+		// index of the first child in children
+		//
+		uint32_t firstChild;
+		uint16_t numChildren;
+		uint8_t ilen;
+		uint8_t fullKeyLen;
+	};
+	
+	std::vector<Node> nodes;
+	std::vector<uint8_t> children;
+	
+	// Append the nodes of the subtree of n sorted keys sharing their first ilen bytes
+	//
+	void AddSubtree(const uint64_t* keys, size_t n, int ilen)
+	{
+		// The keys are sorted, so the LCP of the subtree is the LCP of its first and last key
+		//
+		int fullKeyLen = 8;
+		if (n > 1)
 		{
-			return false;
+			fullKeyLen = __builtin_clzll(keys[0] ^ keys[n - 1]) / 8;
+			assert(ilen <= fullKeyLen && fullKeyLen < 8);
 		}
-		if (lcpLen > 2)
+		int shiftLen = 56 - fullKeyLen * 8;
+		
+		// Split the keys by their byte following the LCP, each part is the subtree of a child
+		//
+		size_t childStart[257];
+		int numChildren = 0;
+		if (n > 1)
 		{
-			uint32_t pos = allPositions1[ilen - 1];
-			bool minKeyUpdated = false;
-			assert(ilen <= lcpLen && lcpLen <= m_hashTable.ht[pos].GetFullKeyLen());
-			// Split as needed
-			// Determine whether the path-compression string completely matched
-			//
-			m_hashTable.ht[pos].SetGeneration(cur_gen);
-			if (lcpLen == m_hashTable.ht[pos].GetFullKeyLen())
+			rep(i, 0, int(n) - 1)
 			{
-				// path-compression string matched, no need to split
-				//
-				m_hashTable.ht[pos].AddChild((value >> (56 - lcpLen * 8)) % 256, cur_gen);
-				if (value < m_hashTable.ht[pos].minKey)
+				if (i == 0 || (keys[i] >> shiftLen) != (keys[i - 1] >> shiftLen))
 				{
-					minKeyUpdated = true;
-					m_hashTable.ht[pos].minKey = value;
+					childStart[numChildren++] = i;
+					children.push_back((keys[i] >> shiftLen) % 256);
 				}
 			}
-			else
+			childStart[numChildren] = n;
+			assert(numChildren >= 2);
+		}
+		nodes.push_back(Node { keys[0], uint32_t(children.size() - numChildren), uint16_t(numChildren), uint8_t(ilen), uint8_t(fullKeyLen) });
+		
+		rep(i, 0, numChildren - 1)
+		{
+			AddSubtree(keys + childStart[i], childStart[i + 1] - childStart[i], fullKeyLen + 1);
+		}
+	}
+	
+	// Append the nodes of n distinct sorted keys
+	// Each group of keys sharing their first 3 bytes is a subtree rooted at depth 3
+	//
+	void AddKeys(const uint64_t* keys, size_t n)
+	{
+		size_t start = 0;
+		while (start < n)
+		{
+			size_t end = start + 1;
+			while (end < n && (keys[end] >> 40) == (keys[start] >> 40))
 			{
-				// need to split at unmatch point
-				// (1) Add a new node with indexLen = lcpLen+1, fullKeyLen = ht[pos]'s fullKeyLen,
-				//     childList = ht[pos]'s childList, this is the original subtree
-				// (2) Modify the fullKeyLen of ht[pos] to lcpLen, and childList to have 
-				//     only two children (corresponding byte of ht[pos].minKey and value)
-				//     Now ht[pos] becomes the splitting point
-				//
-				uint64_t minKey = m_hashTable.ht[pos].minKey;
-				uint32_t oldHash18bit = m_hashTable.ht[pos].GetHash18bit();
-#ifndef NDEBUG
-				vector<int> oldChildList = m_hashTable.ht[pos].GetAllChildren();
-				int oldFullKeyLen = m_hashTable.ht[pos].GetFullKeyLen();
-#endif
+				assert(keys[end - 1] < keys[end]);
+				end++;
+			}
+			assert(end == n || keys[end - 1] < keys[end]);
+			AddSubtree(keys + start, end - start, 3 /*ilen*/);
+			start = end;
+		}
+	}
+	
+	void Clear()
+	{
+		nodes.clear();
+		children.clear();
+	}
+};
 
-				// Add new node
-				//
-				{
-					bool exist, failed;
-					uint32_t newHash18bit = XXH::XXHashFn3(minKey, lcpLen + 1);
-					newHash18bit = newHash18bit & ((1<<18) - 1);
-					uint32_t x = m_hashTable.ReservePositionForInsert(lcpLen + 1 /*indexLen*/, 
-						                                              minKey /*key*/,
-						                                              newHash18bit /*hash18bit*/, 
-						                                              exist /*out*/, 
-						                                              failed /*out*/,
-						                                              cur_gen /*generation*/);
-					assert(!exist && !failed);
-					assert(!m_hashTable.ht[x].IsOccupied());
-					// should be ok without fencing as we have a lock.
-					m_hashTable.ht[x].SetGeneration(cur_gen);
-					m_hashTable.ht[pos].MoveNode(&(m_hashTable.ht[x]), cur_gen);
-					m_hashTable.ht[x].AlterIndexKeyLen(lcpLen + 1);
-					m_hashTable.ht[x].AlterHash18bit(newHash18bit);
-				}
-				
-				// Re-construct ht[pos] (it has been cleared in MoveNode)
-				//
-				{
-					assert(!m_hashTable.ht[pos].IsOccupied());
-					uint64_t z = minKey;
-					if (value < minKey)
-					{
-						z = value;
-						minKeyUpdated = true;
-					}
-					m_hashTable.ht[pos].Init(ilen /*indexLen*/,
-						                     lcpLen /*fullKeyLen*/,
-						                     z /*minKey*/,
-						                     oldHash18bit /*hash18bit*/,
-						                     (minKey >> (56 - 8 * lcpLen)) % 256, /*firstChild*/
-											 cur_gen /*generation*/);
-					m_hashTable.ht[pos].AddChild((value >> (56 - 8 * lcpLen)) % 256, cur_gen);
-				}  
-#ifndef NDEBUG
-				// Sanity check newly added nodes
-				//
-				{
-					// Sanity check splitting node
-					//
-					bool found;
-					uint32_t x = m_hashTable.Lookup(ilen, value, found);
-					assert(found);
-					assert(m_hashTable.ht[x].GetIndexKeyLen() == ilen);
-					assert(m_hashTable.ht[x].GetFullKeyLen() == lcpLen);
-					assert(m_hashTable.ht[x].minKey == min(value, minKey));
-					vector<int> ch = m_hashTable.ht[x].GetAllChildren();
-					assert(ch.size() == 2);
-					int expectedChild1 = (value >> (56 - lcpLen * 8)) % 256;
-					int expectedChild2 = (minKey >> (56 - lcpLen * 8)) % 256;
-					if (expectedChild1 > expectedChild2) { swap(expectedChild1, expectedChild2); }
-					assert(ch[0] == expectedChild1);
-					assert(ch[1] == expectedChild2);
-				}
-				{
-					// Sanity check original subtree
-					//
-					bool found;
-					uint32_t x = m_hashTable.Lookup(lcpLen + 1, minKey, found);
-					assert(found);
-					assert(m_hashTable.ht[x].GetIndexKeyLen() == lcpLen + 1);
-					assert(m_hashTable.ht[x].GetFullKeyLen() == oldFullKeyLen);
-					assert(m_hashTable.ht[x].minKey == minKey);
-					vector<int> ch = m_hashTable.ht[x].GetAllChildren();
-					assert(ch.size() == oldChildList.size());
-					rep(i, 0, int(ch.size()) - 1)
-					{
-						assert(ch[i] == oldChildList[i]);
-					}
-				}
-#endif      
-			}
-			// Update minKey along the parent path
-			//
-			if (minKeyUpdated)
-			{
-				for (ilen--; ilen > 2; ilen--)
-				{
-					uint32_t pos = allPositions1[ilen - 1];
-					if (pos > m_hashTable.htMask)
-					{
-						continue;
-					}
-					if (m_hashTable.ht[pos].IsEqualNoHash(value, ilen))
-					{
-						assert(m_hashTable.ht[pos].GetIndexKeyLen() == ilen);
-						if (value < m_hashTable.ht[pos].minKey)
-						{
-							m_hashTable.ht[pos].SetGeneration(cur_gen);
-							m_hashTable.ht[pos].minKey = value;
-						}
-						else
-						{
-							break;
-						}
-					}
-					else 
-					{
-						pos = allPositions2[ilen - 1];
-						if (pos > m_hashTable.htMask)
-						{
-							continue;
-						}
-						if (m_hashTable.ht[pos].IsEqualNoHash(value, ilen))
-						{
-							assert(m_hashTable.ht[pos].GetIndexKeyLen() == ilen);
-							if (value < m_hashTable.ht[pos].minKey)
-							{
-								m_hashTable.ht[pos].SetGeneration(cur_gen);
-								m_hashTable.ht[pos].minKey = value;
-							}
-							else
-							{
-								break;
-							}
-						}
-					}
-				}
-			}
-		}
-	}
-	
-_end:
-	// Now we know the true LCP and the tree has been setup with correct splitting, insert node
+void MlpSet::GrowHashTableForBulkLoad(size_t n, uint32_t generation)
+{
+	// A path-compressed trie with n leaves has less than 2n nodes
+	//
+	uint64_t minTableSize = RoundUpToNearestPowerOf2((2 * n + 2) * 100 / CuckooHashTable::MAX_LOAD_FACTOR_PERCENT);
+	// The placement writes to the table directly, so a growth in progress is completed as well
 	//
+	if (minTableSize > uint64_t(m_hashTable.htMask) + 1 || m_growingTable != nullptr)
 	{
-		bool exist, failed;
-		m_hashTable.Insert(lcpLen + 1 /*indexLen*/,
-		                   8 /*fullKeyLen*/,
-		                   value /*minKey*/, 
-		                   -1 /*firstChild*/,
-		                   exist /*out*/, 
-		                   failed /*out*/,
-						   cur_gen /*generation*/);
-		assert(!exist && !failed);
+		GrowHashTable(generation, minTableSize);
 	}
+}
 
-	// Finally, if lcp == 2, we need to set the corresponding m_treeDepth2 bit
+void MlpSet::PlaceBulkLoadNode(const BulkLoadPartition& partition, size_t index, uint32_t generation)
+{
+	const BulkLoadPartition::Node& node = partition.nodes[index];
+	const uint8_t* children = partition.children.data() + node.firstChild;
+	// All the children are added right away, as the following insertions may move the node around
 	//
-	if (lcpLen == 2)
+	bool exist, failed;
+	HtPosition pos;
+	while (true)
 	{
-		uint64_t depth2Bit = uint64_t(1) << ((value >> 40) % 64);
-		assert((m_treeDepth2[(value >> 40) / 64].load() & depth2Bit) == 0);
-		m_treeDepth2[(value >> 40) / 64].fetch_or(depth2Bit);
+		pos = m_hashTable.Insert(node.ilen /*indexLen*/,
+		                         node.fullKeyLen /*fullKeyLen*/,
+		                         node.minKey /*minKey*/,
+		                         (node.numChildren > 0) ? int(children[0]) : -1 /*firstChild*/,
+		                         exist /*out*/,
+		                         failed /*out*/,
+		                         generation /*generation*/);
+		if (likely(!failed))
+		{
+			break;
+		}
+		GrowHashTable(generation);
 	}
-
-	std::atomic_thread_fence(std::memory_order_release);
-
-	if (should_take_generation) {
-		cur_generation.store(cur_gen);
+	assert(!exist);
+	rep(i, 1, int(node.numChildren) - 1)
+	{
+		m_hashTable.ht[pos].AddChild(children[i], generation, m_bitmapPool, m_hashTable.MaxBitmapOffset(pos));
 	}
-	
-	return true;
 }
 
-bool MlpSet::Exist(uint64_t value)
+void MlpSet::PlaceBulkLoadPartition(const BulkLoadPartition& partition, uint32_t generation)
 {
-	assert(m_hasCalledInit);
-	uint32_t ilen;
-	uint64_t _allPositions1[4], _allPositions2[4], _expectedHash[4];
-	uint32_t* allPositions1 = reinterpret_cast<uint32_t*>(_allPositions1);
-	uint32_t* allPositions2 = reinterpret_cast<uint32_t*>(_allPositions2);
-	uint32_t* expectedHash = reinterpret_cast<uint32_t*>(_expectedHash);
-	int lcpLen = m_hashTable.QueryLCP(value, 
-		                              ilen /*out*/, 
-		                              allPositions1 /*out*/, 
-		                              allPositions2 /*out*/, 
-		                              expectedHash /*out*/,
-									  [this]() {return ReaderGeneration();} /*generation*/,
-									  cur_generation /*cur_generation*/);
-	if (lcpLen != 8) {
-		DEBUG("lcpLen=" << lcpLen << " value=" << value);
+	rep(i, 0, int(partition.nodes.size()) - 1)
+	{
+		PlaceBulkLoadNode(partition, i, generation);
+	}
+	
+	// The depth 3 nodes are the roots of the subtrees below the flat bitmaps
+	//
+	for (const BulkLoadPartition::Node& node : partition.nodes)
+	{
+		if (node.ilen == 3)
+		{
+			SetTopLevelBits(node.minKey >> 40);
+		}
 	}
-	return (lcpLen == 8);
-}
-
-#define BT_BUF_SIZE 100
-
-#include <execinfo.h>
-#include <stdio.h>
-#include <stdlib.h>
-#include <unistd.h>
-
-void CuckooHashTableNode::SetGeneration(uint32_t new_generation)
-{
-	generation.store((generation.load() & 0xff000000) | (new_generation & 0xffffff));
 }
 
-MlpSet::Promise MlpSet::LowerBoundInternal(uint64_t value, bool& found, uint32_t generation)
+void MlpSet::BulkLoad(const uint64_t* sortedKeys, size_t n)
 {
 	assert(m_hasCalledInit);
-	found = true;
+	assert(m_mappedImage == nullptr);
+	assert(m_hashTable.numNodes == 0);
+	if (n == 0)
+	{
+		return;
+	}
+	uint32_t cur_gen = IncrementGeneration();
+	GrowHashTableForBulkLoad(n, cur_gen);
 	
-	// Issue the prefetch in case LCP turns out to be 2
+	// Compute and place the nodes one top byte at a time, so the node list stays small
 	//
-	MEM_PREFETCH(m_treeDepth2[(value >> 48) * 4]);
+	BulkLoadPartition partition;
+	size_t start = 0;
+	while (start < n)
+	{
+		size_t end = start + 1;
+		while (end < n && (sortedKeys[end] >> 56) == (sortedKeys[start] >> 56))
+		{
+			end++;
+		}
+		partition.Clear();
+		partition.AddKeys(sortedKeys + start, end - start);
+		PlaceBulkLoadPartition(partition, cur_gen);
+		start = end;
+	}
 	
-#ifdef ENABLE_STATS
-	int numParentPathSteps = 0;
-	Auto(
-		assert(numParentPathSteps < 8);
-		stats.m_lowerBoundParentPathStepsHistogram[numParentPathSteps]++;
-	);
-#endif
-
-	uint32_t ilen;
-	uint32_t allPositions[2][8];
-	uint64_t _expectedHash[4];
-	uint32_t* expectedHash = reinterpret_cast<uint32_t*>(_expectedHash);
+	std::atomic_thread_fence(std::memory_order_release);
+	cur_generation.store(cur_gen);
+}
 
-	int lcpLen = m_hashTable.QueryLCPInternal(value,
-		                              		  ilen /*out*/,
-		                              		  allPositions[0] /*out*/,
-		                              		  allPositions[1] /*out*/,
-		                              		  expectedHash /*out*/,
-		                              		  generation /*generation*/);
-	if (lcpLen < 0)
+void MlpSet::ParallelBulkLoad(const uint64_t* keys, size_t n, int numThreads)
+{
+	assert(m_hasCalledInit);
+	assert(m_mappedImage == nullptr);
+	assert(m_hashTable.numNodes == 0);
+	if (n == 0)
 	{
-		// Generation mismatch occurred, retry
-		return CuckooHashTable::LookupMustExistPromise();
+		return;
 	}
-	if (lcpLen == 8)
+	numThreads = max(numThreads, 1);
+	uint32_t cur_gen = IncrementGeneration();
+	GrowHashTableForBulkLoad(n, cur_gen);
+	
+	auto runThreads = [numThreads](const std::function<void(int)>& fn)
 	{
-		if (generation < m_hashTable.ht[allPositions[0][ilen - 1]].LoadGeneration())
+		std::vector<std::thread> threads;
+		rep(t, 0, numThreads - 1)
 		{
-			return CuckooHashTable::LookupMustExistPromise();
+			threads.emplace_back(fn, t);
+		}
+		for (std::thread& thread : threads)
+		{
+			thread.join();
+		}
+	};
+	
+	// Partition the keys by top byte: every thread counts then scatters a contiguous chunk of the input
+	//
+	std::vector<uint64_t> partitioned(n);
+	std::vector<std::array<size_t, 256>> cursors(numThreads);
+	runThreads([&](int t)
+	{
+		cursors[t].fill(0);
+		for (size_t i = n * t / numThreads; i < n * (t + 1) / numThreads; i++)
+		{
+			cursors[t][keys[i] >> 56]++;
+		}
+	});
+	size_t partitionStart[257];
+	size_t offset = 0;
+	rep(b, 0, 255)
+	{
+		partitionStart[b] = offset;
+		rep(t, 0, numThreads - 1)
+		{
+			size_t count = cursors[t][b];
+			cursors[t][b] = offset;
+			offset += count;
 		}
-		return Promise(&m_hashTable.ht[allPositions[0][ilen - 1]]);
 	}
-	if (lcpLen == 2)
+	partitionStart[256] = offset;
+	assert(offset == n);
+	runThreads([&](int t)
 	{
-		goto _flat_mapping;
+		for (size_t i = n * t / numThreads; i < n * (t + 1) / numThreads; i++)
+		{
+			partitioned[cursors[t][keys[i] >> 56]++] = keys[i];
+		}
+	});
+	
+	// The workers take the partitions in order, then sort them and compute their trie nodes
+	//
+	std::vector<BulkLoadPartition> partitions(256);
+	std::atomic<int> nextPartition(0);
+	runThreads([&](int)
+	{
+		int b;
+		while ((b = nextPartition.fetch_add(1)) < 256)
+		{
+			uint64_t* begin = partitioned.data() + partitionStart[b];
+			uint64_t* end = partitioned.data() + partitionStart[b + 1];
+			std::sort(begin, end);
+			end = std::unique(begin, end);
+			partitions[b].AddKeys(begin, end - begin);
+		}
+	});
+	std::vector<uint64_t>().swap(partitioned);
+	
+	// Place the nodes by table range: worker t owns the blocks of 8 slots in the t-th slice of the table, so the
+	// workers never write to the same slot. Each worker sorts a contiguous chunk of the nodes by the owner of
+	// their first bucket, then the owners put them into a free slot of it, or pass them on to the owner of their
+	// second bucket. The nodes whose second bucket is full too need Cuckoo displacement, and the nodes with more
+	// children than a child list holds need a bitmap, which may take a slot of a neighbouring slice, so the
+	// calling thread inserts both kinds at the end
+	//
+	struct NodeRef
+	{
+		uint32_t partition;
+		uint32_t index;
+	};
+	size_t nodeStart[257];
+	nodeStart[0] = 0;
+	rep(b, 0, 255)
+	{
+		nodeStart[b + 1] = nodeStart[b] + partitions[b].nodes.size();
 	}
+	size_t numTrieNodes = nodeStart[256];
+	uint64_t sliceSize = RoundUpToNearestMultipleOf(max<uint64_t>((uint64_t(m_hashTable.htMask) + 1) / numThreads, 8), 8);
+	auto ownerOf = [&](HtPosition pos) { return int(std::min<uint64_t>(pos / sliceSize, numThreads - 1)); };
 	
-	// lcp in hash table
+	// refs[which][t][owner] are the nodes found by worker t for the owner of their first (which == 0) or second bucket
 	//
+	std::vector<std::vector<std::vector<NodeRef>>> refs[2];
+	refs[0].assign(numThreads, std::vector<std::vector<NodeRef>>(numThreads));
+	refs[1].assign(numThreads, std::vector<std::vector<NodeRef>>(numThreads));
+	std::vector<std::vector<NodeRef>> leftover(numThreads);
+	std::vector<uint64_t> numPlaced(numThreads, 0);
+	runThreads([&](int t)
 	{
-		uint32_t pos = allPositions[0][ilen - 1];
-		CuckooHashTableNode *node = &m_hashTable.ht[pos];
-		int dlen = node->GetFullKeyLen();
-		if (dlen == lcpLen)
+		size_t i = numTrieNodes * t / numThreads;
+		size_t end = numTrieNodes * (t + 1) / numThreads;
+		int b = int(std::upper_bound(nodeStart, nodeStart + 257, i) - nodeStart) - 1;
+		for (; i < end; i++)
 		{
-			// path compression string matches, lower bound on child
-			//
-			// Check generation before accessing node methods
-			if (generation < m_hashTable.ht[pos].LoadGeneration())
-			{
-				return CuckooHashTable::LookupMustExistPromise();
-			}
-			uint32_t child = (value >> (56 - dlen * 8)) & 255;
-			int lbChild = m_hashTable.ht[pos].LowerBoundChild(child);
-			// std::atomic_thread_fence(std::memory_order_acquire);
-			if (generation < m_hashTable.ht[pos].LoadGeneration())
+			while (i >= nodeStart[b + 1])
 			{
-				return CuckooHashTable::LookupMustExistPromise();
+				b++;
 			}
-
-			if (lbChild == -1)
+			NodeRef ref { uint32_t(b), uint32_t(i - nodeStart[b]) };
+			const BulkLoadPartition::Node& node = partitions[b].nodes[ref.index];
+			if (node.ilen == 3)
 			{
-				goto _parent;
+				SetTopLevelBits(node.minKey >> 40);
 			}
-			if (lbChild == child) {
-				return CuckooHashTable::LookupMustExistPromise();
-			}
-			// return the minimum value in lbChild subtree
-			//
-			uint64_t keyToFind = value & (~(255ULL << (56 - dlen * 8)));
-			keyToFind |= uint64_t(lbChild) << (56 - dlen * 8);
-			// From here there's no need to check generation as we know the key is in the tree because were locked.
-			return m_hashTable.GetLookupMustExistPromise(dlen + 1, keyToFind);
-		}
-		else
-		{
-			// path compression string does not match
-			// either the given value is smaller than the whole subtree, or larger than the whole subtree
-			//
-			if (value < m_hashTable.ht[pos].minKey)
+			if (node.numChildren > 8)
 			{
-				if (generation < m_hashTable.ht[pos].LoadGeneration())
-				{
-					return CuckooHashTable::LookupMustExistPromise();
-				}
-				// smaller than whole subtree, result is just subtreeMin
-				//
-				return Promise(&m_hashTable.ht[pos]);
-			}
-			else
-			{	
-				// larger than subtreeMax, need to visit parent path
-				//
-				goto _parent;
+				leftover[t].push_back(ref);
+				continue;
 			}
+			refs[0][t][ownerOf(m_hashTable.BucketPosition(0, node.ilen, node.minKey))].push_back(ref);
 		}
-	}
-	
-_parent:
-	// The specified value is larger than the maximum in the subtree
-	// We need to return the smallest value larger than subtreeMax by visiting the parent path
-	// 
+	});
+	rep(which, 0, 1)
 	{
-		ilen--;
-		for (; ilen > 2; ilen--)
+		runThreads([&](int t)
 		{
-#ifdef ENABLE_STATS
-			numParentPathSteps++;
-#endif
-			rep(k, 0, 1)
+			rep(s, 0, numThreads - 1)
 			{
-				uint32_t pos = allPositions[k][ilen - 1];
-				// Check generation before accessing node methods
-				if (m_hashTable.ht[pos].IsEqualNoHash(value, ilen))
+				for (NodeRef ref : refs[which][s][t])
 				{
-					int dlen = m_hashTable.ht[pos].GetFullKeyLen();
-					// Check generation again after method calls to ensure results are valid
-					if (generation < m_hashTable.ht[pos].LoadGeneration())
-					{
-						return CuckooHashTable::LookupMustExistPromise();
-					}
-					uint32_t child = (value >> (56 - dlen * 8)) & 255;
-					if (child < 255)
+					const BulkLoadPartition::Node& node = partitions[ref.partition].nodes[ref.index];
+					const uint8_t* children = partitions[ref.partition].children.data() + node.firstChild;
+					HtPosition pos = m_hashTable.InsertIntoBucket(which,
+					                                              node.ilen /*indexLen*/,
+					                                              node.fullKeyLen /*fullKeyLen*/,
+					                                              node.minKey /*minKey*/,
+					                                              (node.numChildren > 0) ? int(children[0]) : -1 /*firstChild*/,
+					                                              cur_gen /*generation*/);
+					if (pos == HtPosition(-1))
 					{
-						// Check generation before accessing node methods
-						if (generation < m_hashTable.ht[pos].LoadGeneration())
-						{
-							return CuckooHashTable::LookupMustExistPromise();
-						}
-						int lbChild = m_hashTable.ht[pos].LowerBoundChild(child + 1);
-						// Check generation again after method call to ensure result is valid
-						if (generation < m_hashTable.ht[pos].LoadGeneration())
+						if (which == 0)
 						{
-							return CuckooHashTable::LookupMustExistPromise();
+							refs[1][t][ownerOf(m_hashTable.BucketPosition(1, node.ilen, node.minKey))].push_back(ref);
 						}
-						if (lbChild != -1) 
+						else
 						{
-							assert(lbChild != child);
-							// return the minimum value in lbChild subtree
-							//
-							uint64_t keyToFind = value & (~(255ULL << (56 - dlen * 8)));
-							keyToFind |= uint64_t(lbChild) << (56 - dlen * 8);
-							return m_hashTable.GetLookupMustExistPromise(dlen + 1, keyToFind);
+							leftover[t].push_back(ref);
 						}
+						continue;
+					}
+					numPlaced[t]++;
+					rep(i, 1, int(node.numChildren) - 1)
+					{
+						m_hashTable.ht[pos].AddChild(children[i], cur_gen, m_bitmapPool, m_hashTable.MaxBitmapOffset(pos));
 					}
-					break;
 				}
+				std::vector<NodeRef>().swap(refs[which][s][t]);
 			}
-		}
+		});
 	}
-	
-_flat_mapping:
-	// We have reached lv2 of the tree, which are stored in the flat bitarray instead of the hash table
-	//
-#ifdef ENABLE_STATS
-	numParentPathSteps++;
-#endif
-	uint64_t high24bits = value >> 40;
-	if ((high24bits & 255) < 255)
+	rep(t, 0, numThreads - 1)
 	{
-		int lv2LbChild = Bitmap256LowerBound((std::atomic<uint64_t>*)(m_treeDepth2 + (high24bits >> 8) * 4), (high24bits & 255) + 1);
-		if (lv2LbChild != -1)
+		m_hashTable.numNodes += numPlaced[t];
+	}
+	rep(t, 0, numThreads - 1)
+	{
+		for (NodeRef ref : leftover[t])
 		{
-			uint64_t keyToFind = ((high24bits >> 8) << 48) | (uint64_t(lv2LbChild) << 40);
-			return m_hashTable.GetLookupMustExistPromise(3, keyToFind);
+			PlaceBulkLoadNode(partitions[ref.partition], ref.index, cur_gen);
 		}
 	}
-	// check lv1 of tree
-	//
-#ifdef ENABLE_STATS
-	numParentPathSteps++;
-#endif
+	assert(m_hashTable.numNodes == numTrieNodes);
+	
+	std::atomic_thread_fence(std::memory_order_release);
+	cur_generation.store(cur_gen);
+}
+
+bool MlpSet::Insert(uint64_t value, uint32_t generation)
+{
+	assert(m_hasCalledInit);
+	assert(m_mappedImage == nullptr);
+	bool should_take_generation = generation == UINT32_MAX;
+	uint32_t cur_gen = generation;
+	if (should_take_generation) {
+		cur_gen = IncrementGeneration();
+	}	
+	// An insertion adds at most 2 nodes (the leaf and possibly a splitting node)
+	// Grow ahead of time so Cuckoo displacement rarely fails
+	//
+	if (unlikely(m_hashTable.NeedsGrow()))
+	{
+		GrowHashTable(cur_gen);
+	}
+	int lcpLen;
+_retry:
+	// Handle LCP < 2 case first
+	// This is supposed to be a L1 hit (working set 8KB)
+	//
+	{
+		uint64_t h16bits = value >> 48;
+		if (unlikely((m_treeDepth1[h16bits / 64].load() & (uint64_t(1) << (h16bits % 64))) == 0))
+		{
+			lcpLen = 2;
+			uint64_t rootBit = uint64_t(1) << ((h16bits >> 8) % 64);
+			uint64_t depth1Bit = uint64_t(1) << (h16bits % 64);
+			m_root[(h16bits >> 8) / 64].fetch_or(rootBit);
+			m_treeDepth1[h16bits / 64].fetch_or(depth1Bit);
+			goto _end;
+		}
+	}
+	
+	// Issue the prefetch in case LCP turns out to be 2
+	//
+	MEM_PREFETCH(m_treeDepth2[(value >> 40) / 64]);
+	
+	// Since we know the LCP is >= 2, QueryLCP is applicable
+	// 
+	{
+		uint32_t ilen;
+		HtPosition allPositions1[8], allPositions2[8];
+		uint64_t _expectedHash[4];
+		uint32_t* expectedHash = reinterpret_cast<uint32_t*>(_expectedHash);
+
+		// Can be changed to UnsafeQueryLCP as we have a single writer.
+		lcpLen = m_hashTable.QueryLCPInternal(value, 
+									  		  ilen /*out*/, 
+									  		  allPositions1 /*out*/, 
+									  		  allPositions2 /*out*/, 
+									  		  expectedHash /*out*/,
+									  		  UINT32_MAX /*generation*/);
+		if (lcpLen == 8)
+		{
+			return false;
+		}
+		if (lcpLen > 2)
+		{
+			HtPosition pos = allPositions1[ilen - 1];
+			bool minKeyUpdated = false;
+			assert(ilen <= lcpLen && lcpLen <= m_hashTable.ht[pos].GetFullKeyLen());
+			// Split as needed
+			// Determine whether the path-compression string completely matched
+			//
+			m_hashTable.ht[pos].SetGeneration(cur_gen);
+			if (lcpLen == m_hashTable.ht[pos].GetFullKeyLen())
+			{
+				// path-compression string matched, no need to split
+				//
+				m_hashTable.ht[pos].AddChild((value >> (56 - lcpLen * 8)) % 256, cur_gen, m_bitmapPool, m_hashTable.MaxBitmapOffset(pos));
+				if (value < m_hashTable.ht[pos].minKey)
+				{
+					minKeyUpdated = true;
+					m_hashTable.ht[pos].minKey = value;
+				}
+			}
+			else
+			{
+				// need to split at unmatch point
+				// (1) Add a new node with indexLen = lcpLen+1, fullKeyLen = ht[pos]'s fullKeyLen,
+				//     childList = ht[pos]'s childList, this is the original subtree
+				// (2) Modify the fullKeyLen of ht[pos] to lcpLen, and childList to have 
+				//     only two children (corresponding byte of ht[pos].minKey and value)
+				//     Now ht[pos] becomes the splitting point
+				//
+				uint64_t minKey = m_hashTable.ht[pos].minKey;
+				uint32_t oldHash18bit = m_hashTable.ht[pos].GetHash18bit();
+#ifndef NDEBUG
+				vector<int> oldChildList = m_hashTable.ht[pos].GetAllChildren();
+				int oldFullKeyLen = m_hashTable.ht[pos].GetFullKeyLen();
+#endif
+
+				// Add new node
+				//
+				{
+					bool exist, failed;
+					uint32_t newHash18bit = XXH::XXHashFn3(minKey, lcpLen + 1);
+					newHash18bit = newHash18bit & ((1<<18) - 1);
+					HtPosition x = m_hashTable.ReservePositionForInsert(lcpLen + 1 /*indexLen*/, 
+						                                              minKey /*key*/,
+						                                              newHash18bit /*hash18bit*/, 
+						                                              exist /*out*/, 
+						                                              failed /*out*/,
+						                                              cur_gen /*generation*/);
+					if (unlikely(failed))
+					{
+						// Nothing has been modified yet, so grow the table and start over
+						//
+						GrowHashTable(cur_gen);
+						goto _retry;
+					}
+					assert(!exist);
+					assert(!m_hashTable.ht[x].IsOccupied());
+					// The Cuckoo displacement making room for the new node may have moved ht[pos] itself
+					// to its other position, in which case x may even be pos
+					//
+					if (unlikely(!m_hashTable.ht[pos].IsEqualNoHash(minKey, ilen)))
+					{
+						bool found;
+						pos = m_hashTable.Lookup(ilen, minKey, found);
+						assert(found && pos != x);
+					}
+					// should be ok without fencing as we have a lock.
+					m_hashTable.ht[x].SetGeneration(cur_gen);
+					m_hashTable.ht[pos].MoveNode(&(m_hashTable.ht[x]), cur_gen, m_bitmapPool, m_hashTable.MaxBitmapOffset(x));
+					m_hashTable.ht[x].AlterIndexKeyLen(lcpLen + 1);
+					m_hashTable.ht[x].AlterHash18bit(newHash18bit);
+					// The original subtree is the only node off the path of value the insertion touches
+					//
+					if (m_growingTable != nullptr)
+					{
+						m_hashTable.SyncMigratedNode(lcpLen + 1, minKey, cur_gen);
+					}
+				}
+				
+				// Re-construct ht[pos] (it has been cleared in MoveNode)
+				//
+				{
+					assert(!m_hashTable.ht[pos].IsOccupied());
+					uint64_t z = minKey;
+					if (value < minKey)
+					{
+						z = value;
+						minKeyUpdated = true;
+					}
+					m_hashTable.ht[pos].Init(ilen /*indexLen*/,
+						                     lcpLen /*fullKeyLen*/,
+						                     z /*minKey*/,
+						                     oldHash18bit /*hash18bit*/,
+						                     (minKey >> (56 - 8 * lcpLen)) % 256, /*firstChild*/
+											 cur_gen /*generation*/);
+					m_hashTable.ht[pos].AddChild((value >> (56 - 8 * lcpLen)) % 256, cur_gen, m_bitmapPool, m_hashTable.MaxBitmapOffset(pos));
+				}  
+#ifndef NDEBUG
+				// Sanity check newly added nodes
+				//
+				{
+					// Sanity check splitting node
+					//
+					bool found;
+					HtPosition x = m_hashTable.Lookup(ilen, value, found);
+					assert(found);
+					assert(m_hashTable.ht[x].GetIndexKeyLen() == ilen);
+					assert(m_hashTable.ht[x].GetFullKeyLen() == lcpLen);
+					assert(m_hashTable.ht[x].minKey == min(value, minKey));
+					vector<int> ch = m_hashTable.ht[x].GetAllChildren();
+					assert(ch.size() == 2);
+					int expectedChild1 = (value >> (56 - lcpLen * 8)) % 256;
+					int expectedChild2 = (minKey >> (56 - lcpLen * 8)) % 256;
+					if (expectedChild1 > expectedChild2) { swap(expectedChild1, expectedChild2); }
+					assert(ch[0] == expectedChild1);
+					assert(ch[1] == expectedChild2);
+				}
+				{
+					// Sanity check original subtree
+					//
+					bool found;
+					HtPosition x = m_hashTable.Lookup(lcpLen + 1, minKey, found);
+					assert(found);
+					assert(m_hashTable.ht[x].GetIndexKeyLen() == lcpLen + 1);
+					assert(m_hashTable.ht[x].GetFullKeyLen() == oldFullKeyLen);
+					assert(m_hashTable.ht[x].minKey == minKey);
+					vector<int> ch = m_hashTable.ht[x].GetAllChildren();
+					assert(ch.size() == oldChildList.size());
+					rep(i, 0, int(ch.size()) - 1)
+					{
+						assert(ch[i] == oldChildList[i]);
+					}
+				}
+#endif      
+			}
+			// Update minKey along the parent path
+			//
+			if (minKeyUpdated)
+			{
+				for (ilen--; ilen > 2; ilen--)
+				{
+					if (allPositions1[ilen - 1] > m_hashTable.htMask || allPositions2[ilen - 1] > m_hashTable.htMask)
+					{
+						continue;
+					}
+					HtPosition pos = m_hashTable.FindInBuckets(value, ilen, allPositions1[ilen - 1], allPositions2[ilen - 1]);
+					if (pos == HtPosition(-1))
+					{
+						continue;
+					}
+					assert(m_hashTable.ht[pos].GetIndexKeyLen() == ilen);
+					if (value < m_hashTable.ht[pos].minKey)
+					{
+						m_hashTable.ht[pos].SetGeneration(cur_gen);
+						m_hashTable.ht[pos].minKey = value;
+					}
+					else
+					{
+						break;
+					}
+				}
+			}
+		}
+	}
+	
+_end:
+	// Now we know the true LCP and the tree has been setup with correct splitting, insert node
+	//
+	{
+		bool exist, failed;
+		while (true)
+		{
+			m_hashTable.Insert(lcpLen + 1 /*indexLen*/,
+			                   8 /*fullKeyLen*/,
+			                   value /*minKey*/, 
+			                   -1 /*firstChild*/,
+			                   exist /*out*/, 
+			                   failed /*out*/,
+							   cur_gen /*generation*/);
+			if (likely(!failed))
+			{
+				break;
+			}
+			// The path has been modified already, its copies must be up to date if a growth in progress completes
+			//
+			SyncGrowingHashTable(value, cur_gen);
+			GrowHashTable(cur_gen);
+		}
+		assert(!exist);
+	}
+
+	// Finally, if lcp == 2, we need to set the corresponding m_treeDepth2 bit
+	//
+	if (lcpLen == 2)
+	{
+		uint64_t depth2Bit = uint64_t(1) << ((value >> 40) % 64);
+		assert((m_treeDepth2[(value >> 40) / 64].load() & depth2Bit) == 0);
+		m_treeDepth2[(value >> 40) / 64].fetch_or(depth2Bit);
+	}
+	
+	StepHashTableGrowth(value, cur_gen);
+
+	std::atomic_thread_fence(std::memory_order_release);
+
+	if (should_take_generation) {
+		cur_generation.store(cur_gen);
+	}
+	
+	return true;
+}
+
+bool MlpSet::Exist(uint64_t value)
+{
+	assert(m_hasCalledInit);
+	uint32_t ilen;
+	HtPosition allPositions1[8], allPositions2[8];
+	uint64_t _expectedHash[4];
+	uint32_t* expectedHash = reinterpret_cast<uint32_t*>(_expectedHash);
+	int lcpLen = m_hashTable.QueryLCP(value, 
+		                              ilen /*out*/, 
+		                              allPositions1 /*out*/, 
+		                              allPositions2 /*out*/, 
+		                              expectedHash /*out*/,
+									  [this]() { return ReaderGeneration(); } /*generation*/,
+									  cur_generation /*cur_generation*/);
+	if (lcpLen != 8) {
+		DEBUG("lcpLen=" << lcpLen << " value=" << value);
+	}
+	return (lcpLen == 8);
+}
+
+#define BT_BUF_SIZE 100
+
+#include <execinfo.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+void CuckooHashTableNode::SetGeneration(uint32_t new_generation)
+{
+	generation.store((generation.load() & 0xff000000) | (new_generation & 0xffffff));
+}
+
+MlpSet::Promise MlpSet::LowerBoundInternal(uint64_t value, bool& found, uint32_t generation)
+{
+	HtPosition allPositions1[8], allPositions2[8];
+	uint64_t _expectedHash[4];
+	uint32_t* expectedHash = reinterpret_cast<uint32_t*>(_expectedHash);
+	
+	LowerBoundPrepare(value, allPositions1, allPositions2, expectedHash);
+	return LowerBoundResolve(value, found, generation, allPositions1, allPositions2, expectedHash);
+}
+
+void MlpSet::LowerBoundPrepare(uint64_t value, HtPosition* allPositions1, HtPosition* allPositions2, uint32_t* expectedHash)
+{
+	assert(m_hasCalledInit);
+	
+	// Issue the prefetch in case LCP turns out to be 2
+	//
+	MEM_PREFETCH(m_treeDepth2[(value >> 48) * 4]);
+	
+	m_hashTable.QueryLCPPrepare(value, allPositions1, allPositions2, expectedHash);
+}
+
+MlpSet::Promise MlpSet::LowerBoundResolve(uint64_t value, 
+                                          bool& found, 
+                                          uint32_t generation, 
+                                          HtPosition* allPositions1, 
+                                          HtPosition* allPositions2, 
+                                          uint32_t* expectedHash)
+{
+	assert(m_hasCalledInit);
+	found = true;
+	
+	int numParentPathSteps = 0;
+	Auto(
+		m_hashTable.stats.Count(&MlpStats::lowerBoundParentPathStepsHistogram, numParentPathSteps);
+	);
+
+	uint32_t ilen;
+	HtPosition* allPositions[2] = { allPositions1, allPositions2 };
+
+	int lcpLen = m_hashTable.QueryLCPResolve(value,
+		                              		 ilen /*out*/,
+		                              		 allPositions[0] /*out*/,
+		                              		 allPositions[1] /*out*/,
+		                              		 expectedHash /*out*/,
+		                              		 generation /*generation*/);
+	if (lcpLen < 0)
+	{
+		// Generation mismatch occurred, retry
+		return CuckooHashTable::LookupMustExistPromise();
+	}
+	if (lcpLen == 8)
+	{
+		if (generation < m_hashTable.ht[allPositions[0][ilen - 1]].LoadGeneration())
+		{
+			return CuckooHashTable::LookupMustExistPromise();
+		}
+		return Promise(&m_hashTable.ht[allPositions[0][ilen - 1]]);
+	}
+	if (lcpLen == 2)
+	{
+		goto _flat_mapping;
+	}
+	
+	// lcp in hash table
+	//
+	{
+		HtPosition pos = allPositions[0][ilen - 1];
+		CuckooHashTableNode *node = &m_hashTable.ht[pos];
+		int dlen = node->GetFullKeyLen();
+		if (dlen == lcpLen)
+		{
+			// path compression string matches, lower bound on child
+			//
+			// Check generation before accessing node methods
+			if (generation < m_hashTable.ht[pos].LoadGeneration())
+			{
+				return CuckooHashTable::LookupMustExistPromise();
+			}
+			uint32_t child = (value >> (56 - dlen * 8)) & 255;
+			int lbChild = m_hashTable.ht[pos].LowerBoundChild(child);
+			// std::atomic_thread_fence(std::memory_order_acquire);
+			if (generation < m_hashTable.ht[pos].LoadGeneration())
+			{
+				return CuckooHashTable::LookupMustExistPromise();
+			}
+
+			if (lbChild == -1)
+			{
+				goto _parent;
+			}
+			if (lbChild == child) {
+				return CuckooHashTable::LookupMustExistPromise();
+			}
+			// return the minimum value in lbChild subtree
+			//
+			uint64_t keyToFind = value & (~(255ULL << (56 - dlen * 8)));
+			keyToFind |= uint64_t(lbChild) << (56 - dlen * 8);
+			// From here there's no need to check generation as we know the key is in the tree because were locked.
+			return m_hashTable.GetLookupMustExistPromise(dlen + 1, keyToFind);
+		}
+		else
+		{
+			// path compression string does not match
+			// either the given value is smaller than the whole subtree, or larger than the whole subtree
+			//
+			if (value < m_hashTable.ht[pos].minKey)
+			{
+				if (generation < m_hashTable.ht[pos].LoadGeneration())
+				{
+					return CuckooHashTable::LookupMustExistPromise();
+				}
+				// smaller than whole subtree, result is just subtreeMin
+				//
+				return Promise(&m_hashTable.ht[pos]);
+			}
+			else
+			{	
+				// larger than subtreeMax, need to visit parent path
+				//
+				goto _parent;
+			}
+		}
+	}
+	
+_parent:
+	// The specified value is larger than the maximum in the subtree
+	// We need to return the smallest value larger than subtreeMax by visiting the parent path
+	// 
+	{
+		ilen--;
+		for (; ilen > 2; ilen--)
+		{
+			numParentPathSteps++;
+			HtPosition pos = m_hashTable.FindInBuckets(value, ilen, allPositions[0][ilen - 1], allPositions[1][ilen - 1]);
+			if (pos == HtPosition(-1))
+			{
+				continue;
+			}
+			int dlen = m_hashTable.ht[pos].GetFullKeyLen();
+			// Check generation again after method calls to ensure results are valid
+			if (generation < m_hashTable.ht[pos].LoadGeneration())
+			{
+				return CuckooHashTable::LookupMustExistPromise();
+			}
+			uint32_t child = (value >> (56 - dlen * 8)) & 255;
+			if (child < 255)
+			{
+				// Check generation before accessing node methods
+				if (generation < m_hashTable.ht[pos].LoadGeneration())
+				{
+					return CuckooHashTable::LookupMustExistPromise();
+				}
+				int lbChild = m_hashTable.ht[pos].LowerBoundChild(child + 1);
+				// Check generation again after method call to ensure result is valid
+				if (generation < m_hashTable.ht[pos].LoadGeneration())
+				{
+					return CuckooHashTable::LookupMustExistPromise();
+				}
+				if (lbChild != -1) 
+				{
+					assert(lbChild != child);
+					// return the minimum value in lbChild subtree
+					//
+					uint64_t keyToFind = value & (~(255ULL << (56 - dlen * 8)));
+					keyToFind |= uint64_t(lbChild) << (56 - dlen * 8);
+					return m_hashTable.GetLookupMustExistPromise(dlen + 1, keyToFind);
+				}
+			}
+		}
+	}
+	
+_flat_mapping:
+	// We have reached lv2 of the tree, which are stored in the flat bitarray instead of the hash table
+	//
+	numParentPathSteps++;
+	uint64_t high24bits = value >> 40;
+	if ((high24bits & 255) < 255)
+	{
+		int lv2LbChild = Bitmap256LowerBound((std::atomic<uint64_t>*)(m_treeDepth2 + (high24bits >> 8) * 4), (high24bits & 255) + 1);
+		if (lv2LbChild != -1)
+		{
+			uint64_t keyToFind = ((high24bits >> 8) << 48) | (uint64_t(lv2LbChild) << 40);
+			return m_hashTable.GetLookupMustExistPromise(3, keyToFind);
+		}
+	}
+	// check lv1 of tree
+	//
+	numParentPathSteps++;
 	if (((high24bits >> 8) & 255) < 255)
 	{
-		int lv1LbChild = Bitmap256LowerBound((std::atomic<uint64_t>*)(m_treeDepth1 + (high24bits >> 16) * 4), ((high24bits >> 8) & 255) + 1);
-		if (lv1LbChild != -1)
+		int lv1LbChild = Bitmap256LowerBound((std::atomic<uint64_t>*)(m_treeDepth1 + (high24bits >> 16) * 4), ((high24bits >> 8) & 255) + 1);
+		if (lv1LbChild != -1)
+		{
+			uint64_t high16bits = ((high24bits >> 16) << 8) | lv1LbChild;
+			int lv2FirstChild = Bitmap256LowerBound((std::atomic<uint64_t>*)(m_treeDepth2 + high16bits * 4), 0 /*child*/);
+			assert(lv2FirstChild != -1);
+			uint64_t keyToFind = (high16bits << 48) | (uint64_t(lv2FirstChild) << 40);
+			return m_hashTable.GetLookupMustExistPromise(3, keyToFind);
+		}
+	}
+	// finally check root
+	//
+	numParentPathSteps++;
+	if ((high24bits >> 16) < 255)
+	{
+		int lv0LbChild = Bitmap256LowerBound((std::atomic<uint64_t>*)m_root, (high24bits >> 16) + 1);
+		if (lv0LbChild != -1)
+		{
+			int lv1FirstChild = Bitmap256LowerBound((std::atomic<uint64_t>*)(m_treeDepth1 + lv0LbChild * 4), 0 /*child*/);
+			assert(lv1FirstChild != -1);
+			uint64_t high16bits = (lv0LbChild << 8) | lv1FirstChild;
+			int lv2FirstChild = Bitmap256LowerBound((std::atomic<uint64_t>*)(m_treeDepth2 + high16bits * 4), 0 /*child*/);
+			assert(lv2FirstChild != -1);
+			uint64_t keyToFind = (high16bits << 48) | (uint64_t(lv2FirstChild) << 40);
+			return m_hashTable.GetLookupMustExistPromise(3, keyToFind);
+		}
+	}
+	// not found
+	//
+	found = false;
+	return CuckooHashTable::LookupMustExistPromise();
+}
+
+uint64_t MlpSet::WriterLowerBound(uint64_t value, bool &found) {
+	MlpSet::Promise prom = LowerBoundInternal(value, found, UINT32_MAX);
+	if (found) {
+		return prom.Resolve();
+	}
+	return UINT64_MAX;
+}
+
+// This version wasn't safe beforehand as well, so it doesn't need to change.
+MlpSet::Promise MlpSet::LowerBound(uint64_t value)
+{
+	bool found;
+	Promise p = LowerBoundInternal(value, found, UINT32_MAX);
+	if (found) 
+	{
+		p.Prefetch();
+	}
+	return p;
+}
+
+uint64_t MlpSet::LowerBound(uint64_t value, bool& found)
+{
+	do {
+		// LockGuard lock(&displacement_mutex, true);
+		ReaderGenerationGuard generation_guard = ReaderGeneration();
+		uint32_t generation = generation_guard.generation();
+		Promise p = LowerBoundInternal(value, found, generation);
+		if (generation > cur_generation.load() || m_hashTable.ResizedSince(generation_guard.resizeSeq())) {
+			// this implies that the generation was reset or the table was swapped, so we need to retry.
+			continue;
+		}
+		if (!found) {
+			return 0xffffffffffffffffULL;
+		}
+		if (p.IsValid()) {
+			p.Prefetch();
+			uint64_t result = p.Resolve();
+			if (p.IsGenerationValid(generation)) {
+				return result;
+			} else {
+			    std::cout << "LowerBound failed: generation mismatch" << std::endl;
+			}
+		}
+	} while (true);
+}
+
+uint64_t MlpSet::UpperBound(uint64_t value, bool& found)
+{
+	if (value == 0xffffffffffffffffULL)
+	{
+		found = false;
+		return 0xffffffffffffffffULL;
+	}
+	return LowerBound(value + 1, found);
+}
+
+uint64_t MlpSet::Predecessor(uint64_t value, bool& found)
+{
+	assert(m_hasCalledInit);
+	while (true)
+	{
+		ReaderGenerationGuard generation_guard = ReaderGeneration();
+		uint32_t generation = generation_guard.generation();
+		uint64_t result;
+		bool valid = PredecessorInternal(value, found, result, generation);
+		if (!valid || generation > cur_generation.load() || m_hashTable.ResizedSince(generation_guard.resizeSeq()))
+		{
+			// raced with the writer, or the generation was reset or the table was swapped
+			//
+			continue;
+		}
+		return found ? result : 0;
+	}
+}
+
+bool MlpSet::SubtreeMax(CuckooHashTableNode* node, uint64_t& result, uint32_t generation)
+{
+	while (true)
+	{
+		if (node == nullptr)
+		{
+			return false;
+		}
+		uint64_t minKey = node->minKey;
+		if (node->IsLeaf())
+		{
+			result = minKey;
+			return node->LoadGeneration() <= generation;
+		}
+		int dlen = node->GetFullKeyLen();
+		int child = node->PredecessorChild(255);
+		if (generation < node->LoadGeneration() || child == -1)
+		{
+			return false;
+		}
+		int childShift = 56 - 8 * dlen;
+		uint64_t keyToFind = (minKey >> (childShift + 8) << (childShift + 8)) | (uint64_t(child) << childShift);
+		node = m_hashTable.GetLookupMustExistPromise(dlen + 1, keyToFind).GetNode();
+	}
+}
+
+bool MlpSet::PredecessorInternal(uint64_t value, bool& found, uint64_t& result, uint32_t generation)
+{
+	// Mirror of LowerBoundResolve: find the largest child smaller than value's on the LCP node
+	// or its parent path, and return the maximum of that child's subtree
+	//
+	found = true;
+	uint32_t ilen;
+	HtPosition allPositions1[8], allPositions2[8];
+	uint64_t _expectedHash[4];
+	uint32_t* expectedHash = reinterpret_cast<uint32_t*>(_expectedHash);
+	HtPosition* allPositions[2] = { allPositions1, allPositions2 };
+	
+	int lcpLen = m_hashTable.QueryLCPInternal(value, 
+	                                          ilen /*out*/, 
+	                                          allPositions1 /*out*/, 
+	                                          allPositions2 /*out*/, 
+	                                          expectedHash /*out*/,
+	                                          generation);
+	if (lcpLen < 0)
+	{
+		return false;
+	}
+	if (lcpLen == 8)
+	{
+		result = value;
+		return true;
+	}
+	if (lcpLen > 2)
+	{
+		CuckooHashTableNode* node = &m_hashTable.ht[allPositions1[ilen - 1]];
+		int dlen = node->GetFullKeyLen();
+		uint64_t minKey = node->minKey;
+		if (generation < node->LoadGeneration())
 		{
-			uint64_t high16bits = ((high24bits >> 16) << 8) | lv1LbChild;
-			int lv2FirstChild = Bitmap256LowerBound((std::atomic<uint64_t>*)(m_treeDepth2 + high16bits * 4), 0 /*child*/);
-			assert(lv2FirstChild != -1);
-			uint64_t keyToFind = (high16bits << 48) | (uint64_t(lv2FirstChild) << 40);
-			return m_hashTable.GetLookupMustExistPromise(3, keyToFind);
+			return false;
+		}
+		if (dlen == lcpLen)
+		{
+			// path compression string matches, predecessor on child
+			//
+			uint32_t child = (value >> (56 - dlen * 8)) & 255;
+			int predChild = (child > 0) ? node->PredecessorChild(child - 1) : -1;
+			if (generation < node->LoadGeneration())
+			{
+				return false;
+			}
+			if (predChild != -1)
+			{
+				uint64_t keyToFind = value & (~(255ULL << (56 - dlen * 8)));
+				keyToFind |= uint64_t(predChild) << (56 - dlen * 8);
+				return SubtreeMax(m_hashTable.GetLookupMustExistPromise(dlen + 1, keyToFind).GetNode(), result, generation);
+			}
+		}
+		else if (value > minKey)
+		{
+			// path compression string does not match and is smaller than value's, so is the whole subtree
+			//
+			return SubtreeMax(node, result, generation);
+		}
+		
+		// Everything in the subtree is larger than value, visit the parent path
+		//
+		for (ilen--; ilen > 2; ilen--)
+		{
+			HtPosition pos = m_hashTable.FindInBuckets(value, ilen, allPositions[0][ilen - 1], allPositions[1][ilen - 1]);
+			if (pos == HtPosition(-1))
+			{
+				continue;
+			}
+			int dlen = m_hashTable.ht[pos].GetFullKeyLen();
+			uint32_t child = (value >> (56 - dlen * 8)) & 255;
+			int predChild = (child > 0) ? m_hashTable.ht[pos].PredecessorChild(child - 1) : -1;
+			if (generation < m_hashTable.ht[pos].LoadGeneration())
+			{
+				return false;
+			}
+			if (predChild != -1)
+			{
+				uint64_t keyToFind = value & (~(255ULL << (56 - dlen * 8)));
+				keyToFind |= uint64_t(predChild) << (56 - dlen * 8);
+				return SubtreeMax(m_hashTable.GetLookupMustExistPromise(dlen + 1, keyToFind).GetNode(), result, generation);
+			}
 		}
 	}
-	// finally check root
+	
+	// Continue in the flat bitmaps, the largest 24-bit prefix smaller than value's
+	// A bit may be set with nothing under it while the writer is in the middle of an update, which is retried
 	//
-#ifdef ENABLE_STATS
-	numParentPathSteps++;
-#endif
-	if ((high24bits >> 16) < 255)
+	uint64_t high24bits = value >> 40;
+	int64_t predPrefix = -1;
+	if ((high24bits & 255) > 0)
 	{
-		int lv0LbChild = Bitmap256LowerBound((std::atomic<uint64_t>*)m_root, (high24bits >> 16) + 1);
-		if (lv0LbChild != -1)
+		int lv2PredChild = Bitmap256Predecessor(m_treeDepth2 + (high24bits >> 8) * 4, (high24bits & 255) - 1);
+		if (lv2PredChild != -1)
 		{
-			int lv1FirstChild = Bitmap256LowerBound((std::atomic<uint64_t>*)(m_treeDepth1 + lv0LbChild * 4), 0 /*child*/);
-			assert(lv1FirstChild != -1);
-			uint64_t high16bits = (lv0LbChild << 8) | lv1FirstChild;
-			int lv2FirstChild = Bitmap256LowerBound((std::atomic<uint64_t>*)(m_treeDepth2 + high16bits * 4), 0 /*child*/);
-			assert(lv2FirstChild != -1);
-			uint64_t keyToFind = (high16bits << 48) | (uint64_t(lv2FirstChild) << 40);
-			return m_hashTable.GetLookupMustExistPromise(3, keyToFind);
+			predPrefix = int64_t(((high24bits >> 8) << 8) | lv2PredChild);
 		}
 	}
-	// not found
-	//
-	found = false;
-	return CuckooHashTable::LookupMustExistPromise();
+	if (predPrefix == -1 && ((high24bits >> 8) & 255) > 0)
+	{
+		int lv1PredChild = Bitmap256Predecessor(m_treeDepth1 + (high24bits >> 16) * 4, ((high24bits >> 8) & 255) - 1);
+		if (lv1PredChild != -1)
+		{
+			uint64_t high16bits = ((high24bits >> 16) << 8) | lv1PredChild;
+			int lv2LastChild = Bitmap256Predecessor(m_treeDepth2 + high16bits * 4, 255 /*child*/);
+			if (lv2LastChild == -1)
+			{
+				return false;
+			}
+			predPrefix = int64_t((high16bits << 8) | lv2LastChild);
+		}
+	}
+	if (predPrefix == -1 && (high24bits >> 16) > 0)
+	{
+		int lv0PredChild = Bitmap256Predecessor(m_root, (high24bits >> 16) - 1);
+		if (lv0PredChild != -1)
+		{
+			int lv1LastChild = Bitmap256Predecessor(m_treeDepth1 + lv0PredChild * 4, 255 /*child*/);
+			if (lv1LastChild == -1)
+			{
+				return false;
+			}
+			uint64_t high16bits = (uint64_t(lv0PredChild) << 8) | lv1LastChild;
+			int lv2LastChild = Bitmap256Predecessor(m_treeDepth2 + high16bits * 4, 255 /*child*/);
+			if (lv2LastChild == -1)
+			{
+				return false;
+			}
+			predPrefix = int64_t((high16bits << 8) | lv2LastChild);
+		}
+	}
+	if (predPrefix == -1)
+	{
+		found = false;
+		return true;
+	}
+	return SubtreeMax(m_hashTable.GetLookupMustExistPromise(3, uint64_t(predPrefix) << 40).GetNode(), result, generation);
 }
 
-uint64_t MlpSet::WriterLowerBound(uint64_t value, bool &found) {
-	MlpSet::Promise prom = LowerBoundInternal(value, found, UINT32_MAX);
-	if (found) {
-		return prom.Resolve();
+namespace {
+
+// Per-key state carried from the prepare stage to the resolve stage of a batched query
+//
+struct BatchQueryState
+{
+	HtPosition allPositions1[8];
+	HtPosition allPositions2[8];
+	uint64_t expectedHash[4];
+	
+	uint32_t* ExpectedHash() { return reinterpret_cast<uint32_t*>(expectedHash); }
+};
+
+}	// annoymous namespace
+
+void MlpSet::ExistBatch(const uint64_t* keys, size_t n, bool* out)
+{
+	assert(m_hasCalledInit);
+	BatchQueryState state[BATCH_PREFETCH_DISTANCE];
+	size_t retries[BATCH_CHUNK_SIZE];
+	
+	for (size_t start = 0; start < n; start += BATCH_CHUNK_SIZE)
+	{
+		size_t end = min(n, start + BATCH_CHUNK_SIZE);
+		size_t numRetries = 0;
+		bool chunkValid;
+		{
+			ReaderGenerationGuard generation_guard = ReaderGeneration();
+			uint32_t generation = generation_guard.generation();
+			
+			for (size_t i = start; i < end && i < start + BATCH_PREFETCH_DISTANCE; i++)
+			{
+				BatchQueryState& st = state[(i - start) % BATCH_PREFETCH_DISTANCE];
+				m_hashTable.QueryLCPPrepare(keys[i], st.allPositions1, st.allPositions2, st.ExpectedHash());
+			}
+			for (size_t i = start; i < end; i++)
+			{
+				BatchQueryState& st = state[(i - start) % BATCH_PREFETCH_DISTANCE];
+				uint32_t ilen;
+				int lcpLen = m_hashTable.QueryLCPResolve(keys[i], 
+				                                         ilen /*out*/, 
+				                                         st.allPositions1, 
+				                                         st.allPositions2, 
+				                                         st.ExpectedHash(), 
+				                                         generation);
+				if (unlikely(lcpLen < 0))
+				{
+					retries[numRetries++] = i;
+				}
+				else
+				{
+					out[i] = (lcpLen == 8);
+				}
+				// the slot is free now, start the key BATCH_PREFETCH_DISTANCE ahead
+				//
+				if (i + BATCH_PREFETCH_DISTANCE < end)
+				{
+					m_hashTable.QueryLCPPrepare(keys[i + BATCH_PREFETCH_DISTANCE], st.allPositions1, st.allPositions2, st.ExpectedHash());
+				}
+			}
+			chunkValid = !(generation > cur_generation.load() || m_hashTable.ResizedSince(generation_guard.resizeSeq()));
+		}
+		
+		// Fall back to the single key path (which retries on its own), 
+		// after our reader generation has been released
+		//
+		if (unlikely(!chunkValid))
+		{
+			for (size_t i = start; i < end; i++)
+			{
+				out[i] = Exist(keys[i]);
+			}
+			continue;
+		}
+		rep(k, 0, int(numRetries) - 1)
+		{
+			out[retries[k]] = Exist(keys[retries[k]]);
+		}
 	}
-	return UINT64_MAX;
 }
 
-// This version wasn't safe beforehand as well, so it doesn't need to change.
-MlpSet::Promise MlpSet::LowerBound(uint64_t value)
+void MlpSet::LowerBoundBatch(const uint64_t* keys, size_t n, uint64_t* out, bool* found)
 {
-	bool found;
-	Promise p = LowerBoundInternal(value, found, UINT32_MAX);
-	if (found) 
+	assert(m_hasCalledInit);
+	BatchQueryState state[BATCH_PREFETCH_DISTANCE];
+	Promise promises[BATCH_CHUNK_SIZE];
+	size_t retries[BATCH_CHUNK_SIZE];
+	
+	for (size_t start = 0; start < n; start += BATCH_CHUNK_SIZE)
 	{
-		p.Prefetch();
+		size_t end = min(n, start + BATCH_CHUNK_SIZE);
+		size_t numRetries = 0;
+		bool chunkValid;
+		{
+			ReaderGenerationGuard generation_guard = ReaderGeneration();
+			uint32_t generation = generation_guard.generation();
+			
+			for (size_t i = start; i < end && i < start + BATCH_PREFETCH_DISTANCE; i++)
+			{
+				BatchQueryState& st = state[(i - start) % BATCH_PREFETCH_DISTANCE];
+				LowerBoundPrepare(keys[i], st.allPositions1, st.allPositions2, st.ExpectedHash());
+			}
+			// First pass: find the node holding the lower bound of each key, and prefetch it
+			//
+			for (size_t i = start; i < end; i++)
+			{
+				BatchQueryState& st = state[(i - start) % BATCH_PREFETCH_DISTANCE];
+				Promise& p = promises[i - start];
+				p = LowerBoundResolve(keys[i], found[i], generation, st.allPositions1, st.allPositions2, st.ExpectedHash());
+				if (found[i] && p.IsValid())
+				{
+					p.Prefetch();
+				}
+				if (i + BATCH_PREFETCH_DISTANCE < end)
+				{
+					LowerBoundPrepare(keys[i + BATCH_PREFETCH_DISTANCE], st.allPositions1, st.allPositions2, st.ExpectedHash());
+				}
+			}
+			// Second pass: resolve the promises, whose cache lines should have arrived by now
+			//
+			for (size_t i = start; i < end; i++)
+			{
+				Promise& p = promises[i - start];
+				if (!found[i])
+				{
+					out[i] = 0xffffffffffffffffULL;
+				}
+				else if (likely(p.IsValid()))
+				{
+					out[i] = p.Resolve();
+					if (unlikely(!p.IsGenerationValid(generation)))
+					{
+						retries[numRetries++] = i;
+					}
+				}
+				else
+				{
+					// a generation mismatch was detected while resolving
+					//
+					retries[numRetries++] = i;
+				}
+			}
+			chunkValid = !(generation > cur_generation.load() || m_hashTable.ResizedSince(generation_guard.resizeSeq()));
+		}
+		
+		// Fall back to the single key path (which retries on its own), 
+		// after our reader generation has been released
+		//
+		if (unlikely(!chunkValid))
+		{
+			for (size_t i = start; i < end; i++)
+			{
+				bool f;
+				out[i] = LowerBound(keys[i], f);
+				found[i] = f;
+			}
+			continue;
+		}
+		rep(k, 0, int(numRetries) - 1)
+		{
+			bool f;
+			out[retries[k]] = LowerBound(keys[retries[k]], f);
+			found[retries[k]] = f;
+		}
 	}
-	return p;
 }
 
-uint64_t MlpSet::LowerBound(uint64_t value, bool& found)
+struct MlpSet::ScanState
 {
-	do {
-		// LockGuard lock(&displacement_mutex, true);
+	uint64_t lo;
+	uint64_t hi;
+	uint64_t* out;
+	size_t maxKeys;
+	size_t numKeys;
+	uint32_t generation;
+	// reached hi or maxKeys
+	//
+	bool done;
+	// raced with the writer, the attempt must be retried
+	//
+	bool failed;
+};
+
+size_t MlpSet::ScanRange(uint64_t lo, uint64_t hi, uint64_t* out, size_t maxKeys)
+{
+	assert(m_hasCalledInit);
+	if (lo > hi || maxKeys == 0)
+	{
+		return 0;
+	}
+	while (true)
+	{
 		ReaderGenerationGuard generation_guard = ReaderGeneration();
-		uint32_t generation = generation_guard.generation();
-		Promise p = LowerBoundInternal(value, found, generation);
-		if (generation > cur_generation.load()) {
-			// this implies that the generation was reset, so we need to retry.
+		ScanState st;
+		st.lo = lo;
+		st.hi = hi;
+		st.out = out;
+		st.maxKeys = maxKeys;
+		st.numKeys = 0;
+		st.generation = generation_guard.generation();
+		st.done = false;
+		st.failed = false;
+		
+		uint64_t h24bits = lo >> 40;
+		while (!st.done && !st.failed && NextTopLevelPrefix(h24bits) && h24bits <= (hi >> 40))
+		{
+			CuckooHashTableNode* node = m_hashTable.GetLookupMustExistPromise(3 /*ilen*/, h24bits << 40).GetNode();
+			if (node == nullptr)
+			{
+				st.failed = true;
+				break;
+			}
+			ScanSubtree(node, h24bits == (lo >> 40) /*bounded*/, st);
+			if (h24bits == (1 << 24) - 1)
+			{
+				break;
+			}
+			h24bits++;
+		}
+		
+		if (st.failed || st.generation > cur_generation.load() || m_hashTable.ResizedSince(generation_guard.resizeSeq()))
+		{
 			continue;
 		}
-		if (!found) {
-			return 0xffffffffffffffffULL;
+		return st.numKeys;
+	}
+}
+
+void MlpSet::ScanSubtree(CuckooHashTableNode* node, bool bounded, ScanState& st)
+{
+	uint64_t minKey = node->minKey;
+	int fullKeyLen = node->GetFullKeyLen();
+	bool isLeaf = node->IsLeaf();
+	if (node->LoadGeneration() > st.generation)
+	{
+		st.failed = true;
+		return;
+	}
+	if (bounded)
+	{
+		// The node is on the path of lo, compare the rest of its path-compression string
+		//
+		int shiftLen = 64 - 8 * fullKeyLen;
+		uint64_t nodePrefix = (fullKeyLen == 8) ? minKey : (minKey >> shiftLen);
+		uint64_t loPrefix = (fullKeyLen == 8) ? st.lo : (st.lo >> shiftLen);
+		if (nodePrefix < loPrefix)
+		{
+			// the whole subtree is smaller than lo
+			//
+			return;
 		}
-		if (p.IsValid()) {
-			p.Prefetch();
-			uint64_t result = p.Resolve();
-			if (p.IsGenerationValid(generation)) {
-				return result;
-			} else {
-			    std::cout << "LowerBound failed: generation mismatch" << std::endl;
+		bounded = (nodePrefix == loPrefix);
+	}
+	if (minKey > st.hi)
+	{
+		st.done = true;
+		return;
+	}
+	if (isLeaf)
+	{
+		st.out[st.numKeys++] = minKey;
+		st.done = (st.numKeys == st.maxKeys);
+		return;
+	}
+	
+	int childShift = 56 - 8 * fullKeyLen;
+	uint64_t prefix = minKey >> (childShift + 8) << (childShift + 8);
+	int firstChild = bounded ? int((st.lo >> childShift) & 255) : 0;
+	
+	// Software-pipeline the children: the slots of the next SCAN_PREFETCH_DISTANCE ones are in flight
+	// while the current one is visited
+	//
+	CuckooHashTable::LookupMustExistPromise ahead[SCAN_PREFETCH_DISTANCE];
+	int aheadChild[SCAN_PREFETCH_DISTANCE];
+	size_t head = 0;
+	size_t numAhead = 0;
+	int nextChild = node->LowerBoundChild(firstChild);
+	auto issueNext = [&]()
+	{
+		size_t slot = (head + numAhead) % SCAN_PREFETCH_DISTANCE;
+		aheadChild[slot] = nextChild;
+		ahead[slot] = m_hashTable.GetLookupMustExistPromise(fullKeyLen + 1 /*ilen*/, prefix | (uint64_t(nextChild) << childShift));
+		ahead[slot].Prefetch();
+		numAhead++;
+		nextChild = (nextChild < 255) ? node->LowerBoundChild(nextChild + 1) : -1;
+	};
+	while (numAhead < SCAN_PREFETCH_DISTANCE && nextChild != -1)
+	{
+		issueNext();
+	}
+	while (numAhead > 0)
+	{
+		int child = aheadChild[head];
+		CuckooHashTableNode* childNode = ahead[head].GetNode();
+		head = (head + 1) % SCAN_PREFETCH_DISTANCE;
+		numAhead--;
+		if (nextChild != -1)
+		{
+			issueNext();
+		}
+		if (childNode == nullptr)
+		{
+			st.failed = true;
+			return;
+		}
+		ScanSubtree(childNode, bounded && child == firstChild, st);
+		if (st.done || st.failed)
+		{
+			return;
+		}
+	}
+	
+	// The children read above are only valid if the node wasn't modified meanwhile
+	//
+	if (node->LoadGeneration() > st.generation)
+	{
+		st.failed = true;
+	}
+}
+
+bool MlpSet::NextTopLevelPrefix(uint64_t& h24bits)
+{
+	// A bit may be set with nothing set under it while the writer is in the middle of an insertion or removal,
+	// such prefixes are skipped like empty ones
+	//
+	while (h24bits < (1 << 24))
+	{
+		int lv2Child = Bitmap256LowerBound(m_treeDepth2 + (h24bits >> 8) * 4, h24bits & 255);
+		if (lv2Child != -1)
+		{
+			h24bits = (h24bits >> 8 << 8) | uint64_t(lv2Child);
+			return true;
+		}
+		// nothing left under this 16-bit prefix, move to the next one with its m_treeDepth1 bit set
+		//
+		uint64_t h16bits = (h24bits >> 8) + 1;
+		while (h16bits < (1 << 16))
+		{
+			int lv1Child = Bitmap256LowerBound(m_treeDepth1 + (h16bits >> 8) * 4, h16bits & 255);
+			if (lv1Child != -1)
+			{
+				h16bits = (h16bits >> 8 << 8) | uint64_t(lv1Child);
+				break;
+			}
+			// nothing left under this 8-bit prefix, move to the next one with its root bit set
+			//
+			uint64_t h8bits = (h16bits >> 8) + 1;
+			int lv0Child = (h8bits < 256) ? Bitmap256LowerBound(m_root, h8bits) : -1;
+			if (lv0Child == -1)
+			{
+				return false;
 			}
+			h16bits = uint64_t(lv0Child) << 8;
 		}
-	} while (true);
+		h24bits = h16bits << 8;
+	}
+	return false;
 }
 
 }	// namespace MlpSetUInt64
@@ -1,9 +1,9 @@
 #pragma once
 
 #include "common.h"
+#include "MlpSetUInt64Hash.h"
 #include <shared_mutex>
 #include <atomic>
-#include <sched.h>      // for sched_getcpu
 
 #include <mutex>
 static std::mutex debug_print_mutex;
@@ -31,11 +31,16 @@ static std::mutex debug_print_mutex;
 					} while(0)
 #endif
 #include <optional>
+#include <functional>
+#include <thread>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <unordered_set>
 
 namespace MlpSetUInt64
 {
 
-
 // Displacement can't be protected by generation.
 static std::shared_mutex displacement_mutex;
 
@@ -49,6 +54,117 @@ private:
 	bool _is_shared;
 };
 
+// Page backing of the large memory chunks of the set (top level bitmaps and hash table arrays)
+//
+enum class MemoryBacking : uint8_t
+{
+	// regular 4KB pages
+	//
+	PLAIN_PAGES,
+	// regular allocation aligned to 2MB and advised with MADV_HUGEPAGE,
+	// the kernel backs it with transparent huge pages when it can
+	//
+	TRANSPARENT_HUGE_PAGES,
+	// explicit huge pages from the hugetlbfs pool (MAP_HUGETLB),
+	// requires huge pages to be reserved by the administrator (vm.nr_hugepages)
+	//
+	HUGETLB
+};
+
+enum class NumaPolicy : uint8_t
+{
+	// first touch placement
+	//
+	DEFAULT,
+	// place all pages on the nodes in numaNodeMask
+	//
+	BIND,
+	// interleave the pages across the nodes in numaNodeMask
+	//
+	INTERLEAVE
+};
+
+struct MemoryPolicy
+{
+	MemoryBacking backing;
+	NumaPolicy numaPolicy;
+	// bit i set means NUMA node i, ignored with NumaPolicy::DEFAULT
+	//
+	uint64_t numaNodeMask;
+
+	MemoryPolicy(MemoryBacking _backing = MemoryBacking::PLAIN_PAGES,
+	             NumaPolicy _numaPolicy = NumaPolicy::DEFAULT,
+	             uint64_t _numaNodeMask = 0)
+		: backing(_backing)
+		, numaPolicy(_numaPolicy)
+		, numaNodeMask(_numaNodeMask)
+	{ }
+};
+
+// Allocate size bytes of zeroed, 4KB aligned memory following policy, as an anonymous mapping
+// If the requested backing can't be provided, falls back from HUGETLB to TRANSPARENT_HUGE_PAGES to PLAIN_PAGES
+// backing is set to the backing actually used, which must be passed to FreeBackingMemory
+// The NUMA policy is applied before the memory is first touched. It is best effort:
+// if the kernel rejects it (no NUMA support, node not online) the memory is placed by first touch,
+// and *numaPolicyApplied (if given) is set to false
+// No page is touched, so memory that is never written costs nothing
+//
+void* AllocateBackingMemory(uint64_t size, const MemoryPolicy& policy, MemoryBacking& backing /*out*/, 
+                            bool* numaPolicyApplied = nullptr /*out*/);
+void FreeBackingMemory(void* ptr, uint64_t size, MemoryBacking backing);
+
+// Slab allocator for the 32-byte external child bitmaps
+// Bitmaps are carved out of cache-line aligned chunks, so that no bitmap straddles a cache line
+// Allocate is only called by the writer. Bitmaps are handed back by Release once no reader can
+// access them anymore (possibly from the reclamation thread) and recycled by later allocations
+// All the chunks are freed when the pool is destroyed
+//
+class ExternalBitMapPool
+{
+public:
+	ExternalBitMapPool();
+	~ExternalBitMapPool();
+	
+	ExternalBitMapPool(const ExternalBitMapPool& other) = delete;
+	ExternalBitMapPool& operator=(const ExternalBitMapPool& other) = delete;
+	
+	// Returns a zeroed bitmap
+	//
+	uint64_t* Allocate();
+	void Release(uint64_t* ptr);
+	
+	// Release with the signature expected by MlpSet::AddDeallocation
+	//
+	static void ReleaseDeferred(void* pool, void* ptr);
+	
+	// number of bitmaps handed out since the pool was created
+	//
+	uint64_t NumAllocations() const { return m_numAllocations; }
+	// number of chunks allocated from the system
+	//
+	uint64_t NumChunks() const { return m_chunks.size(); }
+	
+	static constexpr size_t BITMAP_SIZE = 32;
+	static constexpr size_t CHUNK_SIZE = 65536;
+
+private:
+	struct FreeBitMap
+	{
+		FreeBitMap* next;
+	};
+	
+	// owned by the writer
+	//
+	FreeBitMap* m_freeList;
+	// bitmaps released since the writer last took them
+	//
+	std::atomic<FreeBitMap*> m_released;
+	char* m_chunkCursor;
+	char* m_chunkEnd;
+	std::vector<void*> m_chunks;
+	uint64_t m_numAllocations;
+};
+
 // Cuckoo hash table node
 //
 struct CuckooHashTableNode
@@ -212,6 +328,13 @@ struct CuckooHashTableNode
 		return ((hash >> 21) & 7) == 4;
 	}
 	
+	// Whether the bitmap of this node lives in a neighboring slot
+	//
+	bool IsUsingNeighboringBitMap()
+	{
+		return !(IsUsingInternalChildMap() || IsExternalPointerBitMap() || IsLeaf());
+	}
+	
 	int GetChildNum() const
 	{
 		return NUM_CHILDREN(generation.load());
@@ -226,30 +349,38 @@ struct CuckooHashTableNode
 	
 	void Init(int ilen, int dlen, uint64_t dkey, uint32_t hash18bit, int firstChild, uint32_t start_gen);
 	
-	int FindNeighboringEmptySlot();
+	// The offset (-3 to 3) of a free slot next to this node for its internal bitmap, or 0 if there is none
+	// Slots after the node are only considered up to maxOffset, NO_NEIGHBORING_BITMAP allows none at all
+	//
+	int FindNeighboringEmptySlot(int maxOffset = 3);
 	
-	void BitMapSet(int child, bool on=true);
+	static constexpr int NO_NEIGHBORING_BITMAP = -4;
 	
-	// TODO: free external bitmap memory when hash table is destroyed
-	//
-	uint64_t* AllocateExternalBitMap();
+	void BitMapSet(int child, bool on=true);
 	
 	// Switch from internal child list to internal/external bitmap
+	// maxBitmapOffset limits where the internal bitmap goes (see FindNeighboringEmptySlot)
 	//
-	void ExtendToBitMap(uint32_t generation);
+	void ExtendToBitMap(uint32_t generation, ExternalBitMapPool& pool, int maxBitmapOffset = 3);
 	
 	// Find minimum child >= given child
 	// returns -1 if larger child does not exist
 	//
 	int LowerBoundChild(uint32_t child);
 	
+	// Find maximum child <= given child
+	// returns -1 if smaller child does not exist
+	//
+	int PredecessorChild(uint32_t child);
+	
 	// Check if given child exists
 	//
 	bool ExistChild(int child);
 	
 	// Add a new child, must not exist
+	// maxBitmapOffset limits where the internal bitmap goes, if one is needed (see FindNeighboringEmptySlot)
 	//
-	void AddChild(int child, uint32_t generation);
+	void AddChild(int child, uint32_t generation, ExternalBitMapPool& pool, int maxBitmapOffset = 3);
 
 	void RevertToInternalBitmap(std::function<void(void*)> addDeallocationFunc);
 
@@ -263,15 +394,21 @@ struct CuckooHashTableNode
 	
 	// Copy its internal bitmap to external
 	//
-	uint64_t* CopyToExternalBitMap();
+	uint64_t* CopyToExternalBitMap(ExternalBitMapPool& pool);
+	
+	// Copy this node as well as its bitmap to target, leaving this node untouched
+	// target may live in a different hash table (used when migrating to a larger table)
+	// maxBitmapOffset limits where the internal bitmap goes next to target (see FindNeighboringEmptySlot)
+	//
+	void CopyNodeTo(CuckooHashTableNode* target, uint32_t generation, ExternalBitMapPool& pool, int maxBitmapOffset = 3);
 	
 	// Move this node as well as its bitmap to target
 	//
-	void MoveNode(CuckooHashTableNode* target, uint32_t generation);
+	void MoveNode(CuckooHashTableNode* target, uint32_t generation, ExternalBitMapPool& pool, int maxBitmapOffset = 3);
 	
 	// Relocate its internal bitmap to another position
 	//
-	void RelocateBitMap();
+	void RelocateBitMap(ExternalBitMapPool& pool, int maxBitmapOffset = 3);
 
 	 // For leaf nodes only: manage the node type using bitmap bits
     enum LeafType : uint8_t {
@@ -319,14 +456,39 @@ struct CuckooHashTableNode
 
 static_assert(sizeof(CuckooHashTableNode) == 24, "size of node should be 24");
 
+// Holds the reader's published generation for the duration of a query
+// The guard knows the slot it published to, so ending the read is a single inlined store
+//
 class ReaderGenerationGuard final {
 public:
-	ReaderGenerationGuard(uint32_t reader_generation, std::function<void(void)> func):
-		m_generation(reader_generation), m_readerEndFunc(func) {}
+	ReaderGenerationGuard(uint32_t reader_generation, uint32_t resize_seq, std::atomic<uint32_t>* reader_slot = nullptr,
+	                      std::atomic<uint64_t>* shared_reader_slot = nullptr):
+		m_generation(reader_generation), m_resizeSeq(resize_seq), m_readerSlot(reader_slot), m_sharedReaderSlot(shared_reader_slot) {}
 
 	~ReaderGenerationGuard()
 	{
-		m_readerEndFunc();
+		if (m_readerSlot != nullptr)
+		{
+			m_readerSlot->store(UINT32_MAX);
+		}
+		else if (m_sharedReaderSlot != nullptr)
+		{
+			LeaveSharedReaderSlot(m_sharedReaderSlot);
+		}
+	}
+
+	// A shared reader slot holds the number of readers inside a read in its high 32 bits,
+	// and a generation no newer than any of theirs in its low 32 bits (UINT32_MAX once they have all left)
+	//
+	static void LeaveSharedReaderSlot(std::atomic<uint64_t>* slot)
+	{
+		uint64_t value = slot->load();
+		uint64_t newValue;
+		do
+		{
+			assert((value >> 32) > 0);
+			newValue = ((value >> 32) == 1) ? UINT32_MAX : (value - (uint64_t(1) << 32));
+		} while (!slot->compare_exchange_weak(value, newValue));
 	}
 
 	// ensure this class is not copy-able
@@ -335,30 +497,134 @@ public:
 	
 	uint32_t generation() const { return m_generation; }
 
+	// the hash table resize sequence observed when the reader started
+	//
+	uint32_t resizeSeq() const { return m_resizeSeq; }
+
 private:
 	uint32_t m_generation;
-	std::function<void(void)> m_readerEndFunc;
+	uint32_t m_resizeSeq;
+	std::atomic<uint32_t>* m_readerSlot;
+	std::atomic<uint64_t>* m_sharedReaderSlot;
 };
 
-// This class does not own the main hash table's memory
-// TODO: it should manage the external bitmap memory, but not implemented yet
+// Totals of the runtime instrumentation counters of a set, see MlpSet::EnableStats
 //
-class CuckooHashTable
+struct MlpStats
+{
+	// QueryLCP calls which had to take the slow path because of a hash conflict
+	//
+	uint64_t slowPathCount;
+	// QueryLCP results by the index length of the node found (2 means only the flat bitmaps matched)
+	//
+	uint64_t lcpResultHistogram[9];
+	// nodes moved and internal bitmaps relocated by Cuckoo displacement
+	//
+	uint64_t movedNodesCount;
+	uint64_t relocatedBitmapsCount;
+	// Cuckoo displacements by the length of their chain, the last bucket also counts the longer ones
+	//
+	static constexpr int DISPLACEMENT_DEPTH_BUCKETS = 16;
+	uint64_t displacementDepthHistogram[DISPLACEMENT_DEPTH_BUCKETS];
+	// Cuckoo displacements which gave up, after which the node goes to the stash, or the table is grown if it is full
+	//
+	uint64_t displacementFailures;
+	// nodes placed in the overflow stash of the table
+	//
+	uint64_t stashInsertions;
+	// LowerBound queries by the number of steps walked up the parent path (including the flat bitmap levels)
+	//
+	uint64_t lowerBoundParentPathStepsHistogram[9];
+	// Reclaim calls which had to leave buffers pending because a reader could still be using them
+	//
+	uint64_t pendingDeallocationsPostponed;
+	
+	void Report() const;
+};
+
+// The per-thread shards of the MlpStats counters of a set
+// A thread only writes to the shard of its reader slot, so counting needs neither an atomic read-modify-write
+// nor exclusive access to a shared cache line. GetTotals sums the shards on demand
+// The shards are allocated by the first Enable. While disabled, counting costs one load and a not-taken branch
+//
+class StatsRecorder
 {
 public:
+	StatsRecorder();
+	~StatsRecorder();
+	
+	StatsRecorder(const StatsRecorder& other) = delete;
+	StatsRecorder& operator=(const StatsRecorder& other) = delete;
+	
+	// Enable and Disable must not be called concurrently with each other, counting may go on meanwhile
+	//
+	void Enable();
+	void Disable();
+	bool IsEnabled() const { return m_active.load(std::memory_order_relaxed) != nullptr; }
+	
+	MlpStats GetTotals() const;
+	// Counts made concurrently with Clear may survive it
+	//
+	void Clear();
+	
+	// Add one to a counter, or to a bucket of a histogram, of the current thread
+	//
+	void Count(uint64_t MlpStats::*counter);
+	template<size_t N>
+	void Count(uint64_t (MlpStats::*histogram)[N], size_t bucket);
 
-#ifdef ENABLE_STATS
-	struct Stats
+private:
+	struct alignas(64) Shard
 	{
-		uint32_t m_slowpathCount;
-		uint32_t m_movedNodesCount;
-		uint32_t m_relocatedBitmapsCount;
-		uint32_t m_lcpResultHistogram[9];
-		Stats();
-		void ClearStats();
-		void ReportStats();
+		MlpStats counters;
 	};
-#endif
+	
+	// the counters of the current thread, nullptr if disabled
+	// shared is set if other threads count there as well (see ReaderSlotRegistry::OVERFLOW_SLOT)
+	//
+	MlpStats* ThreadCounters(bool& shared);
+	
+	static void Increment(uint64_t& counter, bool shared)
+	{
+		if (unlikely(shared))
+		{
+			__atomic_fetch_add(&counter, 1, __ATOMIC_RELAXED);
+			return;
+		}
+		__atomic_store_n(&counter, __atomic_load_n(&counter, __ATOMIC_RELAXED) + 1, __ATOMIC_RELAXED);
+	}
+	
+	std::atomic<Shard*> m_active;
+	// one shard per reader slot, kept until destruction once allocated since threads may still be counting
+	// when the recorder is disabled
+	//
+	Shard* m_shards;
+};
+
+// The kernel computing the 18 prefix hashes of a queried key in CuckooHashTable::QueryLCPPrepare (see MlpSetUInt64Hash.h)
+// All kernels give identical results, the best one supported by the running CPU is selected once at startup.
+// The selection is process-wide, and must not be changed while queries are running
+//
+enum class HashKernel : uint8_t
+{
+	SCALAR,
+	SSE42,
+	AVX2,
+	AVX512
+};
+
+const char* HashKernelName(HashKernel kernel);
+bool IsHashKernelSupported(HashKernel kernel);
+HashKernel GetHashKernel();
+// Returns false (and keeps the current kernel) if the running CPU does not support the kernel
+//
+bool SetHashKernel(HashKernel kernel);
+
+// This class does not own the main hash table's memory, nor the external bitmaps (allocated from bitmapPool)
+//
+class CuckooHashTable
+{
+public:
 
 	class LookupMustExistPromise
 	{
@@ -371,54 +637,46 @@ public:
 		{ }
 		
 		LookupMustExistPromise(uint16_t valid, uint16_t shiftLen, 
-		                       CuckooHashTableNode* h1, CuckooHashTableNode* h2, 
+		                       CuckooHashTableNode* h1, CuckooHashTableNode* h2, CuckooHashTableNode* stash,
 		                       uint32_t expectedHash, uint64_t shiftedKey)
 			: valid(valid)
 			, shiftLen(shiftLen)
 			, h1(h1)
 			, h2(h2)
+			, stash(stash)
 			, expectedHash(expectedHash)
 			, shiftedKey(shiftedKey)
 		{ }
 		
 		bool IsValid() { return valid; }
 
-		bool IsGenerationValid(uint32_t generation) { 
-			if (h2 == nullptr || h1->IsEqual(expectedHash, shiftLen, shiftedKey))
-			{
-				return h1->LoadGeneration() <= generation;
-			}
-			else
-			{
-				return h2->LoadGeneration() <= generation;
-			}
+		// The node may have been removed after Resolve read it (the writer clears minKey after the hash),
+		// so a node found in neither bucket is never valid, h2's generation says nothing about it
+		//
+		bool IsGenerationValid(uint32_t generation) {
+			CuckooHashTableNode* node = Find();
+			return node != nullptr && node->LoadGeneration() <= generation;
 		}
 
 		uint32_t GetGeneration() {
-			if (h2 == nullptr || h1->IsEqual(expectedHash, shiftLen, shiftedKey))
-			{
-				return h1->LoadGeneration();
-			}
-			else
-			{
-				return h2->LoadGeneration();
-			}
+			CuckooHashTableNode* node = Find();
+			return (node != nullptr) ? node->LoadGeneration() : h2->LoadGeneration();
 		}
 		
 		uint64_t Resolve()
 		{
 			assert(IsValid());
-			if (h2 == nullptr || h1->IsEqual(expectedHash, shiftLen, shiftedKey))
-			{
-				return h1->minKey;
-			}
-			else
-			{
-				return h2->minKey;
-			}
+			CuckooHashTableNode* node = Find();
+			return (node != nullptr) ? node->minKey : h2->minKey;
 		}
 
-		
+		// The node itself, or nullptr if it is in neither bucket (moved or removed by a concurrent writer)
+		//
+		CuckooHashTableNode* GetNode()
+		{
+			assert(IsValid());
+			return Find();
+		}
 		
 		void Prefetch()
 		{
@@ -430,31 +688,115 @@ public:
 			}
 		}
 		
+		// h1 is the node itself if h2 is nullptr, otherwise h1 and h2 are the first slots of the node's two buckets
+		// stash is the first stash slot if the stash held a node of this length when the promise was made, nullptr otherwise
+		//
 		uint16_t valid;
 		uint16_t shiftLen;
 		CuckooHashTableNode* h1;
 		CuckooHashTableNode* h2;
+		CuckooHashTableNode* stash;
 		uint32_t expectedHash;
 		uint64_t shiftedKey;
+		
+	private:
+		CuckooHashTableNode* Find()
+		{
+			if (h2 == nullptr)
+			{
+				return h1;
+			}
+			rep(i, 0, BUCKET_SIZE - 1)
+			{
+				if (h1[i].IsEqual(expectedHash, shiftLen, shiftedKey)) { return h1 + i; }
+			}
+			rep(i, 0, BUCKET_SIZE - 1)
+			{
+				if (h2[i].IsEqual(expectedHash, shiftLen, shiftedKey)) { return h2 + i; }
+			}
+			if (stash != nullptr)
+			{
+				rep(i, 0, STASH_SIZE - 1)
+				{
+					if (stash[i].IsEqual(expectedHash, shiftLen, shiftedKey)) { return stash + i; }
+				}
+			}
+			return nullptr;
+		}
 	};
 	
 	CuckooHashTable();
 	
-	void Init(CuckooHashTableNode* _ht, uint64_t _mask);
+	// With _hasStash, the array must have STASH_SIZE more slots after the table (see STASH_SIZE)
+	//
+	void Init(CuckooHashTableNode* _ht, uint64_t _mask, ExternalBitMapPool* _bitmapPool, bool _hasStash = false);
+	
+	// Whether the table is loaded enough that it should be grown before the next insertion
+	//
+	bool NeedsGrow() { return numNodes + 2 > (uint64_t(htMask) + 1) * MAX_LOAD_FACTOR_PERCENT / 100; }
+	
+	// Whether the table is loaded enough that an incremental growth should start (see StartMigration)
+	//
+	bool ShouldStartGrowing() { return numNodes + 2 > (uint64_t(htMask) + 1) * START_GROWTH_LOAD_FACTOR_PERCENT / 100; }
+	
+	// Re-insert every node of this table into newTable (which must be initialized and empty)
+	// This table is left untouched so concurrent readers may keep using it
+	// Returns false if newTable ran out of room, in which case newTable is garbage
+	//
+	bool MigrateTo(CuckooHashTable& newTable, uint32_t generation);
+	
+	// MigrateTo spread over many writer operations: StartMigration(newTable) (initialized and empty), then each
+	// MigrateStep copies the nodes of the next numSlots slots into newTable. In between, the writer keeps modifying
+	// this table, which stays the one readers use, and must call SyncMigratedNode on every node it modified
+	// (or removed) before the next step. Nodes moved by Cuckoo displacement are synced by MigrateStep itself
+	// newTable holds a copy of exactly the nodes of this table once MigrationDone, and may then be published
+	// after FinishMigration. If newTable ran out of room (MigrationFailed), AbortMigration must be called instead
+	//
+	void StartMigration(CuckooHashTable& newTable);
+	void MigrateStep(uint64_t numSlots, uint32_t generation);
+	void SyncMigratedNode(int ilen, uint64_t key, uint32_t generation);
+	bool IsMigrating() const { return migrationTarget != nullptr; }
+	bool MigrationDone() const { return migrationCursor >= NumSlots() && movedDuringMigration.empty(); }
+	bool MigrationFailed() const { return migrationFailed; }
+	void FinishMigration();
+	// Free the external bitmaps created for newTable, which must not have been published
+	//
+	void AbortMigration();
+	
+	// Publish a new table array and mask to readers, along with the lengths of the nodes in its stash (see stashIlenMask)
+	// The caller is responsible for retiring the old array once readers drained
+	//
+	void SwapTable(CuckooHashTableNode* _ht, uint64_t _mask, uint32_t _stashIlenMask);
+	
+	// Whether the table has been (or is being) swapped since a reader observed resizeSeq == seq
+	//
+	bool ResizedSince(uint32_t seq) { return (seq & 1) || resizeSeq.load() != seq; }
 	
 	// Execute Cuckoo displacements to make up a slot for the specified key
+	// If no slot can be made, failed is set and the table is left unmodified, the caller may grow the table and retry
 	//
-	uint32_t ReservePositionForInsert(int ilen, uint64_t dkey, uint32_t hash18bit, bool& exist, bool& failed, uint32_t generation);
+	HtPosition ReservePositionForInsert(int ilen, uint64_t dkey, uint32_t hash18bit, bool& exist, bool& failed, uint32_t generation);
 	
 	// Insert a node into the hash table
 	// Since we use path-compression, if the node is not a leaf, it must has at least one child already known
 	// In case it is a leaf, firstChild should be -1
 	//
-	uint32_t Insert(int ilen, int dlen, uint64_t dkey, int firstChild, bool& exist, bool& failed, uint32_t generation);
+	HtPosition Insert(int ilen, int dlen, uint64_t dkey, int firstChild, bool& exist, bool& failed, uint32_t generation);
+	
+	// The first slot of the first (which == 0) or second Cuckoo bucket of the node for the first ilen bytes of key
+	//
+	HtPosition BucketPosition(int which, int ilen, uint64_t key);
+	
+	// Insert a node into a free slot of its first (which == 0) or second bucket without any displacement,
+	// returns the slot, or -1 if the bucket is full. The node must not be in the table yet
+	// Threads may insert at the same time as long as they never write to the same block of 8 slots,
+	// and numNodes is left to the caller (used by the placement passes of MlpSet::ParallelBulkLoad)
+	//
+	HtPosition InsertIntoBucket(int which, int ilen, int dlen, uint64_t dkey, int firstChild, uint32_t generation);
 
 	// Single point lookup, returns index in hash table if found
 	//
-	uint32_t Lookup(int ilen, uint64_t ikey, bool& found);
+	HtPosition Lookup(int ilen, uint64_t ikey, bool& found);
 
 	// Removes a node from the hash table
 	// Returns true if the node is removed, false if it does not exist
@@ -470,88 +812,526 @@ public:
 	// In case this function returns > 2,
 	//   idxLen will be the index len of the lcp node in hash table (so allPositions1[idxLen - 1] will be the lcp node)
 	//   for i >= idxLen - 1, allPositions1[i] will be the node for prefix i+1 (0 if not exist)
-	//   for 2 <= i < idxLen - 1, allPositions1[i] and allPositions2[i] will be the possible 2 places where the node show up,
-	//   and expectedHash[i] will be its expected hash value.
-	// allPositions1, allPositions2, expectedHash must be buffers at least 32 bytes long. 
+	//   for 2 <= i < idxLen - 1, allPositions1[i] and allPositions2[i] will be the first slots of the 2 buckets where the node may show up
+	//   (see FindInBuckets), and expectedHash[i] will be its expected hash value.
+	// allPositions1, allPositions2, expectedHash must be buffers of at least 8 elements. 
 	//
 	int QueryLCPInternal(uint64_t key, 
                  		 uint32_t& idxLen, 
-                 		 uint32_t* allPositions1, 
-                 		 uint32_t* allPositions2, 
+                 		 HtPosition* allPositions1, 
+                 		 HtPosition* allPositions2, 
                  		 uint32_t* expectedHash,
 				 		 uint32_t generation);
 
+	// QueryLCPInternal split in two stages, so that the lookups of many keys can be interleaved
+	// QueryLCPPrepare computes the hashes and positions of all prefixes of key and prefetches them
+	// QueryLCPResolve then reads the prefetched slots and returns the same as QueryLCPInternal
+	// Between the two stages, the table may only grow (positions computed with an old mask stay in bounds),
+	// and the caller must check ResizedSince to validate the result
+	//
+	void QueryLCPPrepare(uint64_t key, 
+                         HtPosition* allPositions1, 
+                         HtPosition* allPositions2, 
+                         uint32_t* expectedHash);
+	
+	int QueryLCPResolve(uint64_t key, 
+                        uint32_t& idxLen, 
+                        HtPosition* allPositions1, 
+                        HtPosition* allPositions2, 
+                        uint32_t* expectedHash,
+                        uint32_t generation);
+
+	// generation_getter is any callable returning a ReaderGenerationGuard, 
+	// it is called again every time the query has to be retried
+	//
+	template<typename GenerationGetter>
 	int QueryLCP(uint64_t key, 
                  uint32_t& idxLen, 
-                 uint32_t* allPositions1, 
-                 uint32_t* allPositions2, 
+                 HtPosition* allPositions1, 
+                 HtPosition* allPositions2, 
                  uint32_t* expectedHash,
-				 std::function<ReaderGenerationGuard(void)> generation_getter,
+				 const GenerationGetter& generation_getter,
 				 std::atomic<uint32_t>& cur_generation);
 	
 	void ResetGenerations();
+	
+	// The slot holding the node for the first ilen bytes of key, given the two Cuckoo positions of that prefix
+	// (as left by QueryLCPInternal for the ancestors of the lcp node), or -1 if the node is in neither bucket nor the stash
+	// A position may also be any slot of its bucket, such as the lcp node slot QueryLCPInternal returns
+	//
+	HtPosition FindInBuckets(uint64_t key, int ilen, HtPosition pos1, HtPosition pos2)
+	{
+		rep(k, 0, 1)
+		{
+			HtPosition pos = BucketOf(k == 0 ? pos1 : pos2);
+			if (unlikely(pos > htMask))
+			{
+				// a stash slot, searched below
+				//
+				continue;
+			}
+			rep(i, 0, BUCKET_SIZE - 1)
+			{
+				if (ht[pos + i].IsEqualNoHash(key, ilen)) { return pos + i; }
+			}
+		}
+		if (unlikely(stashIlenMask.load(std::memory_order_relaxed) & (1U << ilen)))
+		{
+			// htMask must be loaded before ht, see SwapTable
+			//
+			HtPosition stashStart = htMask.load(std::memory_order_acquire) + 1;
+			CuckooHashTableNode* table = ht.load(std::memory_order_relaxed);
+			rep(i, 0, STASH_SIZE - 1)
+			{
+				if (table[stashStart + i].IsEqualNoHash(key, ilen)) { return stashStart + i; }
+			}
+		}
+		return -1;
+	}
+	
+	// The number of slots which may hold nodes, the stash slots included
+	//
+	uint64_t NumSlots() const { return uint64_t(htMask) + 1 + (hasStash ? STASH_SIZE : 0); }
+	
+	// The largest offset from slot pos at which the node there may keep an internal bitmap (see FindNeighboringEmptySlot)
+	// Bitmaps never take stash slots, which are kept for nodes: nodes at the end of the table don't look past it,
+	// and nodes in the stash only use external bitmaps
+	//
+	int MaxBitmapOffset(HtPosition pos) const
+	{
+		if (!hasStash) { return 3; }
+		if (pos > htMask) { return CuckooHashTableNode::NO_NEIGHBORING_BITMAP; }
+		return int(std::min<uint64_t>(3, uint64_t(htMask) - pos));
+	}
 
 	// hash table array pointer
+	// Readers load htMask (acquire) before ht, and SwapTable stores ht before htMask (release),
+	// so a reader never combines a new larger mask with the old array
 	//
-	CuckooHashTableNode* ht;
+	std::atomic<CuckooHashTableNode*> ht;
 	// hash table mask (always a power of 2 minus 1)
 	//
-	uint32_t htMask;
-#ifdef ENABLE_STATS
-	// statistic info
+	std::atomic<HtPosition> htMask;
+	// number of slots occupied by nodes (not counting internal bitmaps), maintained by the writer
+	//
+	uint64_t numNodes;
+	// seqlock-style counter, odd while ht/htMask are being swapped by a resize
+	// readers must retry if it changed while they were running
+	//
+	std::atomic<uint32_t> resizeSeq;
+	// allocator of the external bitmaps of the nodes, shared with the tables this one migrates to
+	//
+	ExternalBitMapPool* bitmapPool;
+	// whether the array has a stash after the table
+	//
+	bool hasStash;
+	// bit ilen is set while the stash holds a node of index length ilen, it is set when such a node is placed
+	// in the stash, and cleared by Remove once the last one is gone
+	// readers only search the stash for the lengths set here
+	//
+	std::atomic<uint32_t> stashIlenMask;
+	
+	// State of a migration from this table (see StartMigration): the table being filled, nullptr if none,
+	// the next slot to copy (the nodes before it have their copy in migrationTarget), and the nodes Cuckoo
+	// displacement moved since the last step, by index length and key, which may have crossed the cursor
+	//
+	CuckooHashTable* migrationTarget;
+	uint64_t migrationCursor;
+	bool migrationFailed;
+	std::vector<std::pair<int, uint64_t>> movedDuringMigration;
+	// State of a migration into this table: the external bitmaps created for its copies of the nodes, which
+	// (unlike the ones shared with the old table) must be freed with them if the migration is aborted
+	//
+	bool isMigrationTarget;
+	std::unordered_set<uint64_t*> createdBitmaps;
+	
+	// The two Cuckoo positions of a node are the first slots of its two buckets, and it may live in any slot of either.
+	// The slots are laid out in blocks of 8 (192 bytes, 3 cache lines) holding 3 buckets, slots {0,1}, {3,4} and {6,7},
+	// so that each bucket is within a single cache line. Slots 2 and 5 only hold the internal bitmaps of their neighbours.
+	// Two 2-slot buckets per node keep displacements short up to a load of about 90% of the bucket slots
+	//
+	static constexpr int BUCKET_SIZE = 2;
+	// grow the table once more than this percentage of slots hold nodes (the bucket slots are 75% of the table)
+	//
+	static constexpr uint64_t MAX_LOAD_FACTOR_PERCENT = 65;
+	// an incremental growth starts at this load, and copies MIGRATION_SLOTS_PER_STEP slots of the table per writer
+	// operation (see MlpSet::StepHashTableGrowth). An insertion adds at most 2 nodes, so the load goes up by
+	// at most 2 / MIGRATION_SLOTS_PER_STEP (6.25%) until the migration is done, well before MAX_LOAD_FACTOR_PERCENT
+	//
+	static constexpr uint64_t START_GROWTH_LOAD_FACTOR_PERCENT = 50;
+	static constexpr uint64_t MIGRATION_SLOTS_PER_STEP = 32;
+	// the table never grows beyond this many slots, limited by the width of HtPosition
+	// (-1 must stay an invalid position) and by the number of hash bits we have (see BucketHashMask)
 	//
-	Stats stats;
+#ifdef MLP_LARGE_CAPACITY
+	static constexpr uint64_t MAX_TABLE_SIZE = 1ULL << 37;
+#else
+	static constexpr uint64_t MAX_TABLE_SIZE = 1ULL << 30;
 #endif
 
+	// The stash holds the rare nodes for which Cuckoo displacement found no slot, so the table does not have to grow
+	// for them. It is the STASH_SIZE slots right after the table (positions htMask + 1 onwards), followed by
+	// gap slots like the table itself, and is searched only when a node is in none of its buckets and its length is
+	// set in stashIlenMask. Internal bitmaps never take stash slots (see MaxBitmapOffset)
+	//
+	static constexpr int STASH_SIZE = 8;
+	
+	// Cuckoo displacement looks for the shortest path of moves ending at a free slot, giving up on paths
+	// longer than MAX_DISPLACEMENT_PATH_LEN nodes or once MAX_DISPLACEMENT_QUEUE slots have been visited
+	//
+	static constexpr int MAX_DISPLACEMENT_PATH_LEN = 12;
+	static constexpr int MAX_DISPLACEMENT_QUEUE = 4096;
+	
+	// The first slot of the bucket holding slot pos
+	//
+	static HtPosition BucketOf(HtPosition pos)
+	{
+		return pos - HtPosition((pos & 7) % 3 == 1);
+	}
+	// runtime instrumentation, the MlpSet owning the table counts its own events here as well
+	//
+	StatsRecorder stats;
+
 private:
-	void HashTableCuckooDisplacement(uint32_t victimPosition, int rounds, bool& failed, uint32_t generation);
+	// Free one of the 2 * BUCKET_SIZE occupied slots in candidates by moving nodes to their other bucket
+	// Returns the freed slot, or -1 if there is no short enough path, in which case nothing has been moved
+	//
+	HtPosition HashTableCuckooDisplacement(const HtPosition* candidates, uint32_t generation);
+	// Move the internal bitmap at pos to another slot (or out of the table)
+	//
+	void RelocateBitmapAt(HtPosition pos);
+	
+	// Copy the node at pos into migrationTarget, setting migrationFailed if it has no room left
+	//
+	void CopyToMigrationTarget(HtPosition pos, uint32_t generation);
+	// Remove the copy of a node made by a migration into this table (if any), along with its bitmap
+	//
+	void RemoveMigratedNode(int ilen, uint64_t key, uint32_t generation);
+	// Remember the external bitmap of the node at pos if it was just created for this table by a migration into it
+	// (its bitmap was in a neighboring slot before the node was copied, moved, or had its bitmap relocated)
+	//
+	void NoteCreatedBitmap(HtPosition pos, bool hadNeighboringBitMap)
+	{
+		if (unlikely(isMigrationTarget) && hadNeighboringBitMap && ht[pos].IsExternalPointerBitMap())
+		{
+			createdBitmaps.insert(reinterpret_cast<uint64_t*>(ht[pos].childMap.load()));
+		}
+	}
+	
+	// The stash slots (starting at stashStart, see QueryLCPResolve) whose hash matches expectedHash, as a bitmask
+	//
+	uint32_t MatchStashHashes(HtPosition stashStart, uint32_t expectedHash);
+	// The stash slot holding the node, or -1
+	//
+	HtPosition FindInStash(uint32_t expectedHash, int shiftLen, uint64_t shiftedKey);
+	
+	// Whether a node in the stash was modified after the reader's generation
+	//
+	bool StashModifiedAfter(HtPosition stashStart, uint32_t generation)
+	{
+		rep(i, 0, STASH_SIZE - 1)
+		{
+			if (ht[stashStart + i].GetOccupyFlag() == 2 && ht[stashStart + i].LoadGeneration() > generation)
+			{
+				return true;
+			}
+		}
+		return false;
+	}
+	
+	// Prefetch the bucket starting at pos, which is a single cache line
+	//
+	void PrefetchBucket(HtPosition pos)
+	{
+		MEM_PREFETCH(ht[pos]);
+	}
+	
+	// Whether a node in either bucket was modified after the reader's generation
+	// (the generation field of a slot holding an internal bitmap is part of the bitmap)
+	//
+	bool BucketsModifiedAfter(HtPosition pos1, HtPosition pos2, uint32_t generation)
+	{
+		rep(i, 0, BUCKET_SIZE - 1)
+		{
+			if ((ht[pos1 + i].GetOccupyFlag() == 2 && ht[pos1 + i].LoadGeneration() > generation) || 
+			    (ht[pos2 + i].GetOccupyFlag() == 2 && ht[pos2 + i].LoadGeneration() > generation))
+			{
+				return true;
+			}
+		}
+		return false;
+	}
 	
 #ifndef NDEBUG
 	bool m_hasCalledInit;
 #endif
 };
 
+template<typename GenerationGetter>
+inline int CuckooHashTable::QueryLCP(uint64_t key, 
+                                     uint32_t& idxLen, 
+                                     HtPosition* allPositions1, 
+                                     HtPosition* allPositions2, 
+                                     uint32_t* expectedHash,
+                                     const GenerationGetter& generation_getter,
+                                     std::atomic<uint32_t>& cur_generation)
+{
+	while (true)
+	{
+		ReaderGenerationGuard generation_guard = generation_getter();
+		uint32_t generation = generation_guard.generation();
+		// LockGuard lock(&displacement_mutex, true);
+		int ret = QueryLCPInternal(key, idxLen, allPositions1, allPositions2, expectedHash, generation);
+		if (generation > cur_generation.load() || ResizedSince(generation_guard.resizeSeq())) {
+			// this implies that the generation was reset or the table was swapped, so we need to retry.
+			continue;
+		}
+		if (ret >= 0)
+		{
+			return ret;
+		}
+	}
+}
+
 // Removed global empty_promise to fix race condition - now use local construction
 
+class InterleavedLookupEngine;
+
+// Every thread reading from an MlpSet is assigned a reader slot index on its first query.
+// The index is returned when the thread exits, and may then be reused by a new thread.
+// Indexes are shared by all sets: each set holds one reader generation per index
+// Once all MAX_READER_SLOTS indexes are taken, further threads all get OVERFLOW_SLOT for their lifetime,
+// which the sets back with a single shared, atomically counted reader generation
+//
+class ReaderSlotRegistry
+{
+public:
+	static constexpr uint32_t MAX_READER_SLOTS = 1024;
+	static constexpr uint32_t OVERFLOW_SLOT = MAX_READER_SLOTS;
+	
+	static uint32_t ALWAYS_INLINE CurrentThreadSlot()
+	{
+		if (unlikely(t_slot == INVALID_SLOT))
+		{
+			AcquireSlot();
+		}
+		return t_slot;
+	}
+	
+	// All the slots in use are below this index, apart from OVERFLOW_SLOT
+	//
+	static uint32_t NumSlotsInUse() { return s_numSlotsInUse.load(); }
+
+private:
+	static constexpr uint32_t INVALID_SLOT = UINT32_MAX;
+	
+	static void AcquireSlot();
+	static void ReleaseSlot();
+	
+	// returns the slot of the current thread when destroyed at thread exit
+	//
+	struct ThreadSlotOwner
+	{
+		~ThreadSlotOwner() { ReleaseSlot(); }
+	};
+	
+	static inline thread_local uint32_t t_slot = INVALID_SLOT;
+	static std::atomic<uint32_t> s_numSlotsInUse;
+};
+
+inline MlpStats* ALWAYS_INLINE StatsRecorder::ThreadCounters(bool& shared)
+{
+	Shard* shards = m_active.load(std::memory_order_relaxed);
+	if (likely(shards == nullptr))
+	{
+		return nullptr;
+	}
+	uint32_t slot = ReaderSlotRegistry::CurrentThreadSlot();
+	shared = (slot == ReaderSlotRegistry::OVERFLOW_SLOT);
+	return &shards[slot].counters;
+}
+
+inline void ALWAYS_INLINE StatsRecorder::Count(uint64_t MlpStats::*counter)
+{
+	bool shared;
+	MlpStats* counters = ThreadCounters(shared);
+	if (unlikely(counters != nullptr))
+	{
+		Increment(counters->*counter, shared);
+	}
+}
+
+template<size_t N>
+inline void ALWAYS_INLINE StatsRecorder::Count(uint64_t (MlpStats::*histogram)[N], size_t bucket)
+{
+	bool shared;
+	MlpStats* counters = ThreadCounters(shared);
+	if (unlikely(counters != nullptr))
+	{
+		assert(bucket < N);
+		Increment((counters->*histogram)[bucket], shared);
+	}
+}
+
 class MlpSet
 {
+	// the interleaved lookup engine drives the stages of the lookups directly
+	//
+	friend class InterleavedLookupEngine;
 
 public:
 // Single writer implies no need for atomic operation. On the other hand using atomic we,
 // can reduce amount of times we see an old generation which may cause more restarts, might be worth to try both atomic and non-atomic
 std::atomic<uint32_t> cur_generation;
 
-#ifdef ENABLE_STATS
-	struct Stats
-	{
-		uint32_t m_lowerBoundParentPathStepsHistogram[8];
-
-		// amount of pending de-allocations which weren't freed immediately
-		// counted for every call to remove
-		uint64_t m_numbersOfPendingDeallocationPostponed;
-		Stats();
-		void ClearStats();
-		void ReportStats();
-	};
-	Stats stats;
-#endif
 
 	typedef CuckooHashTable::LookupMustExistPromise Promise;
 	
 	MlpSet();
 	~MlpSet();
 	
-	// Initialize the set to hold at most maxSetSize elements
+	// Initialize the set to initially hold maxSetSize elements
+	// The hash table is grown online if more elements are inserted
+	// memoryPolicy controls the pages backing the top level bitmaps and the hash table (including the grown tables)
+	//
+	void Init(uint32_t maxSetSize, const MemoryPolicy& memoryPolicy = MemoryPolicy());
+	
+	// Backing actually used for the top level bitmaps, which may differ from the requested one
+	// if the system couldn't provide it
+	//
+	MemoryBacking GetMemoryBacking() const { return m_memoryBacking; }
+	// Whether the kernel accepted the requested NUMA policy for the top level bitmaps
+	// (always true with NumaPolicy::DEFAULT)
 	//
-	void Init(uint32_t maxSetSize);
+	bool IsNumaPolicyApplied() const { return m_numaPolicyApplied; }
+	
+	// Write an image of the set to path, which can later be opened with OpenMapped
+	// External bitmaps are relocated into the image, so it is self contained
+	// Must not run concurrently with writers (readers are fine). Returns false on I/O error
+	// For MlpRangeTree, the leaf data pointers are written as is
+	//
+	bool SaveTo(const char* path);
+	
+	// Initialize the set by mapping an image written by SaveTo (call instead of Init)
+	// Nothing is rebuilt: queries run directly against the read-only, copy-on-write mapping,
+	// so processes opening the same image share its pages through the page cache
+	// The set is read-only, Insert and Remove must not be called
+	// Returns false if the file can't be mapped or isn't an image from a compatible build
+	//
+	bool OpenMapped(const char* path);
 	
 	// Insert an element, returns true if the insertion took place, false if the element already exists
+	// Insert and Remove must only be called by one writer thread at a time, concurrently with any number of readers.
+	// For several writer threads use ShardedMlpSet (MlpSetUInt64Sharded.h), whose shards each have their own writer
 	//
 	bool Insert(uint64_t value, uint32_t generation = UINT32_MAX);
 
 	// Removes an element, returns true if the removal took place, false if the element doesn't exists
 	bool Remove(uint64_t value, uint32_t generation = UINT32_MAX);
 	
+	// Populate an empty set with n distinct keys sorted in increasing order
+	// The path-compressed trie is computed in one pass over the keys and each node is placed into the hash table
+	// once with its final child map, instead of going through the splits, child map extensions and LCP queries of n Inserts
+	// The hash table is grown up front to fit the keys. Must not run concurrently with any other operation on the set
+	//
+	void BulkLoad(const uint64_t* sortedKeys, size_t n);
+	
+	// Populate an empty set with n keys in any order (duplicates are allowed) using numThreads worker threads
+	// The keys are partitioned by their top byte (the 256 subtrees of the root), then the workers sort the
+	// partitions and compute their trie nodes. The workers then place the nodes into the hash table, each owning
+	// a slice of the table: every node goes into a free slot of its first bucket, else of its second bucket.
+	// The calling thread inserts the few nodes left (which need Cuckoo displacement) and the nodes needing a bitmap
+	// Must not run concurrently with any other operation on the set
+	//
+	void ParallelBulkLoad(const uint64_t* keys, size_t n, int numThreads);
+	
+	enum class ReclamationMode
+	{
+		// the writer reclaims memory itself after a Remove (default)
+		//
+		INLINE,
+		// memory is only reclaimed by explicit calls to Reclaim()
+		//
+		MANUAL,
+		// a background thread reclaims memory
+		//
+		BACKGROUND
+	};
+	
+	// Configure how memory unlinked by the writer is reclaimed, must be called after Init and before any write
+	// Reclamation starts once the backlog reaches highWatermark buffers. In BACKGROUND mode the reclamation 
+	// thread then keeps retrying (as readers finish) until the backlog is down to lowWatermark buffers
+	//
+	void ConfigureReclamation(ReclamationMode mode, size_t lowWatermark, size_t highWatermark);
+	
+	// Free all the buffers no reader can access anymore, returns the number of buffers freed
+	// May be called from any thread, concurrently with the writer and readers
+	//
+	size_t Reclaim();
+	
+	// Number of buffers unlinked by the writer and not freed yet
+	//
+	size_t GetReclamationBacklog() const { return m_reclamationBacklog.load(); }
+
+	struct MemoryStats
+	{
+		// the flat bitmaps of the top 3 levels
+		//
+		uint64_t topLevelBitmapBytes;
+		// the part of them backed by physical pages: they are mapped untouched, and a set holding
+		// a narrow key range (such as a shard of ShardedMlpSet) only ever writes a small part of them
+		//
+		uint64_t topLevelBitmapResidentBytes;
+		// the current hash table array, including its stash and the gap slots on both ends,
+		// and the array of the table being filled by an incremental growth, if any
+		//
+		uint64_t hashTableBytes;
+		// chunks obtained from the system by the external bitmap pool (bitmaps in use and recycled ones)
+		//
+		uint64_t externalBitmapPoolBytes;
+		// the image mapped by OpenMapped, which holds all of the above (they are 0 then)
+		//
+		uint64_t mappedImageBytes;
+		// the per-reader generations, allocated as threads first read from the set
+		//
+		uint64_t readerGenerationBytes;
+
+		uint64_t hashTableSlots;
+		// slots holding nodes over hashTableSlots, the table grows past MAX_LOAD_FACTOR
+		//
+		double loadFactor;
+		static constexpr double MAX_LOAD_FACTOR = CuckooHashTable::MAX_LOAD_FACTOR_PERCENT / 100.0;
+
+		uint64_t numLeaves;
+		uint64_t numInnerNodes;
+		// the inner nodes by child map kind, with the bytes their child maps take outside of the node itself:
+		// a child list is stored in the node, an internal bitmap takes a neighbouring hash table slot,
+		// a pointer bitmap is allocated from the external bitmap pool
+		//
+		uint64_t numInternalMapNodes;
+		uint64_t numInternalBitmapNodes;
+		uint64_t internalBitmapBytes;
+		uint64_t numPointerBitmapNodes;
+		uint64_t pointerBitmapBytes;
+		// nodes (of any kind above) held in the overflow stash after the table
+		//
+		uint64_t numStashedNodes;
+
+		// buffers unlinked by the writer and not freed yet (see GetReclamationBacklog)
+		//
+		uint64_t pendingDeallocations;
+
+		uint64_t TotalBytes() const
+		{
+			return topLevelBitmapBytes + hashTableBytes + externalBitmapPoolBytes + mappedImageBytes + readerGenerationBytes;
+		}
+	};
+
+	// Memory usage and hash table occupancy of the set
+	// Walks the whole hash table, so it must not run concurrently with writers (readers are fine)
+	//
+	MemoryStats GetMemoryStats();
+
 	// Returns whether the specified value exists in the set
 	//
 	bool Exist(uint64_t value);
@@ -566,6 +1346,67 @@ std::atomic<uint32_t> cur_generation;
 	// The promise can be resolved via Promise.Resolve() to get the lower_bound
 	//
 	MlpSet::Promise LowerBound(uint64_t value);
+	
+	// Returns the maximum value less or equal to the specified value
+	// set `found` to false and return 0 if specified value is smaller than all values in set
+	//
+	uint64_t Predecessor(uint64_t value, bool& found);
+	
+	// Returns the minimum value strictly greater than the specified value
+	// set `found` to false and return -1 if no value in set is larger than the specified value
+	//
+	uint64_t UpperBound(uint64_t value, bool& found);
+	
+	// Batched versions of Exist and LowerBound, the results for keys[i] are written to out[i] (and found[i])
+	// The hash table lookups of consecutive keys are software-pipelined: the slots of the key 
+	// BATCH_PREFETCH_DISTANCE positions ahead are prefetched while the current key is resolved,
+	// so that many more memory accesses are in flight than with one key at a time
+	//
+	void ExistBatch(const uint64_t* keys, size_t n, bool* out);
+	void LowerBoundBatch(const uint64_t* keys, size_t n, uint64_t* out, bool* found);
+	
+	// how many keys ahead the batched queries prefetch
+	//
+	static constexpr size_t BATCH_PREFETCH_DISTANCE = 16;
+	// how many keys the batched queries process under a single reader generation
+	//
+	static constexpr size_t BATCH_CHUNK_SIZE = 256;
+	
+	// Write the keys in [lo, hi] in increasing order to out, at most maxKeys of them
+	// Returns the number of keys written, if it is maxKeys the scan can be continued from out[maxKeys - 1] + 1
+	// Rather than a LowerBound query per key, the leaves are visited by walking the children of their parent,
+	// with the slots of the next SCAN_PREFETCH_DISTANCE siblings prefetched ahead of the one being visited
+	//
+	size_t ScanRange(uint64_t lo, uint64_t hi, uint64_t* out, size_t maxKeys);
+	
+	// Call cb(key) for every key in [lo, hi] in increasing order
+	// The keys are collected SCAN_CHUNK_SIZE at a time under a reader generation, cb is called outside of it
+	//
+	template<typename Func>
+	void ScanRange(uint64_t lo, uint64_t hi, Func cb)
+	{
+		uint64_t keys[SCAN_CHUNK_SIZE];
+		while (lo <= hi)
+		{
+			size_t n = ScanRange(lo, hi, keys, SCAN_CHUNK_SIZE);
+			for (size_t i = 0; i < n; i++)
+			{
+				cb(keys[i]);
+			}
+			if (n < SCAN_CHUNK_SIZE || keys[n - 1] == hi)
+			{
+				break;
+			}
+			lo = keys[n - 1] + 1;
+		}
+	}
+	
+	// how many siblings ahead ScanRange prefetches
+	//
+	static constexpr size_t SCAN_PREFETCH_DISTANCE = 8;
+	// how many keys ScanRange(lo, hi, cb) collects under a single reader generation
+	//
+	static constexpr size_t SCAN_CHUNK_SIZE = 256;
 
 	uint64_t WriterLowerBound(uint64_t value, bool& found);
 
@@ -577,56 +1418,213 @@ std::atomic<uint32_t> cur_generation;
 	std::atomic<uint64_t>* GetLv1Ptr() { return m_treeDepth1; }
 	std::atomic<uint64_t>* GetLv2Ptr() { return m_treeDepth2; }
 	CuckooHashTable* GetHtPtr() { return &m_hashTable; }
+	const ExternalBitMapPool& GetExternalBitMapPool() const { return m_bitmapPool; }
 	
-#ifdef ENABLE_STATS
-	void ClearStats();
-	void ReportStats();
-#endif
+	// Runtime instrumentation of the operations of all threads on this set (see MlpStats), off by default
+	// EnableStats and DisableStats must not be called concurrently with each other
+	//
+	void EnableStats() { m_hashTable.stats.Enable(); }
+	void DisableStats() { m_hashTable.stats.Disable(); }
+	MlpStats GetStats() const { return m_hashTable.stats.GetTotals(); }
+	void ClearStats() { m_hashTable.stats.Clear(); }
+	void ReportStats() const { GetStats().Report(); }
 
 protected:
+	// default reclamation high watermark
+	//
 	static constexpr size_t PENDING_ALLOCATIONS_CLEAR_BUFFER = 10;
 
 	static constexpr size_t CACHE_LINE_SIZE = 64;
 
-	struct PerCpuInteger {
+	struct PerReaderInteger {
 		std::atomic<uint32_t> value;
 		char padding[CACHE_LINE_SIZE - sizeof(std::atomic<uint32_t>)];
 	};
 
+	static constexpr std::chrono::milliseconds RECLAMATION_RETRY_INTERVAL = std::chrono::milliseconds(1);
+
+	// called as deleter(context, ptr)
+	//
+	using Deleter = void (*)(void*, void*);
+
 	struct AwaitingDeallocation {
 		void* ptr;
+		Deleter deleter;
+		void* context;
 		uint32_t generation;
-		AwaitingDeallocation(void* buffer, uint32_t current_generation):
-			ptr(buffer), generation(current_generation) {}
+		// next (older) entry in the writer's queue
+		//
+		AwaitingDeallocation* next;
+		AwaitingDeallocation(void* buffer, Deleter buffer_deleter, void* deleter_context, uint32_t current_generation):
+			ptr(buffer), deleter(buffer_deleter), context(deleter_context), generation(current_generation), next(nullptr) {}
 	};
 
 	MlpSet::Promise LowerBoundInternal(uint64_t value, bool& found, uint32_t generation);
+	
+	// Predecessor under the given reader generation (UINT32_MAX for the writer)
+	// Returns false if it raced with the writer, in which case found and result are meaningless
+	//
+	bool PredecessorInternal(uint64_t value, bool& found, uint64_t& result, uint32_t generation);
+	
+	// Maximum key in the subtree of node, found by following the largest children down to the leaf
+	// Returns false if node is nullptr or it raced with the writer
+	//
+	bool SubtreeMax(CuckooHashTableNode* node, uint64_t& result, uint32_t generation);
+	
+	// LowerBoundInternal split in two stages, see CuckooHashTable::QueryLCPPrepare
+	//
+	void LowerBoundPrepare(uint64_t value, HtPosition* allPositions1, HtPosition* allPositions2, uint32_t* expectedHash);
+	MlpSet::Promise LowerBoundResolve(uint64_t value, 
+	                                  bool& found, 
+	                                  uint32_t generation, 
+	                                  HtPosition* allPositions1, 
+	                                  HtPosition* allPositions2, 
+	                                  uint32_t* expectedHash);
+
+	// Clear the m_treeDepth2 bit of a 24-bit prefix, and the m_treeDepth1 and m_root bits above it
+	// if no other prefix is left under them
+	//
+	void ClearTopLevelBits(uint64_t h24bits);
+	
+	// Set the m_treeDepth2 bit of a 24-bit prefix, and the m_treeDepth1 and m_root bits above it
+	//
+	void SetTopLevelBits(uint64_t h24bits);
 
-	void ClearRootCache(uint64_t value, std::optional<uint64_t> successor);
-
-	void ClearL1Cache(uint64_t value, std::optional<uint64_t> successor);
-
-	void ClearL2Cache(uint64_t value, std::optional<uint64_t> successor);
-
-	std::optional<uint64_t> ClearLowLevelCaches(uint64_t value);
+	// Clear the flat bitmap bits only value occupies, before its leaf is removed. ilen and allPositions come
+	// from QueryLCP on value, this only looks at the nodes on that path (no LowerBound queries)
+	// Returns the successor RemoveLeaf needs, which is omitted if no surviving node has value as its minKey
+	//
+	std::optional<uint64_t> ClearLowLevelCaches(uint64_t value, uint32_t ilen, const HtPosition* allPositions1, const HtPosition* allPositions2);
+	
+	// Remove the leaf of value from the hash table and update its parent path (the part of Remove after
+	// the flat bitmaps are cleared). ilen and allPositions come from QueryLCP on value, successor is the smallest
+	// key greater than value left in the set, if any (only needed if value is the minKey of a surviving node)
+	//
+	void RemoveLeaf(uint64_t value, uint32_t ilen, const HtPosition* allPositions1, const HtPosition* allPositions2,
+	                std::optional<uint64_t> successor, uint32_t generation);
+	
+	// Remove n existing keys sorted in increasing order, all under the given writer generation
+	// No other key of the set may lie between them, successor is the smallest key of the set greater than all of them, if any
+	// The flat bitmaps are cleared once per affected prefix instead of once per key
+	//
+	void RemoveSortedKeys(const uint64_t* keys, size_t n, std::optional<uint64_t> successor, uint32_t generation);
 
 	// must be called for every method that modifies the DS
 	uint32_t IncrementGeneration();
 
 	ReaderGenerationGuard ReaderGeneration();
+	// ReaderGeneration for the threads beyond ReaderSlotRegistry::MAX_READER_SLOTS
+	//
+	ReaderGenerationGuard SharedReaderGeneration();
 
-	void ResetReaderGeneration(int cpu);
-
-	void AddDeallocation(void* ptr);
+	// Defer deleter(context, ptr) until no reader can access ptr anymore
+	// Only pushes to the lock-free reclamation queue, never frees memory by itself
+	//
+	void AddDeallocation(void* ptr, Deleter deleter, void* context);
 
+	// Called by the writer after a Remove, reclaims memory if configured to do so
+	//
 	void DeallocatePending();
 	
-	// we mmap memory all at once, hold the pointer to the memory chunk
-	// TODO: this needs to changed after we support hash table resizing 
+	void ReclamationThreadMain();
+	
+	// Stop the reclamation thread if it's running
+	//
+	void StopReclamationThread();
+	
+	// The generation of the reader in slot, allocating its chunk on first use
+	//
+	std::atomic<uint32_t>& ReaderGenerationOfSlot(uint32_t slot);
+	PerReaderInteger* AllocateReaderGenerationChunk(uint32_t chunk);
+	
+	// Layout of a hash table allocation of htSize slots: the offset of slot 0 and the total size
+	//
+	static void GetHashTableMemoryLayout(uint64_t htSize, uint64_t& gap /*out*/, uint64_t& size /*out*/);
+	
+	// Allocate a zeroed hash table array of htSize slots, with a gap of 6 slots on both ends, following m_memoryPolicy
+	// Returns the start of the allocation (to be passed to FreeHashTableMemory), ht is set to slot 0
+	//
+	void* AllocateHashTableMemory(uint64_t htSize, CuckooHashTableNode*& ht);
+	
+	// Deleter of hash table arrays for AddDeallocation
+	//
+	static void FreeHashTableMemory(void* context, void* ptr);
+	
+	// Migrate the hash table into one twice as large (or at least minTableSize slots), readers are not blocked
+	// An incremental growth in progress is completed first, which is all it takes unless minTableSize asks for more
+	// The old array is kept alive until no reader can be using it anymore
+	//
+	void GrowHashTable(uint32_t generation, uint64_t minTableSize = 0);
+	
+	// Incremental growth, so that no single insertion pays for migrating the whole table: once the table is
+	// loaded enough, a table twice as large is filled a few slots per Insert and Remove (see MIGRATION_SLOTS_PER_STEP)
+	// while readers and the writer keep using the current one, and it is published once it holds every node
+	// Called after the writer modified the nodes on the path of key, which are brought up to date in the new table first
+	//
+	void StepHashTableGrowth(uint64_t key, uint32_t generation);
+	
+	// Bring the copies of the nodes on the path of key up to date in the table being grown, if any
+	//
+	void SyncGrowingHashTable(uint64_t key, uint32_t generation);
+	
+	// Copy what is left of the table being grown and publish it
+	// Returns false if it ran out of room, in which case it is dropped and the current table is left as it is
+	//
+	bool FinishHashTableGrowth(uint32_t generation);
+	
+	// Progress of a ScanRange attempt
+	//
+	struct ScanState;
+	
+	// Emit the keys of the subtree of node to the scan, only the ones >= the scan's lo if bounded
+	//
+	void ScanSubtree(CuckooHashTableNode* node, bool bounded, ScanState& st);
+	
+	// Move h24bits to the smallest 24-bit prefix >= h24bits with its m_treeDepth2 bit set
+	// Returns false if there is none
+	//
+	bool NextTopLevelPrefix(uint64_t& h24bits);
+	
+	// Trie nodes computed from sorted keys by the bulk loads, to be placed into the hash table
+	//
+	struct BulkLoadPartition;
+	
+	// Grow the hash table so that a bulk load of n keys never has to grow it
+	//
+	void GrowHashTableForBulkLoad(size_t n, uint32_t generation);
+	
+	// Place the nodes of a partition and make them visible through the flat bitmaps
+	//
+	void PlaceBulkLoadPartition(const BulkLoadPartition& partition, uint32_t generation);
+	
+	// Insert the node at index in partition.nodes with all its children, growing the table if needed
+	//
+	void PlaceBulkLoadNode(const BulkLoadPartition& partition, size_t index, uint32_t generation);
+	
+	// memory chunk holding the flat bitmaps for the top 3 levels of the tree
 	//
 	void* m_memoryPtr;
 	uint64_t m_allocatedSize;
-	
+	MemoryBacking m_memoryBacking;
+	bool m_numaPolicyApplied;
+	// requested policy, also used for the tables allocated when the hash table grows
+	//
+	MemoryPolicy m_memoryPolicy;
+	// memory chunk holding the current hash table array, replaced when the table grows
+	//
+	void* m_hashTableMemoryPtr;
+	// the table being filled by an incremental growth (see StepHashTableGrowth) and its memory chunk, nullptr if none
+	//
+	std::unique_ptr<CuckooHashTable> m_growingTable;
+	void* m_growingTableMemoryPtr;
+	// whether the hash table grows incrementally, otherwise it is migrated at once when it is full
+	// MlpRangeTree edits its leaves in place behind Insert's back, so their copies could not be kept up to date
+	//
+	bool m_incrementalGrowth;
+	// image mapped by OpenMapped, holding both chunks above (nullptr if the set was built by Init)
+	//
+	void* m_mappedImage;
+	uint64_t m_mappedImageSize;
 	// flat bitmap mapping parts of the tree
 	// root and depth 1 should be in L1 or L2 cache
 	// root of the tree, length 256 bits (32B)
@@ -641,11 +1639,37 @@ protected:
 	// hash mapping parts of the tree, starting at lv3
 	//
 	CuckooHashTable m_hashTable;
+	// external bitmaps of all the hash tables (current and retired)
+	//
+	ExternalBitMapPool m_bitmapPool;
 
-	std::vector<char> m_readerGenerationsBuffer;
-	PerCpuInteger* m_readerGenerations;
+	// The generations of the readers by ReaderSlotRegistry slot, in chunks of READER_GENERATION_CHUNK_SIZE
+	// allocated by the first reader with a slot in the chunk, so a set read by a few threads only holds a few of them
+	//
+	static constexpr uint32_t READER_GENERATION_CHUNK_SIZE = 64;
+	static constexpr uint32_t NUM_READER_GENERATION_CHUNKS = ReaderSlotRegistry::MAX_READER_SLOTS / READER_GENERATION_CHUNK_SIZE;
+	std::atomic<PerReaderInteger*> m_readerGenerationChunks[NUM_READER_GENERATION_CHUNKS];
+	// the shared reader slot of the threads with ReaderSlotRegistry::OVERFLOW_SLOT, see ReaderGenerationGuard
+	//
+	alignas(CACHE_LINE_SIZE) std::atomic<uint64_t> m_sharedReaderGeneration;
+	char m_sharedReaderGenerationPadding[CACHE_LINE_SIZE - sizeof(std::atomic<uint64_t>)];
 
-	std::vector<AwaitingDeallocation> m_awaitingDeallocations;
+	// Entries pushed by the writer, newest first
+	//
+	std::atomic<AwaitingDeallocation*> m_deallocationQueue;
+	// Entries taken from the queue by Reclaim, in generation order, protected by m_reclamationMutex
+	//
+	std::vector<AwaitingDeallocation*> m_awaitingDeallocations;
+	std::mutex m_reclamationMutex;
+	std::atomic<size_t> m_reclamationBacklog;
+	
+	ReclamationMode m_reclamationMode;
+	size_t m_reclamationLowWatermark;
+	size_t m_reclamationHighWatermark;
+	std::thread m_reclamationThread;
+	std::mutex m_reclamationThreadMutex;
+	std::condition_variable m_reclamationThreadCv;
+	std::atomic<bool> m_stopReclamationThread;
 	
 #ifndef NDEBUG
 	bool m_hasCalledInit;
@@ -1,5 +1,6 @@
 #include "common.h"
 #include "MlpSetUInt64.h"
+#include "MlpSetUInt64Sharded.h"
 
 #include "gtest/gtest.h"
 
@@ -7,6 +8,7 @@
 #include <atomic>
 #include <vector>
 #include <random>
+#include <algorithm>
 #include <cstdio>
 #include <chrono>
 #include <unordered_set>
@@ -158,6 +160,570 @@ TEST(MlpSetUInt64, ConcurrentInsertAndQueriesFixedThreads)
     printf("Total reader queries found: %llu\n", (unsigned long long)total);
 }
 
+// Concurrency test: the set is initialized with a tiny capacity so the writer has to grow
+// the hash table many times, while readers keep querying keys that are known to be inserted.
+// Contract: exactly one writer; multiple concurrent readers allowed.
+TEST(MlpSetUInt64, ConcurrentQueriesDuringHashTableGrowth)
+{
+    const int kTotalThreads = 4;
+    const uint64_t kNumInserts = 1 << 20;
+
+    MlpSetUInt64::MlpSet ms;
+    ms.Init(4096);
+
+    // Spread the keys so that most of them end up in the hash table rather than the top levels
+    auto keyOf = [](uint64_t i) { return i * 0x9E3779B97F4A7C15ULL; };
+
+    std::atomic<uint64_t> insertedCount{0};
+    std::atomic<bool> stopReaders{false};
+
+    std::thread writer([&]() {
+        for (uint64_t i = 0; i < kNumInserts; i++)
+        {
+            ReleaseAssert(ms.Insert(keyOf(i)));
+            insertedCount.store(i + 1);
+        }
+        stopReaders.store(true);
+    });
+    SetThreadAffinity(writer, 0);
+
+    std::vector<std::thread> readers;
+    std::vector<uint64_t> readerCounts(kTotalThreads - 1, 0);
+    for (int t = 0; t < kTotalThreads - 1; t++)
+    {
+        readers.emplace_back([&, t]() {
+            std::mt19937_64 rng(static_cast<uint64_t>(t) + 987654321ULL);
+            uint64_t localCount = 0;
+            while (!stopReaders.load())
+            {
+                uint64_t c = insertedCount.load();
+                if (c == 0) { continue; }
+
+                uint64_t key = keyOf(rng() % c);
+                ReleaseAssert(ms.Exist(key));
+
+                bool found;
+                uint64_t lb = ms.LowerBound(key, found);
+                ReleaseAssert(found && lb == key);
+
+                localCount++;
+            }
+            readerCounts[t] = localCount;
+        });
+        SetThreadAffinity(readers.back(), t + 1);
+    }
+
+    writer.join();
+    for (auto &th : readers) { th.join(); }
+
+    for (uint64_t i = 0; i < kNumInserts; i++)
+    {
+        ReleaseAssert(ms.Exist(keyOf(i)));
+    }
+
+    uint64_t total = 0;
+    for (uint64_t cnt : readerCounts) { total += cnt; }
+    printf("Total reader queries found during growth: %llu\n", (unsigned long long)total);
+}
+
+// Concurrency test: the writer keeps inserting and removing churn keys interleaved with a fixed set of keys,
+// while readers scan random windows. Every scan must be sorted and contain all the fixed keys in its window,
+// and the predecessor queries must not skip a fixed key.
+TEST(MlpSetUInt64, ConcurrentScanRangeDuringChurn)
+{
+    const int kTotalThreads = 4;
+    const uint64_t kNumStable = 1 << 17;
+
+    MlpSetUInt64::MlpSet ms;
+    ms.Init(4096);
+
+    // Stable keys are even, churn keys odd, both dense enough to share parent nodes
+    auto stableKeyOf = [](uint64_t i) { return (i * 0x9E3779B97F4A7C15ULL) >> 24 << 1; };
+    std::vector<uint64_t> stable;
+    for (uint64_t i = 0; i < kNumStable; i++)
+    {
+        if (ms.Insert(stableKeyOf(i)))
+        {
+            stable.push_back(stableKeyOf(i));
+        }
+    }
+    std::sort(stable.begin(), stable.end());
+
+    std::atomic<bool> stopReaders{false};
+    std::thread writer([&]() {
+        std::mt19937_64 rng(42);
+        for (int round = 0; round < 20; round++)
+        {
+            std::vector<uint64_t> churn;
+            for (int i = 0; i < 20000; i++)
+            {
+                uint64_t key = stable[rng() % stable.size()] + 1 + 2 * (rng() % 4);
+                if (ms.Insert(key))
+                {
+                    churn.push_back(key);
+                }
+            }
+            for (uint64_t key : churn)
+            {
+                ReleaseAssert(ms.Remove(key));
+            }
+        }
+        stopReaders.store(true);
+    });
+    SetThreadAffinity(writer, 0);
+
+    std::vector<std::thread> readers;
+    std::vector<uint64_t> readerCounts(kTotalThreads - 1, 0);
+    for (int t = 0; t < kTotalThreads - 1; t++)
+    {
+        readers.emplace_back([&, t]() {
+            std::mt19937_64 rng(static_cast<uint64_t>(t) + 123456789ULL);
+            uint64_t localCount = 0;
+            while (!stopReaders.load())
+            {
+                size_t first = rng() % stable.size();
+                size_t last = std::min(stable.size() - 1, first + rng() % 2000);
+                uint64_t lo = stable[first];
+                uint64_t hi = stable[last];
+                size_t expected = first;
+                uint64_t prev = 0;
+                bool hasPrev = false;
+                ms.ScanRange(lo, hi, [&](uint64_t key) {
+                    ReleaseAssert(lo <= key && key <= hi);
+                    ReleaseAssert(!hasPrev || prev < key);
+                    hasPrev = true;
+                    prev = key;
+                    if (key % 2 == 0)
+                    {
+                        ReleaseAssert(expected <= last && key == stable[expected]);
+                        expected++;
+                    }
+                });
+                ReleaseAssert(expected == last + 1);
+
+                // The predecessor of a stable key is either a churn key or the previous stable key
+                bool found;
+                ReleaseAssert(ms.Predecessor(hi, found) == hi && found);
+                if (last > 0)
+                {
+                    uint64_t pred = ms.Predecessor(hi - 1, found);
+                    ReleaseAssert(found && pred < hi && (pred % 2 == 1 || pred == stable[last - 1]));
+                }
+                localCount++;
+            }
+            readerCounts[t] = localCount;
+        });
+        SetThreadAffinity(readers.back(), t + 1);
+    }
+
+    writer.join();
+    for (auto &th : readers) { th.join(); }
+
+    uint64_t total = 0;
+    for (uint64_t cnt : readerCounts) { total += cnt; }
+    printf("Total scans during churn: %llu\n", (unsigned long long)total);
+}
+
+// Concurrency test: writers on different shards of a ShardedMlpSet insert and remove keys in parallel,
+// while readers check that the keys of a fixed set in between are always found by LowerBound.
+TEST(MlpSetUInt64, ShardedMlpSetConcurrentWriters)
+{
+    const int kWriters = 4;
+    const int kReaders = 2;
+    const uint64_t kKeysPerWriter = 100000;
+
+    MlpSetUInt64::ShardedMlpSet<16> ms;
+    ms.Init(1 << 20);
+
+    // writer w churns shard 2w+1, the even shards hold a fixed key each
+    std::vector<uint64_t> fixedKeys;
+    for (int shard = 0; shard < 16; shard += 2)
+    {
+        fixedKeys.push_back(MlpSetUInt64::ShardedMlpSet<16>::ShardBase(shard) + 12345);
+        ReleaseAssert(ms.Insert(fixedKeys.back()));
+    }
+
+    std::atomic<int> writersDone{0};
+    std::vector<std::thread> threads;
+    for (int w = 0; w < kWriters; w++)
+    {
+        threads.emplace_back([&, w]() {
+            uint64_t base = MlpSetUInt64::ShardedMlpSet<16>::ShardBase(2 * w + 1);
+            for (int round = 0; round < 3; round++)
+            {
+                for (uint64_t i = 0; i < kKeysPerWriter; i++)
+                {
+                    ReleaseAssert(ms.Insert(base + i * 7919));
+                }
+                for (uint64_t i = 0; i < kKeysPerWriter; i++)
+                {
+                    ReleaseAssert(ms.Remove(base + i * 7919));
+                }
+            }
+            writersDone.fetch_add(1);
+        });
+        SetThreadAffinity(threads.back(), w % std::thread::hardware_concurrency());
+    }
+    for (int r = 0; r < kReaders; r++)
+    {
+        threads.emplace_back([&, r]() {
+            std::mt19937_64 rng(r + 777);
+            while (writersDone.load() < kWriters)
+            {
+                // from anywhere in an odd shard the lower bound is in the churned shard or the next fixed key
+                size_t k = rng() % (fixedKeys.size() - 1);
+                uint64_t key = fixedKeys[k] + 1 + rng() % (fixedKeys[k + 1] - fixedKeys[k] - 1);
+                bool found;
+                uint64_t lb = ms.LowerBound(key, found);
+                ReleaseAssert(found && lb >= key && lb <= fixedKeys[k + 1]);
+                ReleaseAssert(lb == fixedKeys[k + 1] || (lb - MlpSetUInt64::ShardedMlpSet<16>::ShardBase(2 * int(k) + 1)) % 7919 == 0);
+                ReleaseAssert(ms.Exist(fixedKeys[rng() % fixedKeys.size()]));
+            }
+        });
+        SetThreadAffinity(threads.back(), (kWriters + r) % std::thread::hardware_concurrency());
+    }
+    for (auto& th : threads) { th.join(); }
+
+    bool found;
+    ReleaseAssert(ms.LowerBound(fixedKeys[0] + 1, found) == fixedKeys[1] && found);
+}
+
+// Concurrency test: several writers of a ShardedMlpSet insert and then remove interleaved keys, so writers
+// also meet on the same shard, while readers concurrently query keys known to be already inserted by some writer.
+TEST(MlpSetUInt64, ConcurrentMultiWriterInsertRemove)
+{
+    const int kNumWriters = 4;
+    const int kNumReaders = 2;
+    const uint64_t kKeysPerWriter = 1 << 17;
+
+    MlpSetUInt64::ShardedMlpSet<16> ms;
+    ms.Init(4096);
+
+    // writer w owns the keys keyOf(w, i), interleaved with the keys of the other writers
+    auto keyOf = [](int w, uint64_t i) { return (i * kNumWriters + w) * 0x9E3779B97F4A7C15ULL; };
+
+    std::vector<std::atomic<uint64_t>> insertedCount(kNumWriters);
+    std::atomic<int> writersDone{0};
+
+    std::vector<std::thread> writers;
+    for (int w = 0; w < kNumWriters; w++)
+    {
+        writers.emplace_back([&, w]() {
+            for (uint64_t i = 0; i < kKeysPerWriter; i++)
+            {
+                ReleaseAssert(ms.Insert(keyOf(w, i)));
+                insertedCount[w].store(i + 1);
+            }
+            // remove the odd keys
+            for (uint64_t i = 1; i < kKeysPerWriter; i += 2)
+            {
+                ReleaseAssert(ms.Remove(keyOf(w, i)));
+            }
+            ReleaseAssert(!ms.Remove(keyOf(w, 1)));
+            writersDone.fetch_add(1);
+        });
+        SetThreadAffinity(writers.back(), w);
+    }
+
+    std::vector<std::thread> readers;
+    for (int t = 0; t < kNumReaders; t++)
+    {
+        readers.emplace_back([&, t]() {
+            std::mt19937_64 rng(static_cast<uint64_t>(t) + 123456789ULL);
+            while (writersDone.load() < kNumWriters)
+            {
+                int w = rng() % kNumWriters;
+                uint64_t c = insertedCount[w].load();
+                if (c == 0) { continue; }
+
+                // even keys are never removed
+                uint64_t key = keyOf(w, (rng() % c) & ~uint64_t(1));
+                ReleaseAssert(ms.Exist(key));
+
+                bool found;
+                uint64_t lb = ms.LowerBound(key, found);
+                ReleaseAssert(found && lb == key);
+            }
+        });
+        SetThreadAffinity(readers.back(), kNumWriters + t);
+    }
+
+    for (auto &th : writers) { th.join(); }
+    for (auto &th : readers) { th.join(); }
+
+    for (int w = 0; w < kNumWriters; w++)
+    {
+        for (uint64_t i = 0; i < kKeysPerWriter; i++)
+        {
+            ReleaseAssert(ms.Exist(keyOf(w, i)) == (i % 2 == 0));
+        }
+    }
+}
+
+// Concurrency benchmark: more reader threads than CPUs, not pinned, so readers share CPUs and migrate
+// between them, while one writer keeps inserting and removing keys next to the ones being queried.
+// Contract: exactly one writer; multiple concurrent readers allowed.
+TEST(MlpSetUInt64, OversubscribedReaders)
+{
+    const int kNumReaders = 4 * std::max(1u, std::thread::hardware_concurrency());
+    const uint64_t kNumStableKeys = 1 << 16;
+    const int kDurationMs = 2000;
+
+    MlpSetUInt64::MlpSet ms;
+    ms.Init(4 * kNumStableKeys);
+
+    // stable keys are never removed, the writer churns on the keys in between them
+    auto stableKey = [](uint64_t i) { return (2 * i) * 0x9E3779B97F4A7C15ULL; };
+    auto churnKey = [](uint64_t i) { return (2 * i + 1) * 0x9E3779B97F4A7C15ULL; };
+    for (uint64_t i = 0; i < kNumStableKeys; i++)
+    {
+        ReleaseAssert(ms.Insert(stableKey(i)));
+    }
+
+    std::atomic<bool> stop{false};
+    std::thread writer([&]() {
+        uint64_t round = 0;
+        while (!stop.load())
+        {
+            for (uint64_t i = 0; i < 1024; i++)
+            {
+                ms.Insert(churnKey(round * 1024 + i));
+            }
+            for (uint64_t i = 0; i < 1024; i++)
+            {
+                ms.Remove(churnKey(round * 1024 + i));
+            }
+            round = (round + 1) % (kNumStableKeys / 1024);
+        }
+    });
+
+    std::vector<std::thread> readers;
+    std::vector<uint64_t> readerCounts(kNumReaders, 0);
+    for (int t = 0; t < kNumReaders; t++)
+    {
+        readers.emplace_back([&, t]() {
+            std::mt19937_64 rng(static_cast<uint64_t>(t) + 55555ULL);
+            uint64_t localCount = 0;
+            while (!stop.load())
+            {
+                uint64_t key = stableKey(rng() % kNumStableKeys);
+                ReleaseAssert(ms.Exist(key));
+
+                bool found;
+                uint64_t lb = ms.LowerBound(key, found);
+                ReleaseAssert(found && lb == key);
+                localCount++;
+            }
+            readerCounts[t] = localCount;
+        });
+    }
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(kDurationMs));
+    stop.store(true);
+    writer.join();
+    for (auto &th : readers) { th.join(); }
+
+    uint64_t total = 0;
+    for (uint64_t cnt : readerCounts) { total += cnt; }
+    printf("%d readers: %llu queries, %.1f ns/query (wall clock, all readers combined)\n",
+           kNumReaders, (unsigned long long)total, kDurationMs * 1e6 / (double)total);
+}
+
+// More reader threads than ReaderSlotRegistry has slots: the threads beyond MAX_READER_SLOTS share
+// the overflow slot, and must still be protected from reclamation and counted by the stats
+// Contract: exactly one writer; multiple concurrent readers allowed.
+TEST(MlpSetUInt64, ReaderSlotOverflow)
+{
+    const int kNumReaders = MlpSetUInt64::ReaderSlotRegistry::MAX_READER_SLOTS + 64;
+    const int kQueriesPerReader = 64;
+    const uint64_t kNumStableKeys = 1 << 14;
+
+    MlpSetUInt64::MlpSet ms;
+    ms.Init(4 * kNumStableKeys);
+    ms.ConfigureReclamation(MlpSetUInt64::MlpSet::ReclamationMode::INLINE, 0 /*lowWatermark*/, 1 /*highWatermark*/);
+
+    auto stableKey = [](uint64_t i) { return (2 * i) * 0x9E3779B97F4A7C15ULL; };
+    auto churnKey = [](uint64_t i) { return (2 * i + 1) * 0x9E3779B97F4A7C15ULL; };
+    for (uint64_t i = 0; i < kNumStableKeys; i++)
+    {
+        ReleaseAssert(ms.Insert(stableKey(i)));
+    }
+
+    // all readers hold on to their slot until every one of them has one, so some must overflow
+    //
+    ms.EnableStats();
+    std::atomic<int> numStarted{0};
+    std::atomic<bool> go{false};
+    std::atomic<bool> stop{false};
+    std::vector<std::thread> readers;
+    for (int t = 0; t < kNumReaders; t++)
+    {
+        readers.emplace_back([&, t]() {
+            std::mt19937_64 rng(static_cast<uint64_t>(t) + 77777ULL);
+            rep(i, 0, kQueriesPerReader - 1)
+            {
+                ReleaseAssert(ms.Exist(stableKey(rng() % kNumStableKeys)));
+            }
+            numStarted.fetch_add(1);
+            while (!go.load())
+            {
+                std::this_thread::yield();
+            }
+            while (!stop.load())
+            {
+                uint64_t key = stableKey(rng() % kNumStableKeys);
+                bool found;
+                ReleaseAssert(ms.Exist(key));
+                ReleaseAssert(ms.LowerBound(key, found) == key && found);
+                std::this_thread::yield();
+            }
+        });
+    }
+    while (numStarted.load() < kNumReaders)
+    {
+        std::this_thread::yield();
+    }
+    ReleaseAssert(MlpSetUInt64::ReaderSlotRegistry::NumSlotsInUse() == MlpSetUInt64::ReaderSlotRegistry::MAX_READER_SLOTS);
+    // no writer ran yet, so no query was retried
+    //
+    MlpSetUInt64::MlpStats st = ms.GetStats();
+    uint64_t lcpResults = 0;
+    rep(i, 0, 8)
+    {
+        lcpResults += st.lcpResultHistogram[i];
+    }
+    ReleaseAssert(lcpResults == uint64_t(kNumReaders) * kQueriesPerReader);
+    ms.DisableStats();
+    go.store(true);
+
+    // the writer frees what it unlinks as soon as no reader can reach it anymore
+    //
+    for (uint64_t round = 0; round < 16; round++)
+    {
+        for (uint64_t i = 0; i < 1024; i++)
+        {
+            ReleaseAssert(ms.Insert(churnKey(round * 1024 + i)));
+        }
+        for (uint64_t i = 0; i < 1024; i++)
+        {
+            ReleaseAssert(ms.Remove(churnKey(round * 1024 + i)));
+        }
+    }
+    stop.store(true);
+    for (auto &th : readers) { th.join(); }
+
+    ms.Reclaim();
+    ReleaseAssert(ms.GetReclamationBacklog() == 0);
+}
+
+// Concurrency test: the writer repeatedly fills nodes with children (so they get external bitmaps)
+// and empties them again, while readers query keys that are never removed. Unlinked bitmaps and
+// old hash tables are reclaimed by the background reclamation thread.
+// Contract: exactly one writer; multiple concurrent readers allowed.
+TEST(MlpSetUInt64, BackgroundReclamation)
+{
+    const int kNumReaders = 3;
+    const uint64_t kNumPrefixes = 1024;
+    const int kRounds = 20;
+
+    MlpSetUInt64::MlpSet ms;
+    ms.Init(4096);
+    ms.ConfigureReclamation(MlpSetUInt64::MlpSet::ReclamationMode::BACKGROUND, 16 /*lowWatermark*/, 64 /*highWatermark*/);
+
+    // child 0 of every prefix is never removed
+    auto keyOf = [](uint64_t prefix, uint64_t child) { return ((prefix * 0x9E3779B97F4A7C15ULL) & ~uint64_t(0xff)) | child; };
+    for (uint64_t p = 0; p < kNumPrefixes; p++)
+    {
+        ReleaseAssert(ms.Insert(keyOf(p, 0)));
+    }
+
+    std::atomic<bool> stop{false};
+    std::vector<std::thread> readers;
+    for (int t = 0; t < kNumReaders; t++)
+    {
+        readers.emplace_back([&, t]() {
+            std::mt19937_64 rng(static_cast<uint64_t>(t) + 42ULL);
+            while (!stop.load())
+            {
+                uint64_t key = keyOf(rng() % kNumPrefixes, 0);
+                ReleaseAssert(ms.Exist(key));
+                bool found;
+                ReleaseAssert(ms.LowerBound(key, found) == key && found);
+            }
+        });
+    }
+
+    size_t maxBacklog = 0;
+    for (int round = 0; round < kRounds; round++)
+    {
+        for (uint64_t p = 0; p < kNumPrefixes; p++)
+        {
+            for (uint64_t c = 1; c < 256; c += 8)
+            {
+                ReleaseAssert(ms.Insert(keyOf(p, c)));
+            }
+        }
+        for (uint64_t p = 0; p < kNumPrefixes; p++)
+        {
+            for (uint64_t c = 1; c < 256; c += 8)
+            {
+                ReleaseAssert(ms.Remove(keyOf(p, c)));
+            }
+        }
+        maxBacklog = std::max(maxBacklog, ms.GetReclamationBacklog());
+    }
+
+    stop.store(true);
+    for (auto &th : readers) { th.join(); }
+
+    // Once the high watermark is reached, the reclamation thread drains the backlog down to the low watermark
+    //
+    for (int i = 0; i < 1000 && ms.GetReclamationBacklog() >= 64; i++)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    printf("Max backlog observed: %zu, final backlog: %zu\n", maxBacklog, ms.GetReclamationBacklog());
+    ReleaseAssert(ms.GetReclamationBacklog() < 64);
+
+    // With no readers left, everything can be reclaimed
+    //
+    ms.Reclaim();
+    ReleaseAssert(ms.GetReclamationBacklog() == 0);
+
+    for (uint64_t p = 0; p < kNumPrefixes; p++)
+    {
+        ReleaseAssert(ms.Exist(keyOf(p, 0)));
+        ReleaseAssert(!ms.Exist(keyOf(p, 1)));
+    }
+}
+
+// Memory unlinked by the writer is only freed by explicit Reclaim() calls in MANUAL mode
+//
+TEST(MlpSetUInt64, ManualReclamation)
+{
+    MlpSetUInt64::MlpSet ms;
+    ms.Init(256);
+    ms.ConfigureReclamation(MlpSetUInt64::MlpSet::ReclamationMode::MANUAL, 0 /*lowWatermark*/, 1 /*highWatermark*/);
+
+    // grows the hash table a few times, retiring the old ones
+    //
+    for (uint64_t i = 0; i < (1 << 15); i++)
+    {
+        ReleaseAssert(ms.Insert(i * 0x9E3779B97F4A7C15ULL));
+    }
+    for (uint64_t i = 0; i < (1 << 15); i += 2)
+    {
+        ReleaseAssert(ms.Remove(i * 0x9E3779B97F4A7C15ULL));
+    }
+    size_t backlog = ms.GetReclamationBacklog();
+    ReleaseAssert(backlog > 0);
+
+    size_t freed = ms.Reclaim();
+    ReleaseAssert(freed == backlog);
+    ReleaseAssert(ms.GetReclamationBacklog() == 0);
+    ReleaseAssert(ms.Reclaim() == 0);
+}
+
 // Concurrency test: one writer inserts sequential keys IN REVERSE ORDER while several readers
 // concurrently query Exist and LowerBound for keys known to be already inserted.
 // Contract: exactly one writer; multiple concurrent readers allowed.
@@ -299,6 +865,7 @@ TEST(MlpSetUInt64, SequentialInsertThenRemove)
     
     MlpSetUInt64::MlpSet ms;
     ms.Init(kNumElements + 1024);
+    ms.EnableStats();
     
     std::atomic<uint64_t> currentPhase{0}; // 0=inserting, 1=removing, 2=done
     std::atomic<uint64_t> insertedCount{0};
@@ -391,9 +958,7 @@ TEST(MlpSetUInt64, SequentialInsertThenRemove)
            wms, (unsigned long long)kNumElements, (unsigned long long)removedCount.load());
     printf("Total successful reader operations: %llu\n", (unsigned long long)totalReaderOps);
 
-    #ifdef ENABLE_STATS
-    printf("Pending deallocations postponed: %llu\n", ms.stats.m_numbersOfPendingDeallocationPostponed);
-    #endif
+    printf("Pending deallocations postponed: %llu\n", (unsigned long long)ms.GetStats().pendingDeallocationsPostponed);
 }
 
 // Test 2: Random order insert then remove in same order with concurrent readers  
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <cstdint>
+
+// The hash functions of the Cuckoo hash table, and the per-ISA kernels computing the prefix hashes of a query
+//
+// The build targets plain x86-64, the kernels for newer instruction sets live in their own translation units
+// (MlpSetUInt64HashSse42.cpp, MlpSetUInt64HashAvx2.cpp, MlpSetUInt64HashAvx512.cpp), which are the only ones
+// compiled with the corresponding -m flags (see Makefile.real). They must only be called after checking that
+// the running CPU supports them (see SetHashKernel), and must not use any inline function of other headers,
+// since the linker could pick their copy of it for the rest of the binary.
+//
+namespace MlpSetUInt64
+{
+
+// Index of a slot in the Cuckoo hash table
+// By default slot indexes are 32-bit, which limits the table to 2^30 slots (the hash positions also pick
+// a bucket within a block of 8 slots, see CuckooHashTable::BUCKET_SIZE).
+// Building with MLP_LARGE_CAPACITY defined ('make release LARGE=1') makes them 64-bit,
+// the high bits of the two Cuckoo positions then come from the unused high 14 bits of XXHashFn3,
+// which allows up to 2^37 slots
+//
+#ifdef MLP_LARGE_CAPACITY
+typedef uint64_t HtPosition;
+#else
+typedef uint32_t HtPosition;
+#endif
+
+// The hash function is a slightly modified XXH32, to fix a known deficiency
+// The 3 hash functions are XXHashFn1, XXHashFn2, XXHashFn3, each hashing the first len bytes of key
+//
+namespace XXH
+{
+
+constexpr uint32_t XXH_SEED1 = 1192827283U;
+constexpr uint32_t XXH_SEED2 = 534897851U;
+
+constexpr uint32_t PRIME32_1 = 2654435761U;
+constexpr uint32_t PRIME32_2 = 2246822519U;
+constexpr uint32_t PRIME32_3 = 3266489917U;
+constexpr uint32_t PRIME32_4 = 668265263U;
+constexpr uint32_t PRIME32_5 = 374761393U;
+
+#define XXH_rotl32(x,r) ((x << r) | (x >> (32 - r)))
+
+uint32_t XXH32_avalanche(uint32_t h32);
+uint32_t XXHashFn1(uint64_t key, uint32_t len);
+uint32_t XXHashFn2(uint64_t key, uint32_t len);
+uint32_t XXHashFn3(uint64_t key, uint32_t len);
+
+}	// namespace XXH
+
+// The hash kernels of CuckooHashTable::QueryLCPPrepare
+// For 2 <= i <= 7, they write the two Cuckoo positions (masked with mask) of the prefix of length i+1
+// to allPositions1[i] and allPositions2[i], and its expected hash (as in CuckooHashTableNode::hash, with dlen masked out)
+// to expectedHash[i]. Entries 0 and 1 of the buffers are used as scratch space.
+//
+typedef void (*QueryHashesFn)(uint64_t key, HtPosition mask, HtPosition* allPositions1, HtPosition* allPositions2, uint32_t* expectedHash);
+
+void QueryHashesScalar(uint64_t key, HtPosition mask, HtPosition* allPositions1, HtPosition* allPositions2, uint32_t* expectedHash);
+// 4 lanes of 32 bits
+//
+void QueryHashesSse42(uint64_t key, HtPosition mask, HtPosition* allPositions1, HtPosition* allPositions2, uint32_t* expectedHash);
+// 8 lanes, one register per hash function
+//
+void QueryHashesAvx2(uint64_t key, HtPosition mask, HtPosition* allPositions1, HtPosition* allPositions2, uint32_t* expectedHash);
+// 16 lanes, XXHashFn1 and XXHashFn2 share a register
+//
+void QueryHashesAvx512(uint64_t key, HtPosition mask, HtPosition* allPositions1, HtPosition* allPositions2, uint32_t* expectedHash);
+
+}	// namespace MlpSetUInt64
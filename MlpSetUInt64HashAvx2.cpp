@@ -0,0 +1,107 @@
+#include "MlpSetUInt64Hash.h"
+#include <immintrin.h>
+
+// The AVX2 hash kernel, compiled with -mavx2 (see MlpSetUInt64Hash.h)
+//
+namespace MlpSetUInt64
+{
+
+namespace
+{
+
+// Lane l of every register is the prefix of length l + 1, the lanes of length 1 and 2 are computed and ignored
+// The constants are plain arrays, so that nothing AVX2 runs during static initialization
+//
+alignas(32) const uint32_t XXH_AVX2_INIT1[8] = {
+	XXH::PRIME32_5 + XXH::XXH_SEED1 + 1U, XXH::PRIME32_5 + XXH::XXH_SEED1 + 2U, XXH::PRIME32_5 + XXH::XXH_SEED1 + 3U, XXH::PRIME32_5 + XXH::XXH_SEED1 + 4U,
+	XXH::PRIME32_5 + XXH::XXH_SEED1 + 5U, XXH::PRIME32_5 + XXH::XXH_SEED1 + 6U, XXH::PRIME32_5 + XXH::XXH_SEED1 + 7U, XXH::PRIME32_5 + XXH::XXH_SEED1 + 8U
+};
+alignas(32) const uint32_t XXH_AVX2_INIT2[8] = {
+	XXH::PRIME32_5 + XXH::XXH_SEED2 + 1U, XXH::PRIME32_5 + XXH::XXH_SEED2 + 2U, XXH::PRIME32_5 + XXH::XXH_SEED2 + 3U, XXH::PRIME32_5 + XXH::XXH_SEED2 + 4U,
+	XXH::PRIME32_5 + XXH::XXH_SEED2 + 5U, XXH::PRIME32_5 + XXH::XXH_SEED2 + 6U, XXH::PRIME32_5 + XXH::XXH_SEED2 + 7U, XXH::PRIME32_5 + XXH::XXH_SEED2 + 8U
+};
+alignas(32) const uint32_t XXH_AVX2_INIT3[8] = {
+	XXH::PRIME32_5 + 1U, XXH::PRIME32_5 + 2U, XXH::PRIME32_5 + 3U, XXH::PRIME32_5 + 4U,
+	XXH::PRIME32_5 + 5U, XXH::PRIME32_5 + 6U, XXH::PRIME32_5 + 7U, XXH::PRIME32_5 + 8U
+};
+// the bytes of the high (resp. low) 32 bits of the key that are part of the prefix
+//
+alignas(32) const uint32_t XXH_AVX2_HIGH_MASK[8] = {
+	0xff000000U, 0xffff0000U, 0xffffff00U, 0xffffffffU, 0xffffffffU, 0xffffffffU, 0xffffffffU, 0xffffffffU
+};
+alignas(32) const uint32_t XXH_AVX2_LOW_MASK[8] = {
+	0U, 0U, 0U, 0U, 0xff000000U, 0xffff0000U, 0xffffff00U, 0xffffffffU
+};
+// the expected hash tag of lane i (occupied, ilen - 1 == i)
+//
+alignas(32) const uint32_t XXH_AVX2_EXPECT_TAG[8] = {
+	0x80000000U, 0x80000000U | (1U << 27), 0x80000000U | (2U << 27), 0x80000000U | (3U << 27),
+	0x80000000U | (4U << 27), 0x80000000U | (5U << 27), 0x80000000U | (6U << 27), 0x80000000U | (7U << 27)
+};
+
+inline __m256i Load(const uint32_t* ptr)
+{
+	return _mm256_load_si256(reinterpret_cast<const __m256i*>(ptr));
+}
+
+inline __m256i XXHRound(__m256i h, __m256i input, __m256i multiplier)
+{
+	h = _mm256_xor_si256(h, _mm256_mullo_epi32(input, multiplier));
+	h = _mm256_or_si256(_mm256_slli_epi32(h, 17), _mm256_srli_epi32(h, 15));
+	return _mm256_mullo_epi32(h, _mm256_set1_epi32(XXH::PRIME32_4));
+}
+
+// Both rounds of XXH32_CoreLogic, only prefixes longer than 4 bytes go through the second one
+//
+inline __m256i XXHCoreLogic(__m256i init, __m256i high, __m256i low, __m256i multiplier)
+{
+	__m256i h = XXHRound(init, high, multiplier);
+	h = _mm256_blend_epi32(h, XXHRound(h, low, multiplier), 0xf0);
+	h = _mm256_xor_si256(h, _mm256_srli_epi32(h, 15));
+	h = _mm256_mullo_epi32(h, _mm256_set1_epi32(XXH::PRIME32_2));
+	h = _mm256_xor_si256(h, _mm256_srli_epi32(h, 13));
+	h = _mm256_mullo_epi32(h, _mm256_set1_epi32(XXH::PRIME32_3));
+	return _mm256_xor_si256(h, _mm256_srli_epi32(h, 16));
+}
+
+}	// anonymous namespace
+
+void QueryHashesAvx2(uint64_t key, HtPosition mask, HtPosition* allPositions1, HtPosition* allPositions2, uint32_t* expectedHash)
+{
+	const __m256i high = _mm256_and_si256(_mm256_set1_epi32(uint32_t(key >> 32)), Load(XXH_AVX2_HIGH_MASK));
+	const __m256i low = _mm256_and_si256(_mm256_set1_epi32(uint32_t(key)), Load(XXH_AVX2_LOW_MASK));
+	const __m256i prime1 = _mm256_set1_epi32(XXH::PRIME32_1);
+	const __m256i prime3 = _mm256_set1_epi32(XXH::PRIME32_3);
+
+	__m256i h1 = XXHCoreLogic(Load(XXH_AVX2_INIT1), high, low, prime1);
+	__m256i h2 = XXHCoreLogic(Load(XXH_AVX2_INIT2), high, low, prime3);
+	__m256i h3 = XXHCoreLogic(Load(XXH_AVX2_INIT3), high, low, prime3);
+
+#ifdef MLP_LARGE_CAPACITY
+	// high bits of the positions, see HashPosition1 and HashPosition2
+	//
+	const __m256i hashModMask = _mm256_set1_epi64x(mask);
+	__m256i high1 = _mm256_and_si256(_mm256_srli_epi32(h3, 18), _mm256_set1_epi32(0x7f));
+	__m256i high2 = _mm256_srli_epi32(h3, 25);
+	// unpack works within 128-bit halves, so the lanes come out as 0, 1, 4, 5 and 2, 3, 6, 7
+	//
+	__m256i lo1 = _mm256_and_si256(_mm256_unpacklo_epi32(h1, high1), hashModMask);
+	__m256i hi1 = _mm256_and_si256(_mm256_unpackhi_epi32(h1, high1), hashModMask);
+	__m256i lo2 = _mm256_and_si256(_mm256_unpacklo_epi32(h2, high2), hashModMask);
+	__m256i hi2 = _mm256_and_si256(_mm256_unpackhi_epi32(h2, high2), hashModMask);
+	_mm256_storeu_si256(reinterpret_cast<__m256i*>(allPositions1), _mm256_permute2x128_si256(lo1, hi1, 0x20));
+	_mm256_storeu_si256(reinterpret_cast<__m256i*>(allPositions1 + 4), _mm256_permute2x128_si256(lo1, hi1, 0x31));
+	_mm256_storeu_si256(reinterpret_cast<__m256i*>(allPositions2), _mm256_permute2x128_si256(lo2, hi2, 0x20));
+	_mm256_storeu_si256(reinterpret_cast<__m256i*>(allPositions2 + 4), _mm256_permute2x128_si256(lo2, hi2, 0x31));
+#else
+	const __m256i hashModMask = _mm256_set1_epi32(mask);
+	_mm256_storeu_si256(reinterpret_cast<__m256i*>(allPositions1), _mm256_and_si256(h1, hashModMask));
+	_mm256_storeu_si256(reinterpret_cast<__m256i*>(allPositions2), _mm256_and_si256(h2, hashModMask));
+#endif
+
+	__m256i expect = _mm256_and_si256(h3, _mm256_set1_epi32(0x3ffff));
+	expect = _mm256_or_si256(expect, Load(XXH_AVX2_EXPECT_TAG));
+	_mm256_storeu_si256(reinterpret_cast<__m256i*>(expectedHash), expect);
+}
+
+}	// namespace MlpSetUInt64
@@ -0,0 +1,106 @@
+#include "MlpSetUInt64Hash.h"
+#include <immintrin.h>
+
+// The AVX-512 hash kernel, compiled with -mavx512f (see MlpSetUInt64Hash.h)
+//
+namespace MlpSetUInt64
+{
+
+namespace
+{
+
+// Lane l of the first register is XXHashFn1 (l < 8) or XXHashFn2 (l >= 8) of the prefix of length l % 8 + 1,
+// lane l of the second one is XXHashFn3 of the same prefix. The lanes of length 1 and 2 are computed and ignored.
+// The constants are plain arrays, so that nothing AVX-512 runs during static initialization
+//
+alignas(64) const uint32_t XXH_AVX512_INIT12[16] = {
+	XXH::PRIME32_5 + XXH::XXH_SEED1 + 1U, XXH::PRIME32_5 + XXH::XXH_SEED1 + 2U, XXH::PRIME32_5 + XXH::XXH_SEED1 + 3U, XXH::PRIME32_5 + XXH::XXH_SEED1 + 4U,
+	XXH::PRIME32_5 + XXH::XXH_SEED1 + 5U, XXH::PRIME32_5 + XXH::XXH_SEED1 + 6U, XXH::PRIME32_5 + XXH::XXH_SEED1 + 7U, XXH::PRIME32_5 + XXH::XXH_SEED1 + 8U,
+	XXH::PRIME32_5 + XXH::XXH_SEED2 + 1U, XXH::PRIME32_5 + XXH::XXH_SEED2 + 2U, XXH::PRIME32_5 + XXH::XXH_SEED2 + 3U, XXH::PRIME32_5 + XXH::XXH_SEED2 + 4U,
+	XXH::PRIME32_5 + XXH::XXH_SEED2 + 5U, XXH::PRIME32_5 + XXH::XXH_SEED2 + 6U, XXH::PRIME32_5 + XXH::XXH_SEED2 + 7U, XXH::PRIME32_5 + XXH::XXH_SEED2 + 8U
+};
+alignas(64) const uint32_t XXH_AVX512_INIT3[16] = {
+	XXH::PRIME32_5 + 1U, XXH::PRIME32_5 + 2U, XXH::PRIME32_5 + 3U, XXH::PRIME32_5 + 4U,
+	XXH::PRIME32_5 + 5U, XXH::PRIME32_5 + 6U, XXH::PRIME32_5 + 7U, XXH::PRIME32_5 + 8U,
+	XXH::PRIME32_5 + 1U, XXH::PRIME32_5 + 2U, XXH::PRIME32_5 + 3U, XXH::PRIME32_5 + 4U,
+	XXH::PRIME32_5 + 5U, XXH::PRIME32_5 + 6U, XXH::PRIME32_5 + 7U, XXH::PRIME32_5 + 8U
+};
+alignas(64) const uint32_t XXH_AVX512_MULT12[16] = {
+	XXH::PRIME32_1, XXH::PRIME32_1, XXH::PRIME32_1, XXH::PRIME32_1, XXH::PRIME32_1, XXH::PRIME32_1, XXH::PRIME32_1, XXH::PRIME32_1,
+	XXH::PRIME32_3, XXH::PRIME32_3, XXH::PRIME32_3, XXH::PRIME32_3, XXH::PRIME32_3, XXH::PRIME32_3, XXH::PRIME32_3, XXH::PRIME32_3
+};
+// the bytes of the high (resp. low) 32 bits of the key that are part of the prefix
+//
+alignas(64) const uint32_t XXH_AVX512_HIGH_MASK[16] = {
+	0xff000000U, 0xffff0000U, 0xffffff00U, 0xffffffffU, 0xffffffffU, 0xffffffffU, 0xffffffffU, 0xffffffffU,
+	0xff000000U, 0xffff0000U, 0xffffff00U, 0xffffffffU, 0xffffffffU, 0xffffffffU, 0xffffffffU, 0xffffffffU
+};
+alignas(64) const uint32_t XXH_AVX512_LOW_MASK[16] = {
+	0U, 0U, 0U, 0U, 0xff000000U, 0xffff0000U, 0xffffff00U, 0xffffffffU,
+	0U, 0U, 0U, 0U, 0xff000000U, 0xffff0000U, 0xffffff00U, 0xffffffffU
+};
+// the expected hash tag of lane i (occupied, ilen - 1 == i)
+//
+alignas(32) const uint32_t XXH_AVX512_EXPECT_TAG[8] = {
+	0x80000000U, 0x80000000U | (1U << 27), 0x80000000U | (2U << 27), 0x80000000U | (3U << 27),
+	0x80000000U | (4U << 27), 0x80000000U | (5U << 27), 0x80000000U | (6U << 27), 0x80000000U | (7U << 27)
+};
+
+inline __m512i XXHRoundAvx512(__m512i h, __m512i input, __m512i multiplier)
+{
+	h = _mm512_xor_si512(h, _mm512_mullo_epi32(input, multiplier));
+	return _mm512_mullo_epi32(_mm512_rol_epi32(h, 17), _mm512_set1_epi32(XXH::PRIME32_4));
+}
+
+inline __m512i XXHAvalancheAvx512(__m512i h)
+{
+	h = _mm512_xor_si512(h, _mm512_srli_epi32(h, 15));
+	h = _mm512_mullo_epi32(h, _mm512_set1_epi32(XXH::PRIME32_2));
+	h = _mm512_xor_si512(h, _mm512_srli_epi32(h, 13));
+	h = _mm512_mullo_epi32(h, _mm512_set1_epi32(XXH::PRIME32_3));
+	return _mm512_xor_si512(h, _mm512_srli_epi32(h, 16));
+}
+
+}	// anonymous namespace
+
+void QueryHashesAvx512(uint64_t key, HtPosition mask, HtPosition* allPositions1, HtPosition* allPositions2, uint32_t* expectedHash)
+{
+	const __m512i high = _mm512_and_si512(_mm512_set1_epi32(uint32_t(key >> 32)), _mm512_load_si512(XXH_AVX512_HIGH_MASK));
+	const __m512i low = _mm512_and_si512(_mm512_set1_epi32(uint32_t(key)), _mm512_load_si512(XXH_AVX512_LOW_MASK));
+	const __m512i mult12 = _mm512_load_si512(XXH_AVX512_MULT12);
+	const __m512i mult3 = _mm512_set1_epi32(XXH::PRIME32_3);
+	// only prefixes longer than 4 bytes go through the second round
+	//
+	const __mmask16 longPrefix = 0xf0f0;
+
+	__m512i h12 = XXHRoundAvx512(_mm512_load_si512(XXH_AVX512_INIT12), high, mult12);
+	__m512i h3 = XXHRoundAvx512(_mm512_load_si512(XXH_AVX512_INIT3), high, mult3);
+	h12 = _mm512_mask_mov_epi32(h12, longPrefix, XXHRoundAvx512(h12, low, mult12));
+	h3 = _mm512_mask_mov_epi32(h3, longPrefix, XXHRoundAvx512(h3, low, mult3));
+	h12 = XXHAvalancheAvx512(h12);
+	h3 = XXHAvalancheAvx512(h3);
+
+	__m256i fn3 = _mm512_castsi512_si256(h3);
+#ifdef MLP_LARGE_CAPACITY
+	// high bits of the positions, see HashPosition1 and HashPosition2
+	//
+	const __m512i hashModMask = _mm512_set1_epi64(mask);
+	__m512i wideFn3 = _mm512_cvtepu32_epi64(fn3);
+	__m512i high1 = _mm512_slli_epi64(_mm512_and_si512(_mm512_srli_epi64(wideFn3, 18), _mm512_set1_epi64(0x7f)), 32);
+	__m512i high2 = _mm512_slli_epi64(_mm512_srli_epi64(wideFn3, 25), 32);
+	__m512i pos1 = _mm512_or_si512(_mm512_cvtepu32_epi64(_mm512_castsi512_si256(h12)), high1);
+	__m512i pos2 = _mm512_or_si512(_mm512_cvtepu32_epi64(_mm512_extracti64x4_epi64(h12, 1)), high2);
+	_mm512_storeu_si512(allPositions1, _mm512_and_si512(pos1, hashModMask));
+	_mm512_storeu_si512(allPositions2, _mm512_and_si512(pos2, hashModMask));
+#else
+	__m512i pos = _mm512_and_si512(h12, _mm512_set1_epi32(mask));
+	_mm256_storeu_si256(reinterpret_cast<__m256i*>(allPositions1), _mm512_castsi512_si256(pos));
+	_mm256_storeu_si256(reinterpret_cast<__m256i*>(allPositions2), _mm512_extracti64x4_epi64(pos, 1));
+#endif
+
+	__m256i expect = _mm256_and_si256(fn3, _mm256_set1_epi32(0x3ffff));
+	expect = _mm256_or_si256(expect, _mm256_load_si256(reinterpret_cast<const __m256i*>(XXH_AVX512_EXPECT_TAG)));
+	_mm256_storeu_si256(reinterpret_cast<__m256i*>(expectedHash), expect);
+}
+
+}	// namespace MlpSetUInt64
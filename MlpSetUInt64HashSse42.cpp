@@ -0,0 +1,209 @@
+#include "MlpSetUInt64Hash.h"
+#include <cassert>
+#include <immintrin.h>
+
+// The SSE4.2 hash kernel, compiled with -msse4.2 (see MlpSetUInt64Hash.h)
+//
+namespace MlpSetUInt64
+{
+
+namespace XXH
+{
+
+static const __m128i PRIME32_1_ARRAY = _mm_set_epi32(PRIME32_1, PRIME32_1, PRIME32_1, PRIME32_1);
+static const __m128i PRIME32_2_ARRAY = _mm_set_epi32(PRIME32_2, PRIME32_2, PRIME32_2, PRIME32_2);
+static const __m128i PRIME32_3_ARRAY = _mm_set_epi32(PRIME32_3, PRIME32_3, PRIME32_3, PRIME32_3);
+static const __m128i PRIME32_4_ARRAY = _mm_set_epi32(PRIME32_4, PRIME32_4, PRIME32_4, PRIME32_4);
+
+static const __m128i XXH_OUT1_INIT = _mm_set_epi32(PRIME32_5 + XXH_SEED1 + 8U,
+                                                   PRIME32_5 + XXH_SEED1 + 7U,
+                                                   PRIME32_5 + XXH_SEED1 + 6U,
+                                                   PRIME32_5 + XXH_SEED1 + 5U);
+static const __m128i XXH_OUT2_INIT = _mm_set_epi32(PRIME32_5 + XXH_SEED2 + 8U,
+                                                   PRIME32_5 + XXH_SEED2 + 7U,
+                                                   PRIME32_5 + XXH_SEED2 + 6U,
+                                                   PRIME32_5 + XXH_SEED2 + 5U);
+static const __m128i XXH_OUT3_INIT = _mm_set_epi32(PRIME32_5 + 8U,
+                                                   PRIME32_5 + 7U,
+                                                   PRIME32_5 + 6U,
+                                                   PRIME32_5 + 5U);
+static const __m128i XXH_OUT4_INIT = _mm_set_epi32(PRIME32_5 + XXH_SEED1 + 4U,
+                                                   PRIME32_5 + XXH_SEED1 + 3U,
+                                                   PRIME32_5 + XXH_SEED2 + 4U,
+                                                   PRIME32_5 + XXH_SEED2 + 3U);
+static const __m128i XXH_LOW_MASK = _mm_set_epi32(0xffffffffU, 
+                                                  0xffffff00U, 
+                                                  0xffff0000U, 
+                                                  0xff000000U);
+
+static void XXHExecuteRotlAndMult(__m128i& data)
+{
+	__m128i tmp = _mm_srli_epi32(data, 15);
+	data = _mm_slli_epi32(data, 17);
+	data = _mm_or_si128(data, tmp);
+	data = _mm_mullo_epi32(data, PRIME32_4_ARRAY);
+}
+
+static void XXHExecuteAvalanche(__m128i& data)
+{
+	__m128i tmp = _mm_srli_epi32(data, 15);
+	data = _mm_xor_si128(data, tmp);
+	data = _mm_mullo_epi32(data, PRIME32_2_ARRAY);
+	
+	tmp = _mm_srli_epi32(data, 13);
+	data = _mm_xor_si128(data, tmp);
+	data = _mm_mullo_epi32(data, PRIME32_3_ARRAY);
+	
+	tmp = _mm_srli_epi32(data, 16);
+	data = _mm_xor_si128(data, tmp);
+}
+
+
+// Computes the 18 hashes of the prefixes of length 3 to 8 of key
+// out1, out2, out3 hold XXHashFn1, XXHashFn2, XXHashFn3 of lengths 5 to 8 (from low to high lane),
+// out4 holds XXHashFn2(3), XXHashFn2(4), XXHashFn1(3), XXHashFn1(4), and out5 holds XXHashFn3(3), XXHashFn3(4)
+//
+static void XXHashArray(uint64_t key, __m128i& out1, __m128i& out2, __m128i& out3, __m128i& out4, uint64_t& out5)
+{
+	uint32_t low = key;
+	uint32_t high = key >> 32;
+	
+	uint32_t x1 = high * PRIME32_1;
+	uint32_t x2 = high * PRIME32_3;
+	
+	out1 = _mm_set1_epi32(x1);
+	out1 = _mm_xor_si128(out1, XXH_OUT1_INIT);
+	XXHExecuteRotlAndMult(out1);
+	
+	out2 = _mm_set1_epi32(x2);
+	out2 = _mm_xor_si128(out2, XXH_OUT2_INIT);
+	XXHExecuteRotlAndMult(out2);
+	
+	out3 = _mm_set1_epi32(x2);
+	out3 = _mm_xor_si128(out3, XXH_OUT3_INIT);
+	XXHExecuteRotlAndMult(out3);
+	
+	uint32_t high3byte = high & 0xffffff00U;
+	uint32_t high3byteP1 = high3byte * PRIME32_1;
+	uint32_t high3byteP3 = high3byte * PRIME32_3;
+	
+	out4 = _mm_set_epi32(x1, high3byteP1, x2, high3byteP3);
+	out4 = _mm_xor_si128(out4, XXH_OUT4_INIT);
+	XXHExecuteRotlAndMult(out4);
+	
+	__m128i v1 = _mm_set1_epi32(low);
+	v1 = _mm_and_si128(v1, XXH_LOW_MASK);
+	__m128i v2 = _mm_mullo_epi32(v1, PRIME32_1_ARRAY);
+	__m128i v3 = _mm_mullo_epi32(v1, PRIME32_3_ARRAY);
+	
+	out1 = _mm_xor_si128(out1, v2);
+	XXHExecuteRotlAndMult(out1);
+	
+	out2 = _mm_xor_si128(out2, v3);
+	XXHExecuteRotlAndMult(out2);
+	
+	out3 = _mm_xor_si128(out3, v3);
+	XXHExecuteRotlAndMult(out3);
+	
+	XXHExecuteAvalanche(out1);
+	XXHExecuteAvalanche(out2);
+	XXHExecuteAvalanche(out3);
+	XXHExecuteAvalanche(out4);
+	
+	uint32_t h34 = (PRIME32_5 + 4U) ^ x2;
+	h34 = XXH_rotl32(h34, 17) * PRIME32_4;
+	h34 = XXH32_avalanche(h34);
+	
+	uint32_t h33 = (PRIME32_5 + 3U) ^ high3byteP3;
+	h33 = XXH_rotl32(h33, 17) * PRIME32_4;
+	h33 = XXH32_avalanche(h33);
+	
+	assert(_mm_extract_epi32(out1, 3) == XXHashFn1(key, 8));
+	assert(_mm_extract_epi32(out1, 2) == XXHashFn1(key, 7));
+	assert(_mm_extract_epi32(out1, 1) == XXHashFn1(key, 6));
+	assert(_mm_extract_epi32(out1, 0) == XXHashFn1(key, 5));
+	assert(_mm_extract_epi32(out2, 3) == XXHashFn2(key, 8));
+	assert(_mm_extract_epi32(out2, 2) == XXHashFn2(key, 7));
+	assert(_mm_extract_epi32(out2, 1) == XXHashFn2(key, 6));
+	assert(_mm_extract_epi32(out2, 0) == XXHashFn2(key, 5));
+	assert(_mm_extract_epi32(out3, 3) == XXHashFn3(key, 8));
+	assert(_mm_extract_epi32(out3, 2) == XXHashFn3(key, 7));
+	assert(_mm_extract_epi32(out3, 1) == XXHashFn3(key, 6));
+	assert(_mm_extract_epi32(out3, 0) == XXHashFn3(key, 5));
+	assert(_mm_extract_epi32(out4, 3) == XXHashFn1(key, 4));
+	assert(_mm_extract_epi32(out4, 2) == XXHashFn1(key, 3));
+	assert(_mm_extract_epi32(out4, 1) == XXHashFn2(key, 4));
+	assert(_mm_extract_epi32(out4, 0) == XXHashFn2(key, 3));
+	assert(h34 == XXHashFn3(key, 4));
+	assert(h33 == XXHashFn3(key, 3));
+	
+	out5 = (uint64_t(h34) << 32) | h33;
+}
+
+}	// namespace XXH
+
+namespace
+{
+
+const __m128i HASH18_MASK = _mm_set_epi32(0x3ffffU, 0x3ffffU, 0x3ffffU, 0x3ffffU);
+const __m128i HASH_EXPECT_MASK1 = _mm_set_epi32(0x80000000U | (7U << 27), 
+                                                0x80000000U | (6U << 27), 
+                                                0x80000000U | (5U << 27), 
+                                                0x80000000U | (4U << 27));
+
+#ifdef MLP_LARGE_CAPACITY
+const __m128i HASH_HIGH7_MASK = _mm_set_epi32(0x7fU, 0x7fU, 0x7fU, 0x7fU);
+
+// Combine 4 low 32-bit halves and 4 high halves into 4 masked 64-bit positions
+//
+inline void StorePositions(HtPosition* dst, __m128i low, __m128i high, __m128i mask)
+{
+	_mm_storeu_si128(reinterpret_cast<__m128i*>(dst), _mm_and_si128(_mm_unpacklo_epi32(low, high), mask));
+	_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + 2), _mm_and_si128(_mm_unpackhi_epi32(low, high), mask));
+}
+#endif
+
+}	// anonymous namespace
+
+void QueryHashesSse42(uint64_t key, HtPosition mask, HtPosition* allPositions1, HtPosition* allPositions2, uint32_t* expectedHash)
+{
+	__m128i h1, h2, h3, h4;
+	uint64_t h5;
+	XXH::XXHashArray(key, h1, h2, h3, h4, h5);
+
+#ifdef MLP_LARGE_CAPACITY
+	__m128i hashModMask = _mm_set1_epi64x(mask);
+
+	// high bits of the positions, see HashPosition1 and HashPosition2
+	// h4 holds (from low to high lane) Fn2(3), Fn2(4), Fn1(3), Fn1(4), and h5 holds Fn3(3), Fn3(4)
+	//
+	__m128i high1 = _mm_and_si128(_mm_srli_epi32(h3, 18), HASH_HIGH7_MASK);
+	__m128i high2 = _mm_srli_epi32(h3, 25);
+	uint32_t h33 = h5, h34 = h5 >> 32;
+	__m128i high4 = _mm_set_epi32((h34 >> 18) & 0x7f, (h33 >> 18) & 0x7f, h34 >> 25, h33 >> 25);
+
+	StorePositions(allPositions1 + 4, h1, high1, hashModMask);
+	StorePositions(allPositions2 + 4, h2, high2, hashModMask);
+	StorePositions(allPositions1, h4, high4, hashModMask);
+#else
+	__m128i hashModMask = _mm_set1_epi32(mask);
+	h1 = _mm_and_si128(h1, hashModMask);
+	h2 = _mm_and_si128(h2, hashModMask);
+	h4 = _mm_and_si128(h4, hashModMask);
+
+	_mm_storeu_si128(reinterpret_cast<__m128i*>(allPositions1 + 4), h1);
+	_mm_storeu_si128(reinterpret_cast<__m128i*>(allPositions2 + 4), h2);
+	_mm_storeu_si128(reinterpret_cast<__m128i*>(allPositions1), h4);
+#endif
+	allPositions2[2] = allPositions1[0];
+	allPositions2[3] = allPositions1[1];
+
+	__m128i expect1 = _mm_and_si128(h3, HASH18_MASK);
+	expect1 = _mm_or_si128(expect1, HASH_EXPECT_MASK1);
+	_mm_storeu_si128(reinterpret_cast<__m128i*>(expectedHash + 4), expect1);
+	h5 &= 0x3ffff0003ffffULL;
+	h5 |= 0x8000000080000000ULL | (3ULL << 59) | (2ULL << 27);
+	*reinterpret_cast<uint64_t*>(expectedHash + 2) = h5;
+}
+
+}	// namespace MlpSetUInt64
@@ -0,0 +1,283 @@
+#include "MlpSetUInt64Interleaved.h"
+
+namespace MlpSetUInt64
+{
+
+InterleavedLookupEngine::InterleavedLookupEngine(MlpSet* set, int width)
+	: m_set(set)
+	, m_tree(nullptr)
+	, m_width(width)
+	, m_lookups(width)
+{
+	ReleaseAssert(width > 0);
+}
+
+InterleavedLookupEngine::InterleavedLookupEngine(MlpRangeTree* tree, int width)
+	: m_set(tree)
+	, m_tree(tree)
+	, m_width(width)
+	, m_lookups(width)
+{
+	ReleaseAssert(width > 0);
+}
+
+void InterleavedLookupEngine::Start(Lookup& lookup, const Request* requests, size_t index)
+{
+	lookup.index = index;
+	lookup.type = requests[index].type;
+	lookup.key = requests[index].key;
+	lookup.lookupKey = lookup.key;
+	if (lookup.type == LookupType::EXIST)
+	{
+		lookup.state = State::EXIST_LCP;
+		m_set->m_hashTable.QueryLCPPrepare(lookup.key, lookup.allPositions1, lookup.allPositions2, lookup.ExpectedHash());
+	}
+	else
+	{
+		assert(lookup.type == LookupType::LOWER_BOUND || m_tree != nullptr);
+		lookup.state = State::LOWER_BOUND_LCP;
+		m_set->LowerBoundPrepare(lookup.key, lookup.allPositions1, lookup.allPositions2, lookup.ExpectedHash());
+	}
+}
+
+int InterleavedLookupEngine::ResolveLeaf(Lookup& lookup, uint32_t generation, CuckooHashTableNode*& leaf)
+{
+	CuckooHashTable& hashTable = m_set->m_hashTable;
+	uint32_t ilen;
+	int lcpLen = hashTable.QueryLCPResolve(lookup.lookupKey,
+	                                       ilen /*out*/,
+	                                       lookup.allPositions1,
+	                                       lookup.allPositions2,
+	                                       lookup.ExpectedHash(),
+	                                       generation);
+	if (lcpLen < 0)
+	{
+		return -1;
+	}
+	if (lcpLen != 8)
+	{
+		return 0;
+	}
+	leaf = &hashTable.ht[lookup.allPositions1[ilen - 1]];
+	if (!leaf->IsEqualNoHash(lookup.lookupKey, ilen))
+	{
+		leaf = &hashTable.ht[lookup.allPositions2[ilen - 1]];
+	}
+	return leaf->IsLeaf() ? 1 : 0;
+}
+
+bool InterleavedLookupEngine::Step(Lookup& lookup, uint32_t generation, Result* results, bool& retry)
+{
+	Result& result = results[lookup.index];
+	retry = false;
+	switch (lookup.state)
+	{
+		case State::EXIST_LCP:
+		{
+			uint32_t ilen;
+			int lcpLen = m_set->m_hashTable.QueryLCPResolve(lookup.key,
+			                                                ilen /*out*/,
+			                                                lookup.allPositions1,
+			                                                lookup.allPositions2,
+			                                                lookup.ExpectedHash(),
+			                                                generation);
+			retry = (lcpLen < 0);
+			result.found = (lcpLen == 8);
+			return true;
+		}
+		case State::LOWER_BOUND_LCP:
+		{
+			bool found;
+			lookup.promise = m_set->LowerBoundResolve(lookup.key,
+			                                          found /*out*/,
+			                                          generation,
+			                                          lookup.allPositions1,
+			                                          lookup.allPositions2,
+			                                          lookup.ExpectedHash());
+			if (!found)
+			{
+				result.found = false;
+				result.value = 0xffffffffffffffffULL;
+				result.data = nullptr;
+				return true;
+			}
+			if (unlikely(!lookup.promise.IsValid()))
+			{
+				retry = true;
+				return true;
+			}
+			lookup.promise.Prefetch();
+			lookup.state = State::LOWER_BOUND_PROMISE;
+			return false;
+		}
+		case State::LOWER_BOUND_PROMISE:
+		{
+			uint64_t lowerBound = lookup.promise.Resolve();
+			if (unlikely(!lookup.promise.IsGenerationValid(generation)))
+			{
+				retry = true;
+				return true;
+			}
+			if (lookup.type == LookupType::LOWER_BOUND)
+			{
+				result.found = true;
+				result.value = lowerBound;
+				return true;
+			}
+			// RangeTree Load: the lower bound leaf is either the key itself or the end of the range containing it
+			//
+			lookup.lookupKey = lowerBound;
+			m_set->m_hashTable.QueryLCPPrepare(lookup.lookupKey, lookup.allPositions1, lookup.allPositions2, lookup.ExpectedHash());
+			lookup.state = State::LEAF_LCP;
+			return false;
+		}
+		case State::LEAF_LCP:
+		{
+			CuckooHashTableNode* leaf;
+			int ret = ResolveLeaf(lookup, generation, leaf /*out*/);
+			if (ret < 0)
+			{
+				retry = true;
+				return true;
+			}
+			result.data = nullptr;
+			if (ret == 0)
+			{
+				return true;
+			}
+			switch (leaf->GetLeafType())
+			{
+				case CuckooHashTableNode::LEAF_SINGLE:
+				case CuckooHashTableNode::LEAF_RANGE_START:
+				{
+					if (lookup.lookupKey == lookup.key)
+					{
+						result.data = leaf->GetLeafData();
+					}
+					break;
+				}
+				case CuckooHashTableNode::LEAF_RANGE_END:
+				{
+					// the data is stored on the range start leaf
+					//
+					lookup.rangeEnd = leaf;
+					lookup.lookupKey = leaf->GetRangeStart();
+					m_set->m_hashTable.QueryLCPPrepare(lookup.lookupKey, lookup.allPositions1, lookup.allPositions2, lookup.ExpectedHash());
+					lookup.state = State::RANGE_START_LCP;
+					return false;
+				}
+			}
+			retry = (leaf->LoadGeneration() > generation);
+			return true;
+		}
+		case State::RANGE_START_LCP:
+		{
+			CuckooHashTableNode* leaf;
+			int ret = ResolveLeaf(lookup, generation, leaf /*out*/);
+			if (ret < 0)
+			{
+				retry = true;
+				return true;
+			}
+			result.data = (ret > 0) ? leaf->GetLeafData() : nullptr;
+			retry = (lookup.rangeEnd->LoadGeneration() > generation) || (ret > 0 && leaf->LoadGeneration() > generation);
+			return true;
+		}
+	}
+	assert(false);
+	return true;
+}
+
+void InterleavedLookupEngine::RunSingle(const Request& request, Result& result)
+{
+	switch (request.type)
+	{
+		case LookupType::EXIST:
+		{
+			result.found = m_set->Exist(request.key);
+			break;
+		}
+		case LookupType::LOWER_BOUND:
+		{
+			result.value = m_set->LowerBound(request.key, result.found);
+			break;
+		}
+		case LookupType::RANGE_LOAD:
+		{
+			assert(m_tree != nullptr);
+			result.data = m_tree->Load(request.key);
+			break;
+		}
+	}
+}
+
+void InterleavedLookupEngine::Run(const Request* requests, size_t n, Result* results)
+{
+	size_t retries[ROUND_SIZE];
+	for (size_t start = 0; start < n; start += ROUND_SIZE)
+	{
+		size_t end = min(n, start + ROUND_SIZE);
+		size_t numRetries = 0;
+		bool roundValid;
+		{
+			ReaderGenerationGuard generation_guard = m_set->ReaderGeneration();
+			uint32_t generation = generation_guard.generation();
+
+			int numActive = 0;
+			size_t next = start;
+			while (numActive < m_width && next < end)
+			{
+				Start(m_lookups[numActive++], requests, next++);
+			}
+			// Round-robin over the lookups in flight, refilling a finished lookup's place with a new request
+			//
+			while (numActive > 0)
+			{
+				int i = 0;
+				while (i < numActive)
+				{
+					Lookup& lookup = m_lookups[i];
+					bool retry;
+					if (!Step(lookup, generation, results, retry /*out*/))
+					{
+						i++;
+						continue;
+					}
+					if (unlikely(retry))
+					{
+						retries[numRetries++] = lookup.index;
+					}
+					if (next < end)
+					{
+						Start(lookup, requests, next++);
+						i++;
+					}
+					else
+					{
+						numActive--;
+						lookup = m_lookups[numActive];
+					}
+				}
+			}
+			roundValid = !(generation > m_set->cur_generation.load() || m_set->m_hashTable.ResizedSince(generation_guard.resizeSeq()));
+		}
+
+		// Fall back to the single key path (which retries on its own),
+		// after our reader generation has been released
+		//
+		if (unlikely(!roundValid))
+		{
+			for (size_t i = start; i < end; i++)
+			{
+				RunSingle(requests[i], results[i]);
+			}
+			continue;
+		}
+		rep(k, 0, int(numRetries) - 1)
+		{
+			RunSingle(requests[retries[k]], results[retries[k]]);
+		}
+	}
+}
+
+}	// namespace MlpSetUInt64
@@ -0,0 +1,121 @@
+#pragma once
+
+#include "MlpSetUInt64.h"
+#include "MlpSetUInt64Range.h"
+
+namespace MlpSetUInt64
+{
+
+// Executes many independent point lookups on one thread by interleaving them
+// Every lookup is a small state machine: each step consumes the cache lines prefetched by the previous step,
+// issues the prefetches for the next one and yields, so that the DRAM accesses of up to 'width' lookups overlap
+// Hand-rolled rather than C++20 coroutines since the code base is C++17
+//
+class InterleavedLookupEngine
+{
+public:
+	enum class LookupType : uint8_t
+	{
+		EXIST,
+		LOWER_BOUND,
+		RANGE_LOAD
+	};
+
+	struct Request
+	{
+		LookupType type;
+		uint64_t key;
+	};
+
+	// EXIST: found tells if the key exists
+	// LOWER_BOUND: found and value are the same as the output of MlpSet::LowerBound
+	// RANGE_LOAD: data is the same as the output of MlpRangeTree::Load
+	//
+	struct Result
+	{
+		bool found;
+		uint64_t value;
+		void* data;
+	};
+
+	// RANGE_LOAD requests are only allowed if the engine is constructed on a MlpRangeTree
+	//
+	InterleavedLookupEngine(MlpSet* set, int width = DEFAULT_WIDTH);
+	InterleavedLookupEngine(MlpRangeTree* tree, int width = DEFAULT_WIDTH);
+
+	// Execute requests[0, n), the result of requests[i] is written to results[i]
+	// Readers may run concurrently with the single writer, as with the single key APIs
+	//
+	void Run(const Request* requests, size_t n, Result* results);
+
+	// default number of lookups in flight
+	//
+	static constexpr int DEFAULT_WIDTH = 16;
+	// number of lookups executed under a single reader generation
+	//
+	static constexpr size_t ROUND_SIZE = 256;
+
+private:
+	enum class State : uint8_t
+	{
+		// waiting for the slots of the key's prefixes (Exist)
+		//
+		EXIST_LCP,
+		// waiting for the slots of the key's prefixes (LowerBound)
+		//
+		LOWER_BOUND_LCP,
+		// waiting for the node holding the lower bound
+		//
+		LOWER_BOUND_PROMISE,
+		// waiting for the slots of the lower bound leaf (RangeTree Load)
+		//
+		LEAF_LCP,
+		// waiting for the slots of the range start leaf (RangeTree Load)
+		//
+		RANGE_START_LCP
+	};
+
+	struct Lookup
+	{
+		State state;
+		LookupType type;
+		size_t index;
+		uint64_t key;
+		// key of the node currently being looked up in the hash table
+		//
+		uint64_t lookupKey;
+		CuckooHashTableNode* rangeEnd;
+		MlpSet::Promise promise;
+		HtPosition allPositions1[8];
+		HtPosition allPositions2[8];
+		uint64_t expectedHash[4];
+
+		uint32_t* ExpectedHash() { return reinterpret_cast<uint32_t*>(expectedHash); }
+	};
+
+	// Issue the first prefetches of requests[index]
+	//
+	void Start(Lookup& lookup, const Request* requests, size_t index);
+
+	// Execute one step of the lookup
+	// Returns true if the lookup is finished, in which case retry tells if it ran into
+	// a concurrent modification and must be executed again
+	//
+	bool Step(Lookup& lookup, uint32_t generation, Result* results, bool& retry);
+
+	// Find the leaf node for the lookup key using the slots prepared in lookup
+	// returns -1 on generation mismatch, 0 if the leaf doesn't exist, 1 otherwise
+	//
+	int ResolveLeaf(Lookup& lookup, uint32_t generation, CuckooHashTableNode*& leaf);
+
+	// Execute a single request without interleaving
+	//
+	void RunSingle(const Request& request, Result& result);
+
+	MlpSet* m_set;
+	MlpRangeTree* m_tree;
+	int m_width;
+	std::vector<Lookup> m_lookups;
+};
+
+}	// namespace MlpSetUInt64
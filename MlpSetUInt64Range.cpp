@@ -37,9 +37,8 @@ MlpRangeTree::NodeResult MlpRangeTree::QueryLCPWithNode(uint64_t key, uint32_t g
     
     // Now locate the node using QueryLCP
     uint32_t ilen;
-    uint64_t _allPositions1[4], _allPositions2[4], _expectedHash[4];
-    uint32_t* allPositions1 = reinterpret_cast<uint32_t*>(_allPositions1);
-    uint32_t* allPositions2 = reinterpret_cast<uint32_t*>(_allPositions2);
+    HtPosition allPositions1[8], allPositions2[8];
+    uint64_t _expectedHash[4];
     uint32_t* expectedHash = reinterpret_cast<uint32_t*>(_expectedHash);
     
     int lcpLen = m_hashTable.QueryLCPInternal(lowerBoundKey, ilen, 
@@ -53,7 +52,7 @@ MlpRangeTree::NodeResult MlpRangeTree::QueryLCPWithNode(uint64_t key, uint32_t g
     
     if (lcpLen == 8) {
         // It's a leaf - find which position has it
-        uint32_t pos = allPositions1[ilen-1];
+        HtPosition pos = allPositions1[ilen-1];
         CuckooHashTableNode* node = &m_hashTable.ht[pos];
         
         if (!node->IsEqualNoHash(lowerBoundKey, ilen)) {
@@ -110,7 +109,7 @@ void* MlpRangeTree::Load(uint64_t key) {
         if (result.node->LoadGeneration() > generation) {
             continue;
         }
-        if (generation > cur_generation.load()) {
+        if (generation > cur_generation.load() || m_hashTable.ResizedSince(generation_guard.resizeSeq())) {
             continue;
         }
         return ret_val;
@@ -137,9 +136,8 @@ bool MlpRangeTree::InsertSinglePoint(uint64_t key, void* value) { //
 
     // Find the node we just inserted
     uint32_t ilen;
-    uint64_t _allPositions1[4], _allPositions2[4], _expectedHash[4];
-    uint32_t* allPositions1 = reinterpret_cast<uint32_t*>(_allPositions1);
-    uint32_t* allPositions2 = reinterpret_cast<uint32_t*>(_allPositions2);
+    HtPosition allPositions1[8], allPositions2[8];
+    uint64_t _expectedHash[4];
     uint32_t* expectedHash = reinterpret_cast<uint32_t*>(_expectedHash);
     
     int lcpLen = m_hashTable.QueryLCPInternal(key, ilen, 
@@ -147,7 +145,7 @@ bool MlpRangeTree::InsertSinglePoint(uint64_t key, void* value) { //
                                         expectedHash, UINT32_MAX);
     
     if (lcpLen == 8) {
-        uint32_t pos = allPositions1[ilen-1];
+        HtPosition pos = allPositions1[ilen-1];
         CuckooHashTableNode* node = &m_hashTable.ht[pos];
         node->SetGeneration(generation);
         if (!node->IsEqualNoHash(key, ilen)) {
@@ -171,7 +169,7 @@ bool MlpRangeTree::StoreRange(uint64_t start, uint64_t end, void* value) { //
     ResetGenerationsIfNeeded(generation);
 
     // Clear any overlapping ranges/values
-    ClearRange(start, end);
+    ClearRange(start, end, generation);
     
     // Insert the new range
     bool inserted = InsertRangeNodes(start, end, value, generation);
@@ -216,9 +214,8 @@ bool MlpRangeTree::InsertRangeNodes(uint64_t start, uint64_t end, void* value, u
     // Configure end node
     {
         uint32_t ilen;
-        uint64_t _allPositions1[4], _allPositions2[4], _expectedHash[4];
-        uint32_t* allPositions1 = reinterpret_cast<uint32_t*>(_allPositions1);
-        uint32_t* allPositions2 = reinterpret_cast<uint32_t*>(_allPositions2);
+        HtPosition allPositions1[8], allPositions2[8];
+        uint64_t _expectedHash[4];
         uint32_t* expectedHash = reinterpret_cast<uint32_t*>(_expectedHash);
         
         int lcpLen = m_hashTable.QueryLCPInternal(end, ilen, 
@@ -226,7 +223,7 @@ bool MlpRangeTree::InsertRangeNodes(uint64_t start, uint64_t end, void* value, u
                                                   expectedHash, UINT32_MAX);
         
         if (lcpLen == 8) {
-            uint32_t pos = allPositions1[ilen-1];
+            HtPosition pos = allPositions1[ilen-1];
             CuckooHashTableNode* node = &m_hashTable.ht[pos];
             node->SetGeneration(generation);
             if (!node->IsEqualNoHash(end, ilen)) {
@@ -248,9 +245,8 @@ bool MlpRangeTree::InsertRangeNodes(uint64_t start, uint64_t end, void* value, u
     // Configure start node
     {
         uint32_t ilen;
-        uint64_t _allPositions1[4], _allPositions2[4], _expectedHash[4];
-        uint32_t* allPositions1 = reinterpret_cast<uint32_t*>(_allPositions1);
-        uint32_t* allPositions2 = reinterpret_cast<uint32_t*>(_allPositions2);
+        HtPosition allPositions1[8], allPositions2[8];
+        uint64_t _expectedHash[4];
         uint32_t* expectedHash = reinterpret_cast<uint32_t*>(_expectedHash);
         
         int lcpLen = m_hashTable.QueryLCPInternal(start, ilen, 
@@ -258,7 +254,7 @@ bool MlpRangeTree::InsertRangeNodes(uint64_t start, uint64_t end, void* value, u
                                                   expectedHash, UINT32_MAX);
         
         if (lcpLen == 8) {
-            uint32_t pos = allPositions1[ilen-1];
+            HtPosition pos = allPositions1[ilen-1];
             CuckooHashTableNode* node = &m_hashTable.ht[pos];
             node->SetGeneration(generation);
             if (!node->IsEqualNoHash(start, ilen)) {
@@ -274,9 +270,28 @@ bool MlpRangeTree::InsertRangeNodes(uint64_t start, uint64_t end, void* value, u
     return true;
 }
 
-void MlpRangeTree::ClearRange(uint64_t start, uint64_t end) {
-    std::vector<std::pair<uint64_t, uint64_t>> rangesToRemove;
-    std::vector<uint64_t> pointsToRemove;
+CuckooHashTableNode* MlpRangeTree::WriterFindLeaf(uint64_t key) {
+    uint32_t ilen;
+    HtPosition allPositions1[8], allPositions2[8];
+    uint64_t _expectedHash[4];
+    uint32_t* expectedHash = reinterpret_cast<uint32_t*>(_expectedHash);
+    
+    int lcpLen = m_hashTable.QueryLCPInternal(key, ilen, 
+                                              allPositions1, allPositions2, 
+                                              expectedHash, UINT32_MAX);
+    if (lcpLen != 8) {
+        return nullptr;
+    }
+    CuckooHashTableNode* node = &m_hashTable.ht[allPositions1[ilen-1]];
+    if (!node->IsEqualNoHash(key, ilen)) {
+        node = &m_hashTable.ht[allPositions2[ilen-1]];
+    }
+    return node;
+}
+
+void MlpRangeTree::ClearRange(uint64_t start, uint64_t end, uint32_t generation) {
+    // Leaves to remove, collected in increasing order
+    std::vector<uint64_t> keysToRemove;
     
     NodeResult current = QueryLCPWithNode(start, UINT32_MAX);
     
@@ -284,7 +299,8 @@ void MlpRangeTree::ClearRange(uint64_t start, uint64_t end) {
     if (current.found && current.node->IsLeaf() && 
         current.node->GetLeafType() == CuckooHashTableNode::LEAF_RANGE_END) {
         uint64_t rangeStart = current.node->GetRangeStart();
-        rangesToRemove.push_back({rangeStart, current.key});
+        keysToRemove.push_back(rangeStart);
+        keysToRemove.push_back(current.key);
         current = QueryLCPWithNode(current.key + 1, UINT32_MAX);
     }
     
@@ -300,7 +316,7 @@ void MlpRangeTree::ClearRange(uint64_t start, uint64_t end) {
         
         switch (type) {
             case CuckooHashTableNode::LEAF_SINGLE:
-                pointsToRemove.push_back(current.key);
+                keysToRemove.push_back(current.key);
                 break;
                 
             case CuckooHashTableNode::LEAF_RANGE_START:
@@ -309,7 +325,8 @@ void MlpRangeTree::ClearRange(uint64_t start, uint64_t end) {
                     NodeResult endResult = QueryLCPWithNode(current.key + 1, UINT32_MAX);
                     if (endResult.found && endResult.node->IsLeaf() && 
                         endResult.node->GetLeafType() == CuckooHashTableNode::LEAF_RANGE_END) {
-                        rangesToRemove.push_back({current.key, endResult.key});
+                        keysToRemove.push_back(current.key);
+                        keysToRemove.push_back(endResult.key);
                         nextKey = endResult.key + 1;
                     }
                 }
@@ -320,19 +337,121 @@ void MlpRangeTree::ClearRange(uint64_t start, uint64_t end) {
                 break;
         }
         
+        if (nextKey == 0) {
+            // wrapped around after UINT64_MAX
+            break;
+        }
         current = QueryLCPWithNode(nextKey, UINT32_MAX);
     }
     
-    // Remove all collected ranges
-    for (const auto& range : rangesToRemove) {
-        MlpSet::Remove(range.first, UINT32_MAX);   // Remove start // TODO: Fix after Shai finishes!!!!
-        MlpSet::Remove(range.second, UINT32_MAX);  // Remove end // TODO: Fix after Shai finishes!!!!
+    if (keysToRemove.empty()) {
+        return;
+    }
+    // No other leaf lies between the collected ones, so they can be removed together
+    std::optional<uint64_t> successor;
+    if (keysToRemove.back() != UINT64_MAX) {
+        bool found;
+        uint64_t next = WriterLowerBound(keysToRemove.back() + 1, found);
+        if (found) {
+            successor = next;
+        }
+    }
+    RemoveSortedKeys(keysToRemove.data(), keysToRemove.size(), successor, generation);
+}
+
+bool MlpRangeTree::EraseRange(uint64_t start, uint64_t end) {
+    if (start > end) return false;
+    
+    NodeResult current = QueryLCPWithNode(start, UINT32_MAX);
+    if (!current.found || !current.node->IsLeaf()) {
+        return false;
+    }
+    
+    // A range starting before start keeps its part before start
+    bool truncateLeft = false;
+    uint64_t leftStart = 0;
+    void* leftValue = nullptr;
+    if (current.node->GetLeafType() == CuckooHashTableNode::LEAF_RANGE_END && 
+        current.node->GetRangeStart() < start) {
+        truncateLeft = true;
+        leftStart = current.node->GetRangeStart();
+        leftValue = WriterFindLeaf(leftStart)->GetLeafData();
+    }
+    
+    // Collect the leaves in [start, end], in increasing order
+    std::vector<uint64_t> keysToRemove;
+    bool hasNext = true;
+    uint64_t next = current.key;
+    while (hasNext && next <= end) {
+        keysToRemove.push_back(next);
+        if (next == UINT64_MAX) {
+            hasNext = false;
+            break;
+        }
+        next = WriterLowerBound(next + 1, hasNext);
+    }
+    
+    // A range ending after end keeps its part after end, it may be the same range as above
+    bool truncateRight = false;
+    uint64_t rightEnd = 0;
+    void* rightValue = nullptr;
+    if (hasNext) {
+        CuckooHashTableNode* node = WriterFindLeaf(next);
+        if (node->GetLeafType() == CuckooHashTableNode::LEAF_RANGE_END && node->GetRangeStart() <= end) {
+            truncateRight = true;
+            rightEnd = next;
+            rightValue = (node->GetRangeStart() < start) ? leftValue : WriterFindLeaf(node->GetRangeStart())->GetLeafData();
+        }
+    }
+    
+    if (keysToRemove.empty() && !truncateRight) {
+        return false;
     }
     
-    // Remove all collected points
-    for (uint64_t point : pointsToRemove) {
-        MlpSet::Remove(point, UINT32_MAX);   // TODO: Fix after Shai finishes!!!!
+    uint32_t generation = cur_generation.load() + 1;
+    ResetGenerationsIfNeeded(generation);
+    
+    std::optional<uint64_t> successor;
+    if (hasNext) {
+        successor = next;
     }
+    RemoveSortedKeys(keysToRemove.data(), keysToRemove.size(), successor, generation);
+    
+    // The remaining parts of the boundary ranges become single points if they are down to one key
+    if (truncateLeft) {
+        if (leftStart == start - 1) {
+            CuckooHashTableNode* node = WriterFindLeaf(leftStart);
+            node->SetGeneration(generation);
+            node->SetLeafType(CuckooHashTableNode::LEAF_SINGLE);
+        } else {
+            MlpSet::Insert(start - 1, generation);
+            CuckooHashTableNode* node = WriterFindLeaf(start - 1);
+            node->SetGeneration(generation);
+            node->SetLeafType(CuckooHashTableNode::LEAF_RANGE_END);
+            node->SetRangeStart(leftStart);
+        }
+    }
+    if (truncateRight) {
+        if (end + 1 == rightEnd) {
+            CuckooHashTableNode* node = WriterFindLeaf(rightEnd);
+            node->SetGeneration(generation);
+            node->SetLeafType(CuckooHashTableNode::LEAF_SINGLE);
+            node->SetLeafData(rightValue);
+        } else {
+            MlpSet::Insert(end + 1, generation);
+            CuckooHashTableNode* node = WriterFindLeaf(end + 1);
+            node->SetGeneration(generation);
+            node->SetLeafType(CuckooHashTableNode::LEAF_RANGE_START);
+            node->SetLeafData(rightValue);
+            // the insertion may have moved the end node around
+            node = WriterFindLeaf(rightEnd);
+            node->SetGeneration(generation);
+            node->SetRangeStart(end + 1);
+        }
+    }
+    
+    cur_generation.store(generation);
+    return true;
 }
 
 bool MlpRangeTree::Erase(uint64_t key) { //
@@ -444,7 +563,7 @@ bool MlpRangeTree::FindNext(uint64_t from, uint64_t& rangeStart, uint64_t& range
         if (result.node->LoadGeneration() > generation) {
             continue;
         }
-        if (generation > cur_generation.load()) {
+        if (generation > cur_generation.load() || m_hashTable.ResizedSince(generation_guard.resizeSeq())) {
             continue;
         }
         return ret_val;
@@ -504,6 +623,11 @@ MlpRangeTree::Iterator::Iterator(MlpRangeTree* t, uint64_t start)
 
 void MlpRangeTree::Iterator::Next() {
     if (!valid) return;
+    // nextSearchKey wrapped around, there is nothing after UINT64_MAX
+    if (currentEnd == UINT64_MAX) {
+        valid = false;
+        return;
+    }
     
     QueryAndReturnIfNotValid(result, nextSearchKey, starting_generation);
     
@@ -547,4 +671,43 @@ void MlpRangeTree::Iterator::Next() {
     }
 }
 
+void MlpRangeTree::Iterator::Prev() {
+    if (!valid) return;
+    if (currentStart == 0) {
+        valid = false;
+        return;
+    }
+    
+    // The last key before the current entry is a single point or the end of a range
+    bool found;
+    uint64_t key;
+    if (!tree->PredecessorInternal(currentStart - 1, found, key, starting_generation) || !found) {
+        valid = false;
+        return;
+    }
+    QueryAndReturnIfNotValid(result, key, starting_generation);
+    
+    switch (result.node->GetLeafType()) {
+        case CuckooHashTableNode::LEAF_SINGLE:
+            currentStart = currentEnd = result.key;
+            currentValue = result.node->GetLeafData();
+            break;
+            
+        case CuckooHashTableNode::LEAF_RANGE_END:
+            currentEnd = result.key;
+            currentStart = result.node->GetRangeStart();
+            // Get value from start node
+            {
+                QueryAndReturnIfNotValid(startResult, currentStart, starting_generation);
+                currentValue = startResult.node->GetLeafData();
+            }
+            break;
+            
+        default:
+            valid = false;
+            return;
+    }
+    nextSearchKey = currentEnd + 1;
+}
+
 } // namespace MlpSetUInt64
@@ -6,6 +6,9 @@ namespace MlpSetUInt64 {
 
 class MlpRangeTree : public MlpSet {
 public:
+    // The leaves are edited in place after MlpSet::Insert, so the hash table grows synchronously
+    MlpRangeTree() { m_incrementalGrowth = false; }
+
     // Initialize the range tree
     using MlpSet::Init;  // Use parent's Init
     bool InsertSinglePoint(uint64_t key, void* value);
@@ -22,8 +25,11 @@ public:
     // Erase the entire range containing the key
     bool Erase(uint64_t key);
     
-    // Erase a specific range [start, end]
-    // bool EraseRange(uint64_t start, uint64_t end);
+    // Erase everything stored in [start, end]: the entries inside are removed and the ranges crossing
+    // start or end are truncated to their part outside [start, end] (a range covering all of it is split in two)
+    // Takes a single writer generation and time proportional to the number of entries affected
+    // Returns false if nothing was stored in [start, end]
+    bool EraseRange(uint64_t start, uint64_t end);
     
     // Find next range from index upwards
     bool FindNext(uint64_t from, uint64_t& rangeStart, uint64_t& rangeEnd, void*& value);
@@ -39,6 +45,9 @@ public:
         // Move to next entry
         void Next();
         
+        // Move to previous entry (the one ending right before StartKey())
+        void Prev();
+        
         // Get current entry details - all inline for performance
         uint64_t StartKey() const { return currentStart; }
         uint64_t EndKey() const { return currentEnd; }
@@ -102,8 +111,11 @@ private:
     // Enhanced QueryLCP that returns the node pointer
     NodeResult QueryLCPWithNode(uint64_t key, uint32_t generation);
     
+    // Writer-side lookup of the leaf of key (nullptr if key isn't in the set)
+    CuckooHashTableNode* WriterFindLeaf(uint64_t key);
+    
     // Range operations helpers
-    void ClearRange(uint64_t start, uint64_t end);
+    void ClearRange(uint64_t start, uint64_t end, uint32_t generation);
     bool InsertRangeNodes(uint64_t start, uint64_t end, void* value, uint32_t generation);
 };
 
@@ -0,0 +1,176 @@
+#pragma once
+
+#include "MlpSetUInt64.h"
+#include <memory>
+
+namespace MlpSetUInt64
+{
+
+// A front-end splitting the key space by the top log2(N) bits into N independent MlpSets
+// Every shard has its own writer generation and writer lock, so writers on different shards
+// proceed fully in parallel. Any thread may call Insert and Remove, readers are lock-free.
+//
+template<int N>
+class ShardedMlpSet
+{
+public:
+	static_assert(N >= 1 && N <= 256 && (N & (N - 1)) == 0, "the number of shards must be a power of 2 up to 256");
+
+	ShardedMlpSet()
+		: m_shards(new Shard[N])
+	{
+		for (int i = 0; i < NUM_OCCUPANCY_WORDS; i++)
+		{
+			m_occupied[i].store(0);
+		}
+	}
+
+	// maxSetSize is the expected size of the whole set, every shard starts with an even part of it
+	// Every shard maps the full 2MB of top level bitmaps, but only writes to the 1/N of them covering its
+	// key range, and the rest is never backed by memory (see MlpSet::MemoryStats::topLevelBitmapResidentBytes).
+	// That relies on 4KB pages: with huge page backing each shard touches at least one whole 2MB page
+	//
+	void Init(uint32_t maxSetSize, const MemoryPolicy& memoryPolicy = MemoryPolicy())
+	{
+		for (int i = 0; i < N; i++)
+		{
+			m_shards[i].set.Init(maxSetSize / N, memoryPolicy);
+		}
+	}
+
+	bool Insert(uint64_t value)
+	{
+		Shard& shard = m_shards[ShardOf(value)];
+		std::lock_guard<std::mutex> lock(shard.writerMutex);
+		// The shard is marked before the key becomes visible, so LowerBound never skips it
+		// The bitmap is shared by all writers, so it is only written when the bit actually changes
+		//
+		if (shard.size == 0)
+		{
+			SetOccupied(ShardOf(value), true);
+		}
+		bool inserted = shard.set.Insert(value);
+		if (inserted)
+		{
+			shard.size++;
+		}
+		return inserted;
+	}
+
+	bool Remove(uint64_t value)
+	{
+		Shard& shard = m_shards[ShardOf(value)];
+		std::lock_guard<std::mutex> lock(shard.writerMutex);
+		bool removed = shard.set.Remove(value);
+		if (removed)
+		{
+			shard.size--;
+			if (shard.size == 0)
+			{
+				SetOccupied(ShardOf(value), false);
+			}
+		}
+		return removed;
+	}
+
+	bool Exist(uint64_t value)
+	{
+		return m_shards[ShardOf(value)].set.Exist(value);
+	}
+
+	// Returns the minimum value greater or equal to the specified value
+	// set `found` to false and return -1 if specified value is larger than all values in set
+	// Falls through to the next non-empty shard according to the shard occupancy bitmap
+	//
+	uint64_t LowerBound(uint64_t value, bool& found)
+	{
+		int shardIdx = ShardOf(value);
+		if (IsOccupied(shardIdx))
+		{
+			uint64_t result = m_shards[shardIdx].set.LowerBound(value, found);
+			if (found)
+			{
+				return result;
+			}
+		}
+		for (shardIdx = NextOccupied(shardIdx + 1); shardIdx < N; shardIdx = NextOccupied(shardIdx + 1))
+		{
+			// the shard may have been emptied since the bitmap was read
+			//
+			uint64_t result = m_shards[shardIdx].set.LowerBound(ShardBase(shardIdx), found);
+			if (found)
+			{
+				return result;
+			}
+		}
+		found = false;
+		return 0xffffffffffffffffULL;
+	}
+
+	static int ShardOf(uint64_t value)
+	{
+		return (SHARD_BITS == 0) ? 0 : int(value >> (64 - SHARD_BITS));
+	}
+
+	static uint64_t ShardBase(int shardIdx)
+	{
+		return (SHARD_BITS == 0) ? 0 : (uint64_t(shardIdx) << (64 - SHARD_BITS));
+	}
+
+	// For debug purposes only
+	//
+	MlpSet& GetShard(int shardIdx) { return m_shards[shardIdx].set; }
+
+private:
+	static constexpr int SHARD_BITS = __builtin_ctz(N);
+	static constexpr int NUM_OCCUPANCY_WORDS = (N + 63) / 64;
+
+	// Shards are cache line aligned so that the writer state of one doesn't false-share with its neighbours
+	//
+	struct alignas(64) Shard
+	{
+		MlpSet set;
+		std::mutex writerMutex;
+		// number of keys, only accessed under writerMutex
+		//
+		uint64_t size = 0;
+	};
+
+	bool IsOccupied(int shardIdx)
+	{
+		return (m_occupied[shardIdx / 64].load() & (uint64_t(1) << (shardIdx % 64))) != 0;
+	}
+
+	void SetOccupied(int shardIdx, bool on)
+	{
+		if (on)
+		{
+			m_occupied[shardIdx / 64].fetch_or(uint64_t(1) << (shardIdx % 64));
+		}
+		else
+		{
+			m_occupied[shardIdx / 64].fetch_and(~(uint64_t(1) << (shardIdx % 64)));
+		}
+	}
+
+	// The first occupied shard >= shardIdx, or N if there is none
+	//
+	int NextOccupied(int shardIdx)
+	{
+		while (shardIdx < N)
+		{
+			uint64_t x = m_occupied[shardIdx / 64].load() >> (shardIdx % 64);
+			if (x)
+			{
+				return std::min(N, shardIdx + __builtin_ctzll(x));
+			}
+			shardIdx = (shardIdx / 64 + 1) * 64;
+		}
+		return N;
+	}
+
+	std::unique_ptr<Shard[]> m_shards;
+	std::atomic<uint64_t> m_occupied[NUM_OCCUPANCY_WORDS];
+};
+
+}	// namespace MlpSetUInt64
@@ -0,0 +1,253 @@
+#include "MlpSetUInt64.h"
+#include <string>
+
+namespace MlpSetUInt64
+{
+
+namespace
+{
+
+// Image layout (all sections are page aligned):
+//     header
+//     top level bitmaps chunk (m_memoryPtr)
+//     hash table chunk (m_hashTableMemoryPtr), with the external bitmap pointers
+//         rewritten to their address in the image mapped at preferredBase
+//     external bitmaps, 32 bytes each
+//     hash table positions of the nodes pointing to the external bitmaps, used to relocate them
+//         if the image can't be mapped at preferredBase
+//
+struct SnapshotHeader
+{
+	char magic[8];
+	uint32_t version;
+	// the image can only be opened by a build with the same node layout
+	//
+	uint32_t nodeSize;
+	uint32_t htPositionSize;
+	uint32_t generation;
+	uint64_t fileSize;
+	uint64_t preferredBase;
+	uint64_t topLevelOffset;
+	uint64_t topLevelSize;
+	uint64_t hashTableOffset;
+	uint64_t hashTableSize;
+	uint64_t htMask;
+	uint64_t numNodes;
+	uint64_t bitmapsOffset;
+	uint64_t numBitmaps;
+	uint64_t relocationsOffset;
+};
+
+const char SNAPSHOT_MAGIC[8] = { 'M', 'L', 'P', 'S', 'N', 'A', 'P', '\0' };
+// Version 2: nodes are placed in 2-slot buckets, an image of version 1 would be searched at the wrong slots
+// Version 3: the hash table is followed by its stash
+//
+const uint32_t SNAPSHOT_VERSION = 3;
+const uint64_t SNAPSHOT_PAGE_SIZE = 4096;
+// Mapping the image at this address makes the external bitmap pointers valid as they are,
+// so the image pages are never written and stay shared between processes
+//
+const uint64_t SNAPSHOT_PREFERRED_BASE = 0x200000000000ULL;
+
+uint64_t RoundUpToPage(uint64_t x)
+{
+	return (x + SNAPSHOT_PAGE_SIZE - 1) / SNAPSHOT_PAGE_SIZE * SNAPSHOT_PAGE_SIZE;
+}
+
+bool WriteAll(int fd, const void* buf, uint64_t len, uint64_t offset)
+{
+	const char* ptr = reinterpret_cast<const char*>(buf);
+	while (len > 0)
+	{
+		ssize_t ret = pwrite(fd, ptr, len, offset);
+		if (ret <= 0)
+		{
+			return false;
+		}
+		ptr += ret;
+		len -= ret;
+		offset += ret;
+	}
+	return true;
+}
+
+bool ReadAll(int fd, void* buf, uint64_t len, uint64_t offset)
+{
+	char* ptr = reinterpret_cast<char*>(buf);
+	while (len > 0)
+	{
+		ssize_t ret = pread(fd, ptr, len, offset);
+		if (ret <= 0)
+		{
+			return false;
+		}
+		ptr += ret;
+		len -= ret;
+		offset += ret;
+	}
+	return true;
+}
+
+}	// anonymous namespace
+
+bool MlpSet::SaveTo(const char* path)
+{
+	assert(m_hasCalledInit);
+	uint64_t htSize = m_hashTable.htMask + 1;
+	uint64_t gap, htMemorySize;
+	GetHashTableMemoryLayout(htSize, gap /*out*/, htMemorySize /*out*/);
+
+	// Only nodes hold pointers, the gap slots around the table are internal bitmaps
+	//
+	std::vector<uint64_t> pointerNodes;
+	for (uint64_t i = 0; i < m_hashTable.NumSlots(); i++)
+	{
+		CuckooHashTableNode& node = m_hashTable.ht[i];
+		if (node.IsOccupiedAndNode() && !node.IsLeaf() && !node.IsUsingInternalChildMap() && node.IsExternalPointerBitMap())
+		{
+			pointerNodes.push_back(i);
+		}
+	}
+
+	SnapshotHeader header;
+	memset(&header, 0, sizeof header);
+	memcpy(header.magic, SNAPSHOT_MAGIC, sizeof header.magic);
+	header.version = SNAPSHOT_VERSION;
+	header.nodeSize = sizeof(CuckooHashTableNode);
+	header.htPositionSize = sizeof(HtPosition);
+	header.generation = cur_generation.load();
+	header.preferredBase = SNAPSHOT_PREFERRED_BASE;
+	header.topLevelOffset = RoundUpToPage(sizeof header);
+	header.topLevelSize = m_allocatedSize;
+	header.hashTableOffset = RoundUpToPage(header.topLevelOffset + header.topLevelSize);
+	header.hashTableSize = htMemorySize;
+	header.htMask = m_hashTable.htMask;
+	header.numNodes = m_hashTable.numNodes;
+	header.bitmapsOffset = RoundUpToPage(header.hashTableOffset + header.hashTableSize);
+	header.numBitmaps = pointerNodes.size();
+	header.relocationsOffset = header.bitmapsOffset + header.numBitmaps * ExternalBitMapPool::BITMAP_SIZE;
+	header.fileSize = header.relocationsOffset + header.numBitmaps * sizeof(uint64_t);
+
+	// Write to a temporary file and rename it, so that path always holds a complete image
+	//
+	std::string tmpPath = std::string(path) + ".tmp";
+	int fd = open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+	{
+		return false;
+	}
+	bool ok = WriteAll(fd, &header, sizeof header, 0);
+	ok = ok && WriteAll(fd, m_memoryPtr, header.topLevelSize, header.topLevelOffset);
+	ok = ok && WriteAll(fd, m_hashTableMemoryPtr, header.hashTableSize, header.hashTableOffset);
+	for (uint64_t k = 0; k < pointerNodes.size() && ok; k++)
+	{
+		CuckooHashTableNode& node = m_hashTable.ht[pointerNodes[k]];
+		uint64_t bitmapOffset = header.bitmapsOffset + k * ExternalBitMapPool::BITMAP_SIZE;
+		uint64_t relocated = header.preferredBase + bitmapOffset;
+		uint64_t childMapOffset = header.hashTableOffset +
+		                          (reinterpret_cast<uintptr_t>(&node.childMap) - reinterpret_cast<uintptr_t>(m_hashTableMemoryPtr));
+		ok = ok && WriteAll(fd, reinterpret_cast<void*>(node.childMap.load()), ExternalBitMapPool::BITMAP_SIZE, bitmapOffset);
+		ok = ok && WriteAll(fd, &relocated, sizeof relocated, childMapOffset);
+		ok = ok && WriteAll(fd, &pointerNodes[k], sizeof(uint64_t), header.relocationsOffset + k * sizeof(uint64_t));
+	}
+	ok = ok && (ftruncate(fd, header.fileSize) == 0) && (fsync(fd) == 0);
+	ok = (close(fd) == 0) && ok;
+	if (ok)
+	{
+		ok = (rename(tmpPath.c_str(), path) == 0);
+	}
+	if (!ok)
+	{
+		unlink(tmpPath.c_str());
+	}
+	return ok;
+}
+
+bool MlpSet::OpenMapped(const char* path)
+{
+	assert(!m_hasCalledInit);
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+	{
+		return false;
+	}
+	SnapshotHeader header;
+	struct stat st;
+	if (!ReadAll(fd, &header, sizeof header, 0) || fstat(fd, &st) != 0)
+	{
+		close(fd);
+		return false;
+	}
+	uint64_t gap, htMemorySize;
+	GetHashTableMemoryLayout(header.htMask + 1, gap /*out*/, htMemorySize /*out*/);
+	bool compatible = memcmp(header.magic, SNAPSHOT_MAGIC, sizeof header.magic) == 0 &&
+	                  header.version == SNAPSHOT_VERSION &&
+	                  header.nodeSize == sizeof(CuckooHashTableNode) &&
+	                  header.htPositionSize == sizeof(HtPosition) &&
+	                  header.fileSize == uint64_t(st.st_size) &&
+	                  header.topLevelSize == 32 + 8192 + 2 * 1024 * 1024 &&
+	                  (header.htMask & (header.htMask + 1)) == 0 &&
+	                  header.htMask < CuckooHashTable::MAX_TABLE_SIZE &&
+	                  header.hashTableSize == htMemorySize &&
+	                  header.relocationsOffset + header.numBitmaps * sizeof(uint64_t) == header.fileSize;
+	if (!compatible)
+	{
+		close(fd);
+		return false;
+	}
+
+	void* preferredBase = reinterpret_cast<void*>(header.preferredBase);
+	void* base = mmap(preferredBase, header.fileSize, PROT_READ, MAP_PRIVATE | MAP_FIXED_NOREPLACE, fd, 0 /*offset*/);
+	if (base != preferredBase)
+	{
+		// Kernels older than 4.17 treat MAP_FIXED_NOREPLACE as a hint
+		//
+		if (base != MAP_FAILED)
+		{
+			munmap(base, header.fileSize);
+		}
+		// The preferred range is taken (e.g. by another image), map anywhere and relocate the bitmap pointers
+		// This only dirties the pages of the nodes pointing to external bitmaps
+		//
+		base = mmap(nullptr, header.fileSize, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0 /*offset*/);
+		if (base == MAP_FAILED)
+		{
+			close(fd);
+			return false;
+		}
+		uintptr_t ptr = reinterpret_cast<uintptr_t>(base);
+		CuckooHashTableNode* ht = reinterpret_cast<CuckooHashTableNode*>(ptr + header.hashTableOffset + gap);
+		const uint64_t* relocations = reinterpret_cast<const uint64_t*>(ptr + header.relocationsOffset);
+		for (uint64_t k = 0; k < header.numBitmaps; k++)
+		{
+			ReleaseAssert(relocations[k] < header.htMask + 1 + CuckooHashTable::STASH_SIZE);
+			CuckooHashTableNode& node = ht[relocations[k]];
+			node.childMap.store(node.childMap.load() - header.preferredBase + ptr);
+		}
+		ReleaseAssert(mprotect(base, header.fileSize, PROT_READ) == 0);
+	}
+	close(fd);
+
+#ifndef NDEBUG
+	m_hasCalledInit = true;
+#endif
+	m_mappedImage = base;
+	m_mappedImageSize = header.fileSize;
+
+	uintptr_t ptr = reinterpret_cast<uintptr_t>(base) + header.topLevelOffset;
+	m_memoryPtr = reinterpret_cast<void*>(ptr);
+	m_allocatedSize = header.topLevelSize;
+	m_root = reinterpret_cast<std::atomic<uint64_t>*>(ptr);
+	m_treeDepth1 = reinterpret_cast<std::atomic<uint64_t>*>(ptr + 32);
+	m_treeDepth2 = reinterpret_cast<std::atomic<uint64_t>*>(ptr + 32 + 8192);
+
+	m_hashTableMemoryPtr = reinterpret_cast<void*>(reinterpret_cast<uintptr_t>(base) + header.hashTableOffset);
+	CuckooHashTableNode* ht = reinterpret_cast<CuckooHashTableNode*>(reinterpret_cast<uintptr_t>(m_hashTableMemoryPtr) + gap);
+	m_hashTable.Init(ht, header.htMask, &m_bitmapPool, true /*hasStash*/);
+	m_hashTable.numNodes = header.numNodes;
+
+	cur_generation.store(header.generation);
+	return true;
+}
+
+}	// namespace MlpSetUInt64
@@ -49,6 +49,8 @@ void test_single_points() {
 
 #include "common.h"
 #include "MlpSetUInt64.h"
+#include "MlpSetUInt64Interleaved.h"
+#include "MlpSetUInt64Sharded.h"
 #include "StupidTrie/Stupid64bitIntegerTrie.h"
 #include "WorkloadInterface.h"
 #include "WorkloadA.h"
@@ -84,12 +86,14 @@ TEST(MlpSetUInt64, VitroCuckooHashLogicCorrectness)
 	memset(allocatedPtr, 0, allocatedArrLen);
 	
 	MlpSetUInt64::CuckooHashTable ht;
+	MlpSetUInt64::ExternalBitMapPool bitmapPool;
 	
 	{
 		uintptr_t x = reinterpret_cast<uintptr_t>(allocatedPtr);
 		x += 6 * sizeof(MlpSetUInt64::CuckooHashTableNode);
 		x = x / 128 * 128;
-		ht.Init(reinterpret_cast<MlpSetUInt64::CuckooHashTableNode*>(x), HtSize - 1);
+		ht.Init(reinterpret_cast<MlpSetUInt64::CuckooHashTableNode*>(x), HtSize - 1, &bitmapPool);
+		ht.stats.Enable();
 	}
 	
 	vector<StupidUInt64Trie::TrieNodeDescriptor> data;
@@ -184,7 +188,7 @@ TEST(MlpSetUInt64, VitroCuckooHashLogicCorrectness)
 			firstChild = row->children[0];
 		}
 		bool exist, failed;
-		uint32_t pos = ht.Insert(row->ilen, row->dlen, row->minv, firstChild, exist, failed, 0);
+		HtPosition pos = ht.Insert(row->ilen, row->dlen, row->minv, firstChild, exist, failed, 0);
 		ReleaseAssert(!exist);
 		ReleaseAssert(!failed);
 		ReleaseAssert(ht.ht[pos].GetIndexKeyLen() == row->ilen);
@@ -192,7 +196,7 @@ TEST(MlpSetUInt64, VitroCuckooHashLogicCorrectness)
 		ReleaseAssert(ht.ht[pos].GetFullKey() == row->minv);
 		rep(i, 1, childCount - 1)
 		{
-			ht.ht[pos].AddChild(row->children[i], 0);
+			ht.ht[pos].AddChild(row->children[i], 0, bitmapPool);
 		}
 		if (childCount > 0)
 		{
@@ -205,10 +209,9 @@ TEST(MlpSetUInt64, VitroCuckooHashLogicCorrectness)
 		}
 	}
 	printf("Insertion complete.\n");
-#ifdef ENABLE_STATS
-	printf("Cuckoo hash table stats: %u node moves %u bitmap moves\n", 
-		   ht.stats.m_movedNodesCount, ht.stats.m_relocatedBitmapsCount);
-#endif
+	printf("Cuckoo hash table stats: %llu node moves %llu bitmap moves\n", 
+		   (unsigned long long)ht.stats.GetTotals().movedNodesCount, 
+		   (unsigned long long)ht.stats.GetTotals().relocatedBitmapsCount);
 
 	// sanity check whole hash table
 	//
@@ -257,7 +260,7 @@ TEST(MlpSetUInt64, VitroCuckooHashLogicCorrectness)
 	rept(row, data)
 	{
 		bool found;
-		uint32_t pos = ht.Lookup(row->ilen, row->minv, found);
+		HtPosition pos = ht.Lookup(row->ilen, row->minv, found);
 		ReleaseAssert(found);
 		ReleaseAssert(ht.ht[pos].GetIndexKeyLen() == row->ilen);
 		ReleaseAssert(ht.ht[pos].GetFullKeyLen() == row->dlen);
@@ -303,12 +306,14 @@ TEST(MlpSetUInt64, VitroCuckooHashQueryLcpCorrectness)
 	memset(allocatedPtr, 0, allocatedArrLen);
 	
 	MlpSetUInt64::CuckooHashTable ht;
+	MlpSetUInt64::ExternalBitMapPool bitmapPool;
 	
 	{
 		uintptr_t x = reinterpret_cast<uintptr_t>(allocatedPtr);
 		x += 6 * sizeof(MlpSetUInt64::CuckooHashTableNode);
 		x = x / 128 * 128;
-		ht.Init(reinterpret_cast<MlpSetUInt64::CuckooHashTableNode*>(x), HtSize - 1);
+		ht.Init(reinterpret_cast<MlpSetUInt64::CuckooHashTableNode*>(x), HtSize - 1, &bitmapPool);
+		ht.stats.Enable();
 	}
 	
 	const int numQueries = 1 << 15;
@@ -362,7 +367,7 @@ TEST(MlpSetUInt64, VitroCuckooHashQueryLcpCorrectness)
 			S[ilen][key] = fullKey;
 			
 			bool exist, failed;
-			uint32_t pos = ht.Insert(ilen, dlen, fullKey, (dlen == 8 ? -1 : 233) /*firstChild*/, exist, failed, 0);
+			HtPosition pos = ht.Insert(ilen, dlen, fullKey, (dlen == 8 ? -1 : 233) /*firstChild*/, exist, failed, 0);
 			ReleaseAssert(!exist);
 			ReleaseAssert(!failed);
 			ReleaseAssert(ht.ht[pos].GetIndexKeyLen() == ilen);
@@ -428,16 +433,15 @@ TEST(MlpSetUInt64, VitroCuckooHashQueryLcpCorrectness)
 		rep(i,0,numQueries - 1)
 		{
 			uint32_t ilen;
-			uint64_t _allPositions1[4], _allPositions2[4], _expectedHash[4];
-			uint32_t* allPositions1 = reinterpret_cast<uint32_t*>(_allPositions1);
-			uint32_t* allPositions2 = reinterpret_cast<uint32_t*>(_allPositions2);
+			MlpSetUInt64::HtPosition allPositions1[8], allPositions2[8];
+			uint64_t _expectedHash[4];
 			uint32_t* expectedHash = reinterpret_cast<uint32_t*>(_expectedHash);
 			int lcpLen = ht.QueryLCP(q[i], 
 			                         ilen /*out*/, 
 			                         allPositions1 /*out*/, 
 			                         allPositions2 /*out*/, 
 			                         expectedHash /*out*/,
-									 []() { return MlpSetUInt64::ReaderGenerationGuard(0, [](){});},
+									 []() { return MlpSetUInt64::ReaderGenerationGuard(0, 0); },
 									 writer_generation /*cur_generation*/);
 			actualAnswers[i].first = lcpLen;
 			if (lcpLen == 2)
@@ -446,16 +450,14 @@ TEST(MlpSetUInt64, VitroCuckooHashQueryLcpCorrectness)
 			}
 			else
 			{
-				uint32_t pos = allPositions1[ilen - 1];
+				MlpSetUInt64::HtPosition pos = allPositions1[ilen - 1];
 				actualAnswers[i].second = ht.ht[pos].minKey;
 			}
 		}
 	}
 	
 	printf("Query completed.\n");
-#ifdef ENABLE_STATS
-	printf("Hash table stats: %u slowpath count\n", ht.stats.m_slowpathCount);
-#endif
+	printf("Hash table stats: %llu slowpath count\n", (unsigned long long)ht.stats.GetTotals().slowPathCount);
 
 	printf("Validating answers..\n");
 	{
@@ -494,13 +496,13 @@ void AssertTreeShapeEqualA(StupidUInt64Trie::Trie& st, MlpSetUInt64::MlpSet& ms,
 		if (ilen >= 4)
 		{
 			bool found;
-			uint32_t pos = ms.GetHtPtr()->Lookup(3, key, found);
+			HtPosition pos = ms.GetHtPtr()->Lookup(3, key, found);
 			ReleaseAssert(found);
 		}
 		if (ilen >= 3)
 		{
 			bool found;
-			uint32_t pos = ms.GetHtPtr()->Lookup(ilen, key, found);
+			HtPosition pos = ms.GetHtPtr()->Lookup(ilen, key, found);
 			ReleaseAssert(found);
 			ReleaseAssert(ms.GetHtPtr()->ht[pos].GetIndexKeyLen() == ilen);
 			ReleaseAssert(ms.GetHtPtr()->ht[pos].GetFullKeyLen() == dlen);
@@ -614,6 +616,7 @@ TEST(MlpSetUInt64, MlpSetInsertCorrectness)
 	
 	MlpSetUInt64::MlpSet ms;
 	ms.Init(N + 1000);
+	ms.EnableStats();
 	
 	printf("MlpSet insertion..\n");
 	{
@@ -630,12 +633,11 @@ TEST(MlpSetUInt64, MlpSetInsertCorrectness)
 	printf("MlpSet insertion complete. Validating..\n");
 	AssertTreeShapeEqualA(st, ms, true /*printDetail*/);
 	printf("Test complete.\n");
-#ifdef ENABLE_STATS
-	printf("Hash table stats: %u slowpath, %u node moves, %u bitmap relocation\n", 
-	       ms.GetHtPtr()->stats.m_slowpathCount, 
-	       ms.GetHtPtr()->stats.m_movedNodesCount, 
-	       ms.GetHtPtr()->stats.m_relocatedBitmapsCount);
-#endif
+	MlpSetUInt64::MlpStats stats = ms.GetStats();
+	printf("Hash table stats: %llu slowpath, %llu node moves, %llu bitmap relocation\n", 
+	       (unsigned long long)stats.slowPathCount, 
+	       (unsigned long long)stats.movedNodesCount, 
+	       (unsigned long long)stats.relocatedBitmapsCount);
 }
 
 // Vitro test for CuckooHashTableNode::LowerBoundChild
@@ -648,6 +650,7 @@ TEST(MlpSetUInt64, VitroHtNodeLowerBoundChildCorrectness)
 	const int numTests = 10000000;
 #endif
 	printf("Vitro test for CuckooHashTableNode::LowerBoundChild..\n");
+	MlpSetUInt64::ExternalBitMapPool bitmapPool;
 	{
 		printf("Testing internal child list case..\n");
 		rep(iter, 0, numTests)
@@ -670,7 +673,7 @@ TEST(MlpSetUInt64, VitroHtNodeLowerBoundChildCorrectness)
 					if (!existed.count(x)) break;
 				}
 				existed.insert(x);
-				nd.AddChild(x, 0);
+				nd.AddChild(x, 0, bitmapPool);
 			}
 			ReleaseAssert(nd.IsUsingInternalChildMap());
 			rep(i, 0, 255)
@@ -704,7 +707,7 @@ TEST(MlpSetUInt64, VitroHtNodeLowerBoundChildCorrectness)
 					if (!existed.count(x)) break;
 				}
 				existed.insert(x);
-				nd[3].AddChild(x, 0);
+				nd[3].AddChild(x, 0, bitmapPool);
 			}
 			ReleaseAssert(!nd[3].IsUsingInternalChildMap() && !nd[3].IsExternalPointerBitMap());
 			rep(i, 0, 255)
@@ -746,7 +749,7 @@ TEST(MlpSetUInt64, VitroHtNodeLowerBoundChildCorrectness)
 					if (!existed.count(x)) break;
 				}
 				existed.insert(x);
-				nd[3].AddChild(x, 0);
+				nd[3].AddChild(x, 0, bitmapPool);
 			}
 			ReleaseAssert(!nd[3].IsUsingInternalChildMap() && nd[3].IsExternalPointerBitMap());
 			rep(i, 0, 255)
@@ -887,12 +890,10 @@ void NO_INLINE MlpSetExecuteWorkload(WorkloadUInt64& workload)
 			ms.Insert(workload.initialValues[i]);
 		}
 	}
+	printf("External bitmaps: %llu allocations served from %llu chunks\n",
+	       (unsigned long long)ms.GetExternalBitMapPool().NumAllocations(),
+	       (unsigned long long)ms.GetExternalBitMapPool().NumChunks());
 	
-#ifdef ENABLE_STATS
-	ms.ReportStats();
-	ms.ClearStats();
-#endif
-
 	printf("MlpSet executing workload..\n");
 	{
 		AutoTimer timer;
@@ -957,10 +958,6 @@ void NO_INLINE MlpSetExecuteWorkload(WorkloadUInt64& workload)
 			}
 		}
 	}
-	
-#ifdef ENABLE_STATS
-	ms.ReportStats();
-#endif
 
 	printf("MlpSet workload completed.\n");
 }
@@ -1009,6 +1006,75 @@ void NO_INLINE MlpSetExecuteWorkloadPromise(WorkloadUInt64& workload)
 	printf("MlpSet workload completed.\n");
 }
 
+// Execute the workload using the batched query APIs 
+// Consecutive queries of the same type are issued as one batch (there is no dependency between them)
+//
+void NO_INLINE MlpSetExecuteWorkloadBatch(WorkloadUInt64& workload)
+{
+	printf("MlpSet executing workload using batched queries\n");
+	MlpSetUInt64::MlpSet ms;
+	ms.Init(workload.numInitialValues + 1000);
+	
+	printf("MlpSet populating initial values..\n");
+	{
+		AutoTimer timer;
+		rep(i, 0, workload.numInitialValues - 1)
+		{
+			ms.Insert(workload.initialValues[i]);
+		}
+	}
+	
+	uint64_t* keys = new uint64_t[workload.numOperations];
+	bool* boolResults = new bool[workload.numOperations];
+	ReleaseAssert(keys != nullptr && boolResults != nullptr);
+	Auto(delete [] keys);
+	Auto(delete [] boolResults);
+	rep(i, 0, workload.numOperations - 1)
+	{
+		keys[i] = workload.operations[i].key;
+	}
+	
+	printf("MlpSet executing workload..\n");
+	{
+		AutoTimer timer;
+		uint64_t i = 0;
+		while (i < workload.numOperations)
+		{
+			WorkloadOperationType type = workload.operations[i].type;
+			uint64_t j = i;
+			while (j < workload.numOperations && workload.operations[j].type == type) { j++; }
+			switch (type)
+			{
+				case WorkloadOperationType::INSERT:
+				{
+					rep(k, i, j - 1)
+					{
+						workload.results[k] = ms.Insert(keys[k]);
+					}
+					break;
+				}
+				case WorkloadOperationType::EXIST:
+				{
+					ms.ExistBatch(keys + i, j - i, boolResults + i);
+					rep(k, i, j - 1)
+					{
+						workload.results[k] = boolResults[k];
+					}
+					break;
+				}
+				case WorkloadOperationType::LOWER_BOUND:
+				{
+					ms.LowerBoundBatch(keys + i, j - i, workload.results + i, boolResults + i);
+					break;
+				}
+			}
+			i = j;
+		}
+	}
+	
+	printf("MlpSet workload completed.\n");
+}
+
 TEST(MlpSetUInt64, WorkloadA_16M_NoDep)
 {
 	printf("Generating workload WorkloadA 16M NO-ENFORCE dep..\n");
@@ -1049,6 +1115,31 @@ TEST(MlpSetUInt64, WorkloadA_16M_Dep)
 	printf("Finished %d queries %d positives\n", int(workload.numOperations), int(sum));
 }
 
+// Run this in both the default ('make release') and the large capacity ('make release_large') build 
+// to measure the cost of 64-bit hash table positions
+//
+TEST(MlpSetUInt64, WorkloadA_80M_Dep)
+{
+	printf("Generating workload WorkloadA 80M ENFORCE dep (%d-bit hash table positions)..\n", 
+	       int(sizeof(MlpSetUInt64::HtPosition) * 8));
+	WorkloadUInt64 workload = WorkloadA::GenWorkload80M();
+	Auto(workload.FreeMemory());
+	
+	workload.EnforceDependency();
+	
+	printf("Executing workload..\n");
+	MlpSetExecuteWorkload<true>(workload);
+	
+	printf("Validating results..\n");
+	uint64_t sum = 0;
+	rep(i, 0, workload.numOperations - 1)
+	{
+		ReleaseAssert(workload.results[i] == workload.expectedResults[i]);
+		sum += workload.results[i];
+	}
+	printf("Finished %d queries %d positives\n", int(workload.numOperations), int(sum));
+}
+
 void test_basic_range() {
     TEST_PRINT("Basic Range Operations");
     
@@ -1512,6 +1603,157 @@ TEST(MlpSetUInt64, MlpSetInsertBenchmarkSanity)
 	printf("MlpSetInsertBenchmarkSanity duration=%.3f ms\n", duration_ms);
 }
 
+TEST(MlpSetUInt64, MlpSetRemoveBenchmark)
+{
+	// Remove should cost about as much as Insert: it only walks the path it already queried
+	//
+	const int N = 1000000;
+	MlpSetUInt64::MlpSet s;
+	s.Init(N);
+	
+	std::mt19937_64 rng(4321);
+	std::vector<uint64_t> keys(N);
+	rep(i, 0, N - 1)
+	{
+		// half dense (shared prefixes, minKey updates), half sparse (whole prefixes going away)
+		//
+		keys[i] = (i % 2 == 0) ? (rng() % (uint64_t(N) * 64)) : rng();
+	}
+	std::sort(keys.begin(), keys.end());
+	keys.resize(std::unique(keys.begin(), keys.end()) - keys.begin());
+	std::shuffle(keys.begin(), keys.end(), rng);
+	const int n = int(keys.size());
+	std::set<uint64_t> ref;
+	
+	fasttime_t start = gettime();
+	rep(i, 0, n - 1)
+	{
+		s.Insert(keys[i]);
+	}
+	fasttime_t end = gettime();
+	printf("Insert: %.1f ns/op\n", tdiff(start, end) * 1e9 / n);
+	
+	std::shuffle(keys.begin(), keys.end(), rng);
+	start = gettime();
+	rep(i, 0, n / 2 - 1)
+	{
+		s.Remove(keys[i]);
+	}
+	end = gettime();
+	printf("Remove: %.1f ns/op\n", tdiff(start, end) * 1e9 / (n / 2));
+	
+	ref.insert(keys.begin() + n / 2, keys.end());
+	rep(i, 0, 99999)
+	{
+		uint64_t key = (i % 2 == 0) ? (rng() % (uint64_t(N) * 64)) : rng();
+		auto it = ref.lower_bound(key);
+		bool found;
+		uint64_t lb = s.LowerBound(key, found);
+		ReleaseAssert(found == (it != ref.end()));
+		ReleaseAssert(!found || lb == *it);
+	}
+	rep(i, n / 2, n - 1)
+	{
+		s.Remove(keys[i]);
+	}
+	bool found;
+	s.LowerBound(0, found);
+	ReleaseAssert(!found);
+}
+
+TEST(MlpSetUInt64, ScanRangeMicrobenchmark)
+{
+	// Scan windows of 100 to 10k keys, compared to a LowerBound query per key
+	//
+	const int numKeys = 4000000;
+	MlpSetUInt64::MlpSet s;
+	s.Init(numKeys);
+	std::mt19937_64 rng(5678);
+	rep(i, 0, numKeys - 1)
+	{
+		s.Insert(rng() % (uint64_t(numKeys) * 16));
+	}
+	
+	for (int windowKeys : { 100, 1000, 10000 })
+	{
+		const int numScans = 2000000 / windowKeys;
+		vector<uint64_t> starts(numScans);
+		rep(i, 0, numScans - 1)
+		{
+			starts[i] = rng() % (uint64_t(numKeys) * 16);
+		}
+		uint64_t window = uint64_t(windowKeys) * 16;
+		
+		uint64_t sum1 = 0, cnt1 = 0;
+		fasttime_t start = gettime();
+		rep(i, 0, numScans - 1)
+		{
+			bool found;
+			uint64_t key = s.LowerBound(starts[i], found);
+			while (found && key <= starts[i] + window)
+			{
+				sum1 += key;
+				cnt1++;
+				key = s.LowerBound(key + 1, found);
+			}
+		}
+		fasttime_t end = gettime();
+		double lowerBoundSec = tdiff(start, end);
+		
+		uint64_t sum2 = 0, cnt2 = 0;
+		start = gettime();
+		rep(i, 0, numScans - 1)
+		{
+			s.ScanRange(starts[i], starts[i] + window, [&](uint64_t key) { sum2 += key; cnt2++; });
+		}
+		end = gettime();
+		double scanSec = tdiff(start, end);
+		
+		ReleaseAssert(sum1 == sum2 && cnt1 == cnt2);
+		printf("~%d keys per scan: LowerBound loop %.1f ns/key, ScanRange %.1f ns/key\n", 
+		       windowKeys, lowerBoundSec * 1e9 / cnt1, scanSec * 1e9 / cnt2);
+	}
+}
+
+TEST(MlpSetUInt64, ReaderPathMicrobenchmark)
+{
+	// Query a small, cache resident set so that the fixed per-query cost of the
+	// reader path (generation guard, LCP retry loop) dominates the measurement
+	//
+	const int numKeys = 4096;
+	const int numQueries = 4000000;
+	MlpSetUInt64::MlpSet s;
+	s.Init(numKeys);
+	
+	std::mt19937_64 rng(1234);
+	std::vector<uint64_t> keys(numKeys);
+	rep(i, 0, numKeys - 1)
+	{
+		keys[i] = rng();
+		s.Insert(keys[i]);
+	}
+	
+	uint64_t sum = 0;
+	fasttime_t start = gettime();
+	rep(i, 0, numQueries - 1)
+	{
+		sum += s.Exist(keys[i % numKeys]);
+	}
+	fasttime_t end = gettime();
+	ReleaseAssert(sum == uint64_t(numQueries));
+	printf("Exist: %.1f ns/op\n", tdiff(start, end) * 1e9 / numQueries);
+	
+	start = gettime();
+	rep(i, 0, numQueries - 1)
+	{
+		bool found;
+		sum += s.LowerBound(keys[i % numKeys] - 1, found);
+	}
+	end = gettime();
+	printf("LowerBound: %.1f ns/op (checksum %llu)\n", 
+	       tdiff(start, end) * 1e9 / numQueries, (unsigned long long)sum);
+}
+
 TEST(MlpSetUInt64, WorkloadD_16M_Dep)
 {
 	printf("Generating workload WorkloadD 16M ENFORCE dep..\n");
@@ -1531,6 +1773,42 @@ TEST(MlpSetUInt64, WorkloadD_16M_Dep)
 	printf("Finished %d queries\n", int(workload.numOperations));
 }
 
+TEST(MlpSetUInt64, WorkloadA_16M_Batch)
+{
+	printf("Generating workload WorkloadA 16M batched..\n");
+	WorkloadUInt64 workload = WorkloadA::GenWorkload16M();
+	Auto(workload.FreeMemory());
+	
+	printf("Executing workload..\n");
+	MlpSetExecuteWorkloadBatch(workload);
+	
+	printf("Validating results..\n");
+	uint64_t sum = 0;
+	rep(i, 0, workload.numOperations - 1)
+	{
+		ReleaseAssert(workload.results[i] == workload.expectedResults[i]);
+		sum += workload.results[i];
+	}
+	printf("Finished %d queries %d positives\n", int(workload.numOperations), int(sum));
+}
+
+TEST(MlpSetUInt64, WorkloadD_16M_Batch)
+{
+	printf("Generating workload WorkloadD 16M batched..\n");
+	WorkloadUInt64 workload = WorkloadD::GenWorkload16M();
+	Auto(workload.FreeMemory());
+	
+	printf("Executing workload..\n");
+	MlpSetExecuteWorkloadBatch(workload);
+	
+	printf("Validating results..\n");
+	rep(i, 0, workload.numOperations - 1)
+	{
+		ReleaseAssert(workload.results[i] == workload.expectedResults[i]);
+	}
+	printf("Finished %d queries\n", int(workload.numOperations));
+}
+
 TEST(MlpSetUInt64, WorkloadD_80M_Dep)
 {
 	printf("Generating workload WorkloadD 80M ENFORCE dep..\n");
@@ -1550,6 +1828,173 @@ TEST(MlpSetUInt64, WorkloadD_80M_Dep)
 	printf("Finished %d queries\n", int(workload.numOperations));
 }
 
+// Populate a set with the workload's initial values using Insert, then another one using BulkLoad, 
+// and validate the latter with the workload's query keys
+//
+void NO_INLINE MlpSetCompareBulkLoad(WorkloadUInt64& workload)
+{
+	{
+		MlpSetUInt64::MlpSet ms;
+		ms.Init(workload.numInitialValues + 1000);
+		printf("MlpSet populating initial values with Insert..\n");
+		AutoTimer timer;
+		rep(i, 0, workload.numInitialValues - 1)
+		{
+			ms.Insert(workload.initialValues[i]);
+		}
+	}
+	
+	vector<uint64_t> keys(workload.initialValues, workload.initialValues + workload.numInitialValues);
+	printf("Sorting initial values..\n");
+	{
+		AutoTimer timer;
+		sort(keys.begin(), keys.end());
+		keys.resize(unique(keys.begin(), keys.end()) - keys.begin());
+	}
+	
+	MlpSetUInt64::MlpSet ms;
+	ms.Init(workload.numInitialValues + 1000);
+	printf("MlpSet populating initial values with BulkLoad..\n");
+	{
+		AutoTimer timer;
+		ms.BulkLoad(keys.data(), keys.size());
+	}
+	
+	printf("Validating..\n");
+	for (uint64_t key : keys)
+	{
+		ReleaseAssert(ms.Exist(key));
+	}
+	rep(i, 0, workload.numOperations - 1)
+	{
+		uint64_t key = workload.operations[i].key;
+		auto it = lower_bound(keys.begin(), keys.end(), key);
+		bool found;
+		uint64_t lb = ms.LowerBound(key, found);
+		ReleaseAssert(found == (it != keys.end()));
+		ReleaseAssert(!found || lb == *it);
+	}
+}
+
+TEST(MlpSetUInt64, WorkloadA_16M_BulkLoad)
+{
+	printf("Generating workload WorkloadA 16M..\n");
+	WorkloadUInt64 workload = WorkloadA::GenWorkload16M();
+	Auto(workload.FreeMemory());
+	MlpSetCompareBulkLoad(workload);
+}
+
+TEST(MlpSetUInt64, WorkloadD_16M_BulkLoad)
+{
+	printf("Generating workload WorkloadD 16M..\n");
+	WorkloadUInt64 workload = WorkloadD::GenWorkload16M();
+	Auto(workload.FreeMemory());
+	MlpSetCompareBulkLoad(workload);
+}
+
+TEST(MlpSetUInt64, WorkloadA_80M_BulkLoad)
+{
+	printf("Generating workload WorkloadA 80M..\n");
+	WorkloadUInt64 workload = WorkloadA::GenWorkload80M();
+	Auto(workload.FreeMemory());
+	MlpSetCompareBulkLoad(workload);
+}
+
+TEST(MlpSetUInt64, WorkloadD_80M_BulkLoad)
+{
+	printf("Generating workload WorkloadD 80M..\n");
+	WorkloadUInt64 workload = WorkloadD::GenWorkload80M();
+	Auto(workload.FreeMemory());
+	MlpSetCompareBulkLoad(workload);
+}
+
+// Populate the set with the workload's initial values using ParallelBulkLoad with increasing thread counts
+//
+void NO_INLINE MlpSetParallelBulkLoadScaling(WorkloadUInt64& workload)
+{
+	vector<uint64_t> keys(workload.initialValues, workload.initialValues + workload.numInitialValues);
+	sort(keys.begin(), keys.end());
+	keys.resize(unique(keys.begin(), keys.end()) - keys.begin());
+	
+	for (int numThreads : { 1, 2, 4, 8, 16 })
+	{
+		MlpSetUInt64::MlpSet ms;
+		ms.Init(workload.numInitialValues + 1000);
+		printf("MlpSet populating initial values with ParallelBulkLoad, %d threads..\n", numThreads);
+		{
+			AutoTimer timer;
+			ms.ParallelBulkLoad(workload.initialValues, workload.numInitialValues, numThreads);
+		}
+		for (uint64_t key : keys)
+		{
+			ReleaseAssert(ms.Exist(key));
+		}
+		rep(i, 0, workload.numOperations - 1)
+		{
+			uint64_t key = workload.operations[i].key;
+			auto it = lower_bound(keys.begin(), keys.end(), key);
+			bool found;
+			uint64_t lb = ms.LowerBound(key, found);
+			ReleaseAssert(found == (it != keys.end()));
+			ReleaseAssert(!found || lb == *it);
+		}
+	}
+}
+
+TEST(MlpSetUInt64, WorkloadA_16M_ParallelBulkLoad)
+{
+	printf("Generating workload WorkloadA 16M..\n");
+	WorkloadUInt64 workload = WorkloadA::GenWorkload16M();
+	Auto(workload.FreeMemory());
+	MlpSetParallelBulkLoadScaling(workload);
+}
+
+TEST(MlpSetUInt64, WorkloadA_80M_ParallelBulkLoad)
+{
+	printf("Generating workload WorkloadA 80M..\n");
+	WorkloadUInt64 workload = WorkloadA::GenWorkload80M();
+	Auto(workload.FreeMemory());
+	MlpSetParallelBulkLoadScaling(workload);
+}
+
+// ParallelBulkLoad of 4M unsorted keys with 1 to 16 threads, the nodes are placed into the table in parallel
+// by table range. The keys are random, or dense so that many nodes need a bitmap and are placed by the calling thread
+//
+TEST(MlpSetUInt64, ParallelBulkLoadThreadScaling)
+{
+	const size_t n = 4000000;
+	std::mt19937_64 rng(20261020);
+	vector<uint64_t> randomKeys(n), denseKeys(n);
+	rep(i, 0, int(n) - 1)
+	{
+		randomKeys[i] = rng();
+		denseKeys[i] = rng() % (n * 2);
+	}
+	for (vector<uint64_t>* keys : { &randomKeys, &denseKeys })
+	{
+		double singleThreadSec = 0;
+		for (int numThreads : { 1, 2, 4, 8, 16 })
+		{
+			MlpSetUInt64::MlpSet ms;
+			ms.Init(n + 1000);
+			fasttime_t start = gettime();
+			ms.ParallelBulkLoad(keys->data(), n, numThreads);
+			fasttime_t end = gettime();
+			double sec = tdiff(start, end);
+			if (numThreads == 1)
+			{
+				singleThreadSec = sec;
+			}
+			printf("%s keys, %d threads: %.3f s, %.2fx\n", (keys == &randomKeys) ? "random" : "dense", numThreads, sec,
+			       singleThreadSec / sec);
+			rep(i, 0, 999)
+			{
+				ReleaseAssert(ms.Exist((*keys)[rng() % n]));
+			}
+		}
+	}
+}
+
 // Simple test to verify basic functionality: insert 0 and check if it exists
 TEST(MlpSetUInt64, BasicInsertAndExistTest)
 {
@@ -1567,4 +2012,1801 @@ TEST(MlpSetUInt64, BasicInsertAndExistTest)
 	printf("Successfully inserted and found key 0\n");
 }
 
+TEST(MlpSetUInt64, BatchQueryCorrectness)
+{
+	const int N = 200000;
+	// not a multiple of the chunk size, so the last chunk is partial
+	//
+	const int Q = 300001;
+	MlpSetUInt64::MlpSet ms;
+	ms.Init(N);
+	
+	std::mt19937_64 rng(12345);
+	std::set<uint64_t> keys;
+	rep(i, 0, N - 1)
+	{
+		uint64_t key = (i % 2 == 0) ? rng() : (rng() % 10000000);
+		keys.insert(key);
+		ms.Insert(key);
+	}
+	
+	vector<uint64_t> queries(Q);
+	rep(i, 0, Q - 1)
+	{
+		if (i % 3 == 0)
+		{
+			queries[i] = *keys.lower_bound(rng() % 10000000);
+		}
+		else
+		{
+			queries[i] = (i % 3 == 1) ? rng() : (rng() % 10000000);
+		}
+	}
+	
+	bool* exist = new bool[Q];
+	uint64_t* lb = new uint64_t[Q];
+	bool* found = new bool[Q];
+	Auto(delete [] exist);
+	Auto(delete [] lb);
+	Auto(delete [] found);
+	ms.ExistBatch(queries.data(), Q, exist);
+	ms.LowerBoundBatch(queries.data(), Q, lb, found);
+	
+	rep(i, 0, Q - 1)
+	{
+		ReleaseAssert(exist[i] == (keys.count(queries[i]) > 0));
+		auto it = keys.lower_bound(queries[i]);
+		if (it == keys.end())
+		{
+			ReleaseAssert(!found[i]);
+		}
+		else
+		{
+			ReleaseAssert(found[i] && lb[i] == *it);
+		}
+	}
+}
+
+TEST(MlpSetUInt64, InterleavedLookupCorrectness)
+{
+	typedef MlpSetUInt64::InterleavedLookupEngine Engine;
+	const int N = 200000;
+	const int Q = 1000003;
+	std::mt19937_64 rng(4242);
+	
+	// Exist and LowerBound on a set
+	//
+	{
+		MlpSetUInt64::MlpSet ms;
+		ms.Init(N);
+		std::set<uint64_t> keys;
+		rep(i, 0, N - 1)
+		{
+			uint64_t key = (i % 2 == 0) ? rng() : (rng() % 10000000);
+			keys.insert(key);
+			ms.Insert(key);
+		}
+		
+		vector<Engine::Request> requests(Q);
+		rep(i, 0, Q - 1)
+		{
+			requests[i].type = (rng() % 2) ? Engine::LookupType::EXIST : Engine::LookupType::LOWER_BOUND;
+			requests[i].key = (i % 3 == 0) ? *keys.lower_bound(rng() % 10000000) : ((i % 3 == 1) ? rng() : (rng() % 10000000));
+		}
+		vector<Engine::Result> results(Q);
+		Engine engine(&ms);
+		{
+			AutoTimer timer;
+			engine.Run(requests.data(), Q, results.data());
+		}
+		
+		rep(i, 0, Q - 1)
+		{
+			uint64_t key = requests[i].key;
+			if (requests[i].type == Engine::LookupType::EXIST)
+			{
+				ReleaseAssert(results[i].found == (keys.count(key) > 0));
+			}
+			else
+			{
+				auto it = keys.lower_bound(key);
+				if (it == keys.end())
+				{
+					ReleaseAssert(!results[i].found);
+				}
+				else
+				{
+					ReleaseAssert(results[i].found && results[i].value == *it);
+				}
+			}
+		}
+	}
+	
+	// Load on a range tree, with a mix of single points and ranges
+	//
+	{
+		MlpSetUInt64::MlpRangeTree tree;
+		tree.Init(N * 2);
+		vector<int> data(N);
+		uint64_t cur = 1000;
+		vector<uint64_t> probes;
+		rep(i, 0, N - 1)
+		{
+			cur += rng() % 1000 + 2;
+			uint64_t len = (i % 2 == 0) ? 0 : rng() % 1000 + 1;
+			if (len == 0)
+			{
+				ReleaseAssert(tree.InsertSinglePoint(cur, &data[i]));
+			}
+			else
+			{
+				ReleaseAssert(tree.InsertRange(cur, cur + len, &data[i]));
+			}
+			probes.push_back(cur);
+			probes.push_back(cur + len);
+			probes.push_back(cur + len / 2);
+			probes.push_back(cur + len + 1);
+			cur += len;
+		}
+		
+		vector<Engine::Request> requests(probes.size());
+		rep(i, 0, int(probes.size()) - 1)
+		{
+			requests[i].type = Engine::LookupType::RANGE_LOAD;
+			requests[i].key = probes[i];
+		}
+		vector<Engine::Result> results(probes.size());
+		Engine engine(&tree);
+		engine.Run(requests.data(), requests.size(), results.data());
+		
+		rep(i, 0, int(probes.size()) - 1)
+		{
+			ReleaseAssert(results[i].data == tree.Load(probes[i]));
+		}
+	}
+}
+
+TEST(MlpSetUInt64, ExternalBitMapPoolRecycling)
+{
+	MlpSetUInt64::ExternalBitMapPool pool;
+	const int bitmapsPerChunk = MlpSetUInt64::ExternalBitMapPool::CHUNK_SIZE / MlpSetUInt64::ExternalBitMapPool::BITMAP_SIZE;
+	
+	vector<uint64_t*> bitmaps;
+	rep(i, 0, bitmapsPerChunk)
+	{
+		uint64_t* ptr = pool.Allocate();
+		ReleaseAssert(reinterpret_cast<uintptr_t>(ptr) % 32 == 0);
+		ReleaseAssert(ptr[0] == 0 && ptr[1] == 0 && ptr[2] == 0 && ptr[3] == 0);
+		ptr[0] = ptr[3] = uint64_t(-1);
+		bitmaps.push_back(ptr);
+	}
+	ReleaseAssert(pool.NumChunks() == 2);
+	
+	// released bitmaps are recycled (zeroed) before any new chunk is allocated
+	//
+	set<uint64_t*> released;
+	rep(i, 0, bitmapsPerChunk - 1)
+	{
+		pool.Release(bitmaps[i]);
+		released.insert(bitmaps[i]);
+	}
+	rep(i, 0, bitmapsPerChunk * 2 - 2)
+	{
+		uint64_t* ptr = pool.Allocate();
+		ReleaseAssert(ptr[0] == 0 && ptr[3] == 0);
+		if (i < bitmapsPerChunk)
+		{
+			ReleaseAssert(released.count(ptr));
+		}
+	}
+	ReleaseAssert(pool.NumChunks() == 2);
+	ReleaseAssert(pool.NumAllocations() == uint64_t(bitmapsPerChunk) * 3);
+}
+
+TEST(MlpSetUInt64, MemoryBackingPolicies)
+{
+	using MlpSetUInt64::MemoryBacking;
+	using MlpSetUInt64::NumaPolicy;
+	using MlpSetUInt64::MemoryPolicy;
+
+	// Every policy must work whatever the system provides: hugetlb falls back when
+	// no huge pages are reserved, and NUMA policies are ignored if the kernel rejects them
+	//
+	const MemoryPolicy policies[] = {
+		MemoryPolicy(),
+		MemoryPolicy(MemoryBacking::TRANSPARENT_HUGE_PAGES),
+		MemoryPolicy(MemoryBacking::HUGETLB),
+		MemoryPolicy(MemoryBacking::PLAIN_PAGES, NumaPolicy::BIND, 1),
+		MemoryPolicy(MemoryBacking::TRANSPARENT_HUGE_PAGES, NumaPolicy::INTERLEAVE, uint64_t(-1))
+	};
+	const char* backingNames[] = { "plain pages", "transparent huge pages", "hugetlb" };
+	for (const MemoryPolicy& policy : policies)
+	{
+		MemoryBacking backing;
+		bool numaPolicyApplied;
+		void* ptr = MlpSetUInt64::AllocateBackingMemory(3 << 20, policy, backing /*out*/, &numaPolicyApplied /*out*/);
+		ReleaseAssert(reinterpret_cast<uintptr_t>(ptr) % 4096 == 0);
+		ReleaseAssert(static_cast<int>(backing) <= static_cast<int>(policy.backing));
+		ReleaseAssert(numaPolicyApplied || policy.numaPolicy != NumaPolicy::DEFAULT);
+		// nothing is touched by the allocation, so untouched parts of the set cost no memory
+		//
+		if (backing != MemoryBacking::HUGETLB)
+		{
+			vector<unsigned char> residency((3 << 20) / 4096);
+			ReleaseAssert(mincore(ptr, 3 << 20, residency.data()) == 0);
+			for (unsigned char r : residency)
+			{
+				ReleaseAssert((r & 1) == 0);
+			}
+		}
+		rep(i, 0, (3 << 20) / 8 - 1)
+		{
+			ReleaseAssert(reinterpret_cast<uint64_t*>(ptr)[i] == 0);
+		}
+		MlpSetUInt64::FreeBackingMemory(ptr, 3 << 20, backing);
+
+		// small initial size, so the grown tables are allocated with the policy as well
+		//
+		MlpSetUInt64::MlpSet ms;
+		ms.Init(4096, policy);
+		printf("Requested %s, got %s, NUMA policy %s\n", backingNames[static_cast<int>(policy.backing)], 
+		       backingNames[static_cast<int>(ms.GetMemoryBacking())], ms.IsNumaPolicyApplied() ? "applied" : "rejected");
+		std::mt19937_64 rng(20261016);
+		std::set<uint64_t> keys;
+		rep(i, 0, 99999)
+		{
+			uint64_t key = (i % 2 == 0) ? rng() : (rng() % 1000000);
+			ReleaseAssert(ms.Insert(key) == keys.insert(key).second);
+		}
+		for (uint64_t key : keys)
+		{
+			ReleaseAssert(ms.Exist(key));
+		}
+		int cnt = 0;
+		for (uint64_t key : keys)
+		{
+			if (cnt++ % 2 == 0)
+			{
+				ReleaseAssert(ms.Remove(key));
+			}
+		}
+	}
+}
+
+TEST(MlpSetUInt64, SnapshotSaveAndOpenMapped)
+{
+	const char* path = "mlpset_snapshot_test.img";
+	std::mt19937_64 rng(20261017);
+	std::set<uint64_t> keys;
+	{
+		// small initial size so the saved table is a grown one,
+		// and dense groups of children so that some nodes use external bitmaps
+		//
+		MlpSetUInt64::MlpSet ms;
+		ms.Init(4096);
+		rep(i, 0, 199999)
+		{
+			uint64_t key = (i % 2 == 0) ? rng() : ((rng() % 4096) << 16 | (rng() % 65536));
+			ReleaseAssert(ms.Insert(key) == keys.insert(key).second);
+		}
+		printf("External bitmaps: %llu\n", static_cast<unsigned long long>(ms.GetExternalBitMapPool().NumAllocations()));
+		ReleaseAssert(ms.SaveTo(path));
+	}
+
+	// The second image can't be mapped at the preferred address, so its bitmap pointers get relocated
+	//
+	MlpSetUInt64::MlpSet first, second;
+	ReleaseAssert(first.OpenMapped(path));
+	ReleaseAssert(second.OpenMapped(path));
+	ReleaseAssert(unlink(path) == 0);
+
+	for (MlpSetUInt64::MlpSet* ms : { &first, &second })
+	{
+		for (uint64_t key : keys)
+		{
+			ReleaseAssert(ms->Exist(key));
+		}
+		rep(i, 0, 199999)
+		{
+			uint64_t key = (i % 2 == 0) ? rng() : ((rng() % 4096) << 16 | (rng() % 65536));
+			ReleaseAssert(ms->Exist(key) == (keys.count(key) > 0));
+			auto it = keys.lower_bound(key);
+			bool found;
+			uint64_t lb = ms->LowerBound(key, found);
+			ReleaseAssert(found == (it != keys.end()));
+			ReleaseAssert(!found || lb == *it);
+		}
+	}
+
+	MlpSetUInt64::MlpSet bad;
+	ReleaseAssert(!bad.OpenMapped(path));
+}
+
+TEST(MlpSetUInt64, BulkLoadCorrectness)
+{
+	// sparse keys, dense groups (many children per node) and the extreme keys
+	//
+	std::mt19937_64 rng(20261018);
+	std::set<uint64_t> keys = { 0, 1, 255, 256, uint64_t(-1), uint64_t(-2) };
+	rep(i, 0, 299999)
+	{
+		switch (i % 3)
+		{
+			case 0: keys.insert(rng()); break;
+			case 1: keys.insert((rng() % 4096) << 16 | (rng() % 65536)); break;
+			case 2: keys.insert(0x1234560000000000ULL + i); break;
+		}
+	}
+	vector<uint64_t> sortedKeys(keys.begin(), keys.end());
+	
+	// the minimal initial size, so the table is grown before the load
+	//
+	MlpSetUInt64::MlpSet ms;
+	ms.Init(4096);
+	ms.BulkLoad(sortedKeys.data(), sortedKeys.size());
+	
+	for (uint64_t key : keys)
+	{
+		ReleaseAssert(ms.Exist(key));
+	}
+	auto validate = [&]()
+	{
+		rep(i, 0, 199999)
+		{
+			uint64_t key = (i % 2 == 0) ? rng() : ((rng() % 4096) << 16 | (rng() % 65536));
+			ReleaseAssert(ms.Exist(key) == (keys.count(key) > 0));
+			auto it = keys.lower_bound(key);
+			bool found;
+			uint64_t lb = ms.LowerBound(key, found);
+			ReleaseAssert(found == (it != keys.end()));
+			ReleaseAssert(!found || lb == *it);
+		}
+	};
+	validate();
+	
+	// the bulk loaded trie must be usable by the regular writer
+	//
+	rep(i, 0, 99999)
+	{
+		uint64_t key = (i % 2 == 0) ? rng() : ((rng() % 4096) << 16 | (rng() % 65536));
+		ReleaseAssert(ms.Insert(key) == keys.insert(key).second);
+	}
+	int cnt = 0;
+	for (auto it = keys.begin(); it != keys.end(); )
+	{
+		if (cnt++ % 3 == 0)
+		{
+			ReleaseAssert(ms.Remove(*it));
+			it = keys.erase(it);
+		}
+		else
+		{
+			it++;
+		}
+	}
+	validate();
+}
+
+TEST(MlpSetUInt64, ParallelBulkLoadCorrectness)
+{
+	// unsorted keys with duplicates, skewed towards a few top bytes
+	//
+	std::mt19937_64 rng(20261019);
+	vector<uint64_t> input = { 0, uint64_t(-1), 0, uint64_t(-1) };
+	rep(i, 0, 299999)
+	{
+		switch (i % 3)
+		{
+			case 0: input.push_back(rng()); break;
+			case 1: input.push_back((rng() % 4096) << 16 | (rng() % 65536)); break;
+			case 2: input.push_back(input[rng() % input.size()]); break;
+		}
+	}
+	std::set<uint64_t> keys(input.begin(), input.end());
+	
+	for (int numThreads : { 1, 3, 8 })
+	{
+		MlpSetUInt64::MlpSet ms;
+		ms.Init(4096);
+		ms.ParallelBulkLoad(input.data(), input.size(), numThreads);
+		for (uint64_t key : keys)
+		{
+			ReleaseAssert(ms.Exist(key));
+		}
+		rep(i, 0, 99999)
+		{
+			uint64_t key = (i % 2 == 0) ? rng() : ((rng() % 4096) << 16 | (rng() % 65536));
+			ReleaseAssert(ms.Exist(key) == (keys.count(key) > 0));
+			auto it = keys.lower_bound(key);
+			bool found;
+			uint64_t lb = ms.LowerBound(key, found);
+			ReleaseAssert(found == (it != keys.end()));
+			ReleaseAssert(!found || lb == *it);
+		}
+		rep(i, 0, 9999)
+		{
+			uint64_t key = rng();
+			ReleaseAssert(ms.Insert(key) == (keys.count(key) == 0));
+			ReleaseAssert(ms.Remove(key));
+		}
+	}
+}
+
+TEST(MlpSetUInt64, HashTableGrowthCorrectness)
+{
+	// Init with the minimal capacity and insert way more than that,
+	// so the hash table has to grow several times along the way
+	//
+	const int N = 1000000;
+	MlpSetUInt64::MlpSet ms;
+	ms.Init(4096);
+	
+	std::mt19937_64 rng(20251016);
+	std::set<uint64_t> keys;
+	rep(i, 0, N - 1)
+	{
+		// mix dense and sparse keys so that both bitmap kinds and deep leaves get migrated
+		//
+		uint64_t key = (i % 2 == 0) ? rng() : (rng() % 100000000);
+		bool expected = keys.insert(key).second;
+		ReleaseAssert(ms.Insert(key) == expected);
+	}
+	
+	for (uint64_t key : keys)
+	{
+		ReleaseAssert(ms.Exist(key));
+	}
+	
+	rep(i, 0, N - 1)
+	{
+		uint64_t key = (i % 2 == 0) ? rng() : (rng() % 100000000);
+		auto it = keys.lower_bound(key);
+		bool found;
+		uint64_t lb = ms.LowerBound(key, found);
+		if (it == keys.end())
+		{
+			ReleaseAssert(!found);
+		}
+		else
+		{
+			ReleaseAssert(found && lb == *it);
+		}
+		ReleaseAssert(ms.Exist(key) == (keys.count(key) > 0));
+	}
+	
+	// Removals after growth should leave the set consistent as well
+	//
+	int cnt = 0;
+	for (auto it = keys.begin(); it != keys.end(); )
+	{
+		if (cnt++ % 3 == 0)
+		{
+			ReleaseAssert(ms.Remove(*it));
+			it = keys.erase(it);
+		}
+		else
+		{
+			it++;
+		}
+	}
+	for (uint64_t key : keys)
+	{
+		ReleaseAssert(ms.Exist(key));
+	}
+}
+
+// The way MlpRangeTree grows its hash table: the whole table is migrated by the insertion that fills it
+//
+class MlpSetWithSynchronousGrowth : public MlpSetUInt64::MlpSet
+{
+public:
+	MlpSetWithSynchronousGrowth() { m_incrementalGrowth = false; }
+};
+
+TEST(MlpSetUInt64, InsertLatencyAcrossHashTableGrowth)
+{
+	// The hash table grows incrementally, so no insertion should pay for migrating the whole table
+	// The slowest insertion of a set growing its table synchronously gives the cost of a full migration
+	// Removals are interleaved with the insertions so that they take part in the migrations as well
+	//
+	const int N = 2000000;
+	std::mt19937_64 rng(20261017);
+	std::vector<uint64_t> keys(N);
+	for (uint64_t& key : keys)
+	{
+		key = rng();
+	}
+	std::vector<bool> removed(N, false);
+	
+	MlpSetUInt64::MlpSet ms;
+	ms.Init(4096);
+	std::vector<double> latencies(N);
+	rep(i, 0, N - 1)
+	{
+		fasttime_t start = gettime();
+		ReleaseAssert(ms.Insert(keys[i]));
+		latencies[i] = tdiff(start, gettime());
+		if (i % 4 == 3)
+		{
+			ReleaseAssert(ms.Remove(keys[i / 2]));
+			removed[i / 2] = true;
+		}
+	}
+	
+	MlpSetWithSynchronousGrowth syncMs;
+	syncMs.Init(4096);
+	double syncMaxLatency = 0;
+	rep(i, 0, N - 1)
+	{
+		fasttime_t start = gettime();
+		ReleaseAssert(syncMs.Insert(keys[i]));
+		syncMaxLatency = std::max(syncMaxLatency, tdiff(start, gettime()));
+	}
+	
+	std::vector<double> sorted = latencies;
+	std::sort(sorted.begin(), sorted.end());
+	double maxLatency = sorted.back();
+	printf("InsertLatencyAcrossHashTableGrowth: p50 = %.2f us, p99 = %.2f us, p99.99 = %.2f us, max = %.2f us, "
+	       "max with synchronous growth = %.2f us\n",
+	       sorted[N / 2] * 1e6, sorted[N / 100 * 99] * 1e6, sorted[N / 10000 * 9999] * 1e6, maxLatency * 1e6, syncMaxLatency * 1e6);
+	// (with plenty of room for the scheduler getting in the way of a single insertion)
+	//
+	ReleaseAssert(maxLatency * 4 < syncMaxLatency);
+	
+	rep(i, 0, N - 1)
+	{
+		ReleaseAssert(ms.Exist(keys[i]) == !removed[i]);
+	}
+}
+
+TEST(MlpSetUInt64, MemoryStatsAccounting)
+{
+	MlpSetUInt64::MlpSet ms;
+	ms.Init(4096);
+	ms.ConfigureReclamation(MlpSetUInt64::MlpSet::ReclamationMode::MANUAL, 0 /*lowWatermark*/, 1 /*highWatermark*/);
+	
+	MlpSetUInt64::MlpSet::MemoryStats empty = ms.GetMemoryStats();
+	ReleaseAssert(empty.numLeaves == 0 && empty.numInnerNodes == 0 && empty.loadFactor == 0);
+	ReleaseAssert(empty.topLevelBitmapBytes == 32 + 8192 + 2 * 1024 * 1024);
+	ReleaseAssert(empty.hashTableBytes >= empty.hashTableSlots * sizeof(MlpSetUInt64::CuckooHashTableNode));
+	ReleaseAssert(empty.mappedImageBytes == 0);
+	// nothing has been read from the set yet
+	//
+	ReleaseAssert(empty.readerGenerationBytes == 0);
+	
+	// dense keys give nodes with many children (bitmaps), sparse keys give nodes with few (child lists)
+	//
+	std::mt19937_64 rng(20261016);
+	std::set<uint64_t> keys;
+	rep(i, 0, 199999)
+	{
+		uint64_t key = (i % 2 == 0) ? rng() : (rng() % 10000000);
+		keys.insert(key);
+		ms.Insert(key);
+	}
+	
+	MlpSetUInt64::MlpSet::MemoryStats st = ms.GetMemoryStats();
+	ReleaseAssert(st.numLeaves == keys.size());
+	ReleaseAssert(st.numLeaves + st.numInnerNodes == ms.GetHtPtr()->numNodes);
+	ReleaseAssert(st.numInnerNodes == st.numInternalMapNodes + st.numInternalBitmapNodes + st.numPointerBitmapNodes);
+	ReleaseAssert(st.numInternalMapNodes > 0 && st.numInternalBitmapNodes + st.numPointerBitmapNodes > 0);
+	ReleaseAssert(st.pointerBitmapBytes == st.numPointerBitmapNodes * MlpSetUInt64::ExternalBitMapPool::BITMAP_SIZE);
+	ReleaseAssert(st.pointerBitmapBytes <= st.externalBitmapPoolBytes);
+	ReleaseAssert(st.hashTableSlots > empty.hashTableSlots && st.hashTableBytes > empty.hashTableBytes);
+	ReleaseAssert(st.loadFactor > 0 && st.loadFactor <= MlpSetUInt64::MlpSet::MemoryStats::MAX_LOAD_FACTOR);
+	ReleaseAssert(st.TotalBytes() == st.topLevelBitmapBytes + st.hashTableBytes + st.externalBitmapPoolBytes + st.readerGenerationBytes);
+	// a single reading thread only needs one chunk of reader generations
+	//
+	ReleaseAssert(ms.Exist(*keys.begin()));
+	ReleaseAssert(ms.GetMemoryStats().readerGenerationBytes > 0 && ms.GetMemoryStats().readerGenerationBytes <= 4096);
+	// the tables replaced by the growth are waiting for Reclaim
+	//
+	ReleaseAssert(st.pendingDeallocations > 0 && st.pendingDeallocations == ms.GetReclamationBacklog());
+	
+	ms.Reclaim();
+	for (uint64_t key : keys)
+	{
+		ReleaseAssert(ms.Remove(key));
+	}
+	ms.Reclaim();
+	st = ms.GetMemoryStats();
+	ReleaseAssert(st.numLeaves == 0 && st.numInnerNodes == 0 && st.pointerBitmapBytes == 0);
+	ReleaseAssert(st.pendingDeallocations == 0);
+	
+	// an image holds everything in a single mapping
+	//
+	ms.Insert(12345);
+	const char* path = "/tmp/mlpset_memory_stats_test.img";
+	ReleaseAssert(ms.SaveTo(path));
+	{
+		MlpSetUInt64::MlpSet mapped;
+		ReleaseAssert(mapped.OpenMapped(path));
+		MlpSetUInt64::MlpSet::MemoryStats ims = mapped.GetMemoryStats();
+		ReleaseAssert(ims.numLeaves == 1 && ims.mappedImageBytes > 0 && ims.TotalBytes() == ims.mappedImageBytes);
+	}
+	unlink(path);
+}
+
+TEST(MlpSetUInt64, RuntimeStatsCounting)
+{
+	MlpSetUInt64::MlpSet ms;
+	ms.Init(4096);
+	
+	// nothing is counted before EnableStats
+	//
+	std::mt19937_64 rng(20261017);
+	vector<uint64_t> keys;
+	rep(i, 0, 9999)
+	{
+		keys.push_back(rng());
+		ms.Insert(keys.back());
+	}
+	ReleaseAssert(!ms.GetHtPtr()->stats.IsEnabled());
+	MlpSetUInt64::MlpStats st = ms.GetStats();
+	ReleaseAssert(st.movedNodesCount == 0 && st.lcpResultHistogram[8] == 0);
+	
+	ms.EnableStats();
+	rep(i, 0, 199999)
+	{
+		keys.push_back(rng() % 100000000);
+		ms.Insert(keys.back());
+	}
+	st = ms.GetStats();
+	uint64_t chains = 0;
+	rep(i, 0, MlpSetUInt64::MlpStats::DISPLACEMENT_DEPTH_BUCKETS - 1)
+	{
+		chains += st.displacementDepthHistogram[i];
+	}
+	ReleaseAssert(st.movedNodesCount > 0 && chains > 0 && chains <= st.movedNodesCount + st.relocatedBitmapsCount);
+	
+	// without a writer no query is retried, so every query is counted exactly once
+	// whichever thread ran it
+	//
+	ms.ClearStats();
+	const int numThreads = 4;
+	const int queriesPerThread = 50000;
+	std::vector<std::thread> threads;
+	rep(t, 0, numThreads - 1)
+	{
+		threads.emplace_back([&, t]() {
+			std::mt19937_64 trng(t);
+			rep(i, 0, queriesPerThread - 1)
+			{
+				bool found;
+				ReleaseAssert(ms.Exist(keys[trng() % keys.size()]));
+				ms.LowerBound(trng(), found);
+			}
+		});
+	}
+	for (auto& th : threads) { th.join(); }
+	st = ms.GetStats();
+	uint64_t lcpResults = 0, lowerBounds = 0;
+	rep(i, 0, 8)
+	{
+		lcpResults += st.lcpResultHistogram[i];
+		lowerBounds += st.lowerBoundParentPathStepsHistogram[i];
+	}
+	ReleaseAssert(lcpResults == 2ULL * numThreads * queriesPerThread);
+	ReleaseAssert(lowerBounds == uint64_t(numThreads) * queriesPerThread);
+	ReleaseAssert(st.movedNodesCount == 0);
+	ms.ReportStats();
+	
+	// disabling keeps the totals, but stops counting
+	//
+	ms.DisableStats();
+	rep(i, 0, 999)
+	{
+		ms.Exist(keys[i]);
+	}
+	MlpSetUInt64::MlpStats st2 = ms.GetStats();
+	ReleaseAssert(memcmp(&st, &st2, sizeof st) == 0);
+}
+
+TEST(MlpSetUInt64, RuntimeStatsOverhead)
+{
+	const int N = 1000000;
+	const int Q = 4000000;
+	MlpSetUInt64::MlpSet ms;
+	ms.Init(N);
+	std::mt19937_64 rng(20261018);
+	rep(i, 0, N - 1)
+	{
+		ms.Insert(rng() % 1000000000);
+	}
+	vector<uint64_t> queries;
+	rep(i, 0, Q - 1)
+	{
+		queries.push_back(rng() % 1000000000);
+	}
+	
+	auto run = [&]() {
+		uint64_t sum = 0;
+		fasttime_t start = gettime();
+		for (uint64_t q : queries)
+		{
+			bool found;
+			sum += ms.Exist(q);
+			sum += ms.LowerBound(q, found);
+		}
+		fasttime_t end = gettime();
+		ReleaseAssert(sum != 1);
+		return tdiff(start, end) * 1e9 / Q;
+	};
+	
+	// alternate the modes so that both see the same machine state
+	//
+	double disabledNs = 1e18, enabledNs = 1e18;
+	rep(round, 0, 2)
+	{
+		ms.DisableStats();
+		disabledNs = std::min(disabledNs, run());
+		ms.EnableStats();
+		enabledNs = std::min(enabledNs, run());
+	}
+	printf("Exist + LowerBound: %.1f ns with stats disabled, %.1f ns with stats enabled\n", disabledNs, enabledNs);
+}
+
+// All hash kernels supported by the machine must compute the same positions and expected hashes as the scalar one
+//
+TEST(MlpSetUInt64, HashKernelsAgree)
+{
+	using MlpSetUInt64::HashKernel;
+	using MlpSetUInt64::HtPosition;
+
+	const int HtSize = 1 << 16;
+	uint64_t allocatedArrLen = uint64_t(HtSize) * sizeof(MlpSetUInt64::CuckooHashTableNode);
+	void* allocatedPtr = aligned_alloc(128, allocatedArrLen);
+	ReleaseAssert(allocatedPtr != nullptr);
+	Auto(free(allocatedPtr));
+	memset(allocatedPtr, 0, allocatedArrLen);
+
+	MlpSetUInt64::CuckooHashTable ht;
+	MlpSetUInt64::ExternalBitMapPool bitmapPool;
+	ht.Init(reinterpret_cast<MlpSetUInt64::CuckooHashTableNode*>(allocatedPtr), HtSize - 1, &bitmapPool);
+
+	HashKernel originalKernel = MlpSetUInt64::GetHashKernel();
+	Auto(ReleaseAssert(MlpSetUInt64::SetHashKernel(originalKernel)));
+
+	std::mt19937_64 rng(20261016);
+	const int numKeys = 200000;
+	rep(i, 0, numKeys - 1)
+	{
+		uint64_t key = rng();
+		if (i == 0) key = 0;
+		if (i == 1) key = 0xffffffffffffffffULL;
+		if (i % 3 == 2) key &= 0xff00ff00ff00ff00ULL;
+
+		HtPosition expectedPositions1[8], expectedPositions2[8];
+		uint32_t expectedHashes[8];
+		ReleaseAssert(MlpSetUInt64::SetHashKernel(HashKernel::SCALAR));
+		ht.QueryLCPPrepare(key, expectedPositions1, expectedPositions2, expectedHashes);
+
+		for (HashKernel kernel : { HashKernel::SSE42, HashKernel::AVX2, HashKernel::AVX512 })
+		{
+			if (!MlpSetUInt64::SetHashKernel(kernel))
+			{
+				continue;
+			}
+			HtPosition allPositions1[8], allPositions2[8];
+			uint32_t expectedHash[8];
+			ht.QueryLCPPrepare(key, allPositions1, allPositions2, expectedHash);
+			rep(k, 2, 7)
+			{
+				ReleaseAssert(allPositions1[k] == expectedPositions1[k]);
+				ReleaseAssert(allPositions2[k] == expectedPositions2[k]);
+				ReleaseAssert(expectedHash[k] == expectedHashes[k]);
+			}
+		}
+	}
+}
+
+// Prints the cost of the hash computation and of whole queries for every hash kernel supported by the machine
+//
+TEST(MlpSetUInt64, HashKernelThroughput)
+{
+	using MlpSetUInt64::HashKernel;
+	using MlpSetUInt64::HtPosition;
+
+	const int N = 1000000;
+	const int Q = 4000000;
+	MlpSetUInt64::MlpSet ms;
+	ms.Init(N);
+	std::mt19937_64 rng(20261017);
+	rep(i, 0, N - 1)
+	{
+		ms.Insert(rng() % 1000000000);
+	}
+	vector<uint64_t> queries;
+	rep(i, 0, Q - 1)
+	{
+		queries.push_back(rng() % 1000000000);
+	}
+
+	const int HtSize = 1 << 16;
+	uint64_t allocatedArrLen = uint64_t(HtSize) * sizeof(MlpSetUInt64::CuckooHashTableNode);
+	void* allocatedPtr = aligned_alloc(128, allocatedArrLen);
+	ReleaseAssert(allocatedPtr != nullptr);
+	Auto(free(allocatedPtr));
+	memset(allocatedPtr, 0, allocatedArrLen);
+	MlpSetUInt64::CuckooHashTable ht;
+	MlpSetUInt64::ExternalBitMapPool bitmapPool;
+	ht.Init(reinterpret_cast<MlpSetUInt64::CuckooHashTableNode*>(allocatedPtr), HtSize - 1, &bitmapPool);
+
+	HashKernel originalKernel = MlpSetUInt64::GetHashKernel();
+	Auto(ReleaseAssert(MlpSetUInt64::SetHashKernel(originalKernel)));
+
+	for (HashKernel kernel : { HashKernel::SCALAR, HashKernel::SSE42, HashKernel::AVX2, HashKernel::AVX512 })
+	{
+		if (!MlpSetUInt64::SetHashKernel(kernel))
+		{
+			printf("%s: not supported by this machine\n", MlpSetUInt64::HashKernelName(kernel));
+			continue;
+		}
+
+		// the prefix hashes alone, on an in-cache table
+		//
+		double prepareNs = 1e18, queryNs = 1e18;
+		rep(round, 0, 2)
+		{
+			uint64_t sum = 0;
+			fasttime_t start = gettime();
+			for (uint64_t q : queries)
+			{
+				HtPosition allPositions1[8], allPositions2[8];
+				uint32_t expectedHash[8];
+				ht.QueryLCPPrepare(q, allPositions1, allPositions2, expectedHash);
+				sum += allPositions1[5] + allPositions2[6] + expectedHash[7];
+			}
+			fasttime_t end = gettime();
+			ReleaseAssert(sum != 1);
+			prepareNs = std::min(prepareNs, tdiff(start, end) * 1e9 / Q);
+
+			sum = 0;
+			start = gettime();
+			for (uint64_t q : queries)
+			{
+				bool found;
+				sum += ms.Exist(q);
+				sum += ms.LowerBound(q, found);
+			}
+			end = gettime();
+			ReleaseAssert(sum != 1);
+			queryNs = std::min(queryNs, tdiff(start, end) * 1e9 / Q);
+		}
+		printf("%s: QueryLCPPrepare %.1f ns, Exist + LowerBound %.1f ns\n", MlpSetUInt64::HashKernelName(kernel), prepareNs, queryNs);
+	}
+}
+
+// The 2-slot buckets must hold nodes up to MAX_LOAD_FACTOR_PERCENT without a failed displacement,
+// and every node must stay reachable through Lookup and QueryLCP while others are moved around
+//
+TEST(MlpSetUInt64, BucketizedCuckooHighLoad)
+{
+	using MlpSetUInt64::CuckooHashTable;
+	using MlpSetUInt64::HtPosition;
+
+	const int HtSize = 1 << 18;
+	uint64_t allocatedArrLen = uint64_t(HtSize) * sizeof(MlpSetUInt64::CuckooHashTableNode);
+	void* allocatedPtr = aligned_alloc(128, allocatedArrLen);
+	ReleaseAssert(allocatedPtr != nullptr);
+	Auto(free(allocatedPtr));
+	memset(allocatedPtr, 0, allocatedArrLen);
+
+	CuckooHashTable ht;
+	MlpSetUInt64::ExternalBitMapPool bitmapPool;
+	ht.Init(reinterpret_cast<MlpSetUInt64::CuckooHashTableNode*>(allocatedPtr), HtSize - 1, &bitmapPool);
+	ht.stats.Enable();
+
+	std::mt19937_64 rng(20261016);
+	const int numNodes = int(uint64_t(HtSize) * CuckooHashTable::MAX_LOAD_FACTOR_PERCENT / 100);
+	vector<pair<int, uint64_t>> nodes;
+	set<pair<int, uint64_t>> S;
+	while (int(nodes.size()) < numNodes)
+	{
+		int ilen = 3 + rng() % 6;
+		uint64_t key = rng();
+		if (!S.insert(make_pair(ilen, key >> (64 - 8 * ilen))).second)
+		{
+			continue;
+		}
+		bool exist, failed;
+		HtPosition pos = ht.Insert(ilen, 8 /*dlen*/, key, -1 /*firstChild*/, exist, failed, 0 /*generation*/);
+		ReleaseAssert(!exist && !failed);
+		ReleaseAssert(ht.ht[pos].GetIndexKeyLen() == ilen && ht.ht[pos].GetFullKey() == key);
+		// slots 2 and 5 of each block of 8 are not part of a bucket
+		//
+		ReleaseAssert((pos & 7) % 3 != 2);
+		nodes.push_back(make_pair(ilen, key));
+	}
+	ReleaseAssert(ht.numNodes == uint64_t(numNodes));
+	MlpSetUInt64::MlpStats totals = ht.stats.GetTotals();
+	printf("%d nodes in %d slots: %llu node moves, %llu failed displacements\n", numNodes, HtSize,
+	       (unsigned long long)totals.movedNodesCount, (unsigned long long)totals.displacementFailures);
+	ReleaseAssert(totals.displacementFailures == 0);
+
+	auto check = [&](int ilen, uint64_t key, bool expectFound)
+	{
+		bool found;
+		HtPosition pos = ht.Lookup(ilen, key, found);
+		ReleaseAssert(found == expectFound);
+		if (found)
+		{
+			ReleaseAssert(ht.ht[pos].GetFullKey() == key);
+		}
+		ReleaseAssert(ht.GetLookupMustExistPromise(ilen, key).GetNode() == (found ? &ht.ht[pos] : nullptr));
+		// leaves have dlen 8, so a leaf of ilen 8 is found by QueryLCP
+		//
+		if (ilen == 8)
+		{
+			uint32_t idxLen;
+			HtPosition allPositions1[8], allPositions2[8];
+			uint32_t expectedHash[8];
+			int lcp = ht.QueryLCPInternal(key, idxLen, allPositions1, allPositions2, expectedHash, UINT32_MAX);
+			ReleaseAssert((lcp == 8) == expectFound);
+			if (found)
+			{
+				ReleaseAssert(idxLen == 8 && allPositions1[7] == pos);
+				ReleaseAssert(ht.FindInBuckets(key, 8, allPositions1[7], allPositions2[7]) == pos);
+			}
+		}
+	};
+	for (auto& node : nodes)
+	{
+		check(node.first, node.second, true);
+	}
+
+	// remove every other node, the others must not be affected
+	//
+	rep(i, 0, numNodes - 1)
+	{
+		if (i % 2 == 0)
+		{
+			ReleaseAssert(ht.Remove(nodes[i].first, nodes[i].second, 0 /*generation*/));
+		}
+	}
+	ReleaseAssert(ht.numNodes == uint64_t(numNodes - (numNodes + 1) / 2));
+	rep(i, 0, numNodes - 1)
+	{
+		check(nodes[i].first, nodes[i].second, i % 2 == 1);
+	}
+
+	// Internal bitmaps never take stash slots: fill a table with a stash with non-leaf nodes until one is stashed,
+	// then give the nodes at the end of the table and in the stash more children than a child list holds
+	//
+	{
+		const int StashHtSize = 1 << 10;
+		// 16 gap slots before the table (keeping it 128-byte aligned), and the stash and 6 gap slots after it
+		//
+		uint64_t arrLen = (16 + StashHtSize + CuckooHashTable::STASH_SIZE + 6) * sizeof(MlpSetUInt64::CuckooHashTableNode);
+		arrLen = (arrLen + 127) / 128 * 128;
+		void* arrPtr = aligned_alloc(128, arrLen);
+		ReleaseAssert(arrPtr != nullptr);
+		Auto(free(arrPtr));
+		memset(arrPtr, 0, arrLen);
+		CuckooHashTable stashTable;
+		stashTable.Init(reinterpret_cast<MlpSetUInt64::CuckooHashTableNode*>(arrPtr) + 16, StashHtSize - 1, &bitmapPool, true /*hasStash*/);
+
+		vector<uint64_t> keys;
+		while (stashTable.stashIlenMask == 0)
+		{
+			uint64_t key = rng();
+			bool exist, failed;
+			stashTable.Insert(3 /*ilen*/, 3 /*dlen*/, key, 0 /*firstChild*/, exist, failed, 0 /*generation*/);
+			ReleaseAssert(!failed);
+			if (!exist)
+			{
+				keys.push_back(key);
+			}
+		}
+		ReleaseAssert(stashTable.stashIlenMask == (1U << 3));
+		for (HtPosition pos = stashTable.htMask - 2; pos < stashTable.NumSlots(); pos++)
+		{
+			if (stashTable.ht[pos].IsOccupiedAndNode())
+			{
+				rep(child, 1, 15)
+				{
+					stashTable.ht[pos].AddChild(child, 0 /*generation*/, bitmapPool, stashTable.MaxBitmapOffset(pos));
+				}
+			}
+		}
+		for (HtPosition pos = stashTable.htMask + 1; pos < stashTable.NumSlots(); pos++)
+		{
+			ReleaseAssert(!stashTable.ht[pos].IsOccupied() || stashTable.ht[pos].IsNode());
+		}
+		for (uint64_t key : keys)
+		{
+			bool found;
+			HtPosition pos = stashTable.Lookup(3, key, found);
+			ReleaseAssert(found);
+			bool extended = pos >= stashTable.htMask - 2;
+			rep(child, 0, 15)
+			{
+				ReleaseAssert(stashTable.ht[pos].ExistChild(child) == (child == 0 || extended));
+			}
+		}
+	}
+}
+
+// Fill a table until displacement gives up: no path may be longer than MAX_DISPLACEMENT_PATH_LEN,
+// and a failed insert must leave the table exactly as it was
+//
+TEST(MlpSetUInt64, CuckooDisplacementFailureLeavesTableIntact)
+{
+	using MlpSetUInt64::CuckooHashTable;
+	using MlpSetUInt64::HtPosition;
+
+	const int HtSize = 1 << 16;
+	uint64_t allocatedArrLen = uint64_t(HtSize) * sizeof(MlpSetUInt64::CuckooHashTableNode);
+	void* allocatedPtr = aligned_alloc(128, allocatedArrLen);
+	ReleaseAssert(allocatedPtr != nullptr);
+	Auto(free(allocatedPtr));
+	memset(allocatedPtr, 0, allocatedArrLen);
+	vector<uint8_t> tableCopy(allocatedArrLen);
+
+	CuckooHashTable ht;
+	MlpSetUInt64::ExternalBitMapPool bitmapPool;
+	ht.Init(reinterpret_cast<MlpSetUInt64::CuckooHashTableNode*>(allocatedPtr), HtSize - 1, &bitmapPool);
+	ht.stats.Enable();
+
+	std::mt19937_64 rng(20261017);
+	vector<uint64_t> leaves;
+	uint64_t numNodesAtFirstFailure = 0;
+	int numFailures = 0;
+	while (numFailures < 100)
+	{
+		uint64_t key = rng();
+		bool exist, failed;
+		HtPosition pos = ht.Insert(8 /*ilen*/, 8 /*dlen*/, key, -1 /*firstChild*/, exist, failed, 0 /*generation*/);
+		ReleaseAssert(!exist);
+		if (!failed)
+		{
+			leaves.push_back(key);
+			continue;
+		}
+		if (numFailures == 0)
+		{
+			numNodesAtFirstFailure = leaves.size();
+		}
+		numFailures++;
+		ReleaseAssert(pos == HtPosition(-1) && ht.numNodes == leaves.size());
+		
+		// the search is deterministic, so the same insert fails again, and must not have touched anything
+		//
+		memcpy(tableCopy.data(), allocatedPtr, allocatedArrLen);
+		ht.Insert(8, 8, key, -1, exist, failed, 0);
+		ReleaseAssert(failed);
+		ReleaseAssert(memcmp(tableCopy.data(), allocatedPtr, allocatedArrLen) == 0);
+	}
+	MlpSetUInt64::MlpStats totals = ht.stats.GetTotals();
+	printf("%llu nodes in %d slots (%.1f%% of the bucket slots) when displacement first failed, %llu node moves\n", 
+	       (unsigned long long)numNodesAtFirstFailure, HtSize, 100.0 * numNodesAtFirstFailure / (HtSize * 3 / 4), 
+	       (unsigned long long)totals.movedNodesCount);
+	ReleaseAssert(numNodesAtFirstFailure * 100 >= uint64_t(HtSize) * CuckooHashTable::MAX_LOAD_FACTOR_PERCENT);
+	rep(i, CuckooHashTable::MAX_DISPLACEMENT_PATH_LEN + 1, MlpSetUInt64::MlpStats::DISPLACEMENT_DEPTH_BUCKETS - 1)
+	{
+		ReleaseAssert(totals.displacementDepthHistogram[i] == 0);
+	}
+	for (uint64_t key : leaves)
+	{
+		bool found;
+		HtPosition pos = ht.Lookup(8, key, found);
+		ReleaseAssert(found && ht.ht[pos].GetFullKey() == key);
+	}
+}
+
+// Inserts for which displacement fails go to the stash until it is full, and its nodes are found by every lookup,
+// carried over by a migration and removed like any other
+//
+TEST(MlpSetUInt64, CuckooStashAbsorbsDisplacementFailures)
+{
+	using MlpSetUInt64::CuckooHashTable;
+	using MlpSetUInt64::HtPosition;
+
+	// the table, its stash and the gap slots after it
+	//
+	auto allocateTable = [](uint64_t htSize, CuckooHashTable& ht, MlpSetUInt64::ExternalBitMapPool& bitmapPool)
+	{
+		uint64_t allocatedArrLen = (htSize + CuckooHashTable::STASH_SIZE + 6) * sizeof(MlpSetUInt64::CuckooHashTableNode);
+		allocatedArrLen = (allocatedArrLen + 127) / 128 * 128;
+		void* allocatedPtr = aligned_alloc(128, allocatedArrLen);
+		ReleaseAssert(allocatedPtr != nullptr);
+		memset(allocatedPtr, 0, allocatedArrLen);
+		ht.Init(reinterpret_cast<MlpSetUInt64::CuckooHashTableNode*>(allocatedPtr), htSize - 1, &bitmapPool, true /*hasStash*/);
+		return allocatedPtr;
+	};
+
+	const int HtSize = 1 << 16;
+	MlpSetUInt64::ExternalBitMapPool bitmapPool;
+	CuckooHashTable ht;
+	void* allocatedPtr = allocateTable(HtSize, ht, bitmapPool);
+	Auto(free(allocatedPtr));
+	ht.stats.Enable();
+
+	std::mt19937_64 rng(20261018);
+	vector<uint64_t> leaves;
+	vector<uint64_t> stashed;
+	while (true)
+	{
+		uint64_t key = rng();
+		bool exist, failed;
+		HtPosition pos = ht.Insert(8 /*ilen*/, 8 /*dlen*/, key, -1 /*firstChild*/, exist, failed, 0 /*generation*/);
+		ReleaseAssert(!exist);
+		if (failed)
+		{
+			break;
+		}
+		leaves.push_back(key);
+		if (pos > ht.htMask)
+		{
+			stashed.push_back(key);
+			ReleaseAssert(ht.stashIlenMask == (1U << 8));
+		}
+	}
+	MlpSetUInt64::MlpStats totals = ht.stats.GetTotals();
+	ReleaseAssert(stashed.size() == uint64_t(CuckooHashTable::STASH_SIZE));
+	ReleaseAssert(totals.stashInsertions == stashed.size() && totals.displacementFailures == stashed.size() + 1);
+	ReleaseAssert(ht.numNodes == leaves.size());
+
+	auto check = [](CuckooHashTable& table, uint64_t key, bool expectFound)
+	{
+		bool found;
+		HtPosition pos = table.Lookup(8, key, found);
+		ReleaseAssert(found == expectFound);
+		ReleaseAssert(table.GetLookupMustExistPromise(8, key).GetNode() == (found ? &table.ht[pos] : nullptr));
+		uint32_t idxLen;
+		HtPosition allPositions1[8], allPositions2[8];
+		uint32_t expectedHash[8];
+		int lcp = table.QueryLCPInternal(key, idxLen, allPositions1, allPositions2, expectedHash, UINT32_MAX);
+		ReleaseAssert((lcp == 8) == expectFound);
+		if (found)
+		{
+			ReleaseAssert(idxLen == 8 && allPositions1[7] == pos);
+			ReleaseAssert(table.FindInBuckets(key, 8, allPositions1[7], allPositions2[7]) == pos);
+		}
+	};
+	for (uint64_t key : leaves)
+	{
+		check(ht, key, true);
+	}
+
+	// the stashed nodes go back into the buckets of a larger table
+	//
+	{
+		CuckooHashTable newTable;
+		void* newPtr = allocateTable(HtSize * 2, newTable, bitmapPool);
+		Auto(free(newPtr));
+		ReleaseAssert(ht.MigrateTo(newTable, 0 /*generation*/));
+		ReleaseAssert(newTable.numNodes == leaves.size() && newTable.stashIlenMask == 0);
+		for (uint64_t key : leaves)
+		{
+			check(newTable, key, true);
+		}
+	}
+
+	// removing the stashed nodes empties the stash, so readers stop searching it
+	//
+	for (uint64_t key : stashed)
+	{
+		ReleaseAssert(ht.stashIlenMask == (1U << 8));
+		ReleaseAssert(ht.Remove(8, key, 0 /*generation*/));
+		check(ht, key, false);
+	}
+	ReleaseAssert(ht.stashIlenMask == 0);
+	ReleaseAssert(ht.numNodes == leaves.size() - stashed.size());
+}
+
+TEST(MlpSetUInt64, RangeTreeEraseRange)
+{
+	// Reference model: range start -> (range end, value)
+	//
+	typedef std::map<uint64_t, std::pair<uint64_t, void*> > RangeMap;
+	// Returns whether anything was stored in [start, end]
+	//
+	auto referenceErase = [](RangeMap& ref, uint64_t start, uint64_t end)
+	{
+		bool erased = false;
+		vector<std::pair<uint64_t, std::pair<uint64_t, void*> > > kept;
+		auto it = ref.upper_bound(start);
+		if (it != ref.begin() && std::prev(it)->second.first >= start)
+		{
+			it--;
+		}
+		while (it != ref.end() && it->first <= end)
+		{
+			if (it->first < start)
+			{
+				kept.push_back(std::make_pair(it->first, std::make_pair(start - 1, it->second.second)));
+			}
+			if (it->second.first > end)
+			{
+				kept.push_back(std::make_pair(end + 1, it->second));
+			}
+			it = ref.erase(it);
+			erased = true;
+		}
+		for (auto& e : kept)
+		{
+			ref[e.first] = e.second;
+		}
+		return erased;
+	};
+	auto validate = [](MlpSetUInt64::MlpRangeTree& tree, RangeMap& ref)
+	{
+		auto expected = ref.begin();
+		for (auto it = tree.Begin(); it.Valid(); it.Next())
+		{
+			ReleaseAssert(expected != ref.end());
+			ReleaseAssert(it.StartKey() == expected->first);
+			ReleaseAssert(it.EndKey() == expected->second.first);
+			ReleaseAssert(it.Value() == expected->second.second);
+			expected++;
+		}
+		ReleaseAssert(expected == ref.end());
+	};
+	
+	vector<int> data(100000);
+	
+	// Boundary cases on a fixed layout
+	//
+	{
+		MlpSetUInt64::MlpRangeTree tree;
+		tree.Init(100000);
+		RangeMap ref;
+		auto store = [&](uint64_t start, uint64_t end, int i)
+		{
+			ReleaseAssert((start == end) ? tree.InsertSinglePoint(start, &data[i]) : tree.StoreRange(start, end, &data[i]));
+			ref[start] = std::make_pair(end, &data[i]);
+		};
+		store(100, 200, 0);
+		store(300, 300, 1);
+		store(400, 500, 2);
+		store(600, 700, 3);
+		store(1000, 2000, 4);
+		store(uint64_t(-10), uint64_t(-1), 5);
+		validate(tree, ref);
+		
+		vector<std::pair<uint64_t, uint64_t> > erases = {
+			{ 250, 350 },				// a single point in a gap
+			{ 150, 450 },				// truncates both neighbours
+			{ 451, 649 },				// leaves a single key on each side
+			{ 1100, 1900 },				// splits a range
+			{ 1099, 1099 },				// leaves a single key on the left
+			{ 1901, 1901 },				// leaves a single key on the right
+			{ 210, 290 },				// nothing stored
+			{ uint64_t(-5), uint64_t(-1) }	// up to the largest key
+		};
+		for (auto& e : erases)
+		{
+			bool expected = referenceErase(ref, e.first, e.second);
+			ReleaseAssert(tree.EraseRange(e.first, e.second) == expected);
+			validate(tree, ref);
+			ReleaseAssert(tree.Load(e.first) == nullptr && tree.Load(e.second) == nullptr);
+		}
+		ReleaseAssert(!tree.EraseRange(10, 5));
+		ReleaseAssert(tree.EraseRange(0, uint64_t(-1)));
+		ReleaseAssert(tree.IsEmpty());
+		bool found;
+		tree.LowerBound(0, found);
+		ReleaseAssert(!found);
+	}
+	
+	// Random erases over single points and ranges spanning many 24-bit prefixes,
+	// including erases of large contiguous blocks
+	//
+	{
+		MlpSetUInt64::MlpRangeTree tree;
+		tree.Init(200000);
+		RangeMap ref;
+		rep(i, 0, 49999)
+		{
+			uint64_t key = uint64_t(i) << 12;
+			if (i % 2 == 0)
+			{
+				ReleaseAssert(tree.InsertSinglePoint(key, &data[i]));
+				ref[key] = std::make_pair(key, &data[i]);
+			}
+			else
+			{
+				ReleaseAssert(tree.InsertRange(key, key + 3000, &data[i]));
+				ref[key] = std::make_pair(key + 3000, &data[i]);
+			}
+		}
+		std::mt19937_64 rng(20261016);
+		const uint64_t space = uint64_t(50000) << 12;
+		rep(i, 0, 1999)
+		{
+			uint64_t start = rng() % space;
+			uint64_t len = (i % 50 == 0) ? rng() % (space / 20) : rng() % 20000;
+			uint64_t end = start + len;
+			bool expected = referenceErase(ref, start, end);
+			ReleaseAssert(tree.EraseRange(start, end) == expected);
+			if (i % 100 == 0)
+			{
+				validate(tree, ref);
+			}
+		}
+		validate(tree, ref);
+		rep(i, 0, 99999)
+		{
+			uint64_t key = rng() % space;
+			auto it = ref.upper_bound(key);
+			void* expected = nullptr;
+			if (it != ref.begin() && std::prev(it)->second.first >= key)
+			{
+				expected = std::prev(it)->second.second;
+			}
+			ReleaseAssert(tree.Load(key) == expected);
+		}
+	}
+}
+
+TEST(MlpSetUInt64, ScanRangeCorrectness)
+{
+	std::mt19937_64 rng(20261020);
+	MlpSetUInt64::MlpSet ms;
+	ms.Init(4096);
+	std::set<uint64_t> keys = { 0, 1, 255, 256, uint64_t(-2), uint64_t(-1) };
+	rep(i, 0, 199999)
+	{
+		// dense runs (full leaf parents), sparse keys and keys sharing long prefixes
+		//
+		uint64_t key;
+		switch (i % 3)
+		{
+			case 0: key = rng() % 1000000; break;
+			case 1: key = rng(); break;
+			default: key = (rng() % 64) << 40 | (rng() % 4096) << 8; break;
+		}
+		keys.insert(key);
+	}
+	for (uint64_t key : keys)
+	{
+		ms.Insert(key);
+	}
+	
+	auto check = [&](uint64_t lo, uint64_t hi)
+	{
+		vector<uint64_t> expected;
+		for (auto it = keys.lower_bound(lo); it != keys.end() && *it <= hi; it++)
+		{
+			expected.push_back(*it);
+		}
+		vector<uint64_t> result;
+		ms.ScanRange(lo, hi, [&](uint64_t key) { result.push_back(key); });
+		ReleaseAssert(result == expected);
+		
+		// the chunked interface, resumed after every maxKeys keys
+		//
+		size_t maxKeys = rng() % 100 + 1;
+		vector<uint64_t> buf(maxKeys);
+		result.clear();
+		uint64_t from = lo;
+		while (true)
+		{
+			size_t n = ms.ScanRange(from, hi, buf.data(), maxKeys);
+			result.insert(result.end(), buf.begin(), buf.begin() + n);
+			if (n < maxKeys || buf[n - 1] == hi)
+			{
+				break;
+			}
+			from = buf[n - 1] + 1;
+		}
+		ReleaseAssert(result == expected);
+	};
+	
+	check(0, uint64_t(-1));
+	check(0, 0);
+	check(2, 254);
+	check(uint64_t(-1), uint64_t(-1));
+	rep(i, 0, 2999)
+	{
+		uint64_t lo = (i % 2 == 0) ? rng() % 1000000 : ((i % 4 == 1) ? rng() : (rng() % 64) << 40 | rng() % (1ULL << 40));
+		uint64_t hi = lo + ((i % 10 == 0) ? rng() % (1ULL << 40) : rng() % 20000);
+		if (hi < lo)
+		{
+			hi = uint64_t(-1);
+		}
+		check(lo, hi);
+	}
+	ReleaseAssert(ms.ScanRange(10, 5, nullptr, 100) == 0);
+	
+	// Removals must leave nothing behind for the scans
+	//
+	int cnt = 0;
+	for (auto it = keys.begin(); it != keys.end(); )
+	{
+		if (cnt++ % 2 == 0)
+		{
+			ReleaseAssert(ms.Remove(*it));
+			it = keys.erase(it);
+		}
+		else
+		{
+			it++;
+		}
+	}
+	check(0, uint64_t(-1));
+	rep(i, 0, 999)
+	{
+		uint64_t lo = rng() % 1000000;
+		check(lo, lo + rng() % 20000);
+	}
+}
+
+TEST(MlpSetUInt64, HtNodePredecessorChildCorrectness)
+{
+	MlpSetUInt64::ExternalBitMapPool bitmapPool;
+	rep(iter, 0, 99999)
+	{
+		// internal child list, internal bitmap and external bitmap nodes
+		//
+		int numChild;
+		switch (iter % 3)
+		{
+			case 0: numChild = rand() % 8 + 1; break;
+			case 1: numChild = rand() % 20 + 9; break;
+			default: numChild = rand() % 248 + 9; break;
+		}
+		set<int> existed;
+		MlpSetUInt64::CuckooHashTableNode nd[7];
+		memset(nd, 0, sizeof(MlpSetUInt64::CuckooHashTableNode) * 7);
+		if (iter % 3 == 2)
+		{
+			// no room for an internal bitmap
+			//
+			rep(k, 0, 6)
+			{
+				if (k != 3)
+				{
+					nd[k].hash = 3U << 30;
+				}
+			}
+		}
+		{
+			int x = rand() % 256;
+			nd[3].Init(1, 1, 0, 0, x, 0);
+			existed.insert(x);
+		}
+		rep(k, 1, numChild - 1)
+		{
+			int x;
+			while (1)
+			{
+				x = rand() % 256;
+				if (!existed.count(x)) break;
+			}
+			existed.insert(x);
+			nd[3].AddChild(x, 0, bitmapPool);
+		}
+		ReleaseAssert(nd[3].IsUsingInternalChildMap() == (iter % 3 == 0));
+		rep(i, 0, 255)
+		{
+			set<int>::iterator it = existed.upper_bound(i);
+			int expected = (it == existed.begin()) ? -1 : *(--it);
+			ReleaseAssert(nd[3].PredecessorChild(i) == expected);
+		}
+	}
+}
+
+TEST(MlpSetUInt64, PredecessorAndUpperBoundCorrectness)
+{
+	std::mt19937_64 rng(20261021);
+	MlpSetUInt64::MlpSet ms;
+	ms.Init(4096);
+	std::set<uint64_t> keys;
+	
+	auto check = [&](uint64_t key)
+	{
+		bool found;
+		uint64_t ret = ms.Predecessor(key, found);
+		auto it = keys.upper_bound(key);
+		ReleaseAssert(found == (it != keys.begin()));
+		ReleaseAssert(found ? (ret == *std::prev(it)) : (ret == 0));
+		
+		ret = ms.UpperBound(key, found);
+		ReleaseAssert(found == (it != keys.end()));
+		ReleaseAssert(found ? (ret == *it) : (ret == 0xffffffffffffffffULL));
+	};
+	check(0);
+	check(12345);
+	check(uint64_t(-1));
+	
+	rep(i, 0, 299999)
+	{
+		// sparse keys (first levels only), dense keys (deep nodes with many children)
+		// and keys sharing long path-compressed prefixes
+		//
+		uint64_t key;
+		switch (i % 3)
+		{
+			case 0: key = rng(); break;
+			case 1: key = rng() % 2000000; break;
+			default: key = (rng() % 16) << 40 | (rng() % 16) << 16 | (rng() % 256); break;
+		}
+		ReleaseAssert(ms.Insert(key) == keys.insert(key).second);
+		if (i % 10 == 0)
+		{
+			check(rng());
+			check(key);
+			check(key - 1);
+			check(key + 1);
+		}
+	}
+	for (uint64_t key : { uint64_t(0), uint64_t(-1) })
+	{
+		ms.Insert(key);
+		keys.insert(key);
+	}
+	rep(i, 0, 299999)
+	{
+		uint64_t key;
+		switch (i % 4)
+		{
+			case 0: key = rng(); break;
+			case 1: key = rng() % 2100000; break;
+			case 2: key = (rng() % 17) << 40 | (rng() % 17) << 16 | (rng() % 256); break;
+			default: key = *keys.lower_bound(rng()) + (rng() % 3) - 1; break;
+		}
+		check(key);
+	}
+	
+	// after removals the parent paths and the flat bitmaps shrink
+	//
+	int cnt = 0;
+	for (auto it = keys.begin(); it != keys.end(); )
+	{
+		if (cnt++ % 4 != 0)
+		{
+			ReleaseAssert(ms.Remove(*it));
+			it = keys.erase(it);
+		}
+		else
+		{
+			it++;
+		}
+	}
+	rep(i, 0, 99999)
+	{
+		check((i % 2 == 0) ? rng() : rng() % 2100000);
+	}
+}
+
+TEST(MlpSetUInt64, RangeTreeIteratorPrev)
+{
+	MlpSetUInt64::MlpRangeTree tree;
+	tree.Init(100000);
+	vector<int> data(20000);
+	vector<std::pair<uint64_t, uint64_t> > entries;
+	std::mt19937_64 rng(20261022);
+	
+	uint64_t cur = 0;
+	rep(i, 0, 19999)
+	{
+		uint64_t len = (i % 3 == 0) ? 0 : rng() % 1000 + 1;
+		if (len == 0)
+		{
+			ReleaseAssert(tree.InsertSinglePoint(cur, &data[i]));
+		}
+		else
+		{
+			ReleaseAssert(tree.InsertRange(cur, cur + len, &data[i]));
+		}
+		entries.push_back(std::make_pair(cur, cur + len));
+		// adjacent entries, and gaps crossing the flat bitmap levels
+		//
+		cur += len + 1 + ((i % 5 == 0) ? 0 : rng() % ((i % 50 == 0) ? (1ULL << 45) : 100000));
+	}
+	
+	auto it = tree.BeginFrom(entries.back().first);
+	int idx = int(entries.size()) - 1;
+	while (it.Valid())
+	{
+		ReleaseAssert(idx >= 0);
+		ReleaseAssert(it.StartKey() == entries[idx].first && it.EndKey() == entries[idx].second);
+		ReleaseAssert(it.Value() == &data[idx]);
+		it.Prev();
+		idx--;
+	}
+	ReleaseAssert(idx == -1);
+	
+	// Prev and Next from the middle of the tree
+	//
+	rep(i, 0, 9999)
+	{
+		int k = rng() % (entries.size() - 1) + 1;
+		uint64_t start = entries[k].first + rng() % (entries[k].second - entries[k].first + 1);
+		auto it2 = tree.BeginFrom(start);
+		ReleaseAssert(it2.Valid() && it2.StartKey() == entries[k].first);
+		it2.Prev();
+		ReleaseAssert(it2.Valid() && it2.StartKey() == entries[k - 1].first && it2.EndKey() == entries[k - 1].second);
+		ReleaseAssert(it2.Value() == &data[k - 1]);
+		it2.Next();
+		ReleaseAssert(it2.Valid() && it2.StartKey() == entries[k].first && it2.EndKey() == entries[k].second);
+	}
+}
+
+template<int N>
+void ShardedMlpSetCompareWithStdSet()
+{
+	MlpSetUInt64::ShardedMlpSet<N> ms;
+	ms.Init(65536);
+	std::set<uint64_t> keys;
+	std::mt19937_64 rng(20261023 + N);
+	
+	auto check = [&](uint64_t key)
+	{
+		ReleaseAssert(ms.Exist(key) == (keys.count(key) > 0));
+		auto it = keys.lower_bound(key);
+		bool found;
+		uint64_t lb = ms.LowerBound(key, found);
+		ReleaseAssert(found == (it != keys.end()));
+		ReleaseAssert(found ? (lb == *it) : (lb == 0xffffffffffffffffULL));
+	};
+	check(0);
+	
+	// only a few shards are populated, so LowerBound has to skip the empty ones
+	//
+	rep(i, 0, 99999)
+	{
+		uint64_t key = (i % 4 == 0) ? rng() : ((rng() % 3) * 5 << 58 | rng() % 1000000);
+		ReleaseAssert(ms.Insert(key) == keys.insert(key).second);
+	}
+	rep(i, 0, 99999)
+	{
+		check((i % 2 == 0) ? rng() : ((rng() % 16) << 60 | rng() % 1000000));
+	}
+	
+	// empty whole shards again
+	//
+	for (auto it = keys.begin(); it != keys.end(); )
+	{
+		if ((*it >> 58) % 2 == 0 || rng() % 2 == 0)
+		{
+			ReleaseAssert(ms.Remove(*it));
+			it = keys.erase(it);
+		}
+		else
+		{
+			it++;
+		}
+	}
+	ReleaseAssert(!ms.Remove(*keys.begin() + 1) || keys.count(*keys.begin() + 1) > 0);
+	rep(i, 0, 99999)
+	{
+		check((i % 2 == 0) ? rng() : ((rng() % 16) << 60 | rng() % 1000000));
+	}
+	for (uint64_t key : vector<uint64_t>(keys.begin(), keys.end()))
+	{
+		ReleaseAssert(ms.Remove(key));
+		keys.erase(key);
+	}
+	check(0);
+}
+
+TEST(MlpSetUInt64, ShardedMlpSetCorrectness)
+{
+	ShardedMlpSetCompareWithStdSet<1>();
+	ShardedMlpSetCompareWithStdSet<16>();
+}
+
+// Each shard only writes to the top level bitmaps of its own key range, so the shards together
+// hold about one set's worth of them in memory, not N times that
+//
+TEST(MlpSetUInt64, ShardedMlpSetTopLevelMemory)
+{
+	const int N = 16;
+	MlpSetUInt64::ShardedMlpSet<N> ss;
+	ss.Init(1 << 16);
+	std::mt19937_64 rng(20261017);
+	rep(i, 0, 99999)
+	{
+		ss.Insert(rng());
+	}
+	rep(i, 0, 99999)
+	{
+		bool found;
+		ss.LowerBound(rng(), found);
+	}
+	
+	uint64_t mapped = 0, resident = 0;
+	rep(i, 0, N - 1)
+	{
+		MlpSetUInt64::MlpSet::MemoryStats st = ss.GetShard(i).GetMemoryStats();
+		mapped += st.topLevelBitmapBytes;
+		resident += st.topLevelBitmapResidentBytes;
+		// the shard's 1/N of the lv2 bitmap plus a few pages of the root and lv1
+		//
+		ReleaseAssert(st.topLevelBitmapResidentBytes <= 2 * 1024 * 1024 / N + 4 * 4096);
+	}
+	printf("%d shards: %llu KB of top level bitmaps mapped, %llu KB resident\n", 
+	       N, (unsigned long long)mapped / 1024, (unsigned long long)resident / 1024);
+}
+
+// Splitting a node inserts its new parent, and the Cuckoo displacement making room for the parent
+// may move the node being split. Keys from a few byte values split nodes at every length, and the
+// small table keeps the buckets full enough for displacements to happen on most inserts
+//
+TEST(MlpSetUInt64, InsertSplitOfDisplacedNode)
+{
+	MlpSetUInt64::MlpSet ms;
+	ms.Init(4096);
+	
+	const uint8_t byteValues[] = { 0x00, 0x01, 0x80, 0xfe, 0xff };
+	std::mt19937_64 rng(20261017);
+	std::set<uint64_t> keys;
+	rep(i, 0, 299999)
+	{
+		uint64_t key = 0;
+		rep(k, 0, 7)
+		{
+			key = (key << 8) | byteValues[rng() % 5];
+		}
+		ReleaseAssert(ms.Insert(key) == keys.insert(key).second);
+	}
+	
+	// a stale split leaves a node behind twice, or moves an unrelated node
+	//
+	MlpSetUInt64::CuckooHashTable* ht = ms.GetHtPtr();
+	std::set<std::pair<int, uint64_t>> nodes;
+	uint64_t numLeaves = 0;
+	for (uint64_t i = 0; i < ht->NumSlots(); i++)
+	{
+		if (ht->ht[i].IsOccupiedAndNode())
+		{
+			ReleaseAssert(nodes.insert(std::make_pair(ht->ht[i].GetIndexKeyLen(), ht->ht[i].GetIndexKey())).second);
+			numLeaves += ht->ht[i].IsLeaf();
+		}
+	}
+	ReleaseAssert(nodes.size() == ht->numNodes);
+	ReleaseAssert(numLeaves == keys.size());
+	uint64_t lo = 0;
+	for (uint64_t key : keys)
+	{
+		bool found;
+		ReleaseAssert(ms.Exist(key));
+		ReleaseAssert(ms.LowerBound(lo, found) == key && found);
+		lo = key + 1;
+	}
+}
+
+// A promise taken before the writer removed its node must not validate against whatever
+// else is in the node's buckets
+//
+TEST(MlpSetUInt64, PromiseOfRemovedNodeIsInvalid)
+{
+	using MlpSetUInt64::CuckooHashTable;
+	
+	const int HtSize = 1 << 12;
+	uint64_t allocatedArrLen = uint64_t(HtSize + 16) * sizeof(MlpSetUInt64::CuckooHashTableNode);
+	void* allocatedPtr = aligned_alloc(128, allocatedArrLen);
+	ReleaseAssert(allocatedPtr != nullptr);
+	Auto(free(allocatedPtr));
+	memset(allocatedPtr, 0, allocatedArrLen);
+	
+	CuckooHashTable ht;
+	MlpSetUInt64::ExternalBitMapPool bitmapPool;
+	ht.Init(reinterpret_cast<MlpSetUInt64::CuckooHashTableNode*>(allocatedPtr), HtSize - 1, &bitmapPool);
+	
+	std::mt19937_64 rng(20261017);
+	rep(i, 0, 999)
+	{
+		bool exist, failed;
+		uint64_t key = rng();
+		ht.Insert(8 /*ilen*/, 8 /*dlen*/, key, -1 /*firstChild*/, exist, failed, 1 /*generation*/);
+		ReleaseAssert(!exist && !failed);
+		
+		CuckooHashTable::LookupMustExistPromise promise = ht.GetLookupMustExistPromise(8 /*ilen*/, key);
+		ReleaseAssert(promise.IsValid() && promise.IsGenerationValid(1));
+		
+		// once the node is gone, its buckets say nothing about it, whatever their generations are
+		//
+		ReleaseAssert(ht.Remove(8 /*ilen*/, key, 0 /*generation*/));
+		ReleaseAssert(!promise.IsGenerationValid(UINT32_MAX));
+		ReleaseAssert(promise.GetNode() == nullptr);
+		
+		ht.Insert(8 /*ilen*/, 8 /*dlen*/, key, -1 /*firstChild*/, exist, failed, 1 /*generation*/);
+		ReleaseAssert(!exist && !failed);
+	}
+}
+
 }	// annoymous namespace
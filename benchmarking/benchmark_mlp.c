@@ -239,6 +239,152 @@ void bm_run_workloadC(BenchmarkTree* tree)
 	free(writer_operations);
 }
 
+static unsigned long long bm_multi_writer_key(int writer, int index, int elements_per_writer)
+{
+	// writers w and w + 16 share a slice and use consecutive ranges in it
+	return ((unsigned long long)(writer % 16) << 60) |
+	       ((unsigned long long)(writer / 16) * elements_per_writer + index);
+}
+
+void bm_run_workloadC_multi_writer(BenchmarkTree* tree, int writer_count)
+{
+	// Same as workload C, but the 100K elements are split between writer_count
+	// writers, each inserting and then removing its own range concurrently with
+	// the others, along with 3 readers querying 200K elements.
+	// Writer w works in the 1/16th of the key space with top 4 bits w % 16, so
+	// a tree sharded by the top bits gives each writer its own shard.
+	// The threads are spread over the available CPUs.
+	int cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+	int elements_per_writer = 100000 / writer_count;
+	BenchmarkOperation* writer_operations = malloc(sizeof(BenchmarkOperation) * 2 * elements_per_writer * writer_count);
+	WorkLoadRoutineOperations* writer_ops = calloc(writer_count, sizeof(WorkLoadRoutineOperations));
+	WorkLoadRoutineContext* writer_contexts = malloc(sizeof(WorkLoadRoutineContext) * writer_count);
+	for (int w = 0; w < writer_count; w++)
+	{
+		BenchmarkOperation* operations = &writer_operations[2 * elements_per_writer * w];
+		unsigned long long first_key = bm_multi_writer_key(w, 0, elements_per_writer);
+		for (int i = 0; i < elements_per_writer; i++)
+		{
+			operations[i].type = BenchmarkOpInsert;
+			operations[i].insert_key = first_key + i;
+			operations[i].insert_entry = NULL;
+		}
+		for (int i = 0; i < elements_per_writer; i++)
+		{
+			operations[elements_per_writer + i].type = BenchmarkOpErase;
+			operations[elements_per_writer + i].erase_index = first_key + i;
+		}
+		writer_ops[w].operations = operations;
+		writer_ops[w].operation_count = 2 * elements_per_writer;
+		writer_ops[w].tree = tree;
+		writer_ops[w].iterations = 1;
+		writer_contexts[w].operations = &writer_ops[w];
+		writer_contexts[w].cpu = w % cpu_count;
+	}
+
+	BenchmarkOperation* reader_operations = malloc(sizeof(BenchmarkOperation) * 200000);
+	for (int i = 0; i < 200000; i++)
+	{
+		reader_operations[i].type = BenchmarkOpLoad;
+		reader_operations[i].load_index = bm_multi_writer_key(i % writer_count, (i / writer_count) % elements_per_writer,
+		                                                      elements_per_writer);
+	}
+
+	WorkLoadRoutineOperations reader_ops = { 0 };
+	reader_ops.operations = reader_operations;
+	reader_ops.operation_count = 200000;
+	reader_ops.tree = tree;
+	reader_ops.iterations = 1;
+	WorkLoadRoutineContext reader_contexts[3];
+	for (int r = 0; r < 3; r++)
+	{
+		reader_contexts[r].operations = &reader_ops;
+		reader_contexts[r].cpu = (writer_count + r) % cpu_count;
+	}
+
+	pthread_t* threads = malloc(sizeof(pthread_t) * (writer_count + 3));
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int w = 0; w < writer_count; w++)
+	{
+		pthread_create(&threads[w], NULL, &bm_thread_perform_operations, &writer_contexts[w]);
+	}
+	for (int r = 0; r < 3; r++)
+	{
+		pthread_create(&threads[writer_count + r], NULL, &bm_thread_perform_operations, &reader_contexts[r]);
+	}
+
+	for (int i = writer_count + 2; i >= 0; i--)
+	{
+		pthread_join(threads[i], NULL);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	double duration_ms = bm_duration_passed_ms(&start, &end);
+	printf("Benchmark C with %d writers took %.3f ms\n", writer_count, duration_ms);
+
+	free(threads);
+	free(reader_operations);
+	free(writer_contexts);
+	free(writer_ops);
+	free(writer_operations);
+}
+
+void bm_run_writer_scaling(BenchmarkTree* tree, int writer_count, int keys_per_writer)
+{
+	// writer_count writers, each inserting and then removing keys_per_writer keys of its own
+	// 1/16th of the key space (selected by the top 4 bits), with no readers.
+	// The threads are spread over the available CPUs.
+	int cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+	BenchmarkOperation* writer_operations = malloc(sizeof(BenchmarkOperation) * 2 * keys_per_writer * writer_count);
+	WorkLoadRoutineOperations* writer_ops = calloc(writer_count, sizeof(WorkLoadRoutineOperations));
+	WorkLoadRoutineContext* writer_contexts = malloc(sizeof(WorkLoadRoutineContext) * writer_count);
+	for (int w = 0; w < writer_count; w++)
+	{
+		BenchmarkOperation* operations = &writer_operations[2 * keys_per_writer * w];
+		unsigned long long slice = (unsigned long long)(w % 16) << 60;
+		for (int i = 0; i < keys_per_writer; i++)
+		{
+			// spread the keys over the slice, writers sharing a slice get distinct keys
+			unsigned long long key = slice | ((((unsigned long long)i * writer_count + w) * 0x9E3779B97F4A7C15ULL) >> 4);
+			operations[i].type = BenchmarkOpInsert;
+			operations[i].insert_key = key;
+			operations[i].insert_entry = NULL;
+			operations[keys_per_writer + i].type = BenchmarkOpErase;
+			operations[keys_per_writer + i].erase_index = key;
+		}
+		writer_ops[w].operations = operations;
+		writer_ops[w].operation_count = 2 * keys_per_writer;
+		writer_ops[w].tree = tree;
+		writer_ops[w].iterations = 1;
+		writer_contexts[w].operations = &writer_ops[w];
+		writer_contexts[w].cpu = w % cpu_count;
+	}
+
+	pthread_t* threads = malloc(sizeof(pthread_t) * writer_count);
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int w = 0; w < writer_count; w++)
+	{
+		pthread_create(&threads[w], NULL, &bm_thread_perform_operations, &writer_contexts[w]);
+	}
+	for (int w = 0; w < writer_count; w++)
+	{
+		pthread_join(threads[w], NULL);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	double duration_ms = bm_duration_passed_ms(&start, &end);
+	printf("Writer scaling with %d writers: %.3f ms, %.2f M operations/s\n", writer_count, duration_ms,
+	       2.0 * keys_per_writer * writer_count / duration_ms / 1000);
+
+	free(threads);
+	free(writer_contexts);
+	free(writer_ops);
+	free(writer_operations);
+}
+
 typedef enum _BenchmarkDAccessPattern {
 	AccessPatternAllRange,
 	AccessPatternExclusiveRanges,
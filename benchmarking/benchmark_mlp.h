@@ -75,6 +75,14 @@ void bm_run_workloadB(BenchmarkTree* tree);
 
 void bm_run_workloadC(BenchmarkTree* tree);
 
+// workload C with writer_count concurrent writers, writer w in the slice of the key space with
+// top 4 bits w % 16, the tree's Insert and Erase must be thread-safe
+void bm_run_workloadC_multi_writer(BenchmarkTree* tree, int writer_count);
+
+// writer_count writers inserting and removing keys_per_writer keys each, writer w in the slice of
+// the key space with top 4 bits w % 16, the tree's Insert and Erase must be thread-safe
+void bm_run_writer_scaling(BenchmarkTree* tree, int writer_count, int keys_per_writer);
+
 void bm_run_workloadD(BenchmarkTree* tree);
 
 void bm_run_workloadE(BenchmarkTree* tree);
@@ -57,10 +57,6 @@ typedef unsigned long long ULL;
 #define UINT32_MAX 0xffffffff
 #endif
 
-// uncomment to enable stats-related code for analysis
-//
-//#define ENABLE_STATS
-
 // uncomment to cause every child bitmap to be allocated as external
 // #define EXTERNAL_BITMAP_ONLY
 
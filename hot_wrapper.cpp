@@ -5,7 +5,19 @@
 #include <chrono>
 #include <iostream>
 #include <map>
+#include <array>
+#include <bitset>
+#include <cstring>
+#include <iterator>
+#include <numeric>
+#include <utility>
 
+// HOT requires AVX2, BMI2 and LZCNT, only the HOT code and the code below are compiled for them (the standard headers
+// it uses are included before, so that no inline function shared with the rest of the binary is compiled for them).
+// The HOT benchmarks must only run on hosts supporting them
+//
+#pragma GCC push_options
+#pragma GCC target("avx2,bmi,bmi2,lzcnt,popcnt")
 #include <hot/singlethreaded/HOTSingleThreaded.hpp>
 #include <idx/contenthelpers/IdentityKeyExtractor.hpp>
 #include <idx/contenthelpers/OptionalValue.hpp>
@@ -127,3 +139,4 @@ template void HotTrieExecuteWorkload<true>(WorkloadUInt64& workload);
 
 }	// HotTrieUInt64
 
+#pragma GCC pop_options